@@ -5,11 +5,28 @@
  *      Author: Tran Minh Nhat - 2014008
  */
 
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include "74HC595.h"
+#include "selftest.h"
+#ifdef ESP_PLATFORM
 #include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_attr.h"
+#include "soc/gpio_struct.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_lcd_panel_io.h"
+#endif
+
+static const uint8_t Seg74HC595[10] = {0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F};
+
+#ifdef ESP_PLATFORM
 
 /**
  * Init IC 74HC595
@@ -18,13 +35,17 @@
  * @param   dataPin                   data pin
  * @param   latchPin                  latch pin
  * @param   clkPin                    clock pin
+ * @param   len                       number of cascaded chips
  * 
  * @return
- * None
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the frame buffer cannot be allocated
  */
-void Init74HC595(IC74HC595_t *IC74HC595, int16_t dataPin, int16_t latchPin, int16_t clkPin)
+esp_err_t Init74HC595(IC74HC595_t *IC74HC595, int16_t dataPin, int16_t latchPin, int16_t clkPin, size_t len)
 {
-    
+    uint8_t *buf = heap_caps_calloc(len, 1, MALLOC_CAP_8BIT);
+    if(buf == NULL) return ESP_ERR_NO_MEM;
+
     gpio_reset_pin(dataPin);
 	gpio_set_direction(dataPin, GPIO_MODE_OUTPUT);
 	gpio_set_level(dataPin, 0);
@@ -37,49 +58,134 @@ void Init74HC595(IC74HC595_t *IC74HC595, int16_t dataPin, int16_t latchPin, int1
 	gpio_set_direction(clkPin, GPIO_MODE_OUTPUT);
 	gpio_set_level(clkPin, 0);
 
+    memset(IC74HC595, 0, sizeof(IC74HC595_t));
     IC74HC595->dataPin = dataPin;
     IC74HC595->latchPin = latchPin;
     IC74HC595->clkPin = clkPin;
+    IC74HC595->backend = IC74HC595_GPIO;
+    IC74HC595->buf = buf;
+    IC74HC595->len = len;
+    return ESP_OK;
 }
 
 /**
- * Make a clock in shift clock pin
+ * Init IC 74HC595 on a SPI host
+ * The chain is written in one SPI transaction: MOSI drives DS and SCLK drives
+ * SH_CP. The latch pin stays a GPIO pulsed after the transaction, so the new
+ * data can be held in the shift registers until another output changes with it.
  *
  * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
- *
+ * @param   dataPin                   data pin
+ * @param   latchPin                  latch pin
+ * @param   clkPin                    clock pin
+ * @param   len                       number of cascaded chips
+ * @param   host                      SPI host not used by the display (VSPI_HOST)
+ * 
  * @return
  *          - ESP_OK                  if success
- *          - ESP_FAIL                if fails
+ *          - ESP_ERR_NO_MEM          if the frame buffer cannot be allocated
+ *          - others                  error of spi_bus_initialize/spi_bus_add_device
+ */
+esp_err_t Init74HC595SPI(IC74HC595_t *IC74HC595, int16_t dataPin, int16_t latchPin, int16_t clkPin, size_t len, spi_host_device_t host)
+{
+    esp_err_t ret;
+
+    uint8_t *buf = heap_caps_calloc(len, 1, MALLOC_CAP_DMA);
+    if(buf == NULL) return ESP_ERR_NO_MEM;
+
+    gpio_reset_pin(latchPin);
+    gpio_set_direction(latchPin, GPIO_MODE_OUTPUT);
+    gpio_set_level(latchPin, 0);
+
+    spi_bus_config_t buscfg = {
+        .mosi_io_num = dataPin,
+        .miso_io_num = -1,
+        .sclk_io_num = clkPin,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = len,
+    };
+    ret = spi_bus_initialize(host, &buscfg, SPI_DMA_CH_AUTO);
+    if(ret != ESP_OK){
+        heap_caps_free(buf);
+        return ret;
+    }
+
+    spi_device_interface_config_t devcfg = {
+        .mode = 0,                          // 74HC595 shifts on the rising clock edge
+        .clock_speed_hz = SPI_MASTER_FREQ_8M,
+        .spics_io_num = -1,                 // latched by latch74HC595
+        .queue_size = 1,
+    };
+    spi_device_handle_t handle;
+    ret = spi_bus_add_device(host, &devcfg, &handle);
+    if(ret != ESP_OK){
+        spi_bus_free(host);
+        heap_caps_free(buf);
+        return ret;
+    }
+
+    memset(IC74HC595, 0, sizeof(IC74HC595_t));
+    IC74HC595->dataPin = dataPin;
+    IC74HC595->latchPin = latchPin;
+    IC74HC595->clkPin = clkPin;
+    IC74HC595->backend = IC74HC595_SPI;
+    IC74HC595->host = host;
+    IC74HC595->spi = handle;
+    IC74HC595->buf = buf;
+    IC74HC595->len = len;
+    return ESP_OK;
+}
+
+/**
+ * Release the frame buffer and SPI host of IC 74HC595, the pins can be reused after
+ *
+ * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
+ */
+void Deinit74HC595(IC74HC595_t *IC74HC595)
+{
+    if(IC74HC595->backend == IC74HC595_SPI){
+        spi_bus_remove_device(IC74HC595->spi);
+        spi_bus_free(IC74HC595->host);
+        IC74HC595->spi = NULL;
+    }
+    heap_caps_free(IC74HC595->buf);
+    IC74HC595->buf = NULL;
+    IC74HC595->len = 0;
+}
+
+/**
+ * Make a clock in shift clock pin
+ *
+ * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
  */
 void clock74HC595(IC74HC595_t *IC74HC595)
 {
     gpio_set_level(IC74HC595->clkPin, 1);
     gpio_set_level(IC74HC595->clkPin, 0);
 }
+
 /**
  * Make a clock in latch clock pin
  *
  * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
- *
- * @return
- *          - ESP_OK                  if success
- *          - ESP_FAIL                if fails
  */
 void latch74HC595(IC74HC595_t *const IC74HC595)
 {
+    if(IC74HC595->latchPin < 32){
+        GPIO.out_w1ts = 1UL << IC74HC595->latchPin;
+        GPIO.out_w1tc = 1UL << IC74HC595->latchPin;
+        return;
+    }
     gpio_set_level(IC74HC595->latchPin, 1);
     gpio_set_level(IC74HC595->latchPin, 0);
 }
 
 /**
- * Write 1 byte to IC 74HC595
+ * Write 1 byte to IC 74HC595 without latching it
  *
  * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
  * @param   data                      1 byte data need to write into chip
- *
- * @return
- *          - ESP_OK                  if success
- *          - ESP_FAIL                if fails
  */
 void writeByte74HC595(IC74HC595_t *IC74HC595, uint8_t data)
 {
@@ -88,50 +194,424 @@ void writeByte74HC595(IC74HC595_t *IC74HC595, uint8_t data)
     for(idx = 0; idx < 8; idx++){
         if(data & (0x01 << (7 - idx))){
             gpio_set_level(IC74HC595->dataPin, 1);
-            // vTaskDelay(pdMS_TO_TICKS(1000)); 
         }else {
             gpio_set_level(IC74HC595->dataPin, 0);
-            // vTaskDelay(pdMS_TO_TICKS(1000)); 
         }
         clock74HC595(IC74HC595);
-        // vTaskDelay(pdMS_TO_TICKS(1000)); 
+    }
+}
 
+/**
+ * Set the segments of one chip in the frame buffer, shown on the next commit
+ *
+ * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
+ * @param   pos                       chip position, 0 is shifted first (last chip of the chain)
+ * @param   segments                  segment bits (bit0 = a ... bit7 = dp)
+ */
+void setByte74HC595(IC74HC595_t *IC74HC595, size_t pos, uint8_t segments)
+{
+    if(pos < IC74HC595->len) IC74HC595->buf[pos] = segments;
+}
+
+#endif
+
+/**
+ * Segments of a decimal digit (0-9), other values are blank
+ */
+uint8_t Digit74HC595(int digit)
+{
+    return (digit >= 0 && digit <= 9) ? Seg74HC595[digit] : 0;
+}
+
+/**
+ * Decimal digit shown by segment bits, -1 for blank or anything else
+ */
+int Segments74HC595(uint8_t segments)
+{
+    for(int digit = 0; digit < 10; digit++){
+        if(Seg74HC595[digit] == segments) return digit;
+    }
+    return -1;
+}
+
+#ifdef ESP_PLATFORM
+
+/**
+ * Set a decimal digit (0-9) at one chip position, other values blank the digit
+ */
+void setDigit74HC595(IC74HC595_t *IC74HC595, size_t pos, int digit)
+{
+    setByte74HC595(IC74HC595, pos, Digit74HC595(digit));
+}
+
+/**
+ * Set a number over digits positions starting at pos, most significant digit first
+ */
+void setNumber74HC595(IC74HC595_t *IC74HC595, size_t pos, size_t digits, int value)
+{
+    for(size_t i = digits; i > 0; i--){
+        setDigit74HC595(IC74HC595, pos + i - 1, value % 10);
+        value /= 10;
+    }
+}
+
+/*
+ * Shift the frame buffer with direct writes to the GPIO set/clear
+ * registers, one pass over the bits and no call per bit or per chip.
+ */
+static void shiftGPIO74HC595(IC74HC595_t *IC74HC595)
+{
+    const uint32_t data = 1UL << IC74HC595->dataPin;
+    const uint32_t clk = 1UL << IC74HC595->clkPin;
+
+    for(size_t i = 0; i < IC74HC595->len; i++){
+        uint8_t byte = IC74HC595->buf[i];
+        for(uint8_t mask = 0x80; mask; mask >>= 1){
+            if(byte & mask) GPIO.out_w1ts = data;
+            else GPIO.out_w1tc = data;
+            GPIO.out_w1ts = clk;
+            GPIO.out_w1tc = clk;
+        }
     }
-    // vTaskDelay(pdMS_TO_TICKS(1000)); 
-    // latch74HC595(IC74HC595);
+}
 
+/**
+ * Shift the whole frame buffer into the chain without latching it, the
+ * outputs keep the old data until latch74HC595
+ *
+ * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
+ */
+void shift74HC595(IC74HC595_t *IC74HC595)
+{
+    int64_t start = esp_timer_get_time();
+
+    if(IC74HC595->backend == IC74HC595_SPI){
+        spi_transaction_t trans;
+        memset(&trans, 0, sizeof(trans));
+        trans.length = IC74HC595->len * 8;
+        if(IC74HC595->len <= 4){
+            trans.flags = SPI_TRANS_USE_TXDATA;
+            memcpy(trans.tx_data, IC74HC595->buf, IC74HC595->len);
+        }else{
+            trans.tx_buffer = IC74HC595->buf;
+        }
+        spi_device_polling_transmit(IC74HC595->spi, &trans);
+    }else if(IC74HC595->dataPin < 32 && IC74HC595->clkPin < 32){
+        shiftGPIO74HC595(IC74HC595);
+    }else{
+        for(size_t i = 0; i < IC74HC595->len; i++){
+            writeByte74HC595(IC74HC595, IC74HC595->buf[i]);
+        }
+    }
+
+    IC74HC595->update_us = esp_timer_get_time() - start;
+    IC74HC595->total_us += IC74HC595->update_us;
+    IC74HC595->updates++;
 }
 
 /**
- * Write 4 byte to IC 74HC595
+ * Shift the whole frame buffer into the chain and latch it once
+ *
+ * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
+ */
+void commit74HC595(IC74HC595_t *IC74HC595)
+{
+    shift74HC595(IC74HC595);
+    latch74HC595(IC74HC595);
+}
+
+/**
+ * Write 4 byte to the first 4 chip positions and commit
  *
  * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
  * @param   data                      1 byte data need to write into chip
+ */
+void write4Byte74HC595(IC74HC595_t *IC74HC595, uint8_t data4, uint8_t data3, uint8_t data2, uint8_t data1)
+{
+    setByte74HC595(IC74HC595, 0, data4);
+    setByte74HC595(IC74HC595, 1, data3);
+    setByte74HC595(IC74HC595, 2, data2);
+    setByte74HC595(IC74HC595, 3, data1);
+    commit74HC595(IC74HC595);
+}
+
+/**
+ * Print the average CPU time of a chain update
+ *
+ * @param   IC74HC595                 Pointer to IC74HC595_t configuration structure
+ * @param   loops                     number of updates to average
+ */
+void Bench74HC595(IC74HC595_t *IC74HC595, int loops)
+{
+    int64_t total = IC74HC595->total_us;
+    uint32_t updates = IC74HC595->updates;
+
+    if(loops <= 0) return;
+    for(int i = 0; i < loops; i++){
+        setNumber74HC595(IC74HC595, 0, IC74HC595->len, i);
+        commit74HC595(IC74HC595);
+    }
+    printf("[Bench74HC595]%s len=%u %d updates, %"PRId64"us per update\n",
+        IC74HC595->backend == IC74HC595_SPI ? "SPI" : "GPIO", (unsigned)IC74HC595->len, loops,
+        (IC74HC595->total_us - total) / (IC74HC595->updates - updates));
+}
+
+/**
+ * Print the update time of both backends for chains of 1 to 16 chips.
+ * The pins are left free, call before the chain used by the application is initialized.
+ */
+void Bench74HC595Chain(int16_t dataPin, int16_t latchPin, int16_t clkPin, spi_host_device_t host, int loops)
+{
+    static const size_t lengths[] = {1, 2, 4, 8, 16};
+    IC74HC595_t chain;
+
+    for(int i = 0; i < sizeof(lengths)/sizeof(lengths[0]); i++){
+        if(Init74HC595(&chain, dataPin, latchPin, clkPin, lengths[i]) == ESP_OK){
+            Bench74HC595(&chain, loops);
+            Deinit74HC595(&chain);
+        }
+        if(Init74HC595SPI(&chain, dataPin, latchPin, clkPin, lengths[i], host) == ESP_OK){
+            Bench74HC595(&chain, loops);
+            Deinit74HC595(&chain);
+        }
+    }
+}
+
+
+#endif
+
+/**
+ * Pack the frame buffers of a bank into parallel words, one byte per shift clock.
+ * Bit c of a word drives data line c, buffers are shifted MSB first like the single chain.
+ * Lines beyond chains repeat the last chain so unused lines can share its pin.
+ *
+ * @param   buf                       frame buffers, chain c at buf[c * len]
+ * @param   chains                    number of chains, 1 to 8
+ * @param   len                       number of chips in each chain
+ * @param   packed                    output, 8 * len bytes
+ */
+void Pack74HC595Bank(const uint8_t *buf, size_t chains, size_t len, uint8_t *packed)
+{
+    for(size_t i = 0; i < len; i++){
+        uint64_t x = 0, t;
+        for(size_t c = 0; c < IC74HC595_BANK_MAX_CHAINS; c++){
+            x |= (uint64_t)buf[(c < chains ? c : chains - 1) * len + i] << (8 * c);
+        }
+        // 8x8 bit transpose: afterwards byte k of x holds bit k of every chain byte
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;  x ^= t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x ^= t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x ^= t ^ (t << 28);
+        for(int k = 0; k < 8; k++){
+            packed[i * 8 + k] = x >> (8 * (7 - k));
+        }
+    }
+}
+
+/**
+ * Compare Pack74HC595Bank against a bit by bit packing for every chain count
+ *
+ * @return  true if all packed words match
+ */
+bool Check74HC595BankPack(void)
+{
+    uint8_t buf[IC74HC595_BANK_MAX_CHAINS * 4], packed[8 * 4];
+    uint32_t seed = 0x595;
+    int errors = 0;
+
+    for(int round = 0; round < 64; round++){
+        for(size_t i = 0; i < sizeof(buf); i++){
+            buf[i] = SelfTestRandom(&seed);
+        }
+        for(size_t chains = 1; chains <= IC74HC595_BANK_MAX_CHAINS; chains++){
+            for(size_t len = 1; len <= 4; len++){
+                Pack74HC595Bank(buf, chains, len, packed);
+                for(size_t n = 0; n < 8 * len; n++){
+                    uint8_t word = 0;
+                    for(size_t c = 0; c < IC74HC595_BANK_MAX_CHAINS; c++){
+                        uint8_t byte = buf[(c < chains ? c : chains - 1) * len + n / 8];
+                        if(byte & (0x80 >> (n % 8))) word |= 1 << c;
+                    }
+                    if(packed[n] != word) errors++;
+                }
+            }
+        }
+    }
+    printf("[Check74HC595BankPack] %s, %d mismatches\n", errors ? "FAIL" : "ok", errors);
+    return errors == 0;
+}
+
+#ifdef ESP_PLATFORM
+
+static bool IRAM_ATTR bankDone74HC595(esp_lcd_panel_io_handle_t io, esp_lcd_panel_io_event_data_t *edata, void *user_ctx)
+{
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(((IC74HC595Bank_t *)user_ctx)->done, &woken);
+    return woken == pdTRUE;
+}
+
+/**
+ * Init a bank of chains clocked in parallel by I2S in LCD mode.
+ * WR is the shared shift clock and CS the shared latch: it rises after the last clock.
+ *
+ * @param   bank                      Pointer to IC74HC595Bank_t configuration structure
+ * @param   dataPins                  data pin of each chain
+ * @param   chains                    number of chains, 1 to 8
+ * @param   latchPin                  shared latch pin
+ * @param   clkPin                    shared clock pin
+ * @param   dcPin                     spare pin required by the i80 bus, not connected
+ * @param   len                       number of chips in each chain
  *
  * @return
  *          - ESP_OK                  if success
- *          - ESP_FAIL                if fails
+ *          - ESP_ERR_INVALID_ARG     if chains is out of range
+ *          - ESP_ERR_NO_MEM          if a buffer cannot be allocated
+ *          - error from the LCD driver otherwise
  */
-void write4Byte74HC595(IC74HC595_t *IC74HC595, uint8_t data4, uint8_t data3, uint8_t data2, uint8_t data1)
+esp_err_t Init74HC595Bank(IC74HC595Bank_t *bank, const int16_t *dataPins, size_t chains, int16_t latchPin, int16_t clkPin, int16_t dcPin, size_t len)
 {
+    esp_err_t ret;
 
-    writeByte74HC595(IC74HC595, data4);
-    writeByte74HC595(IC74HC595, data3);
-    writeByte74HC595(IC74HC595, data2);
-    writeByte74HC595(IC74HC595, data1);
-    latch74HC595(IC74HC595);
+    if(chains == 0 || chains > IC74HC595_BANK_MAX_CHAINS || len == 0) return ESP_ERR_INVALID_ARG;
+
+    memset(bank, 0, sizeof(IC74HC595Bank_t));
+    bank->latchPin = latchPin;
+    bank->clkPin = clkPin;
+    bank->chains = chains;
+    bank->len = len;
+    for(size_t c = 0; c < IC74HC595_BANK_MAX_CHAINS; c++){
+        bank->dataPins[c] = c < chains ? dataPins[c] : -1;
+    }
+    bank->buf = heap_caps_calloc(chains * len, 1, MALLOC_CAP_8BIT);
+    bank->dma = heap_caps_calloc(8 * len, 1, MALLOC_CAP_DMA);
+    bank->done = xSemaphoreCreateBinary();
+    if(bank->buf == NULL || bank->dma == NULL || bank->done == NULL){
+        Deinit74HC595Bank(bank);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_lcd_i80_bus_config_t bus_config = {
+        .dc_gpio_num = dcPin,
+        .wr_gpio_num = clkPin,
+        .clk_src = LCD_CLK_SRC_DEFAULT,
+        .bus_width = 8,
+        .max_transfer_bytes = 8 * len,
+        .sram_trans_align = 4,
+    };
+    for(size_t c = 0; c < IC74HC595_BANK_MAX_CHAINS; c++){
+        // unused lines carry a copy of the last chain, see Pack74HC595Bank
+        bus_config.data_gpio_nums[c] = dataPins[c < chains ? c : chains - 1];
+    }
+    ret = esp_lcd_new_i80_bus(&bus_config, &bank->bus);
+    if(ret != ESP_OK){
+        Deinit74HC595Bank(bank);
+        return ret;
+    }
+
+    esp_lcd_panel_io_i80_config_t io_config = {
+        .cs_gpio_num = latchPin,
+        .pclk_hz = 8 * 1000 * 1000,
+        .trans_queue_depth = 1,
+        .on_color_trans_done = bankDone74HC595,
+        .user_ctx = bank,
+        .lcd_cmd_bits = 8,
+        .lcd_param_bits = 8,
+    };
+    ret = esp_lcd_new_panel_io_i80(bank->bus, &io_config, &bank->io);
+    if(ret != ESP_OK){
+        Deinit74HC595Bank(bank);
+        return ret;
+    }
+    return ESP_OK;
 }
 
+/**
+ * Release the LCD bus and the buffers of a bank
+ */
+void Deinit74HC595Bank(IC74HC595Bank_t *bank)
+{
+    if(bank->io) esp_lcd_panel_io_del(bank->io);
+    if(bank->bus) esp_lcd_del_i80_bus(bank->bus);
+    if(bank->done) vSemaphoreDelete(bank->done);
+    heap_caps_free(bank->buf);
+    heap_caps_free(bank->dma);
+    memset(bank, 0, sizeof(IC74HC595Bank_t));
+}
 
+/**
+ * Set the segments of one chip position of one chain, takes effect on the next commit
+ */
+void setByte74HC595Bank(IC74HC595Bank_t *bank, size_t chain, size_t pos, uint8_t segments)
+{
+    if(chain < bank->chains && pos < bank->len) bank->buf[chain * bank->len + pos] = segments;
+}
 
-void delay_ms(int ms) 
+/**
+ * Set a number over digits positions of one chain, most significant digit first
+ */
+void setNumber74HC595Bank(IC74HC595Bank_t *bank, size_t chain, size_t pos, size_t digits, int value)
 {
-	int _ms = ms + (portTICK_PERIOD_MS - 1);
-	TickType_t xTicksToDelay = _ms / portTICK_PERIOD_MS;
-	vTaskDelay(xTicksToDelay);
+    for(size_t i = digits; i > 0; i--){
+        setByte74HC595Bank(bank, chain, pos + i - 1, Digit74HC595(value % 10));
+        value /= 10;
+    }
 }
 
+/**
+ * Pack all chains and shift them with one DMA transfer, all chains latch together
+ *
+ * @param   bank                      Pointer to IC74HC595Bank_t configuration structure
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_TIMEOUT         if the transfer did not complete
+ */
+esp_err_t commit74HC595Bank(IC74HC595Bank_t *bank)
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret;
+
+    Pack74HC595Bank(bank->buf, bank->chains, bank->len, bank->dma);
+    ret = esp_lcd_panel_io_tx_color(bank->io, -1, bank->dma, 8 * bank->len);
+    if(ret != ESP_OK) return ret;
+    if(xSemaphoreTake(bank->done, pdMS_TO_TICKS(100)) != pdTRUE) return ESP_ERR_TIMEOUT;
 
+    bank->update_us = esp_timer_get_time() - start;
+    bank->total_us += bank->update_us;
+    bank->updates++;
+    return ESP_OK;
+}
 
+/**
+ * Print the update time of a bank for 1 to 8 chains of len chips.
+ * The pins are left free, call before they are used by the application.
+ */
+void Bench74HC595Bank(const int16_t *dataPins, int16_t latchPin, int16_t clkPin, int16_t dcPin, size_t len, int loops)
+{
+    IC74HC595Bank_t bank;
 
+    if(loops <= 0) return;
+    for(size_t chains = 1; chains <= IC74HC595_BANK_MAX_CHAINS; chains++){
+        if(Init74HC595Bank(&bank, dataPins, chains, latchPin, clkPin, dcPin, len) != ESP_OK) continue;
+        for(int i = 0; i < loops; i++){
+            for(size_t c = 0; c < chains; c++){
+                setNumber74HC595Bank(&bank, c, 0, len, i + c);
+            }
+            commit74HC595Bank(&bank);
+        }
+        if(bank.updates){
+            printf("[Bench74HC595Bank] chains=%u len=%u %"PRIu32" updates, %"PRId64"us per update\n",
+                (unsigned)chains, (unsigned)len, bank.updates, bank.total_us / bank.updates);
+        }
+        Deinit74HC595Bank(&bank);
+    }
+}
+
+
+void delay_ms(int ms) 
+{
+	int _ms = ms + (portTICK_PERIOD_MS - 1);
+	TickType_t xTicksToDelay = _ms / portTICK_PERIOD_MS;
+	vTaskDelay(xTicksToDelay);
+}
 
+#endif
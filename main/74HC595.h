@@ -7,19 +7,86 @@
 
 #ifndef MAIN_74HC595_H_
 #define MAIN_74HC595_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#ifdef ESP_PLATFORM
 #include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "esp_lcd_panel_io.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#endif
+
+#define IC74HC595_BANK_MAX_CHAINS 8
+
+uint8_t Digit74HC595(int digit);
+int Segments74HC595(uint8_t segments);
+void Pack74HC595Bank(const uint8_t *buf, size_t chains, size_t len, uint8_t *packed);
+bool Check74HC595BankPack(void);
+
+#ifdef ESP_PLATFORM
+
+typedef enum {
+    IC74HC595_GPIO = 0,     // bit-banged data/clock/latch
+    IC74HC595_SPI,          // SPI host: MOSI->DS, SCLK->SH_CP, GPIO->ST_CP
+}IC74HC595_backend_t;
 
 typedef struct {
     int16_t dataPin;
     int16_t latchPin;
     int16_t clkPin;
+    IC74HC595_backend_t backend;
+    spi_host_device_t host;
+    spi_device_handle_t spi;
+    uint8_t *buf;           // frame buffer, buf[0] is shifted first and ends in the last chip
+    size_t len;             // number of chips in the chain
+    int64_t update_us;      // CPU time of the last chain update
+    int64_t total_us;       // CPU time of all chain updates
+    uint32_t updates;
 }IC74HC595_t;
 
-void Init74HC595(IC74HC595_t *IC74HC595, int16_t dataPin, int16_t latchPin, int16_t clkPin);
+/*
+ * Up to 8 chains of the same length sharing clock and latch, one data line per chain,
+ * clocked in parallel by the I2S peripheral in LCD (i80) mode from one DMA buffer.
+ */
+typedef struct {
+    int16_t latchPin;
+    int16_t clkPin;
+    int16_t dataPins[IC74HC595_BANK_MAX_CHAINS];
+    size_t chains;          // number of data lines in use
+    size_t len;             // number of chips in each chain
+    uint8_t *buf;           // frame buffers, chain c at buf[c * len], same order as IC74HC595_t.buf
+    uint8_t *dma;           // packed parallel words, one byte per shift clock
+    esp_lcd_i80_bus_handle_t bus;
+    esp_lcd_panel_io_handle_t io;
+    SemaphoreHandle_t done;
+    int64_t update_us;      // time of the last bank update, packing and transfer
+    int64_t total_us;
+    uint32_t updates;
+}IC74HC595Bank_t;
+
+esp_err_t Init74HC595(IC74HC595_t *IC74HC595, int16_t dataPin, int16_t latchPin, int16_t clkPin, size_t len);
+esp_err_t Init74HC595SPI(IC74HC595_t *IC74HC595, int16_t dataPin, int16_t latchPin, int16_t clkPin, size_t len, spi_host_device_t host);
+void Deinit74HC595(IC74HC595_t *IC74HC595);
 void clock74HC595(IC74HC595_t *const IC74HC595);
 void latch74HC595(IC74HC595_t *const IC74HC595);
 void writeByte74HC595(IC74HC595_t *const IC74HC595, uint8_t data);
+void setByte74HC595(IC74HC595_t *IC74HC595, size_t pos, uint8_t segments);
+void setDigit74HC595(IC74HC595_t *IC74HC595, size_t pos, int digit);
+void setNumber74HC595(IC74HC595_t *IC74HC595, size_t pos, size_t digits, int value);
+void shift74HC595(IC74HC595_t *IC74HC595);
+void commit74HC595(IC74HC595_t *IC74HC595);
 void write4Byte74HC595(IC74HC595_t *IC74HC595, uint8_t data1, uint8_t data2, uint8_t data3, uint8_t data4);
+void Bench74HC595(IC74HC595_t *IC74HC595, int loops);
+void Bench74HC595Chain(int16_t dataPin, int16_t latchPin, int16_t clkPin, spi_host_device_t host, int loops);
+esp_err_t Init74HC595Bank(IC74HC595Bank_t *bank, const int16_t *dataPins, size_t chains, int16_t latchPin, int16_t clkPin, int16_t dcPin, size_t len);
+void Deinit74HC595Bank(IC74HC595Bank_t *bank);
+void setByte74HC595Bank(IC74HC595Bank_t *bank, size_t chain, size_t pos, uint8_t segments);
+void setNumber74HC595Bank(IC74HC595Bank_t *bank, size_t chain, size_t pos, size_t digits, int value);
+esp_err_t commit74HC595Bank(IC74HC595Bank_t *bank);
+void Bench74HC595Bank(const int16_t *dataPins, int16_t latchPin, int16_t clkPin, int16_t dcPin, size_t len, int loops);
 void delay_ms(int ms);
+#endif
 
-#endif
\ No newline at end of file
+#endif
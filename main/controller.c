@@ -0,0 +1,1488 @@
+/*
+ * controller.c
+ *
+ *  Permanent signal controller with a double-buffered phase plan.
+ *
+ *  Writers never touch the running plan: they stage a new one into the
+ *  second buffer and the controller commits it at a defined boundary by
+ *  flipping an index. The controller task lives for the whole run, so an
+ *  apply neither kills it mid-update nor allocates anything.
+ *
+ *  One task and one hardware timer run every intersection: each keeps its
+ *  own next deadline and the task sleeps until the earliest of them.
+ *
+ *  Actuated steps (a green with a maximum and a passage time) also get a
+ *  decision tick every CTRL_DECISION_MS: a vehicle call restarts the
+ *  passage time, and the green ends when it runs out after the minimum or
+ *  when the maximum is reached. Whole seconds then count from that moment,
+ *  as after a clearance.
+ *
+ *  A transition (CTRL_TRANSITION) moves a timing change in without the
+ *  clearance: at the next second the running plan itself is rewritten
+ *  toward the staged one. The running green is shortened or stretched, but
+ *  never below CTRL_MIN_GREEN_S nor outside the two plans; the running
+ *  yellow or all-red is left alone. Greens moving by more than
+ *  CTRL_TRANSITION_PCT of the cycle go halfway for the rest of the cycle
+ *  and one more, then the staged plan takes over at a step end.
+ *
+ *  A preemption request replaces the running plan at once with one built
+ *  from the lamps lit at that moment: yellow for the phases moving, all-red,
+ *  then the green of the requested approach, held while the request stands.
+ *  The release runs the same clearance out of the hold, and the active
+ *  plan (or a plan staged meanwhile) starts again from its first step.
+ *
+ *  Intersection 0 leaves a checkpoint in RTC memory at every step it
+ *  starts: the running plan, the step and when it started on the RTC
+ *  clock, which keep through a software, panic or watchdog reset, and the
+ *  clock of its last output every second. The first ControllerAdd after
+ *  such a reset resumes that step instead of starting the plan over, if
+ *  the outage since that last output is short. Clearances, preemptions and holds are not
+ *  checkpointed: the reset after them starts over.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include "controller.h"
+#include "selftest.h"
+#include "74HC595.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_rom_crc.h"
+#include <sys/time.h>
+#include "segdisplay.h"
+#include "timing.h"
+#include "lamp.h"
+#include "supervisor.h"
+#endif
+
+// shared by all instances, compiled by hand
+static const Plan_t clearance = {
+    .steps = 1,
+    .step = {{.duration = CTRL_CLEARANCE_S, .lamps = PLAN_YELLOW1 | PLAN_YELLOW2, .count_to = {0, 0}}},
+    .remain = {{CTRL_CLEARANCE_S, CTRL_CLEARANCE_S}},
+    .cycle = CTRL_CLEARANCE_S,
+};
+
+/*
+ * A new step runs: restart the actuation timers
+ */
+static void CtrlStepStart(Ctrl_t *ctrl)
+{
+    ctrl->step_ms = 0;
+    ctrl->gap_ms = ctrl->run.plan->step[ctrl->run.step].passage * 100;
+}
+
+/**
+ * Start the controller core on a plan
+ *
+ * @return  false if the plan does not compile
+ */
+bool CtrlInit(Ctrl_t *ctrl, const Plan_t *plan)
+{
+    memset(ctrl, 0, sizeof(Ctrl_t));
+    ctrl->preempt_phase = -1;
+    ctrl->plan[0] = *plan;
+    if(!PlanCompile(&ctrl->plan[0])) return false;
+    PlanStart(&ctrl->run, &ctrl->plan[0]);
+    CtrlStepStart(ctrl);
+    return true;
+}
+
+/**
+ * Start the controller core inside a plan, where a checkpoint left it. A
+ * step that ran out meanwhile gets its last second: the next step follows,
+ * none is skipped.
+ *
+ * @param   ctrl                      controller core
+ * @param   plan                      plan running at the checkpoint
+ * @param   step                      step running at the checkpoint
+ * @param   elapsed                   seconds since that step started
+ * @param   cycles                    cycle count at the checkpoint
+ *
+ * @return  false if the plan does not compile or has no such step
+ */
+bool CtrlResume(Ctrl_t *ctrl, const Plan_t *plan, int step, uint32_t elapsed, uint32_t cycles)
+{
+    const PlanStep_t *s;
+    uint32_t last;
+
+    if(!CtrlInit(ctrl, plan) || step < 0 || step >= ctrl->plan[0].steps) return false;
+    s = &ctrl->plan[0].step[step];
+    last = s->max ? s->max : s->duration;
+    last = last ? last - 1 : 0;
+    ctrl->run.step = step;
+    ctrl->run.elapsed = elapsed < last ? elapsed : last;
+    ctrl->run.cycles = cycles;
+    CtrlStepStart(ctrl);
+    ctrl->step_ms = ctrl->run.elapsed * 1000;
+    return true;
+}
+
+/**
+ * Resume a checkpoint by the clock: the outage is the time since the
+ * controller was last alive, the step keeps the time it ran before it.
+ * A step of any length resumes, only an outage longer than
+ * CONTROLLER_RESUME_MAX_S or a clock gone back starts over.
+ *
+ * @param   ctrl                      controller core
+ * @param   plan                      plan running at the checkpoint
+ * @param   step                      step running at the checkpoint
+ * @param   cycles                    cycle count at the checkpoint
+ * @param   step_us                   clock at the start of that step
+ * @param   alive_us                  clock when the controller last ran
+ * @param   now_us                    clock now
+ *
+ * @return  false to start over
+ */
+bool CtrlResumeAt(Ctrl_t *ctrl, const Plan_t *plan, int step, uint32_t cycles, int64_t step_us, int64_t alive_us, int64_t now_us)
+{
+    int64_t outage = now_us - alive_us;
+
+    if(alive_us < step_us || outage < 0 || outage > CONTROLLER_RESUME_MAX_S * 1000000LL) return false;
+    return CtrlResume(ctrl, plan, step, (now_us - step_us) / 1000000, cycles);
+}
+
+/*
+ * Every step of both plans is fixed, or actuated, in both
+ */
+static bool CtrlSameKind(const Plan_t *a, const Plan_t *b)
+{
+    for(int i = 0; i < a->steps; i++){
+        if((a->step[i].max == 0) != (b->step[i].max == 0)) return false;
+    }
+    return true;
+}
+
+/**
+ * Stage a plan for commit, replaces a plan staged earlier and not yet committed
+ *
+ * @param   ctrl                      controller core
+ * @param   plan                      new plan, copied
+ * @param   mode                      commit boundary
+ * 
+ * @return  false if the plan does not compile, or if it changes more than the
+ *          timing of the running plan and mode is CTRL_AT_STEP_END, or also
+ *          turns a fixed step into an actuated one or back with CTRL_TRANSITION
+ */
+bool CtrlStage(Ctrl_t *ctrl, const Plan_t *plan, CtrlCommit_t mode)
+{
+    Plan_t *staged = &ctrl->plan[ctrl->active ^ 1];
+
+    if((mode == CTRL_AT_STEP_END || mode == CTRL_TRANSITION) && !PlanSameLamps(&ctrl->plan[ctrl->active], plan)) return false;
+    if(mode == CTRL_TRANSITION && !CtrlSameKind(&ctrl->plan[ctrl->active], plan)) return false;
+    ctrl->pending = false;
+    ctrl->bridging = false;
+    *staged = *plan;
+    if(!PlanCompile(staged)) return false;
+    ctrl->mode = mode;
+    ctrl->pending = true;
+    return true;
+}
+
+/**
+ * Commit a plan staged with CTRL_NOW: start the clearance, the new plan follows it
+ *
+ * @return  true if a plan was committed
+ */
+bool CtrlCommitNow(Ctrl_t *ctrl)
+{
+    // a preemption holds it, the plan starts when the preemption ends
+    if(!ctrl->pending || ctrl->mode != CTRL_NOW || ctrl->preempting) return false;
+    ctrl->active ^= 1;
+    ctrl->pending = false;
+    ctrl->in_clearance = true;
+    ctrl->commits++;
+    PlanStart(&ctrl->run, &clearance);
+    CtrlStepStart(ctrl);
+    return true;
+}
+
+static bool CtrlPreemptBoundary(Ctrl_t *ctrl);
+
+/*
+ * The running step just ended: leave the clearance, or commit a staged
+ * plan at its boundary
+ */
+static bool CtrlBoundary(Ctrl_t *ctrl)
+{
+    uint8_t next;
+    uint32_t cycles;
+
+    if(ctrl->preempting) return CtrlPreemptBoundary(ctrl);
+    if(ctrl->in_clearance){
+        ctrl->in_clearance = false;
+        PlanStart(&ctrl->run, &ctrl->plan[ctrl->active]);
+        return false;
+    }
+    if(!ctrl->pending) return false;
+    if(ctrl->mode == CTRL_NOW) return CtrlCommitNow(ctrl);
+    if(ctrl->mode == CTRL_AT_CYCLE_END && ctrl->run.step != 0) return false;
+    if(ctrl->mode == CTRL_TRANSITION && (!ctrl->bridging || ctrl->run.cycles < ctrl->transition_end)) return false;
+
+    next = ctrl->run.step;
+    cycles = ctrl->run.cycles;
+    ctrl->active ^= 1;
+    ctrl->pending = false;
+    ctrl->bridging = false;
+    ctrl->commits++;
+    PlanStart(&ctrl->run, &ctrl->plan[ctrl->active]);
+    ctrl->run.step = (ctrl->mode == CTRL_AT_CYCLE_END) ? 0 : next;
+    ctrl->run.cycles = cycles;
+    return true;
+}
+
+/*
+ * Seconds a step of the bridge lasts: halfway, or the new plan's at once
+ */
+static uint16_t CtrlBridgeSeconds(uint16_t from, uint16_t to, bool halfway)
+{
+    return halfway ? (from + to + 1) / 2 : to;
+}
+
+/*
+ * Start a transition: rewrite the running plan toward the staged one. Only
+ * the greens are bridged, the other steps take the staged timing except the
+ * running one, kept until the commit. The running green ends no sooner than CTRL_MIN_GREEN_S (or its
+ * own duration, if shorter) and no sooner than the next second.
+ */
+static void CtrlBridge(Ctrl_t *ctrl)
+{
+    Plan_t *bridge = &ctrl->plan[ctrl->active];
+    const Plan_t *target = &ctrl->plan[ctrl->active ^ 1];
+    uint32_t limit = bridge->cycle * CTRL_TRANSITION_PCT / 100;
+    bool halfway = false;
+
+    for(int i = 0; i < bridge->steps; i++){
+        const PlanStep_t *from = &bridge->step[i], *to = &target->step[i];
+
+        if(!(from->lamps & (PLAN_GREEN1 | PLAN_GREEN2))) continue;
+        if(abs(to->duration - from->duration) > limit || abs(to->max - from->max) > limit) halfway = true;
+    }
+    for(int i = 0; i < bridge->steps; i++){
+        PlanStep_t *step = &bridge->step[i];
+        const PlanStep_t *to = &target->step[i];
+        bool green = step->lamps & (PLAN_GREEN1 | PLAN_GREEN2);
+        uint16_t least;
+
+        if(i == ctrl->run.step && !green) continue;
+        least = step->duration < CTRL_MIN_GREEN_S ? step->duration : CTRL_MIN_GREEN_S;
+        if(least <= ctrl->run.elapsed) least = ctrl->run.elapsed + 1;
+        step->duration = CtrlBridgeSeconds(step->duration, to->duration, green && halfway);
+        step->max = CtrlBridgeSeconds(step->max, to->max, green && halfway);
+        step->passage = to->passage;
+        step->call = to->call;
+        if(i == ctrl->run.step && step->duration < least) step->duration = least;
+        if(step->max && step->max < step->duration) step->max = step->duration;
+    }
+    PlanCompile(bridge);
+    ctrl->bridging = true;
+    ctrl->transition_end = ctrl->run.cycles + (halfway ? 2 : 0);
+}
+
+/**
+ * Advance one second and commit a staged plan at its boundary. An actuated
+ * step that reaches its maximum here is a max-out, also without decision
+ * ticks. A transition staged since the last second starts first.
+ *
+ * @return  true if a plan was committed
+ */
+bool CtrlTick(Ctrl_t *ctrl)
+{
+    bool actuated, committed;
+
+    // after a clearance or a preemption the plan starts over, the bridge waits for it
+    if(ctrl->pending && ctrl->mode == CTRL_TRANSITION && !ctrl->bridging && ctrl->run.plan == &ctrl->plan[ctrl->active]){
+        CtrlBridge(ctrl);
+    }
+    actuated = CtrlActuated(ctrl);
+    if(!PlanTick(&ctrl->run)) return false;
+    if(actuated) ctrl->max_outs++;
+    committed = CtrlBoundary(ctrl);
+    CtrlStepStart(ctrl);
+    return committed;
+}
+
+/**
+ * Decision tick of an actuated step: a call of the step's approach restarts
+ * its passage time, the step ends when the passage runs out after the
+ * minimum (gap-out) or at the maximum (max-out). Otherwise the countdowns
+ * are projected to where the passage time would end the step.
+ *
+ * @param   ctrl                      controller core
+ * @param   calls                     bit per approach with a vehicle present or arrived since the last tick
+ * @param   ms                        time since the last decision tick
+ *
+ * @return  true if the step ended, the next one starts now
+ */
+bool CtrlDecide(Ctrl_t *ctrl, uint8_t calls, uint32_t ms)
+{
+    const PlanStep_t *step = &ctrl->run.plan->step[ctrl->run.step];
+    uint32_t end;
+
+    if(!CtrlActuated(ctrl)) return false;
+    ctrl->step_ms += ms;
+    if(calls & (1 << step->call)) ctrl->gap_ms = step->passage * 100;
+    else ctrl->gap_ms = ctrl->gap_ms > ms ? ctrl->gap_ms - ms : 0;
+
+    if(ctrl->step_ms >= step->max * 1000){
+        ctrl->max_outs++;
+    }else if(ctrl->step_ms >= step->duration * 1000 && ctrl->gap_ms == 0){
+        ctrl->gap_outs++;
+    }else{
+        end = (ctrl->step_ms + ctrl->gap_ms + 999) / 1000;
+        if(end < step->duration) end = step->duration;
+        if(end <= ctrl->run.elapsed) end = ctrl->run.elapsed + 1;
+        if(end > step->max) end = step->max;
+        ctrl->run.extend = end - step->duration;
+        return false;
+    }
+    PlanNext(&ctrl->run);
+    CtrlBoundary(ctrl);
+    CtrlStepStart(ctrl);
+    return true;
+}
+
+/**
+ * True while an actuated step runs: the caller owes it decision ticks
+ */
+bool CtrlActuated(const Ctrl_t *ctrl)
+{
+    return !ctrl->in_clearance && ctrl->run.plan->step[ctrl->run.step].max != 0;
+}
+
+/*
+ * Build and start the way from the lamps lit now to the green of phase, or
+ * to all-red for phase -1: yellow on every phase moving, unless the phase
+ * keeps its green, then all-red, then the hold if asked
+ */
+static void CtrlPreemptStart(Ctrl_t *ctrl, int phase, bool hold)
+{
+    static const uint8_t red[PLAN_HEADS] = {PLAN_RED1, PLAN_RED2};
+    static const uint8_t yellow[PLAN_HEADS] = {PLAN_YELLOW1, PLAN_YELLOW2};
+    static const uint8_t green[PLAN_HEADS] = {PLAN_GREEN1, PLAN_GREEN2};
+    Plan_t *plan = &ctrl->preempt;
+    uint8_t lamps = CtrlLamps(ctrl), clear = 0, target = 0;
+
+    for(int h = 0; h < PLAN_HEADS; h++){
+        target |= h == phase ? green[h] : red[h];
+        if(h == phase && (lamps & green[h])) clear |= green[h];
+        else if(lamps & (green[h] | yellow[h])) clear |= yellow[h];
+        else clear |= red[h];
+    }
+    memset(plan, 0, sizeof(Plan_t));
+    if(clear != target){
+        if(clear != (PLAN_RED1 | PLAN_RED2)) plan->step[plan->steps++] = (PlanStep_t){.duration = CTRL_PREEMPT_YELLOW_S, .lamps = clear, .count_to = {PLAN_SHOW_88, PLAN_SHOW_88}};
+        plan->step[plan->steps++] = (PlanStep_t){.duration = CTRL_ALL_RED_S, .lamps = PLAN_RED1 | PLAN_RED2, .count_to = {PLAN_SHOW_88, PLAN_SHOW_88}};
+    }
+    if(hold) plan->step[plan->steps++] = (PlanStep_t){.duration = 1, .lamps = target, .count_to = {PLAN_SHOW_88, PLAN_SHOW_88}};
+    PlanCompile(plan);
+
+    if(!ctrl->preempting) ctrl->preempt_cycles = ctrl->run.cycles;
+    ctrl->preempting = true;
+    ctrl->preempt_exit = !hold;
+    ctrl->in_clearance = false;
+    PlanStart(&ctrl->run, plan);
+    ctrl->run.cycles = ctrl->preempt_cycles;
+    CtrlStepStart(ctrl);
+}
+
+/*
+ * Back to the active plan from its first step, or to the plan staged
+ * during the preemption
+ *
+ * @return  true if a plan was committed
+ */
+static bool CtrlPreemptEnd(Ctrl_t *ctrl)
+{
+    bool commit = ctrl->pending;
+
+    ctrl->preempting = false;
+    if(commit){
+        ctrl->active ^= 1;
+        ctrl->pending = false;
+        ctrl->bridging = false;
+        ctrl->commits++;
+    }
+    PlanStart(&ctrl->run, &ctrl->plan[ctrl->active]);
+    ctrl->run.cycles = ctrl->preempt_cycles;
+    return commit;
+}
+
+/*
+ * A step of the preempt plan ended: the hold repeats while the request
+ * stands, a release during the clearance in leaves from the all-red
+ */
+static bool CtrlPreemptBoundary(Ctrl_t *ctrl)
+{
+    bool wrapped = ctrl->run.step == 0, last = ctrl->run.step == ctrl->preempt.steps - 1;
+
+    ctrl->run.cycles = ctrl->preempt_cycles;
+    if(ctrl->preempt_exit) return wrapped ? CtrlPreemptEnd(ctrl) : false;
+    if(ctrl->preempt_phase >= 0){
+        if(wrapped) ctrl->run.step = ctrl->preempt.steps - 1;
+        return false;
+    }
+    return (wrapped || last) ? CtrlPreemptEnd(ctrl) : false;
+}
+
+/**
+ * Request preemption for an approach, or release it with -1. A request
+ * changes the lamps at once: the phases moving turn yellow, or the
+ * requested one keeps its green.
+ *
+ * @param   ctrl                      controller core
+ * @param   phase                     approach to give the green to, -1 to release
+ *
+ * @return  true if the running plan was replaced: output now and count whole seconds from here
+ */
+bool CtrlPreempt(Ctrl_t *ctrl, int phase)
+{
+    if(phase >= PLAN_HEADS || phase == ctrl->preempt_phase) return false;
+    ctrl->preempt_phase = phase;
+    if(phase >= 0){
+        ctrl->preempts++;
+        CtrlPreemptStart(ctrl, phase, true);
+        return true;
+    }
+    // released in the hold: the clearance out starts now, otherwise at the end of the clearance in
+    if(!ctrl->preempting || ctrl->preempt_exit || ctrl->run.step != ctrl->preempt.steps - 1) return false;
+    CtrlPreemptStart(ctrl, -1, false);
+    return true;
+}
+
+uint8_t CtrlLamps(const Ctrl_t *ctrl)
+{
+    return PlanLamps(&ctrl->run);
+}
+
+int CtrlCount(const Ctrl_t *ctrl, int head)
+{
+    return PlanCount(&ctrl->run, head);
+}
+
+/**
+ * Segments of the 4 countdown digits in write4Byte74HC595 order: phase 2
+ * tens and units, then phase 1 tens and units. Blank heads are 0.
+ */
+void CtrlDisplay(const Ctrl_t *ctrl, uint8_t segments[4])
+{
+    for(int head = 0; head < PLAN_HEADS; head++){
+        int count = CtrlCount(ctrl, head);
+        uint8_t *digits = &segments[head == 0 ? 2 : 0];
+
+        digits[0] = count < 0 ? 0 : Digit74HC595(count / 10 % 10);
+        digits[1] = count < 0 ? 0 : Digit74HC595(count % 10);
+    }
+}
+
+/*
+ * A phase must never go from green straight to red, and every phase shows exactly one lamp
+ */
+static int SelfTestCheck(uint8_t prev, uint8_t lamps)
+{
+    static const uint8_t phase[2][3] = {
+        {PLAN_RED1, PLAN_YELLOW1, PLAN_GREEN1}, {PLAN_RED2, PLAN_YELLOW2, PLAN_GREEN2},
+    };
+    int errors = PlanConflict(lamps) ? 1 : 0;
+
+    for(int p = 0; p < 2; p++){
+        int lit = 0;
+        for(int c = 0; c < 3; c++) lit += (lamps & phase[p][c]) ? 1 : 0;
+        if(lit != 1) errors++;
+        if((prev & phase[p][2]) && (lamps & phase[p][0])) errors++;
+    }
+    return errors;
+}
+
+/*
+ * Run actuated plans on decision ticks with random calls: every green must
+ * last from its minimum to its maximum, end before its maximum only after a
+ * whole passage time without a call, and fixed steps keep their duration
+ */
+static int SelfTestActuated(uint32_t *seed, uint32_t *outs)
+{
+    static Ctrl_t ctrl;
+    Plan_t plan;
+    int errors = 0;
+
+    for(int trial = 0; trial < 60; trial++){
+        int G1 = 1 + SelfTestRandom(seed) % 10, G2 = 1 + SelfTestRandom(seed) % 10;
+        int passage = 5 + SelfTestRandom(seed) % 30, density = SelfTestRandom(seed) % 100;
+        uint32_t t = 0, tick = 1000, start = 0, last_call[PLAN_HEADS] = {0};
+        uint8_t prev;
+
+        PlanTwoPhaseActuated(&plan, G1, G1 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5,
+            G2, G2 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5, passage);
+        CtrlInit(&ctrl, &plan);
+        prev = CtrlLamps(&ctrl);
+        while(ctrl.run.cycles < 20){
+            const PlanStep_t *step = &ctrl.plan[0].step[ctrl.run.step];
+            uint8_t calls = 0, running = ctrl.run.step;
+            uint32_t since, lasted;
+
+            t += CTRL_DECISION_MS;
+            for(int a = 0; a < PLAN_HEADS; a++){
+                if(SelfTestRandom(seed) % 100 < density){
+                    calls |= 1 << a;
+                    last_call[a] = t;
+                }
+            }
+            // the decision first, as the controller task does, then the second if still due
+            if(CtrlDecide(&ctrl, calls, CTRL_DECISION_MS)){
+                tick = t + 1000;
+            }else if(t == tick){
+                CtrlTick(&ctrl);
+                tick += 1000;
+            }
+            if(ctrl.run.step != running){
+                lasted = t - start;
+                since = t - (last_call[step->call] > start ? last_call[step->call] : start);
+                if(step->max == 0 && lasted != step->duration * 1000u) errors++;
+                if(step->max && (lasted < step->duration * 1000u || lasted > step->max * 1000u)) errors++;
+                if(step->max && lasted < step->max * 1000u && since < step->passage * 100u) errors++;
+                start = t;
+            }
+            for(int h = 0; h < PLAN_HEADS; h++){
+                int count = CtrlCount(&ctrl, h);
+                if(count < 0 || count > 99) errors++;
+            }
+            errors += SelfTestCheck(prev, CtrlLamps(&ctrl));
+            prev = CtrlLamps(&ctrl);
+        }
+        *outs += ctrl.gap_outs + ctrl.max_outs;
+    }
+    return errors;
+}
+
+#define SELFTEST_PREEMPT_BOUND_S (CTRL_PREEMPT_YELLOW_S + CTRL_ALL_RED_S)
+
+/*
+ * Preempt fixed and actuated plans at random times for a random approach,
+ * in virtual time: the request must stop the other green at once, the
+ * requested green must follow within the clearance after CTRL_ALL_RED_S of
+ * all-red, and the plan must come back within the clearance after the
+ * release. The request to green latency goes into hist, by second.
+ */
+static int SelfTestPreempt(uint32_t *seed, uint32_t hist[SELFTEST_PREEMPT_BOUND_S + 1])
+{
+    static const uint8_t green[PLAN_HEADS] = {PLAN_GREEN1, PLAN_GREEN2};
+    static Ctrl_t ctrl;
+    const uint32_t bound = SELFTEST_PREEMPT_BOUND_S * 1000;
+    Plan_t plan;
+    int errors = 0;
+
+    for(int trial = 0; trial < 300; trial++){
+        int G1 = 1 + SelfTestRandom(seed) % 15, Y1 = 1 + SelfTestRandom(seed) % 5;
+        int G2 = 1 + SelfTestRandom(seed) % 15, Y2 = 1 + SelfTestRandom(seed) % 5, phase = trial % PLAN_HEADS;
+        uint32_t t = 0, tick = 1000, red_since = 0;
+        uint32_t request = 100 * (10 + SelfTestRandom(seed) % 600), release = request + 100 * (1 + SelfTestRandom(seed) % 400);
+        bool waiting = false, resuming = false;
+        uint8_t prev, lamps;
+
+        if(trial & 2) PlanTwoPhaseActuated(&plan, G1, G1 + 10, Y1, G2, G2 + 10, Y2, 20);
+        else PlanTwoPhase(&plan, G1, Y1, G2, Y2);
+        CtrlInit(&ctrl, &plan);
+        prev = CtrlLamps(&ctrl);
+        while(t < release + bound + 30000){
+            t += CTRL_DECISION_MS;
+            if(t == request){
+                if(!CtrlPreempt(&ctrl, phase)) errors++;
+                tick = t + 1000;
+                waiting = true;
+                if(CtrlLamps(&ctrl) & green[phase ^ 1]) errors++;
+            }else if(t == release){
+                if(CtrlPreempt(&ctrl, -1)) tick = t + 1000;
+                waiting = false;
+                resuming = true;
+            }else if(CtrlDecide(&ctrl, SelfTestRandom(seed) & 3, CTRL_DECISION_MS)){
+                tick = t + 1000;
+            }
+            if(t == tick){
+                CtrlTick(&ctrl);
+                tick += 1000;
+            }
+            lamps = CtrlLamps(&ctrl);
+            if(lamps == (PLAN_RED1 | PLAN_RED2) && prev != lamps) red_since = t;
+            if(waiting && (lamps & green[phase])){
+                uint32_t latency = t - request;
+
+                waiting = false;
+                if(latency > bound || (latency && (prev != (PLAN_RED1 | PLAN_RED2) || t - red_since < CTRL_ALL_RED_S * 1000))) errors++;
+                hist[latency / 1000]++;
+            }
+            if(resuming && !ctrl.preempting){
+                resuming = false;
+                if(t - release > bound) errors++;
+            }
+            errors += SelfTestCheck(prev, lamps);
+            prev = lamps;
+        }
+        if(waiting || resuming || ctrl.preempting || ctrl.preempts != 1) errors++;
+    }
+    return errors;
+}
+
+/*
+ * Transitions between random fixed plans staged at random seconds: the
+ * staged plan must run within two cycles, every green last between the
+ * two plans' greens (the running one at least CTRL_MIN_GREEN_S or its own
+ * duration), the running yellow keep its timing up to the commit and the
+ * other ones take the staged timing, and
+ * the lamps never skip a yellow. Steps started after the commit run the
+ * staged plan exactly.
+ */
+static int SelfTestTransition(uint32_t *seed, uint32_t *transitions)
+{
+    static Ctrl_t ctrl;
+    Plan_t a, b;
+    int errors = 0;
+
+    for(int trial = 0; trial < 600; trial++){
+        int scale = trial & 1 ? 60 : 20, stage_at, start = 0, running, longest, commit_at = 0;
+        bool committed = false, first = true;
+        uint8_t prev;
+
+        PlanTwoPhase(&a, 1 + SelfTestRandom(seed) % scale, 1 + SelfTestRandom(seed) % 5, 1 + SelfTestRandom(seed) % scale, 1 + SelfTestRandom(seed) % 5);
+        PlanTwoPhase(&b, 1 + SelfTestRandom(seed) % scale, 1 + SelfTestRandom(seed) % 5, 1 + SelfTestRandom(seed) % scale, 1 + SelfTestRandom(seed) % 5);
+        longest = a.cycle > b.cycle ? a.cycle : b.cycle;
+        CtrlInit(&ctrl, &a);
+        stage_at = SelfTestRandom(seed) % (2 * a.cycle);
+        prev = CtrlLamps(&ctrl);
+        running = -1;
+
+        for(int sec = 0; sec < stage_at + 6 * longest; sec++){
+            uint8_t step = ctrl.run.step;
+
+            if(sec == stage_at){
+                if(!CtrlStage(&ctrl, &b, CTRL_TRANSITION)) errors++;
+                running = step;
+                start = sec - ctrl.run.elapsed;
+            }
+            if(CtrlTick(&ctrl)){
+                if(committed || sec - stage_at > 2 * longest) errors++;
+                committed = true;
+                commit_at = sec;
+            }
+            if(sec >= stage_at && ctrl.run.step != step){
+                int lasted = sec + 1 - start, lo = a.step[step].duration, hi = b.step[step].duration;
+
+                if(lo > hi){
+                    hi = lo;
+                    lo = b.step[step].duration;
+                }
+                if(!(a.step[step].lamps & (PLAN_GREEN1 | PLAN_GREEN2))){
+                    if(lasted != (step == running && (!committed || start <= commit_at) ? a : b).step[step].duration) errors++;
+                }else if(lasted > hi || lasted < lo){
+                    errors++;
+                }
+                if(first && step == running && lasted < CTRL_MIN_GREEN_S && lasted < a.step[step].duration) errors++;
+                if(committed && start > commit_at && lasted != b.step[step].duration) errors++;
+                first = false;
+                start = sec + 1;
+            }
+            errors += SelfTestCheck(prev, CtrlLamps(&ctrl));
+            prev = CtrlLamps(&ctrl);
+        }
+        if(!committed || ctrl.pending || ctrl.bridging) errors++;
+        *transitions += committed;
+    }
+    return errors;
+}
+
+/*
+ * Resume random fixed and actuated plans from a checkpoint taken at a random
+ * second, after a random outage: the checkpointed step must light its lamps
+ * at once, run on from where the outage left it but never past its last
+ * second, and hand over to the step after it
+ */
+static int SelfTestResume(uint32_t *seed)
+{
+    static Ctrl_t ctrl, resumed;
+    Plan_t plan;
+    int errors = 0;
+
+    for(int trial = 0; trial < 300; trial++){
+        int G1 = 1 + SelfTestRandom(seed) % 20, G2 = 1 + SelfTestRandom(seed) % 20;
+        int run = SelfTestRandom(seed) % 200, outage = SelfTestRandom(seed) % 10;
+        const PlanStep_t *step;
+        uint32_t last, ticks;
+        uint8_t prev, from;
+
+        if(trial & 1) PlanTwoPhaseActuated(&plan, G1, G1 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5, G2, G2 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5, 30);
+        else PlanTwoPhase(&plan, G1, 1 + SelfTestRandom(seed) % 5, G2, 1 + SelfTestRandom(seed) % 5);
+        CtrlInit(&ctrl, &plan);
+        for(int sec = 0; sec < run; sec++) CtrlTick(&ctrl);
+
+        if(!CtrlResume(&resumed, &plan, ctrl.run.step, ctrl.run.elapsed + outage, ctrl.run.cycles)) errors++;
+        step = &plan.step[ctrl.run.step];
+        last = (step->max ? step->max : step->duration) - 1;
+        if(resumed.run.step != ctrl.run.step || resumed.run.cycles != ctrl.run.cycles) errors++;
+        if(CtrlLamps(&resumed) != CtrlLamps(&ctrl)) errors++;
+        if(resumed.run.elapsed != (ctrl.run.elapsed + outage < last ? ctrl.run.elapsed + outage : last)) errors++;
+        from = resumed.run.step;
+        prev = CtrlLamps(&resumed);
+        ticks = 0;
+        while(resumed.run.step == from && ticks <= last){
+            CtrlTick(&resumed);
+            ticks++;
+        }
+        if(resumed.run.step != (from + 1) % plan.steps || ticks != last + 1 - (uint32_t)(ctrl.run.elapsed + outage < last ? ctrl.run.elapsed + outage : last)) errors++;
+        errors += SelfTestCheck(prev, CtrlLamps(&resumed));
+    }
+    if(CtrlResume(&resumed, &plan, plan.steps, 0, 0)) errors++;
+
+    // resets deep into a long green: only the outage counts against CONTROLLER_RESUME_MAX_S
+    PlanTwoPhase(&plan, 50, 3, 50, 3);
+    for(int into = 0; into < 50; into += 7){
+        for(int outage = 0; outage <= CONTROLLER_RESUME_MAX_S + 2; outage++){
+            const int64_t step_us = 1000000000LL, alive_us = step_us + into * 1000000LL + 400000;
+            const int64_t now_us = alive_us + outage * 1000000LL;
+            bool ok = CtrlResumeAt(&resumed, &plan, 0, 3, step_us, alive_us, now_us);
+            uint32_t elapsed = (now_us - step_us) / 1000000;
+
+            if(ok != (outage <= CONTROLLER_RESUME_MAX_S)) errors++;
+            if(ok && (resumed.run.step != 0 || resumed.run.cycles != 3 || resumed.run.elapsed != (elapsed < 49 ? elapsed : 49))) errors++;
+        }
+    }
+    if(CtrlResumeAt(&resumed, &plan, 0, 0, 1000000000LL, 1030000000LL, 1029000000LL)) errors++;
+    return errors;
+}
+
+#define SELFTEST_FRAMES 512
+
+/*
+ * Run fixed and actuated plans on decision ticks and record every frame the
+ * timing core latches: lamps and countdown digits taken after the same
+ * event, the digits decoded from their segments. Every digit a head shows
+ * must be the seconds its color has left: exactly on a fixed plan, and at
+ * least 1 and 1 on the last frame before the change on an actuated one.
+ */
+static int SelfTestCountdown(uint32_t *seed, uint32_t *frames)
+{
+    static const uint8_t color[PLAN_HEADS] = {PLAN_RED1 | PLAN_YELLOW1 | PLAN_GREEN1, PLAN_RED2 | PLAN_YELLOW2 | PLAN_GREEN2};
+    static struct {
+        uint32_t t;
+        uint8_t lamps;
+        int8_t shown[PLAN_HEADS];
+    }frame[SELFTEST_FRAMES];
+    static Ctrl_t ctrl;
+    Plan_t plan;
+    int errors = 0;
+
+    for(int trial = 0; trial < 100; trial++){
+        bool actuated = trial & 1;
+        int density = SelfTestRandom(seed) % 100, count = 0;
+        uint32_t t = 0, tick = 1000;
+
+        if(actuated) PlanTwoPhaseActuated(&plan, 1 + SelfTestRandom(seed) % 10, 10 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5,
+            1 + SelfTestRandom(seed) % 10, 10 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5, 5 + SelfTestRandom(seed) % 30);
+        else PlanTwoPhase(&plan, 1 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5, 1 + SelfTestRandom(seed) % 20, 1 + SelfTestRandom(seed) % 5);
+        CtrlInit(&ctrl, &plan);
+        while(ctrl.run.cycles < 4 && count < SELFTEST_FRAMES){
+            uint8_t calls = 0, segments[4], lamps;
+            int8_t shown[PLAN_HEADS];
+
+            if(t > 0){
+                for(int a = 0; a < PLAN_HEADS; a++){
+                    if(SelfTestRandom(seed) % 100 < density) calls |= 1 << a;
+                }
+                if(CtrlDecide(&ctrl, calls, CTRL_DECISION_MS)){
+                    tick = t + 1000;
+                }else if(t == tick){
+                    CtrlTick(&ctrl);
+                    tick += 1000;
+                }
+            }
+            // what the latch shows after this event
+            lamps = CtrlLamps(&ctrl);
+            CtrlDisplay(&ctrl, segments);
+            for(int h = 0; h < PLAN_HEADS; h++){
+                const uint8_t *digits = &segments[h == 0 ? 2 : 0];
+                int tens = Segments74HC595(digits[0]), units = Segments74HC595(digits[1]);
+
+                shown[h] = (tens < 0 || units < 0) ? -1 : tens * 10 + units;
+                if(shown[h] != CtrlCount(&ctrl, h) || shown[h] < 1) errors++;
+            }
+            if(count == 0 || lamps != frame[count - 1].lamps || memcmp(shown, frame[count - 1].shown, sizeof(shown))){
+                frame[count].t = t;
+                frame[count].lamps = lamps;
+                memcpy(frame[count].shown, shown, sizeof(shown));
+                count++;
+            }
+            t += CTRL_DECISION_MS;
+        }
+        *frames += count;
+
+        for(int h = 0; h < PLAN_HEADS; h++){
+            for(int i = 0; i < count; i++){
+                int j = i + 1;
+                uint32_t left;
+
+                while(j < count && ((frame[j].lamps ^ frame[i].lamps) & color[h]) == 0) j++;
+                if(j == count) break;
+                left = (frame[j].t - frame[i].t + 999) / 1000;
+                if(!actuated && frame[i].shown[h] != (int)left) errors++;
+                if(actuated && j == i + 1 && frame[i].shown[h] != 1) errors++;
+            }
+        }
+    }
+    return errors;
+}
+
+/**
+ * Swap random plans at random times with every commit mode and check the
+ * commit latency in seconds and every lamp state the swap goes through,
+ * then run actuated plans, preemptions, transitions and resumes
+ *
+ * @return  true if all swaps were hitless
+ */
+bool CtrlSelfTest(void)
+{
+    static const PlanStep_t allred[] = {
+        {.duration = 0, .lamps = PLAN_RED1 | PLAN_GREEN2,  .count_to = {2, 0}},
+        {.duration = 0, .lamps = PLAN_RED1 | PLAN_YELLOW2, .count_to = {2, 1}},
+        {.duration = 2, .lamps = PLAN_RED1 | PLAN_RED2,    .count_to = {2, 4}},
+        {.duration = 0, .lamps = PLAN_RED2 | PLAN_GREEN1,  .count_to = {3, 4}},
+        {.duration = 0, .lamps = PLAN_RED2 | PLAN_YELLOW1, .count_to = {4, 4}},
+    };
+    static Ctrl_t ctrl;
+    Plan_t a, b;
+    uint32_t seed = 0x7e57, outs = 0, transitions = 0, hist[SELFTEST_PREEMPT_BOUND_S + 1] = {0};
+    int errors = 0, swaps = 0;
+
+    for(int trial = 0; trial < 600; trial++){
+        CtrlCommit_t mode = trial % 3;
+        int expect, stage_at;
+        uint8_t prev;
+
+        PlanTwoPhase(&a, 1 + SelfTestRandom(&seed) % 20, 1 + SelfTestRandom(&seed) % 5, 1 + SelfTestRandom(&seed) % 20, 1 + SelfTestRandom(&seed) % 5);
+        PlanTwoPhase(&b, 1 + SelfTestRandom(&seed) % 20, 1 + SelfTestRandom(&seed) % 5, 1 + SelfTestRandom(&seed) % 20, 1 + SelfTestRandom(&seed) % 5);
+        if((trial / 3) % 4 == 3){
+            // all-red clearance between the phases, a structure change
+            memcpy(b.step, allred, sizeof(allred));
+            b.steps = sizeof(allred) / sizeof(allred[0]);
+            b.step[0].duration = 1 + SelfTestRandom(&seed) % 20;
+            b.step[1].duration = 1 + SelfTestRandom(&seed) % 5;
+            b.step[3].duration = 1 + SelfTestRandom(&seed) % 20;
+            b.step[4].duration = 1 + SelfTestRandom(&seed) % 5;
+            PlanCompile(&b);
+        }
+        CtrlInit(&ctrl, &a);
+        stage_at = SelfTestRandom(&seed) % (2 * a.cycle);
+        expect = -1;
+        prev = CtrlLamps(&ctrl);
+
+        for(int sec = 0; sec < 4 * (a.cycle + b.cycle); sec++){
+            uint32_t commits = ctrl.commits;
+
+            if(sec == stage_at){
+                bool staged = CtrlStage(&ctrl, &b, mode);
+                if(staged != (mode != CTRL_AT_STEP_END || PlanSameLamps(&a, &b))) errors++;
+                if(!staged) break;
+                if(mode == CTRL_AT_STEP_END) expect = a.step[ctrl.run.step].duration - ctrl.run.elapsed;
+                if(mode == CTRL_AT_CYCLE_END){
+                    expect = a.step[ctrl.run.step].duration - ctrl.run.elapsed;
+                    for(int s = ctrl.run.step + 1; s < a.steps; s++) expect += a.step[s].duration;
+                }
+                if(mode == CTRL_NOW){
+                    expect = 0;
+                    CtrlCommitNow(&ctrl);
+                }
+            }else{
+                CtrlTick(&ctrl);
+            }
+            if(ctrl.commits != commits){
+                swaps++;
+                if(sec - stage_at != expect) errors++;
+            }
+            errors += SelfTestCheck(prev, CtrlLamps(&ctrl));
+            prev = CtrlLamps(&ctrl);
+        }
+        if(ctrl.pending) errors++;
+    }
+    errors += SelfTestActuated(&seed, &outs);
+    errors += SelfTestPreempt(&seed, hist);
+    errors += SelfTestTransition(&seed, &transitions);
+    errors += SelfTestResume(&seed);
+    printf("[CtrlSelfTest] %s, %d swaps, %"PRIu32" transitions, %"PRIu32" gap/max-outs, %d errors, preempt to green:",
+        errors ? "FAIL" : "ok", swaps, transitions, outs, errors);
+    for(int s = 0; s <= SELFTEST_PREEMPT_BOUND_S; s++) printf(" %"PRIu32"x<%ds", hist[s], s + 1);
+    printf("\n");
+    return errors == 0;
+}
+
+/**
+ * Check that the countdown digits never disagree with the lamps latched
+ * with them, on random fixed and actuated plans
+ *
+ * @return  true if every digit shown was the time its color had left
+ */
+bool CtrlCountdownSelfTest(void)
+{
+    uint32_t seed = 0xc0de, frames = 0;
+    int errors = SelfTestCountdown(&seed, &frames);
+
+    printf("[CtrlCountdownSelfTest] %s, %"PRIu32" frames, %d errors\n", errors ? "FAIL" : "ok", frames, errors);
+    return errors == 0;
+}
+
+/**
+ * Time the controller cores of 1 to max intersections over an hour of
+ * seconds, with a timing change staged at every intersection twice a
+ * minute, and print the cost per intersection-second and the RAM of a core
+ *
+ * @param   max                       largest number of intersections
+ * @param   now_us                    monotonic microsecond clock of the platform
+ */
+void CtrlBench(int max, int64_t (*now_us)(void))
+{
+    static const int sizes[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    Ctrl_t *cores = malloc(max * sizeof(Ctrl_t));
+    Plan_t a, b;
+    volatile uint32_t sink = 0;     // keeps the reads of the outputs
+
+    if(cores == NULL) return;
+    PlanTwoPhase(&a, 10, 5, 8, 4);
+    PlanTwoPhase(&b, 12, 4, 9, 3);
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= max; s++){
+        int n = sizes[s];
+        int64_t start;
+
+        for(int i = 0; i < n; i++) CtrlInit(&cores[i], &a);
+        start = now_us();
+        for(int sec = 0; sec < 3600; sec++){
+            for(int i = 0; i < n; i++){
+                if(sec % 30 == i % 30) CtrlStage(&cores[i], (sec / 30) & 1 ? &a : &b, CTRL_AT_STEP_END);
+                CtrlTick(&cores[i]);
+                sink += CtrlLamps(&cores[i]) + CtrlCount(&cores[i], 0) + CtrlCount(&cores[i], 1);
+            }
+        }
+        printf("[CtrlBench] %2d intersections: %"PRId64"ns per intersection-second, %u bytes per intersection\n",
+            n, (now_us() - start) * 1000 / ((int64_t)3600 * n), (unsigned)sizeof(Ctrl_t));
+    }
+    free(cores);
+}
+
+#ifdef ESP_PLATFORM
+
+#define TAG "CONTROLLER"
+#define CONTROLLER_CHECKPOINT_MAGIC 0x43545231
+
+typedef struct {
+    uint32_t magic;             // written last, cleared first
+    Plan_t plan;                // running plan, the bridge of a transition included
+    uint8_t step;
+    uint32_t cycles;
+    int64_t step_us;            // RTC clock at the step start
+    uint32_t crc;               // of plan to step_us
+    int64_t alive_us;           // RTC clock at the last output, refreshed every second outside the CRC
+}ControllerCheckpoint_t;
+
+typedef struct {
+    Ctrl_t ctrl;
+    ControllerConfig_t config;
+    Lamp_t *lamp;               // CTRL_OUT_GPIO only
+    uint8_t lamps;              // lamps last output
+    int64_t next_us;            // deadline of the next second, 0 until the first output
+    int64_t decide_us;          // deadline of the next decision tick, 0 outside actuated steps
+    int64_t staged_us;
+    int64_t cycle_us;           // start of the running cycle
+    int64_t preempt_us;         // first preempt input edge not answered yet, 0 for none, under ctrl_lock
+    ControllerStats_t stats;
+}Intersection_t;
+
+static Intersection_t *intersections[CONTROLLER_MAX_INTERSECTIONS];
+static volatile int intersection_count;
+static portMUX_TYPE ctrl_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t controller_task;
+static Timing_t timing;
+static bool report_cycles;
+static int64_t busy_us;         // time spent by the timing core on the intersections
+static int supervisor_id = -1;
+static RTC_NOINIT_ATTR ControllerCheckpoint_t checkpoint;
+
+/*
+ * Microseconds of the RTC clock: unlike esp_timer it runs on through a reset
+ */
+static int64_t ControllerClock(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint32_t ControllerCheckpointCrc(void)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&checkpoint.plan,
+        offsetof(ControllerCheckpoint_t, crc) - offsetof(ControllerCheckpoint_t, plan));
+}
+
+/*
+ * A step just started or the first output: checkpoint the running plan of
+ * the intersection, or clear the checkpoint when it runs something a reset
+ * must not resume
+ */
+static void ControllerCheckpoint(const Intersection_t *in)
+{
+    const Ctrl_t *ctrl = &in->ctrl;
+
+    checkpoint.magic = 0;
+    if(ctrl->in_clearance || ctrl->preempting || ctrl->run.plan->steps < 2) return;
+    checkpoint.plan = *ctrl->run.plan;
+    checkpoint.step = ctrl->run.step;
+    checkpoint.cycles = ctrl->run.cycles;
+    checkpoint.alive_us = ControllerClock();
+    checkpoint.step_us = checkpoint.alive_us - (int64_t)ctrl->run.elapsed * TIMING_SECOND_US;
+    checkpoint.crc = ControllerCheckpointCrc();
+    checkpoint.magic = CONTROLLER_CHECKPOINT_MAGIC;
+}
+
+/*
+ * After a warm reset: resume the checkpointed step, the time the reset took
+ * counted into it. Power-on, a damaged checkpoint or a longer outage start over.
+ */
+static bool ControllerRestore(Ctrl_t *ctrl)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+
+    if(reason == ESP_RST_POWERON || reason == ESP_RST_UNKNOWN) return false;
+    if(checkpoint.magic != CONTROLLER_CHECKPOINT_MAGIC || checkpoint.crc != ControllerCheckpointCrc()) return false;
+    // kept valid: a reset again within this step resumes it again, the outage counted from the last output
+    return CtrlResumeAt(ctrl, &checkpoint.plan, checkpoint.step, checkpoint.cycles,
+        checkpoint.step_us, checkpoint.alive_us, ControllerClock());
+}
+
+static void ControllerLampWrite(void *arg)
+{
+    Intersection_t *in = arg;
+
+    LampWrite(in->lamp, in->lamps);
+}
+
+/*
+ * Drive the lamps and the countdown digits of an intersection from its running plan.
+ * Only the controller task changes the running plan, no lock needed. When the
+ * lamps change the digits are shifted here and latched right after the lamp
+ * write, the service would show them up to a shift later.
+ */
+static void ControllerOutput(Intersection_t *in)
+{
+    const ControllerConfig_t *cfg = &in->config;
+    uint8_t next = CtrlLamps(&in->ctrl);
+    uint8_t segments[4];
+    uint32_t count = 0;
+    int64_t skew;
+
+    if(cfg->countWord >= 0){
+        CtrlDisplay(&in->ctrl, segments);
+        count = ((uint32_t)segments[0] << 24) | ((uint32_t)segments[1] << 16) | ((uint32_t)segments[2] << 8) | segments[3];
+    }
+    if(next == in->lamps || cfg->output == CTRL_OUT_NONE){
+        in->lamps = next;
+        if(cfg->countWord >= 0) SegDisplayPost(cfg->countWord, count);
+        return;
+    }
+
+    in->lamps = next;
+    if(cfg->output == CTRL_OUT_595){
+        // posted first, the lamp bits go out in the same shift as the digits
+        SegDisplayPostBits(cfg->lampWord, (uint32_t)((1 << PLAN_LAMPS) - 1) << cfg->lampShift, (uint32_t)next << cfg->lampShift);
+        if(cfg->countWord < 0) return;
+        skew = SegDisplayLatchWith(cfg->countWord, count, NULL, NULL);
+    }else if(cfg->countWord >= 0){
+        skew = SegDisplayLatchWith(cfg->countWord, count, ControllerLampWrite, in);
+    }else{
+        LampWrite(in->lamp, next);
+        return;
+    }
+    if(skew > in->stats.count_skew_max_us) in->stats.count_skew_max_us = skew;
+}
+
+/*
+ * Any edge on a preempt input of an intersection: stamp the first one and
+ * wake the timing core, which reads the levels of all its inputs
+ */
+static void IRAM_ATTR ControllerPreemptISR(void *arg)
+{
+    Intersection_t *in = arg;
+    BaseType_t woken = pdFALSE;
+
+    int64_t now = esp_timer_get_time();
+
+    // 64 bits: the timing core may run on the other CPU
+    portENTER_CRITICAL_ISR(&ctrl_lock);
+    if(in->preempt_us == 0) in->preempt_us = now;
+    portEXIT_CRITICAL_ISR(&ctrl_lock);
+    // a restart of the timing core reads the inputs again
+    if(controller_task == NULL) return;
+    xTaskNotifyFromISR(controller_task, CONTROLLER_EVENT_PREEMPT, eSetBits, &woken);
+    if(woken) portYIELD_FROM_ISR();
+}
+
+/*
+ * Approach whose preempt input is held low, the lowest one first, or -1
+ */
+static int ControllerPreemptPhase(const Intersection_t *in)
+{
+    for(int a = 0; a < PLAN_HEADS; a++){
+        if(gpio_get_level(in->config.preemptPins[a]) == 0) return a;
+    }
+    return -1;
+}
+
+/*
+ * Edge to lamp write latency of an answered preempt input, in bins doubling from 50us
+ */
+static void ControllerPreemptRecord(Intersection_t *in, int64_t edge_us)
+{
+    int64_t latency = esp_timer_get_time() - edge_us;
+    int bin = 0;
+
+    while(bin < CONTROLLER_PREEMPT_BINS - 1 && latency >= (50LL << bin)) bin++;
+    in->stats.preempt_hist[bin]++;
+    in->stats.preempts++;
+    if(latency > CONTROLLER_PREEMPT_BOUND_US) in->stats.preempt_late++;
+    if(latency > in->stats.preempt_max_us) in->stats.preempt_max_us = latency;
+}
+
+/*
+ * The single timing core: sleeps until the earliest deadline of all
+ * intersections, then ticks every intersection that is due. Each one keeps
+ * its own whole-second time line, shifted when a clearance starts.
+ */
+static void ControllerTask(void *pvParameters)
+{
+    ESP_ERROR_CHECK(TimingInit(&timing));
+    TimingReset(&timing, 0);    // offsets below are absolute times of the monotonic clock
+    while(1){
+        int64_t now = esp_timer_get_time(), next = now + TIMING_SECOND_US, start;
+        uint32_t events = 0;
+        int n = intersection_count;
+
+        for(int i = 0; i < n; i++){
+            int64_t due = intersections[i]->next_us ? intersections[i]->next_us : now;
+            if(intersections[i]->decide_us && intersections[i]->decide_us < due) due = intersections[i]->decide_us;
+            if(due < next) next = due;
+        }
+        TimingWaitUntilEvent(&timing, next, &events);
+        SupervisorBeat(supervisor_id);
+
+        start = now = esp_timer_get_time();
+        n = intersection_count;
+        for(int i = 0; i < n; i++){
+            Intersection_t *in = intersections[i];
+            bool committed = false, cycle_end = false, ended = false;
+            uint32_t commits = in->ctrl.commits;
+            int64_t preempt_us = 0;
+
+            if(in->next_us == 0){
+                ControllerOutput(in);
+                in->next_us = now + TIMING_SECOND_US;
+                in->decide_us = CtrlActuated(&in->ctrl) ? now + CTRL_DECISION_MS * 1000 : 0;
+                in->cycle_us = now;
+                if(in->stats.first_output_us) continue;
+                in->stats.first_output_us = esp_timer_get_time();
+                if(i == 0 && !in->stats.resumed) ControllerCheckpoint(in);
+                if(i == 0) ESP_LOGI(TAG, "first lamp output %"PRId64"us after boot, %s", in->stats.first_output_us,
+                    in->stats.resumed ? "resumed from the checkpoint" : "plan started over");
+                continue;
+            }
+            // the lamps flashing in slow mode are not on the output register: the request waits
+            if(!LampFlashing()){
+                // taken before the levels are read: an edge after this stamps again and notifies again
+                portENTER_CRITICAL(&ctrl_lock);
+                preempt_us = in->preempt_us;
+                in->preempt_us = 0;
+                portEXIT_CRITICAL(&ctrl_lock);
+            }
+            if(preempt_us){
+                int phase = ControllerPreemptPhase(in);
+
+                portENTER_CRITICAL(&ctrl_lock);
+                ended = CtrlPreempt(&in->ctrl, phase);
+                portEXIT_CRITICAL(&ctrl_lock);
+                // the clearance into or out of the preemption starts now
+                if(ended) in->next_us = now + TIMING_SECOND_US;
+            }
+            if(!ended && in->decide_us && in->decide_us <= now){
+                uint8_t calls = in->config.calls ? in->config.calls() : 0;
+
+                portENTER_CRITICAL(&ctrl_lock);
+                ended = CtrlDecide(&in->ctrl, calls, CTRL_DECISION_MS);
+                committed = in->ctrl.commits != commits;
+                cycle_end = ended && !in->ctrl.in_clearance && in->ctrl.run.step == 0;
+                portEXIT_CRITICAL(&ctrl_lock);
+                in->decide_us += CTRL_DECISION_MS * 1000;
+                // gap-out or max-out: whole seconds count from here
+                if(ended) in->next_us = now + TIMING_SECOND_US;
+            }
+            if(events & CONTROLLER_EVENT_APPLY){
+                bool clearance;
+
+                portENTER_CRITICAL(&ctrl_lock);
+                clearance = CtrlCommitNow(&in->ctrl);
+                portEXIT_CRITICAL(&ctrl_lock);
+                // the clearance starts now, whole seconds count from here
+                if(clearance){
+                    committed = true;
+                    in->next_us = now + TIMING_SECOND_US;
+                }
+            }
+            if(!committed && !ended){
+                if(in->next_us > now) continue;
+                portENTER_CRITICAL(&ctrl_lock);
+                committed = CtrlTick(&in->ctrl);
+                cycle_end = !in->ctrl.in_clearance && in->ctrl.run.step == 0 && in->ctrl.run.elapsed == 0;
+                ended = in->ctrl.run.elapsed == 0;
+                portEXIT_CRITICAL(&ctrl_lock);
+                in->next_us += TIMING_SECOND_US;
+            }
+            if(committed || ended){
+                // decision ticks of an actuated step start with the step
+                in->decide_us = CtrlActuated(&in->ctrl) ? now + CTRL_DECISION_MS * 1000 : 0;
+            }
+            ControllerOutput(in);
+            if(preempt_us) ControllerPreemptRecord(in, preempt_us);
+            if(i == 0 && (committed || ended)) ControllerCheckpoint(in);
+            else if(i == 0) checkpoint.alive_us = ControllerClock();
+
+            if(committed){
+                in->stats.commits++;
+                in->stats.latency_us = esp_timer_get_time() - in->staged_us;
+                if(in->stats.latency_us > in->stats.latency_max_us) in->stats.latency_max_us = in->stats.latency_us;
+            }
+            if(cycle_end){
+                if(in->config.cycle) in->config.cycle((now - in->cycle_us + TIMING_SECOND_US / 2) / TIMING_SECOND_US);
+                in->cycle_us = now;
+            }
+            if(report_cycles && cycle_end && i == 0){
+                SegDisplayReport();
+                TimingReport(&timing, "controller");
+                ControllerReport(0);
+            }
+        }
+        busy_us += esp_timer_get_time() - start;
+    }
+}
+
+/**
+ * Replace a timing core task that stopped, for the supervisor. The
+ * intersections keep their plans and positions: the lamps hold, and whole
+ * seconds count again from the first loop of the new task.
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the task cannot be created
+ */
+static esp_err_t ControllerRestart(void)
+{
+    TaskHandle_t stopped = controller_task;
+
+    controller_task = NULL;
+    // a deadline firing now would notify the deleted task
+    TimingStop(&timing);
+    vTaskDelete(stopped);
+    // no catching up on the seconds missed: a step would go by in microseconds
+    for(int i = 0; i < intersection_count; i++){
+        intersections[i]->next_us = 0;
+        intersections[i]->decide_us = 0;
+    }
+    if(xTaskCreate(&ControllerTask, "controller", 1024*3, NULL, CONTROLLER_PRIORITY, &controller_task) != pdPASS){
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Start the timing core task, it runs for the whole program under the supervisor
+ *
+ * @param   report                    print the statistics of intersection 0 at every cycle end
+ * 
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the task cannot be created
+ */
+esp_err_t ControllerInit(bool report)
+{
+    report_cycles = report;
+    // above every other task of the application: a preempt input waits for no one
+    if(xTaskCreate(&ControllerTask, "controller", 1024*3, NULL, CONTROLLER_PRIORITY, &controller_task) != pdPASS){
+        return ESP_ERR_NO_MEM;
+    }
+    supervisor_id = SupervisorWatch("timing", CONTROLLER_HEARTBEAT_MS, ControllerRestart, true);
+    return ESP_OK;
+}
+
+/**
+ * Add an intersection to the timing core, its first plan starts at once.
+ * After a warm reset the first intersection added resumes its checkpoint
+ * instead, if it holds one still valid.
+ *
+ * @param   config                    outputs of the intersection, copied
+ * @param   plan                      first plan
+ * @param   id                        set to the intersection number
+ * 
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_ARG     if the plan does not compile, a lamp pin is not an output or a preempt pin not an input
+ *          - others                  if a preempt interrupt cannot be set up, see gpio_isr_handler_add
+ *          - ESP_ERR_NO_MEM          if CONTROLLER_MAX_INTERSECTIONS are running or out of memory
+ */
+esp_err_t ControllerAdd(const ControllerConfig_t *config, const Plan_t *plan, int *id)
+{
+    Intersection_t *in;
+    esp_err_t ret = ESP_OK;
+    int handlers = 0;
+
+    if(intersection_count >= CONTROLLER_MAX_INTERSECTIONS) return ESP_ERR_NO_MEM;
+    in = heap_caps_calloc(1, sizeof(Intersection_t), MALLOC_CAP_8BIT);
+    if(in == NULL) return ESP_ERR_NO_MEM;
+    in->config = *config;
+    in->lamps = 0xFF;
+    if(intersection_count == 0 && ControllerRestore(&in->ctrl)) in->stats.resumed = true;
+    else if(!CtrlInit(&in->ctrl, plan)) ret = ESP_ERR_INVALID_ARG;
+    if(ret == ESP_OK && config->output == CTRL_OUT_GPIO){
+        in->lamp = heap_caps_calloc(1, sizeof(Lamp_t), MALLOC_CAP_8BIT);
+        ret = in->lamp ? LampInit(in->lamp, config->lampPins, PLAN_LAMPS) : ESP_ERR_NO_MEM;
+    }
+    if(ret == ESP_OK && config->preemptPins){
+        ret = gpio_install_isr_service(0);
+        if(ret == ESP_ERR_INVALID_STATE) ret = ESP_OK;
+        for(int a = 0; a < PLAN_HEADS && ret == ESP_OK; a++){
+            ret = gpio_set_direction(config->preemptPins[a], GPIO_MODE_INPUT);
+            if(ret == ESP_OK) ret = gpio_pullup_en(config->preemptPins[a]);
+        }
+        // the handlers only stamp in and wake the core, they may run before it is published
+        for(handlers = 0; handlers < PLAN_HEADS && ret == ESP_OK; handlers++){
+            ret = gpio_set_intr_type(config->preemptPins[handlers], GPIO_INTR_ANYEDGE);
+            if(ret == ESP_OK) ret = gpio_isr_handler_add(config->preemptPins[handlers], ControllerPreemptISR, in);
+            if(ret != ESP_OK) break;
+        }
+        // an input already held low gives no edge
+        if(ret == ESP_OK && ControllerPreemptPhase(in) >= 0){
+            int64_t now = esp_timer_get_time();
+
+            portENTER_CRITICAL(&ctrl_lock);
+            if(in->preempt_us == 0) in->preempt_us = now;
+            portEXIT_CRITICAL(&ctrl_lock);
+        }
+    }
+    if(ret != ESP_OK){
+        while(handlers-- > 0) gpio_isr_handler_remove(config->preemptPins[handlers]);
+        heap_caps_free(in->lamp);
+        heap_caps_free(in);
+        return ret;
+    }
+
+    portENTER_CRITICAL(&ctrl_lock);
+    *id = intersection_count;
+    intersections[intersection_count] = in;
+    intersection_count++;
+    portEXIT_CRITICAL(&ctrl_lock);
+    if(controller_task) xTaskNotify(controller_task, CONTROLLER_EVENT_ADD, eSetBits);
+    return ESP_OK;
+}
+
+/**
+ * Stage a new plan for an intersection, safe from any task. Returns at once,
+ * the plan is copied and committed by the timing core at the boundary given by mode.
+ *
+ * @param   id                        intersection number
+ * @param   plan                      new plan
+ * @param   mode                      commit boundary
+ * 
+ * @return
+ *          - ESP_OK                  if staged
+ *          - ESP_ERR_INVALID_ARG     if the plan does not compile, or changes more than timing with CTRL_AT_STEP_END
+ *                                    or CTRL_TRANSITION
+ */
+esp_err_t ControllerApply(int id, const Plan_t *plan, CtrlCommit_t mode)
+{
+    Intersection_t *in;
+    bool staged;
+
+    if(id < 0 || id >= intersection_count) return ESP_ERR_INVALID_ARG;
+    in = intersections[id];
+    portENTER_CRITICAL(&ctrl_lock);
+    staged = CtrlStage(&in->ctrl, plan, mode);
+    if(staged) in->staged_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&ctrl_lock);
+
+    if(!staged){
+        in->stats.rejected++;
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(mode == CTRL_NOW && controller_task) xTaskNotify(controller_task, CONTROLLER_EVENT_APPLY, eSetBits);
+    return ESP_OK;
+}
+
+/**
+ * Lamps last written to the outputs of an intersection, 0xFF before the first output
+ */
+uint8_t ControllerLamps(int id)
+{
+    return (id >= 0 && id < intersection_count) ? intersections[id]->lamps : 0xFF;
+}
+
+void ControllerGetStats(int id, ControllerStats_t *out)
+{
+    if(id >= 0 && id < intersection_count) *out = intersections[id]->stats;
+}
+
+void ControllerReport(int id)
+{
+    ControllerStats_t stats = {0};
+
+    ControllerGetStats(id, &stats);
+    ESP_LOGI(TAG, "intersection %d: commits=%"PRIu32" rejected=%"PRIu32" latency last=%"PRId64"us max=%"PRId64"us",
+        id, stats.commits, stats.rejected, stats.latency_us, stats.latency_max_us);
+    ESP_LOGI(TAG, "intersection %d: first lamp output %"PRId64"us after boot, %s", id, stats.first_output_us,
+        stats.resumed ? "resumed" : "started over");
+    ESP_LOGI(TAG, "intersection %d: countdown digits latched at most %"PRId64"us after the lamp write", id, stats.count_skew_max_us);
+    if(stats.preempts){
+        ESP_LOGI(TAG, "intersection %d: preempt inputs=%"PRIu32" late=%"PRIu32" max=%"PRId64"us"
+            " <50us:%"PRIu32" <100us:%"PRIu32" <200us:%"PRIu32" <400us:%"PRIu32" <800us:%"PRIu32" <1.6ms:%"PRIu32" <3.2ms:%"PRIu32" more:%"PRIu32,
+            id, stats.preempts, stats.preempt_late, stats.preempt_max_us, stats.preempt_hist[0], stats.preempt_hist[1],
+            stats.preempt_hist[2], stats.preempt_hist[3], stats.preempt_hist[4], stats.preempt_hist[5], stats.preempt_hist[6], stats.preempt_hist[7]);
+    }
+}
+
+/**
+ * Add virtual intersections (no outputs) up to 1, 2, 4 ... max and print,
+ * for each count, the time the timing core spends per second and the heap
+ * taken per added intersection. The virtual intersections keep running.
+ */
+void ControllerBench(int max)
+{
+    static const int sizes[] = {1, 2, 4, 8, 16, 32, 64};
+    ControllerConfig_t config = {.output = CTRL_OUT_NONE, .countWord = -1};
+    Plan_t plan;
+
+    PlanTwoPhase(&plan, 10, 5, 8, 4);
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= max; s++){
+        size_t heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        int added = 0, id;
+        int64_t busy, start;
+
+        while(intersection_count < sizes[s] && ControllerAdd(&config, &plan, &id) == ESP_OK) added++;
+        busy = busy_us;
+        start = esp_timer_get_time();
+        vTaskDelay(pdMS_TO_TICKS(5000));
+        printf("[ControllerBench] %2d intersections: timing core %"PRId64"us per second, %u bytes per added intersection\n",
+            intersection_count, (busy_us - busy) * TIMING_SECOND_US / (esp_timer_get_time() - start),
+            added ? (unsigned)((heap - heap_caps_get_free_size(MALLOC_CAP_8BIT)) / added) : 0);
+    }
+}
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * controller.h
+ *
+ *  Permanent signal controller with a double-buffered phase plan,
+ *  any number of intersections on one timing core.
+ */
+
+#ifndef MAIN_CONTROLLER_H_
+#define MAIN_CONTROLLER_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "plan.h"
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#endif
+
+#define CTRL_CLEARANCE_S        3       // all-yellow clearance before an immediate commit
+#define CTRL_DECISION_MS        100     // decision tick of the actuated steps
+#define CTRL_PREEMPT_YELLOW_S   3       // yellow of the phases stopped for a preemption
+#define CTRL_ALL_RED_S          2       // all-red before the preempt phase gets its green
+#define CTRL_MIN_GREEN_S        5       // a transition never cuts a running green shorter than this
+#define CTRL_TRANSITION_PCT     20      // greens moving more than this share of the cycle take a bridge cycle
+#define CONTROLLER_EVENT_APPLY  (1 << 1)
+#define CONTROLLER_EVENT_ADD    (1 << 2)
+#define CONTROLLER_EVENT_PREEMPT (1 << 3)
+#define CONTROLLER_PREEMPT_BOUND_US 1000    // input edge to lamp output
+#define CONTROLLER_PREEMPT_BINS 8           // latency histogram: <50us, <100us, <200us ... >=3200us
+#define CONTROLLER_MAX_INTERSECTIONS 64
+#define CONTROLLER_PRIORITY     10      // timing core task, above the wheel and the display service
+#define CONTROLLER_HEARTBEAT_MS 2000    // supervisor timeout, the timing core loops at least every second
+#define CONTROLLER_RESUME_MAX_S 10      // a warm reset taking longer starts the plan over
+
+typedef enum {
+    CTRL_AT_STEP_END = 0,   // timing change only, continue at the next step of the new plan
+    CTRL_AT_CYCLE_END,      // new plan from its first step when the cycle ends
+    CTRL_NOW,               // all-yellow clearance now, then the new plan from its first step
+    CTRL_TRANSITION,        // timing change only, the running plan is stretched or shortened into the new one
+}CtrlCommit_t;
+
+typedef struct {
+    Plan_t plan[2];         // running and staged plan
+    uint8_t active;         // index of the running plan
+    bool pending;           // plan[active ^ 1] waits for its commit
+    CtrlCommit_t mode;
+    bool in_clearance;
+    bool bridging;          // CTRL_TRANSITION: the running plan was moved toward the staged one ...
+    uint32_t transition_end;// ... which takes over at the first step end from this cycle count
+    PlanRunner_t run;
+    uint32_t commits;
+    uint32_t step_ms;       // time in the running actuated step, counted by CtrlDecide
+    uint16_t gap_ms;        // passage time left before a gap-out
+    uint32_t gap_outs;
+    uint32_t max_outs;
+    Plan_t preempt;         // clearance into the preempt phase and its hold, or the clearance out of it
+    int8_t preempt_phase;   // approach requesting preemption, -1 for none
+    bool preempting;        // the preempt plan runs instead of the active one
+    bool preempt_exit;      // ... and it is the clearance out of the hold
+    uint32_t preempt_cycles;// cycle count of the active plan, kept through the preemption
+    uint32_t preempts;
+}Ctrl_t;
+
+typedef enum {
+    CTRL_OUT_NONE = 0,      // virtual intersection
+    CTRL_OUT_GPIO,          // one GPIO per lamp
+    CTRL_OUT_595,           // lamps are bits of a 74HC595 display word
+}CtrlOutput_t;
+
+typedef struct {
+    CtrlOutput_t output;
+    const int *lampPins;    // CTRL_OUT_GPIO: GPIO of each PLAN_* lamp bit
+    uint8_t lampWord;       // CTRL_OUT_595: display word holding the lamps
+    uint8_t lampShift;      // CTRL_OUT_595: bit of PLAN_RED1 in that word
+    int8_t countWord;       // display word of the 4 countdown digits, -1 for none
+    uint8_t (*calls)(void); // actuated plans: bit per approach with a vehicle call, NULL for none
+    void (*cycle)(uint32_t cycle_s);    // called by the timing core at each cycle end with its length, NULL for none
+    const int *preemptPins; // GPIO of each approach pulled low to request preemption, NULL for none
+}ControllerConfig_t;
+
+typedef struct {
+    uint32_t commits;
+    uint32_t rejected;      // plans that failed to compile or could not commit at a step end
+    int64_t latency_us;     // stage to commit of the last commit
+    int64_t latency_max_us;
+    uint32_t preempts;
+    uint32_t preempt_late;  // preemptions answered later than CONTROLLER_PREEMPT_BOUND_US
+    int64_t preempt_max_us;
+    uint32_t preempt_hist[CONTROLLER_PREEMPT_BINS];
+    int64_t first_output_us;// boot to the first lamp output
+    bool resumed;           // the first output resumed the checkpoint of a warm reset
+    int64_t count_skew_max_us;// lamp write to the latch of the countdown digits changed with it
+}ControllerStats_t;
+
+bool CtrlInit(Ctrl_t *ctrl, const Plan_t *plan);
+bool CtrlResume(Ctrl_t *ctrl, const Plan_t *plan, int step, uint32_t elapsed, uint32_t cycles);
+bool CtrlResumeAt(Ctrl_t *ctrl, const Plan_t *plan, int step, uint32_t cycles, int64_t step_us, int64_t alive_us, int64_t now_us);
+bool CtrlStage(Ctrl_t *ctrl, const Plan_t *plan, CtrlCommit_t mode);
+bool CtrlCommitNow(Ctrl_t *ctrl);
+bool CtrlTick(Ctrl_t *ctrl);
+bool CtrlDecide(Ctrl_t *ctrl, uint8_t calls, uint32_t ms);
+bool CtrlActuated(const Ctrl_t *ctrl);
+bool CtrlPreempt(Ctrl_t *ctrl, int phase);
+uint8_t CtrlLamps(const Ctrl_t *ctrl);
+int CtrlCount(const Ctrl_t *ctrl, int head);
+void CtrlDisplay(const Ctrl_t *ctrl, uint8_t segments[4]);
+bool CtrlSelfTest(void);
+bool CtrlCountdownSelfTest(void);
+void CtrlBench(int max, int64_t (*now_us)(void));
+#ifdef ESP_PLATFORM
+esp_err_t ControllerInit(bool report);
+esp_err_t ControllerAdd(const ControllerConfig_t *config, const Plan_t *plan, int *id);
+esp_err_t ControllerApply(int id, const Plan_t *plan, CtrlCommit_t mode);
+uint8_t ControllerLamps(int id);
+void ControllerGetStats(int id, ControllerStats_t *stats);
+void ControllerReport(int id);
+void ControllerBench(int max);
+#endif
+
+#endif /* MAIN_CONTROLLER_H_ */
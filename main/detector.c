@@ -0,0 +1,498 @@
+/*
+ * detector.c
+ *
+ *  Vehicle detector inputs: interrupt timestamps through a lock-free ring,
+ *  aggregated into counts, occupancy and headway per approach.
+ *
+ *  Each detector channel (an inductive loop amplifier or a presence
+ *  contact) raises a GPIO interrupt on both edges. The handler stamps the
+ *  edge in microseconds and pushes it into a single-producer single-consumer
+ *  ring: a store of the event and a release store of the head, no lock and
+ *  no allocation. The detector task pops the edges and folds them into the
+ *  running window of every channel, a constant amount of work per edge.
+ *  A PCNT unit counts the arrivals of each channel in hardware, through its
+ *  glitch filter, so the report shows whether the interrupt path lost any.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "detector.h"
+#include "selftest.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "driver/pulse_cnt.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#endif
+
+#define DET_HEADWAY_MAX_US      60000000    // a longer gap is not a following vehicle
+
+/**
+ * Producer side, safe from an interrupt handler
+ *
+ * @return  false if the ring is full, the event is dropped and counted
+ */
+bool DetPush(DetRing_t *ring, const DetEvent_t *event)
+{
+    uint32_t head = ring->head;
+
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= DET_RING_SIZE){
+        ring->overflows++;
+        return false;
+    }
+    ring->event[head & (DET_RING_SIZE - 1)] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Consumer side
+ *
+ * @return  false if the ring is empty
+ */
+bool DetPop(DetRing_t *ring, DetEvent_t *event)
+{
+    uint32_t tail = ring->tail;
+
+    if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) return false;
+    *event = ring->event[tail & (DET_RING_SIZE - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Microseconds from one stamp to a later one, 0 if the later one is not
+ */
+static uint32_t Elapsed(uint32_t from, uint32_t to)
+{
+    return (int32_t)(to - from) > 0 ? to - from : 0;
+}
+
+/**
+ * @param   det                       aggregate of all channels
+ * @param   approach                  approach (phase) of each channel
+ * @param   channels                  number of channels, up to DET_MAX_CHANNELS
+ * @param   now_us                    start of the first window
+ */
+void DetInit(Det_t *det, const uint8_t *approach, int channels, uint32_t now_us)
+{
+    memset(det, 0, sizeof(Det_t));
+    det->channels = channels > DET_MAX_CHANNELS ? DET_MAX_CHANNELS : channels;
+    for(int i = 0; i < det->channels; i++) det->channel[i].approach = approach[i];
+    det->window_us = now_us;
+}
+
+/**
+ * Fold one edge into its channel
+ */
+void DetApply(Det_t *det, const DetEvent_t *event)
+{
+    DetChannel_t *c;
+
+    det->events++;
+    if(event->channel >= det->channels){
+        det->errors++;
+        return;
+    }
+    c = &det->channel[event->channel];
+    if(event->present){
+        if(c->present){
+            // the departure was lost, the loop was occupied until now at least
+            det->errors++;
+            c->occupied_us += Elapsed(c->on_us, event->time_us);
+        }
+        if(c->seen && Elapsed(c->last_on_us, event->time_us) < DET_HEADWAY_MAX_US){
+            c->headway_us += Elapsed(c->last_on_us, event->time_us);
+            c->headways++;
+        }
+        c->present = c->seen = c->called = true;
+        c->on_us = c->last_on_us = event->time_us;
+        c->count++;
+        c->total++;
+    }else{
+        if(!c->present){
+            det->errors++;
+            return;
+        }
+        c->occupied_us += Elapsed(c->on_us, event->time_us);
+        c->present = false;
+    }
+}
+
+/**
+ * Pop and fold every edge waiting in the ring
+ *
+ * @return  number of edges
+ */
+int DetConsume(Det_t *det, DetRing_t *ring)
+{
+    DetEvent_t event;
+    int n = 0;
+
+    while(DetPop(ring, &event)){
+        DetApply(det, &event);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Close the window at now_us, return the figures of each approach and
+ * start the next window
+ */
+void DetSample(Det_t *det, uint32_t now_us, DetStats_t stats[DET_APPROACHES])
+{
+    uint64_t occupied_pm[DET_APPROACHES] = {0}, headway_us[DET_APPROACHES] = {0};
+    uint32_t headways[DET_APPROACHES] = {0}, lanes[DET_APPROACHES] = {0};
+    uint32_t window = Elapsed(det->window_us, now_us);
+
+    memset(stats, 0, DET_APPROACHES * sizeof(DetStats_t));
+    for(int i = 0; i < det->channels; i++){
+        DetChannel_t *c = &det->channel[i];
+        int a = c->approach;
+
+        if(a >= DET_APPROACHES) continue;
+        if(c->present){
+            c->occupied_us += Elapsed(c->on_us, now_us);
+            c->on_us = now_us;
+        }
+        if(c->seen && Elapsed(c->last_on_us, now_us) >= DET_HEADWAY_MAX_US) c->seen = false;
+        stats[a].count += c->count;
+        if(window) occupied_pm[a] += c->occupied_us * 1000 / window;
+        headway_us[a] += c->headway_us;
+        headways[a] += c->headways;
+        lanes[a]++;
+        c->count = c->headways = 0;
+        c->occupied_us = c->headway_us = 0;
+    }
+    for(int a = 0; a < DET_APPROACHES; a++){
+        if(lanes[a]) stats[a].occupancy_pm = occupied_pm[a] / lanes[a];
+        if(headways[a]) stats[a].headway_ms = headway_us[a] / headways[a] / 1000;
+    }
+    det->window_us = now_us;
+}
+
+/**
+ * Vehicle calls for the actuated greens: bit per approach with a loop
+ * occupied now or a vehicle arrived since the previous call
+ */
+uint8_t DetCalls(Det_t *det)
+{
+    uint8_t calls = 0;
+
+    for(int i = 0; i < det->channels; i++){
+        DetChannel_t *c = &det->channel[i];
+
+        if(c->present || c->called) calls |= 1 << c->approach;
+        c->called = false;
+    }
+    return calls;
+}
+
+/**
+ * Feed pulse trains on 4 channels, 30000 edges a second, through the ring
+ * in bursts up to a full ring, drain it in random amounts, and check the
+ * counts, occupied time and headways of every channel against the trains.
+ * The clock crosses the 32-bit wrap. Then check that a full ring drops
+ * and counts exactly the overflow, that lost edges are reported and that
+ * calls hold while a loop is occupied and latch a vehicle that already left.
+ */
+bool DetSelfTest(void)
+{
+    static DetRing_t ring;
+    static Det_t det;
+    static const uint8_t approach[4] = {0, 0, 1, 1};
+    struct {
+        bool present, seen;
+        uint32_t next_us, on_us, last_on_us, count, headways;
+        uint64_t occupied_us, headway_us;
+    }train[4];
+    uint32_t seed = 41, start = 0xFFF00000u, now = start, sent = 0, errors = 0;
+    DetEvent_t event;
+    DetStats_t stats[DET_APPROACHES];
+
+    memset(&ring, 0, sizeof(ring));
+    memset(train, 0, sizeof(train));
+    DetInit(&det, approach, 4, start);
+    for(int i = 0; i < 4; i++) train[i].next_us = start + 20 + SelfTestRandom(&seed) % 200;
+
+    while(sent < 200000){
+        int burst = 1 + SelfTestRandom(&seed) % DET_RING_SIZE, drain = SelfTestRandom(&seed) % (DET_RING_SIZE + 64);
+        uint32_t queued = ring.head - ring.tail;
+
+        if(burst > (int)(DET_RING_SIZE - queued)) burst = DET_RING_SIZE - queued;
+        for(int n = 0; n < burst; n++){
+            int ch = 0;
+            for(int i = 1; i < 4; i++) if((int32_t)(train[i].next_us - train[ch].next_us) < 0) ch = i;
+            now = train[ch].next_us;
+            event = (DetEvent_t){.time_us = now, .channel = ch, .present = !train[ch].present};
+            if(!DetPush(&ring, &event)) errors++;
+            if(event.present){
+                if(train[ch].seen){
+                    train[ch].headway_us += now - train[ch].last_on_us;
+                    train[ch].headways++;
+                }
+                train[ch].on_us = train[ch].last_on_us = now;
+                train[ch].seen = true;
+                train[ch].count++;
+            }else{
+                train[ch].occupied_us += now - train[ch].on_us;
+            }
+            train[ch].present = event.present;
+            // 20 to 219 us between the edges of a channel
+            train[ch].next_us = now + 20 + SelfTestRandom(&seed) % 200;
+            sent++;
+        }
+        for(int n = 0; n < drain && DetPop(&ring, &event); n++) DetApply(&det, &event);
+    }
+    // the vehicles still present leave now
+    DetConsume(&det, &ring);
+    for(int i = 0; i < 4; i++){
+        if(!train[i].present) continue;
+        DetApply(&det, &(DetEvent_t){.time_us = now, .channel = i, .present = 0});
+        train[i].occupied_us += now - train[i].on_us;
+        sent++;
+    }
+    for(int i = 0; i < 4; i++){
+        DetChannel_t *c = &det.channel[i];
+
+        if(c->count != train[i].count || c->total != train[i].count || c->occupied_us != train[i].occupied_us
+            || c->headways != train[i].headways || c->headway_us != train[i].headway_us){
+            printf("[DetSelfTest] channel %d: %"PRIu32" vehicles (expected %"PRIu32"), %"PRIu64"us occupied (%"PRIu64")\n",
+                i, c->count, train[i].count, c->occupied_us, train[i].occupied_us);
+            errors++;
+        }
+    }
+    DetSample(&det, now, stats);
+    if(det.events != sent || det.errors || ring.overflows || stats[0].count != train[0].count + train[1].count
+        || stats[0].occupancy_pm < 300 || stats[0].occupancy_pm > 700) errors++;
+
+    // a consumer that stalls: exactly the edges beyond a full ring are dropped
+    memset(&ring, 0, sizeof(ring));
+    for(int n = 0; n < DET_RING_SIZE + 10; n++){
+        event = (DetEvent_t){.time_us = n, .channel = n & 3, .present = n & 1};
+        DetPush(&ring, &event);
+    }
+    for(int n = 0; DetPop(&ring, &event); n++){
+        if(event.time_us != (uint32_t)n) errors++;
+    }
+    if(ring.overflows != 10) errors++;
+
+    // two arrivals without a departure, a departure without an arrival
+    DetInit(&det, approach, 4, 0);
+    DetApply(&det, &(DetEvent_t){.time_us = 100, .channel = 2, .present = 1});
+    DetApply(&det, &(DetEvent_t){.time_us = 300, .channel = 2, .present = 1});
+    DetApply(&det, &(DetEvent_t){.time_us = 400, .channel = 3, .present = 0});
+    if(DetCalls(&det) != 1 << 1 || DetCalls(&det) != 1 << 1) errors++;
+    DetSample(&det, 1000, stats);
+    if(det.errors != 2 || stats[1].count != 2 || stats[1].occupancy_pm != 450) errors++;
+    DetApply(&det, &(DetEvent_t){.time_us = 1100, .channel = 2, .present = 0});
+    DetApply(&det, &(DetEvent_t){.time_us = 1200, .channel = 0, .present = 1});
+    DetApply(&det, &(DetEvent_t){.time_us = 1300, .channel = 0, .present = 0});
+    if(DetCalls(&det) != 1 << 0 || DetCalls(&det) != 0) errors++;
+
+    printf("[DetSelfTest] %"PRIu32" edges through a %d ring, %s\n", sent, DET_RING_SIZE, errors ? "FAILED" : "passed");
+    return errors == 0;
+}
+
+/**
+ * Time an edge from the push to its fold into the window, a full ring at a time
+ *
+ * @param   events                    number of edges
+ * @param   now_us                    monotonic microsecond clock of the platform
+ */
+void DetBench(int events, int64_t (*now_us)(void))
+{
+    static DetRing_t ring;
+    static Det_t det;
+    static const uint8_t approach[DET_MAX_CHANNELS] = {0, 1, 0, 1, 0, 1, 0, 1};
+    DetEvent_t event = {0};
+    int64_t start, push_us = 0, consume_us = 0;
+
+    memset(&ring, 0, sizeof(ring));
+    DetInit(&det, approach, DET_MAX_CHANNELS, 0);
+    for(int n = 0; n < events; n += DET_RING_SIZE){
+        start = now_us();
+        for(int k = 0; k < DET_RING_SIZE; k++){
+            event.time_us += 37;
+            event.channel = (k >> 1) & (DET_MAX_CHANNELS - 1);
+            event.present = !(k & 1);
+            DetPush(&ring, &event);
+        }
+        push_us += now_us() - start;
+        start = now_us();
+        DetConsume(&det, &ring);
+        consume_us += now_us() - start;
+    }
+    printf("[DetBench] %d edges: push %"PRId64"ns, pop and fold %"PRId64"ns per edge, %"PRIu32" errors, %u bytes ring + %u bytes state\n",
+        events, push_us * 1000 / events, consume_us * 1000 / events, det.errors,
+        (unsigned)sizeof(DetRing_t), (unsigned)sizeof(Det_t));
+}
+
+#ifdef ESP_PLATFORM
+
+#define TAG "DETECTOR"
+#define DET_GLITCH_NS           1000
+#define DET_PCNT_LIMIT          32767
+
+static DetRing_t ring;
+static Det_t det;
+static DetectorConfig_t detectors[DET_MAX_CHANNELS];
+static pcnt_unit_handle_t counters[DET_MAX_CHANNELS];
+static portMUX_TYPE det_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t detector_task;
+
+/*
+ * All detector pins share the one GPIO interrupt of the ISR service, the
+ * handlers never preempt each other: together they are the single producer
+ */
+static void DetectorISR(void *arg)
+{
+    int channel = (int)(intptr_t)arg;
+    DetEvent_t event = {
+        .time_us = (uint32_t)esp_timer_get_time(),
+        .channel = channel,
+        .present = gpio_get_level(detectors[channel].pin) ^ detectors[channel].active_low,
+    };
+    BaseType_t woken = pdFALSE;
+
+    DetPush(&ring, &event);
+    vTaskNotifyGiveFromISR(detector_task, &woken);
+    if(woken) portYIELD_FROM_ISR();
+}
+
+static void DetectorTask(void *pvParameters)
+{
+    while(1){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        portENTER_CRITICAL(&det_lock);
+        DetConsume(&det, &ring);
+        portEXIT_CRITICAL(&det_lock);
+    }
+}
+
+/*
+ * Hardware count of the arrivals of a channel, through the glitch filter.
+ * On an error the unit is deleted again and counters[channel] left NULL.
+ */
+static esp_err_t DetectorCounter(int channel)
+{
+    const DetectorConfig_t *config = &detectors[channel];
+    pcnt_unit_config_t unit_config = {
+        .low_limit = -DET_PCNT_LIMIT,
+        .high_limit = DET_PCNT_LIMIT,
+        .flags.accum_count = true,
+    };
+    pcnt_chan_config_t chan_config = {.edge_gpio_num = config->pin, .level_gpio_num = -1};
+    pcnt_unit_handle_t unit;
+    pcnt_channel_handle_t chan = NULL;
+    bool enabled = false;
+    esp_err_t ret;
+
+    counters[channel] = NULL;
+    ret = pcnt_new_unit(&unit_config, &unit);
+    if(ret != ESP_OK) return ret;
+    ret = pcnt_unit_set_glitch_filter(unit, &(pcnt_glitch_filter_config_t){.max_glitch_ns = DET_GLITCH_NS});
+    if(ret == ESP_OK) ret = pcnt_new_channel(unit, &chan_config, &chan);
+    if(ret == ESP_OK) ret = pcnt_channel_set_edge_action(chan,
+        config->active_low ? PCNT_CHANNEL_EDGE_ACTION_HOLD : PCNT_CHANNEL_EDGE_ACTION_INCREASE,
+        config->active_low ? PCNT_CHANNEL_EDGE_ACTION_INCREASE : PCNT_CHANNEL_EDGE_ACTION_HOLD);
+    if(ret == ESP_OK) ret = pcnt_unit_add_watch_point(unit, DET_PCNT_LIMIT);
+    if(ret == ESP_OK) ret = pcnt_unit_enable(unit);
+    enabled = ret == ESP_OK;
+    if(ret == ESP_OK) ret = pcnt_unit_clear_count(unit);
+    if(ret == ESP_OK) ret = pcnt_unit_start(unit);
+    if(ret != ESP_OK){
+        // a unit is only deleted disabled and without channels
+        if(enabled) pcnt_unit_disable(unit);
+        if(chan) pcnt_del_channel(chan);
+        pcnt_del_unit(unit);
+        return ret;
+    }
+    counters[channel] = unit;
+    return ESP_OK;
+}
+
+/**
+ * Start the detector task and the interrupts of the channels. A channel
+ * without a free PCNT unit, or whose unit fails to set up, still works,
+ * without the hardware count.
+ *
+ * @param   config                    pin, approach and polarity of each channel
+ * @param   channels                  number of channels, up to DET_MAX_CHANNELS
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_ARG     if a channel count or an approach is out of range
+ *          - ESP_ERR_NO_MEM          if the task cannot be created
+ */
+esp_err_t DetectorInit(const DetectorConfig_t *config, int channels)
+{
+    uint8_t approach[DET_MAX_CHANNELS];
+    esp_err_t ret;
+
+    if(channels <= 0 || channels > DET_MAX_CHANNELS) return ESP_ERR_INVALID_ARG;
+    for(int i = 0; i < channels; i++){
+        if(config[i].approach >= DET_APPROACHES) return ESP_ERR_INVALID_ARG;
+        detectors[i] = config[i];
+        approach[i] = config[i].approach;
+    }
+    DetInit(&det, approach, channels, (uint32_t)esp_timer_get_time());
+    if(xTaskCreate(&DetectorTask, "detector", 1024*2, NULL, 5, &detector_task) != pdPASS) return ESP_ERR_NO_MEM;
+
+    ret = gpio_install_isr_service(0);
+    if(ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) return ret;
+    for(int i = 0; i < channels; i++){
+        gpio_set_direction(config[i].pin, GPIO_MODE_INPUT);
+        if(config[i].active_low) gpio_pullup_en(config[i].pin);
+        ret = DetectorCounter(i);
+        if(ret != ESP_OK) ESP_LOGW(TAG, "no PCNT count for channel %d (GPIO %d): %s", i, config[i].pin, esp_err_to_name(ret));
+        gpio_set_intr_type(config[i].pin, GPIO_INTR_ANYEDGE);
+        gpio_isr_handler_add(config[i].pin, DetectorISR, (void *)(intptr_t)i);
+    }
+    return ESP_OK;
+}
+
+/**
+ * Figures of each approach since the previous call, safe from any task
+ */
+void DetectorSample(DetStats_t stats[DET_APPROACHES])
+{
+    portENTER_CRITICAL(&det_lock);
+    DetConsume(&det, &ring);
+    DetSample(&det, (uint32_t)esp_timer_get_time(), stats);
+    portEXIT_CRITICAL(&det_lock);
+}
+
+/**
+ * DetCalls on the live detectors, for ControllerConfig_t.calls
+ */
+uint8_t DetectorCalls(void)
+{
+    uint8_t calls;
+
+    portENTER_CRITICAL(&det_lock);
+    DetConsume(&det, &ring);
+    calls = DetCalls(&det);
+    portEXIT_CRITICAL(&det_lock);
+    return calls;
+}
+
+/**
+ * Arrivals seen by the interrupts against the hardware count of each channel
+ */
+void DetectorReport(void)
+{
+    for(int i = 0; i < det.channels; i++){
+        int count = -1;
+
+        if(counters[i]) pcnt_unit_get_count(counters[i], &count);
+        ESP_LOGI(TAG, "channel %d GPIO %d approach %d: %"PRIu32" vehicles, PCNT %d",
+            i, detectors[i].pin, det.channel[i].approach + 1, det.channel[i].total, count);
+    }
+    ESP_LOGI(TAG, "%"PRIu32" edges, %"PRIu32" lost edges, %"PRIu32" ring overflows", det.events, det.errors, ring.overflows);
+}
+
+#endif
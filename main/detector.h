@@ -0,0 +1,84 @@
+/*
+ * detector.h
+ *
+ *  Vehicle detector inputs: interrupt timestamps through a lock-free ring,
+ *  aggregated into counts, occupancy and headway per approach.
+ */
+
+#ifndef MAIN_DETECTOR_H_
+#define MAIN_DETECTOR_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "plan.h"
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#endif
+
+#define DET_RING_SIZE           256     // power of 2
+#define DET_MAX_CHANNELS        8
+#define DET_APPROACHES          PLAN_HEADS
+
+typedef struct {
+    uint32_t time_us;       // wraps every 71 minutes, only differences are used
+    uint8_t channel;
+    uint8_t present;        // 1: vehicle over the loop from time_us
+}DetEvent_t;
+
+typedef struct {
+    DetEvent_t event[DET_RING_SIZE];
+    uint32_t head;          // written by the producer only
+    uint32_t tail;          // written by the consumer only
+    uint32_t overflows;     // events dropped on a full ring, producer only
+}DetRing_t;
+
+typedef struct {
+    uint8_t approach;
+    bool present;
+    bool seen;              // last_on_us holds a vehicle
+    bool called;            // a vehicle arrived since the last DetCalls
+    uint32_t on_us;         // start of the presence counted in this window
+    uint32_t last_on_us;    // arrival of the previous vehicle, for headways
+    uint32_t count;         // vehicles in the window
+    uint64_t occupied_us;
+    uint64_t headway_us;
+    uint32_t headways;
+    uint32_t total;         // vehicles since DetInit
+}DetChannel_t;
+
+typedef struct {
+    DetChannel_t channel[DET_MAX_CHANNELS];
+    uint8_t channels;
+    uint32_t window_us;     // start of the window
+    uint32_t events;
+    uint32_t errors;        // arrival while present or departure while empty: an edge was lost
+}Det_t;
+
+typedef struct {
+    uint32_t count;         // vehicles
+    uint16_t occupancy_pm;  // time a loop was occupied, per mille, mean over the lanes
+    uint32_t headway_ms;    // mean arrival to arrival gap of a lane, 0 below 2 vehicles
+}DetStats_t;
+
+bool DetPush(DetRing_t *ring, const DetEvent_t *event);
+bool DetPop(DetRing_t *ring, DetEvent_t *event);
+void DetInit(Det_t *det, const uint8_t *approach, int channels, uint32_t now_us);
+void DetApply(Det_t *det, const DetEvent_t *event);
+int DetConsume(Det_t *det, DetRing_t *ring);
+void DetSample(Det_t *det, uint32_t now_us, DetStats_t stats[DET_APPROACHES]);
+uint8_t DetCalls(Det_t *det);
+bool DetSelfTest(void);
+void DetBench(int events, int64_t (*now_us)(void));
+#ifdef ESP_PLATFORM
+typedef struct {
+    int pin;
+    uint8_t approach;
+    bool active_low;        // contact to ground when a vehicle is present
+}DetectorConfig_t;
+
+esp_err_t DetectorInit(const DetectorConfig_t *config, int channels);
+void DetectorSample(DetStats_t stats[DET_APPROACHES]);
+uint8_t DetectorCalls(void);
+void DetectorReport(void);
+#endif
+
+#endif /* MAIN_DETECTOR_H_ */
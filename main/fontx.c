@@ -3,9 +3,11 @@
 #include <string.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
+#include <stdlib.h>
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_spiffs.h"
+#include "esp_timer.h"
 #include "fontx.h"
 #define FontxDebug 0 // for Debug
 
@@ -21,10 +23,48 @@ void InitFontx(FontxFile *fxs, const char *f0, const char *f1)
 	AddFontx(&fxs[1], f1);
 }
 
+/*
+ * Read the code block table of a double-byte font and precompute the
+ * glyph index of every block, so a lookup is a binary search over the
+ * blocks instead of a linear walk that sums the block sizes.
+ */
+static bool LoadFontxBlocks(FontxFile *fx)
+{
+	uint8_t buf[4];
+	uint32_t base = 0;
+
+	fx->blocks = malloc(sizeof(FontxBlock) * fx->bc);
+	if (fx->blocks == NULL) {
+		printf("Fontx:%s no memory for %d blocks.\n",fx->path,fx->bc);
+		return false;
+	}
+	for(int i=0;i<fx->bc;i++) {
+		if (fread(buf, 1, sizeof(buf), fx->file) != sizeof(buf)) {
+			printf("Fontx:%s block table truncated.\n",fx->path);
+			return false;
+		}
+		fx->blocks[i].start = buf[0] | (buf[1] << 8);
+		fx->blocks[i].end = buf[2] | (buf[3] << 8);
+		if (fx->blocks[i].end < fx->blocks[i].start ||
+			(i > 0 && fx->blocks[i].start <= fx->blocks[i-1].end)) {
+			printf("Fontx:%s block %d out of order.\n",fx->path,i);
+			return false;
+		}
+		fx->blocks[i].base = base;
+		base += fx->blocks[i].end - fx->blocks[i].start + 1;
+	}
+	if(FontxDebug)printf("[LoadFontxBlocks]bc=%d glyphs=%"PRIu32"\n",fx->bc,base);
+	return true;
+}
+
 bool OpenFontx(FontxFile *fx)
 {
 	FILE *f;
 	if(!fx->opened){
+		if(fx->path == NULL || fx->path[0] == 0) {
+			fx->valid = false;
+			return fx->valid;
+		}
 		if(FontxDebug)printf("[openFont]fx->path=[%s]\n",fx->path);
 		f = fopen(fx->path, "r");
 		if(FontxDebug)printf("[openFont]fopen=%p\n",f);
@@ -40,6 +80,8 @@ bool OpenFontx(FontxFile *fx)
 			fx->valid = false;
 			printf("Fontx:%s not FONTX format.\n",fx->path);
 			fclose(fx->file);
+			fx->file = NULL;
+			fx->opened = false;
 			return fx->valid ;
 		}
 
@@ -58,6 +100,17 @@ bool OpenFontx(FontxFile *fx)
 			printf("Fontx:%s is too big font size.\n",fx->path);
 			fx->valid = false;
 			fclose(fx->file);
+			fx->file = NULL;
+			fx->opened = false;
+			return fx->valid ;
+		}
+		if(!fx->is_ank && !LoadFontxBlocks(fx)) {
+			fx->valid = false;
+			free(fx->blocks);
+			fx->blocks = NULL;
+			fclose(fx->file);
+			fx->file = NULL;
+			fx->opened = false;
 			return fx->valid ;
 		}
 		fx->valid = true;
@@ -69,6 +122,9 @@ void CloseFontx(FontxFile *fx)
 {
 	if(fx->opened){
 		fclose(fx->file);
+		fx->file = NULL;
+		free(fx->blocks);
+		fx->blocks = NULL;
 		fx->opened = false;
 	}
 }
@@ -98,41 +154,168 @@ uint8_t getFortHeight(FontxFile *fx) {
 	return(fx->h);
 }
 
-bool GetFontx(FontxFile *fxs, uint8_t ascii , uint8_t *pGlyph, uint8_t *pw, uint8_t *ph)
+/*
+ * Return the glyph index of code in a double-byte font, or -1 if the
+ * font has no glyph for it. O(log bc) over the precomputed block index.
+ */
+int FindFontxGlyph(const FontxFile *fx, uint16_t code)
+{
+	int lo = 0;
+	int hi = fx->bc - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (code < fx->blocks[mid].start) {
+			hi = mid - 1;
+		} else if (code > fx->blocks[mid].end) {
+			lo = mid + 1;
+		} else {
+			return fx->blocks[mid].base + (code - fx->blocks[mid].start);
+		}
+	}
+	return -1;
+}
+
+/*
+ * Fetch the glyph of code. ASCII is served by a single-byte (ANK) font,
+ * everything else by a double-byte font indexed by Unicode code point.
+ * The fonts in fxs are tried in order, so fxs[1] is the fallback for
+ * code points fxs[0] does not have.
+ */
+bool GetFontx(FontxFile *fxs, uint16_t code, uint8_t *pGlyph, uint8_t *pw, uint8_t *ph)
 {
   
 	int i;
+	int glyph;
 	uint32_t offset;
 
-	if(FontxDebug)printf("[GetFontx]ascii=0x%x\n",ascii);
+	if(FontxDebug)printf("[GetFontx]code=0x%x\n",code);
 	for(i=0; i<2; i++){
 		if(!OpenFontx(&fxs[i])) continue;
 		if(FontxDebug)printf("[GetFontx]openFontxFile[%d] ok\n",i);
 	
-		//if(ascii < 0x100){
-		if(ascii < 0x80){
-			if(fxs[i].is_ank){
+		if(fxs[i].is_ank){
+			if(code >= 0x80) continue;
 if(FontxDebug)printf("[GetFontx]fxs.is_ank fxs.fsz=%d\n",fxs[i].fsz);
-				offset = 17 + ascii * fxs[i].fsz;
+			offset = 17 + code * fxs[i].fsz;
+		} else {
+			glyph = FindFontxGlyph(&fxs[i], code);
+			if(glyph < 0) continue;
+if(FontxDebug)printf("[GetFontx]glyph=%d fxs.bc=%d\n",glyph,fxs[i].bc);
+			offset = 18 + fxs[i].bc * 4 + glyph * fxs[i].fsz;
+		}
 if(FontxDebug)printf("[GetFontx]offset=%"PRIu32"\n",offset);
-				if(fseek(fxs[i].file, offset, SEEK_SET)) {
-					printf("Fontx:seek(%"PRIu32") failed.\n",offset);
-					return false;
-				}
-				if(fread(pGlyph, 1, fxs[i].fsz, fxs[i].file) != fxs[i].fsz) {
-					printf("Fontx:fread failed.\n");
-					return false;
-				}
-				if(pw) *pw = fxs[i].w;
-				if(ph) *ph = fxs[i].h;
-				return true;
-			}
+		if(fseek(fxs[i].file, offset, SEEK_SET)) {
+			printf("Fontx:seek(%"PRIu32") failed.\n",offset);
+			return false;
+		}
+		if(fread(pGlyph, 1, fxs[i].fsz, fxs[i].file) != fxs[i].fsz) {
+			printf("Fontx:fread failed.\n");
+			return false;
+		}
+		if(pw) *pw = fxs[i].w;
+		if(ph) *ph = fxs[i].h;
+		return true;
+	}
+	return false;
+}
 
-		} else {
+/*
+ * Decode one UTF-8 sequence and advance *utf8 past it.
+ * Code points outside the BMP and malformed sequences decode to U+FFFD.
+ */
+uint16_t UTF2Unicode(const uint8_t **utf8)
+{
+	const uint8_t *p = *utf8;
+	uint32_t code;
+	int more;
 
+	if (p[0] < 0x80) {
+		*utf8 = p + 1;
+		return p[0];
+	} else if ((p[0] & 0xE0) == 0xC0) {
+		code = p[0] & 0x1F;
+		more = 1;
+	} else if ((p[0] & 0xF0) == 0xE0) {
+		code = p[0] & 0x0F;
+		more = 2;
+	} else if ((p[0] & 0xF8) == 0xF0) {
+		code = p[0] & 0x07;
+		more = 3;
+	} else {
+		*utf8 = p + 1;
+		return 0xFFFD;
+	}
+
+	for(int i=1;i<=more;i++) {
+		if ((p[i] & 0xC0) != 0x80) {
+			*utf8 = p + i;
+			return 0xFFFD;
 		}
+		code = (code << 6) | (p[i] & 0x3F);
 	}
-	return false;
+	*utf8 = p + more + 1;
+	if (code > 0xFFFF) return 0xFFFD;
+	return code;
+}
+
+int String2Unicode(const uint8_t *utf8, int length, uint16_t *codes, int maxcodes)
+{
+	const uint8_t *p = utf8;
+	const uint8_t *end = utf8 + length;
+	int spos = 0;
+
+	while (p < end && *p && spos < maxcodes) {
+		codes[spos++] = UTF2Unicode(&p);
+	}
+	return spos;
+}
+
+/*
+ * Print the cost of glyph lookups for every code point of utf8:
+ * the block index search, a linear scan of the same table, and the full
+ * GetFontx including the file read.
+ */
+void BenchFontx(FontxFile *fxs, const uint8_t *utf8, int loops)
+{
+	uint16_t codes[64];
+	uint8_t glyph[FontxGlyphBufSize];
+	int ncodes = String2Unicode(utf8, strlen((const char *)utf8), codes, 64);
+	volatile int sink = 0;
+
+	if (ncodes == 0 || loops <= 0) return;
+	for(int f=0;f<2;f++) {
+		FontxFile *fx = &fxs[f];
+		if(!OpenFontx(fx) || fx->is_ank) continue;
+
+		int64_t t0 = esp_timer_get_time();
+		for(int l=0;l<loops;l++) {
+			for(int i=0;i<ncodes;i++) sink += FindFontxGlyph(fx, codes[i]);
+		}
+		int64_t t1 = esp_timer_get_time();
+		for(int l=0;l<loops;l++) {
+			for(int i=0;i<ncodes;i++) {
+				for(int b=0;b<fx->bc;b++) {
+					if (codes[i] >= fx->blocks[b].start && codes[i] <= fx->blocks[b].end) {
+						sink += fx->blocks[b].base + (codes[i] - fx->blocks[b].start);
+						break;
+					}
+				}
+			}
+		}
+		int64_t t2 = esp_timer_get_time();
+		printf("[BenchFontx]%s bc=%d codes=%d index=%"PRId64"ns linear=%"PRId64"ns per lookup\n",
+			fx->path, fx->bc, ncodes,
+			(t1 - t0) * 1000 / (loops * ncodes), (t2 - t1) * 1000 / (loops * ncodes));
+	}
+
+	int64_t t0 = esp_timer_get_time();
+	for(int l=0;l<loops;l++) {
+		for(int i=0;i<ncodes;i++) sink += GetFontx(fxs, codes[i], glyph, NULL, NULL);
+	}
+	int64_t t1 = esp_timer_get_time();
+	printf("[BenchFontx]GetFontx=%"PRId64"us per glyph\n", (t1 - t0) / (loops * ncodes));
+	(void)sink;
 }
 
 void Font2Bitmap(uint8_t *fonts, uint8_t *line, uint8_t w, uint8_t h, uint8_t inverse) {
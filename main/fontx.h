@@ -2,6 +2,14 @@
 #define MAIN_FONTX_H_
 #define FontxGlyphBufSize (32*32/8)
 
+// One code range of a double-byte FONTX file.
+// base is the glyph index of start, precomputed when the font is opened.
+typedef struct {
+	uint16_t start;
+	uint16_t end;
+	uint16_t base;
+} FontxBlock;
+
 typedef struct {
 	const char *path;
 	char  fxname[10];
@@ -12,6 +20,7 @@ typedef struct {
 	uint8_t h;
 	uint16_t fsz;
 	uint8_t bc;
+	FontxBlock *blocks;
 	FILE *file;
 } FontxFile;
 
@@ -22,7 +31,11 @@ void CloseFontx(FontxFile *fx);
 void DumpFontx(FontxFile *fxs);
 uint8_t getFortWidth(FontxFile *fx);
 uint8_t getFortHeight(FontxFile *fx);
-bool GetFontx(FontxFile *fxs, uint8_t ascii , uint8_t *pGlyph, uint8_t *pw, uint8_t *ph);
+int FindFontxGlyph(const FontxFile *fx, uint16_t code);
+bool GetFontx(FontxFile *fxs, uint16_t code, uint8_t *pGlyph, uint8_t *pw, uint8_t *ph);
+uint16_t UTF2Unicode(const uint8_t **utf8);
+int String2Unicode(const uint8_t *utf8, int length, uint16_t *codes, int maxcodes);
+void BenchFontx(FontxFile *fxs, const uint8_t *utf8, int loops);
 void Font2Bitmap(uint8_t *fonts, uint8_t *line, uint8_t w, uint8_t h, uint8_t inverse);
 void UnderlineBitmap(uint8_t *line, uint8_t w, uint8_t h);
 void ReversBitmap(uint8_t *line, uint8_t w, uint8_t h);
@@ -0,0 +1,332 @@
+/*
+ * lamp.c
+ *
+ *  Signal lamp outputs switched by precomputed GPIO set/clear masks.
+ *
+ *  Every lamp state (one bit per lamp) is compiled once into the words
+ *  written to the GPIO W1TC and W1TS registers, so a change of state is
+ *  two register stores instead of a gpio_set_level call per lamp. Clear
+ *  goes first: between the two stores the outputs show only the lamps lit
+ *  in both the old and the new state, never a lamp of one with a lamp of
+ *  the other.
+ *
+ *  The flashing operation (slow mode) hands the flashing lamps to LEDC
+ *  channels of one timer at LAMP_FLASH_HZ: the hardware blinks them, no
+ *  task runs for it. The pins go back to the GPIO output register at the
+ *  start of a lit half period, lit, so the next state follows the flash
+ *  in phase. The supervisor's fallback blinks the yellows the same way,
+ *  for good.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "lamp.h"
+#include "selftest.h"
+#include "plan.h"
+#ifdef ESP_PLATFORM
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "soc/gpio_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "esp_attr.h"
+#include "esp_rom_gpio.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+#define LAMP_FLASH_MODE         LEDC_LOW_SPEED_MODE     // the high speed timer 0 dims the digits
+#define LAMP_FLASH_TIMER        LEDC_TIMER_0
+#define LAMP_FLASH_RESOLUTION   LEDC_TIMER_17_BIT       // 1 Hz from the 80 MHz APB clock needs a divider below 1024
+#define LAMP_FLASH_PERIOD_US    (1000000 / LAMP_FLASH_HZ)
+#endif
+
+/**
+ * Precompute the register writes of every lamp state
+ *
+ * @param   lamp                      lamp output structure
+ * @param   pins                      GPIO of lamp bit 0, 1, ...
+ * @param   count                     number of lamps, up to LAMP_MAX
+ */
+void LampCompile(Lamp_t *lamp, const int *pins, int count)
+{
+    uint32_t all = 0, all_hi = 0;
+
+    if(count > LAMP_MAX) count = LAMP_MAX;
+    for(int b = 0; b < count; b++){
+        if(pins[b] < 32) all |= 1UL << pins[b];
+        else all_hi |= 1UL << (pins[b] - 32);
+    }
+    lamp->hi = all_hi != 0;
+    for(int state = 0; state < LAMP_STATES; state++){
+        LampMasks_t *m = &lamp->masks[state];
+
+        memset(m, 0, sizeof(LampMasks_t));
+        for(int b = 0; b < count; b++){
+            if(!(state & (1 << b))) continue;
+            if(pins[b] < 32) m->w1ts |= 1UL << pins[b];
+            else m->w1ts_hi |= 1UL << (pins[b] - 32);
+        }
+        m->w1tc = all & ~m->w1ts;
+        m->w1tc_hi = all_hi & ~m->w1ts_hi;
+    }
+}
+
+#ifdef ESP_PLATFORM
+
+static volatile bool lamp_frozen;
+static bool lamp_fallback;          // LampFallback owns the lamps until the reboot
+static int flash_pins[LAMP_MAX];
+static uint8_t flash_lamps;         // lamp bits blinked by LEDC, 0 when not flashing
+static int64_t flash_start_us;      // a lit half period starts here and every LAMP_FLASH_PERIOD_US
+
+/**
+ * Configure the lamp pins as outputs, all lamps off
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_ARG     if a pin cannot drive an output
+ */
+esp_err_t LampInit(Lamp_t *lamp, const int *pins, int count)
+{
+    for(int b = 0; b < count && b < LAMP_MAX; b++){
+        esp_err_t ret = gpio_set_direction(pins[b], GPIO_MODE_OUTPUT);
+        if(ret != ESP_OK) return ret;
+    }
+    LampCompile(lamp, pins, count);
+    portMUX_INITIALIZE(&lamp->lock);
+    lamp->state = 0;
+    GPIO.out_w1tc = lamp->masks[0].w1tc;
+    if(lamp->hi) GPIO.out1_w1tc.val = lamp->masks[0].w1tc_hi;
+    return ESP_OK;
+}
+
+/**
+ * Switch all lamps to a state: clear then set, back to back on this core.
+ * The critical section keeps an interrupt from stretching the gap between
+ * the two stores.
+ */
+void IRAM_ATTR LampWrite(Lamp_t *lamp, uint8_t state)
+{
+    const LampMasks_t *m = &lamp->masks[state & (LAMP_STATES - 1)];
+
+    if(lamp_frozen) return;
+    portENTER_CRITICAL(&lamp->lock);
+    if(lamp->hi){
+        GPIO.out_w1tc = m->w1tc;
+        GPIO.out1_w1tc.val = m->w1tc_hi;
+        GPIO.out_w1ts = m->w1ts;
+        GPIO.out1_w1ts.val = m->w1ts_hi;
+    }else{
+        GPIO.out_w1tc = m->w1tc;
+        GPIO.out_w1ts = m->w1ts;
+    }
+    portEXIT_CRITICAL(&lamp->lock);
+    lamp->state = state;
+}
+
+/**
+ * Stop or resume every LampWrite: the conflict monitor owns the outputs after a trip
+ */
+void IRAM_ATTR LampFreeze(bool frozen)
+{
+    lamp_frozen = frozen;
+}
+
+/*
+ * Hand some lamps to the LEDC, in phase and lit from now
+ */
+static esp_err_t LampFlashRun(const int *pins, uint8_t lamps)
+{
+    ledc_timer_config_t timer = {
+        .speed_mode = LAMP_FLASH_MODE,
+        .duty_resolution = LAMP_FLASH_RESOLUTION,
+        .timer_num = LAMP_FLASH_TIMER,
+        .freq_hz = LAMP_FLASH_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    esp_err_t ret;
+
+    ret = ledc_timer_config(&timer);
+    if(ret != ESP_OK) return ret;
+    ledc_timer_pause(LAMP_FLASH_MODE, LAMP_FLASH_TIMER);
+    for(int b = 0; b < LAMP_MAX; b++){
+        ledc_channel_config_t channel = {
+            .gpio_num = pins[b],
+            .speed_mode = LAMP_FLASH_MODE,
+            .channel = b,
+            .intr_type = LEDC_INTR_DISABLE,
+            .timer_sel = LAMP_FLASH_TIMER,
+            .duty = 1 << (LAMP_FLASH_RESOLUTION - 1),
+            .hpoint = 0,
+        };
+
+        if(!(lamps & (1 << b))) continue;
+        ret = ledc_channel_config(&channel);
+        if(ret != ESP_OK) return ret;
+        flash_pins[b] = pins[b];
+        flash_lamps |= 1 << b;
+    }
+    // every channel counts from 0 together: in phase, lit from now
+    ledc_timer_rst(LAMP_FLASH_MODE, LAMP_FLASH_TIMER);
+    ledc_timer_resume(LAMP_FLASH_MODE, LAMP_FLASH_TIMER);
+    flash_start_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+/**
+ * Blink lamps in hardware, lit first. The other lamps are left to the
+ * caller, who holds them dark.
+ *
+ * @param   pins                      GPIO of lamp bit 0, 1, ...
+ * @param   lamps                     lamp bits to blink, up to LAMP_MAX lamps
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_STATE   if flashing already or frozen by the conflict monitor
+ *          - error from the LEDC driver otherwise
+ */
+esp_err_t LampFlashStart(const int *pins, uint8_t lamps)
+{
+    if(flash_lamps || lamp_frozen) return ESP_ERR_INVALID_STATE;
+    return LampFlashRun(pins, lamps);
+}
+
+/**
+ * Give the flashing lamps back to the output register at the start of the
+ * next lit half period, lit. Blocks up to one period; the caller applies
+ * the next plan right after, which turns them off or keeps them lit.
+ */
+void LampFlashStop(void)
+{
+    int64_t now = esp_timer_get_time(), next;
+
+    if(!flash_lamps || lamp_fallback) return;
+    next = flash_start_us + ((now - flash_start_us) / LAMP_FLASH_PERIOD_US + 1) * LAMP_FLASH_PERIOD_US;
+    vTaskDelay(pdMS_TO_TICKS((next - now) / 1000) > 1 ? pdMS_TO_TICKS((next - now) / 1000) - 1 : 0);
+    while((now = esp_timer_get_time()) < next) esp_rom_delay_us(next - now < 100 ? next - now : 100);
+
+    for(int b = 0; b < LAMP_MAX; b++){
+        if(!(flash_lamps & (1 << b))) continue;
+        if(flash_pins[b] < 32) GPIO.out_w1ts = 1UL << flash_pins[b];
+        else GPIO.out1_w1ts.val = 1UL << (flash_pins[b] - 32);
+        ledc_stop(LAMP_FLASH_MODE, b, 1);
+        esp_rom_gpio_connect_out_signal(flash_pins[b], SIG_GPIO_OUT_IDX, false, false);
+    }
+    flash_lamps = 0;
+}
+
+bool LampFlashing(void)
+{
+    return flash_lamps != 0;
+}
+
+/**
+ * Take the lamps from every writer for good and blink some of them, the
+ * others dark: the supervisor's fallback when the controller stopped. Only
+ * a reboot ends it.
+ *
+ * @param   pins                      GPIO of lamp bit 0, 1, ...
+ * @param   count                     number of lamps, up to LAMP_MAX
+ * @param   lamps                     lamp bits to blink
+ *
+ * @return  ESP_OK, or the error from the LEDC driver: the lamps are dark then
+ */
+esp_err_t LampFallback(const int *pins, int count, uint8_t lamps)
+{
+    if(count > LAMP_MAX) count = LAMP_MAX;
+    lamp_frozen = true;
+    lamp_fallback = true;
+    if(flash_lamps == lamps) return ESP_OK;
+    for(int b = 0; b < count; b++){
+        if(flash_lamps & (1 << b)){
+            ledc_stop(LAMP_FLASH_MODE, b, 0);
+            esp_rom_gpio_connect_out_signal(flash_pins[b], SIG_GPIO_OUT_IDX, false, false);
+        }
+        if(pins[b] < 32) GPIO.out_w1tc = 1UL << pins[b];
+        else GPIO.out1_w1tc.val = 1UL << (pins[b] - 32);
+    }
+    flash_lamps = 0;
+    return LampFlashRun(pins, lamps);
+}
+
+#endif
+
+/*
+ * Lamp state seen on the pins for a simulated output register
+ */
+static uint8_t LampsOnPins(const int *pins, int count, uint64_t out)
+{
+    uint8_t state = 0;
+    for(int b = 0; b < count; b++){
+        if(out & (1ULL << pins[b])) state |= 1 << b;
+    }
+    return state;
+}
+
+/**
+ * Replay every transition between lamp states against a model of the GPIO
+ * output registers, with unrelated outputs set to random values. After each
+ * register store the pins may only show lamps of the old state while clearing
+ * and of the new state while setting, with the common lamps always lit: with
+ * all lamps on GPIO 0-31 the only state in between is old & new. Unrelated
+ * outputs must never change. Also checks
+ * that no transition of the two phase plan passes through a conflict.
+ *
+ * @param   pins                      GPIO of lamp bit 0, 1, ...
+ * @param   count                     number of lamps
+ * 
+ * @return  true if no other state was ever visible
+ */
+bool LampSelfTest(const int *pins, int count)
+{
+    static Lamp_t lamp;
+    uint32_t seed = 0x1a3b;
+    int errors = 0, stores = 0;
+    Plan_t plan;
+
+    LampCompile(&lamp, pins, count);
+    for(int from = 0; from < (1 << count); from++){
+        for(int to = 0; to < (1 << count); to++){
+            const LampMasks_t *m = &lamp.masks[to];
+            uint64_t lamp_bits = 0, other, out;
+            uint64_t writes[4][2];      // bits cleared, bits set
+            int n = 0, clears;
+
+            for(int b = 0; b < count; b++) lamp_bits |= 1ULL << pins[b];
+            other = SelfTestRandom32(&seed);
+            other = (other << 20 ^ other) & ~lamp_bits & 0xFFFFFFFFFFULL;
+            out = other;
+            for(int b = 0; b < count; b++) if(from & (1 << b)) out |= 1ULL << pins[b];
+
+            // the same stores in the same order as LampWrite
+            writes[n][0] = m->w1tc; writes[n++][1] = 0;
+            if(lamp.hi){ writes[n][0] = (uint64_t)m->w1tc_hi << 32; writes[n++][1] = 0; }
+            clears = n;
+            writes[n][0] = 0; writes[n++][1] = m->w1ts;
+            if(lamp.hi){ writes[n][0] = 0; writes[n++][1] = (uint64_t)m->w1ts_hi << 32; }
+
+            for(int w = 0; w < n; w++){
+                uint8_t seen;
+
+                out = (out & ~writes[w][0]) | writes[w][1];
+                seen = LampsOnPins(pins, count, out);
+                stores++;
+                // never a lamp outside the state being left (clear stores) or entered (set stores),
+                // never a lamp common to both switched off
+                if(seen & ~(w < clears ? from : to)) errors++;
+                if((seen & from & to) != (from & to)) errors++;
+                if((out & ~lamp_bits) != other) errors++;
+            }
+            if(LampsOnPins(pins, count, out) != to) errors++;
+        }
+    }
+
+    // the only intermediate state, old & new, of every plan transition
+    PlanTwoPhase(&plan, 10, 5, 8, 4);
+    for(int i = 0; i < plan.steps; i++){
+        uint8_t from = plan.step[i].lamps, to = plan.step[(i + 1) % plan.steps].lamps;
+        if(PlanConflict(from & to)) errors++;
+    }
+    printf("[LampSelfTest] %s, %d register stores, %d errors\n", errors ? "FAIL" : "ok", stores, errors);
+    return errors == 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * lamp.h
+ *
+ *  Signal lamp outputs switched by precomputed GPIO set/clear masks.
+ */
+
+#ifndef MAIN_LAMP_H_
+#define MAIN_LAMP_H_
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#endif
+
+#define LAMP_MAX                6
+#define LAMP_STATES             (1 << LAMP_MAX)
+#define LAMP_FLASH_HZ           1       // 60 flashes a minute, lit half of each period
+
+typedef struct {
+    uint32_t w1ts;          // GPIO 0-31
+    uint32_t w1tc;
+    uint32_t w1ts_hi;       // GPIO 32-39
+    uint32_t w1tc_hi;
+}LampMasks_t;
+
+typedef struct {
+    LampMasks_t masks[LAMP_STATES];     // register writes of every lamp state
+    bool hi;                            // some lamps are on GPIO 32-39
+    uint8_t state;
+#ifdef ESP_PLATFORM
+    portMUX_TYPE lock;
+#endif
+}Lamp_t;
+
+void LampCompile(Lamp_t *lamp, const int *pins, int count);
+#ifdef ESP_PLATFORM
+esp_err_t LampInit(Lamp_t *lamp, const int *pins, int count);
+void LampWrite(Lamp_t *lamp, uint8_t state);
+void LampFreeze(bool frozen);
+esp_err_t LampFlashStart(const int *pins, uint8_t lamps);
+void LampFlashStop(void);
+bool LampFlashing(void);
+esp_err_t LampFallback(const int *pins, int count, uint8_t lamps);
+#endif
+bool LampSelfTest(const int *pins, int count);
+
+#endif /* MAIN_LAMP_H_ */
@@ -12,15 +12,29 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_spiffs.h"
+#include "esp_timer.h"
 #include "st7735s.h"
 #include "fontx.h"
 #include "74HC595.h"
+#include "segdisplay.h"
+#include "segbright.h"
+#include "timing.h"
+#include "plan.h"
+#include "controller.h"
+#include "lamp.h"
+#include "wheel.h"
+#include "optimizer.h"
+#include "detector.h"
+#include "monitor.h"
+#include "schedule.h"
+#include "supervisor.h"
 
 #define LED                     2 
 #define BUTTON_UP               35 
@@ -38,6 +52,13 @@
 #define DATA_PIN_595            5 
 #define LATCH_PIN_595           17
 #define CLOCK_PIN_595           16
+#define CHAIN_LEN_595           4       // 2 digits per phase
+#define OE_PIN_595              32      // LEDC PWM brightness on !OE
+
+#define DETECTOR_PHASE_1        13      // loop amplifier outputs, low while a vehicle is present
+#define DETECTOR_PHASE_2        14
+#define PREEMPT_PHASE_1         15      // emergency vehicle receivers, low while a vehicle requests the green
+#define PREEMPT_PHASE_2         33
 
 #define GPIO_MOSI               23
 #define GPIO_SCLK               19
@@ -54,8 +75,22 @@
 
 #define INTERVAL                2000    
 #define WAIT                    vTaskDelay(INTERVAL/portTICK_PERIOD_MS)
-#define DEBOUNCE                20
+#define DEBOUNCE                20      // ms
+#define REPEAT_DELAY            400     // ms a button is held before it repeats
+#define REPEAT                  150     // ms between repeats
 #define NOTPRESS                -1
+#define EVENT_TIMEOUT           -2      // screen events other than the BUTTON_* pins
+#define EVENT_UART_EXIT         -3
+#define BENCHMARK               0       // 1: print driver benchmarks at startup
+#define ACTUATED_MIN_GREEN      5       // s, actuated greens run at least this or the saved green if shorter
+#define ACTUATED_MAX_FACTOR     2       // actuated greens extend up to this times the saved green
+#define ACTUATED_PASSAGE        25      // tenths of a second a vehicle call extends a green by
+#define SLOW_FLASH_LAMPS        (PLAN_YELLOW1 | PLAN_RED2)  // slow mode: main road flashing yellow, side road flashing red
+#define SLOW_DARK_WAIT_MS       5000    // clearance into the dark hold before flashing, a standing preemption outlasts it
+#define INTERSECTION_NAME       "Ngã tư Lê Lợi" // intro screen, UTF-8: the Vietnamese letters come from VNGH16XB.FNT
+#define SCHEDULE_TZ             "ICT-7" // local time of the schedule, POSIX TZ (no summer time here)
+#define BRIGHT_FADE_MS          2000    // fade of the once-a-minute step along the day/night brightness curve
+#define COMMAND_HEARTBEAT_MS    10000   // supervisor timeout of the UART task, entering slow mode blocks it for seconds
 
 typedef enum {
     G1_CHOSEN = 0,
@@ -66,14 +101,25 @@ typedef enum {
 
 
 const int LED7Seg[10] = {0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F};
+static const int LampPins[PLAN_LAMPS] = {
+    LED_RED_PHASE_1, LED_YELLOW_PHASE_1, LED_GREEN_PHASE_1,
+    LED_RED_PHASE_2, LED_YELLOW_PHASE_2, LED_GREEN_PHASE_2,
+};
+static const DetectorConfig_t Detectors[] = {
+    {.pin = DETECTOR_PHASE_1, .approach = 0, .active_low = true},
+    {.pin = DETECTOR_PHASE_2, .approach = 1, .active_low = true},
+};
+static const int PreemptPins[PLAN_HEADS] = {PREEMPT_PHASE_1, PREEMPT_PHASE_2};
 TaskHandle_t TaskHandler_uart;
-TaskHandle_t TaskHandler_LED;
 
 static QueueHandle_t uart0_queue;
+static QueueHandle_t screen_queue;      // button presses and timer events for screen_task
+static IC74HC595_t IC74HC595;
 
 
 int G1 = 10, Y1 = 5, G2 = 8, Y2 = 4;
 int R1 = 12, R2 = 15;
+static int Intersection;        // controller id of this board's own lamps, the UI edits its plan
 int G1_save = 10, Y1_save = 5, G2_save = 8, Y2_save = 4;
 int R1_save = 12, R2_save = 15;
 int G1_uart = 10, Y1_uart = 5, G2_uart = 8, Y2_uart = 4;
@@ -86,14 +132,21 @@ bool isYELLOW1on = false;
 bool isRED2on = false; 
 bool isGREEN2on = false; 
 bool isYELLOW2on = false;
-bool isInSlowMode = false;
-bool isLEDTaskRunning = true;
-bool uart_exit = false;
+bool isInSlowMode = false;      // lamps flashing, on LEDC
+bool isActuated = false;
+bool isAdaptive = false;        // fixed greens retimed every cycle by the optimizer from the detector counts
+bool isHolding = false;         // manual or slow mode: the schedule only updates the saved timings
+static Sched_t Schedule;
+static WheelTimer_t BrightTimer;     // steps the digits along the day/night brightness curve
+static Opt_t Optimizer;           // the timing core's only
+static volatile bool OptimizerReset;
+static StaticSemaphore_t ModeLockBuffer;
+static SemaphoreHandle_t ModeLock;  // held while a mode changes and its plan is staged
+static int CommandWatch = -1;   // supervisor id of the UART task
 
 static void uart_event_task(void *);
 static void screen_task(void *);
-static void LED_task(void *);
-static void IntroDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height);
+static void IntroDisplay(ST7735_t * const dev, const FontxFile * const fx, const FontxFile * const fxName, const int width, const int height);
 static void Option1Display(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height);
 static void Option2Display(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height);
 static void Option3Display(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height);
@@ -116,11 +169,29 @@ static void TerminalModeDisplay(ST7735_t * const dev, const FontxFile * const fx
 static void SlowModeDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height);
 static void SetTimeLightDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height);
 static void SavedDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height, int idx);
+static void ConflictDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height);
 static void Init_Hardware(void);
 static void OptionSelect(ST7735_t * , FontxFile *, int , int , int );
 static void ManualAdjOptionSelect(ST7735_t * , FontxFile *, int , int , int );
-static int  DetectButton();
-static void LEDAllOff();
+static void InitButtons(void);
+static int  WaitEvent(void);
+static void PostEvent(int event);
+static void ScreenSleep(uint32_t ms);
+static void BrightMinute(void *arg);
+static bool SavedPlan(Plan_t *plan);
+static void ApplySavedPlan(void);
+static bool ApplyHoldPlan(uint8_t lamps);
+static void AdaptiveStart(void);
+static void AdaptiveCycle(uint32_t cycle_s);
+static bool StartSlowMode(void);
+static void StopSlowMode(void);
+static void SlowModeBench(void);
+static bool BuildSchedule(Sched_t *sched);
+static void ScheduleApply(const SchedTiming_t *timing);
+static bool UartWait(uart_event_t *event);
+static esp_err_t RestartCommandTask(void);
+static void FallbackLamps(void);
+static uint8_t LampsFromColor(const char *color, int phase);
 int         scanSetTimeStr(char * str, int len, int *G1, int *Y1, int *G2, int *Y2);
 int         scanAdjStr(char* str, int len, char* str1, char* str2);
 
@@ -128,65 +199,32 @@ int         scanAdjStr(char* str, int len, char* str1, char* str2);
 
 void app_main(void)
 {   
+    static Plan_t plan;
+    ControllerConfig_t config = {.output = CTRL_OUT_GPIO, .lampPins = LampPins, .countWord = 0, .calls = DetectorCalls,
+        .cycle = AdaptiveCycle, .preemptPins = PreemptPins};
+
+    // the lamps first, a warm reset resumes its checkpoint: the display and
+    // the filesystem take hundreds of milliseconds to come up
+    SavedPlan(&plan);
+    ModeLock = xSemaphoreCreateMutexStatic(&ModeLockBuffer);
+    ESP_ERROR_CHECK(ControllerInit(BENCHMARK));
+    ESP_ERROR_CHECK(ControllerAdd(&config, &plan, &Intersection));
     Init_Hardware();
 
 	xTaskCreate(&screen_task, "TFT Screen", 1024*4, NULL, 3, NULL);
-	xTaskCreate(&LED_task, "LED task", 1024*4, NULL, 3, &TaskHandler_LED);      
+    ESP_ERROR_CHECK(MonitorInit(LampPins, PLAN_LAMPS));
+    ESP_ERROR_CHECK(SupervisorInit(FallbackLamps));
+    setenv("TZ", SCHEDULE_TZ, 1);
+    tzset();
+    if(BuildSchedule(&Schedule)) ESP_ERROR_CHECK(ScheduleInit(&Schedule, ScheduleApply));
+    WheelTimerInit(&BrightTimer, BrightMinute, NULL);
+    WheelStart(&BrightTimer, 0);
+    if(BENCHMARK) MonitorFaultTest(100);
+    if(BENCHMARK) SlowModeBench();
+    if(BENCHMARK) ControllerBench(CONTROLLER_MAX_INTERSECTIONS);
     // xTaskCreate(&uart_event_task, "UART Task", 4096, NULL, 2, &TaskHandler_uart);
 }
 
-static void LED_task(void *pvParameters)
-{
-    static IC74HC595_t IC74HC595;
-    Init74HC595(&IC74HC595, DATA_PIN_595, LATCH_PIN_595, CLOCK_PIN_595);
-    int idx;
-
-    while(1){
-        // xSemaphoreGive(red_phase1_sem);
-        idx = R1_save;
-        gpio_set_level(LED_RED_PHASE_1, 1);
-        gpio_set_level(LED_GREEN_PHASE_2, 1);
-
-        while(idx >= 1){
-            for(int i = G2_save; i >= 1; i--){
-                write4Byte74HC595(&IC74HC595, LED7Seg[i/10], LED7Seg[i%10], LED7Seg[idx/10], LED7Seg[idx%10]);
-                idx --;
-                vTaskDelay(pdMS_TO_TICKS(1000));
-            }
-            gpio_set_level(LED_GREEN_PHASE_2, 0);
-            gpio_set_level(LED_YELLOW_PHASE_2, 1);
-            for(int i = Y2_save; i >= 1; i--){
-                write4Byte74HC595(&IC74HC595, LED7Seg[i/10], LED7Seg[i%10], LED7Seg[idx/10], LED7Seg[idx%10]);
-                idx --;
-                vTaskDelay(pdMS_TO_TICKS(1000));
-            }
-            gpio_set_level(LED_YELLOW_PHASE_2, 0);
-        }
-        gpio_set_level(LED_RED_PHASE_1, 0);
-        idx = R2_save;
-
-        gpio_set_level(LED_RED_PHASE_2, 1);
-        gpio_set_level(LED_GREEN_PHASE_1, 1);
-        while (idx >= 1){
-            for(int i = G1_save; i >= 1; i--){
-                write4Byte74HC595(&IC74HC595, LED7Seg[idx/10], LED7Seg[idx%10], LED7Seg[i/10], LED7Seg[i%10]);
-                idx --;
-                vTaskDelay(pdMS_TO_TICKS(1000));
-            }
-            gpio_set_level(LED_GREEN_PHASE_1, 0);
-            gpio_set_level(LED_YELLOW_PHASE_1, 1);
-
-            for(int i = Y1_save; i >= 1; i--){
-                write4Byte74HC595(&IC74HC595, LED7Seg[idx/10], LED7Seg[idx%10], LED7Seg[i/10], LED7Seg[i%10]);
-                idx --;
-                vTaskDelay(pdMS_TO_TICKS(1000));
-            }
-            gpio_set_level(LED_YELLOW_PHASE_1, 0);
-        }
-        gpio_set_level(LED_RED_PHASE_2, 0);
-    } 
-}
-
 static void OptionSelect(ST7735_t * dev, FontxFile *fx, int width, int height, int option)
 {
     switch(option){
@@ -279,18 +317,23 @@ static void uart_event_task(void *pvParameters)
     char str1[10]="";
     char str2[10]="";
 
-    static IC74HC595_t IC74HC595;
-    Init74HC595(&IC74HC595, DATA_PIN_595, LATCH_PIN_595, CLOCK_PIN_595);
-    char* dtmp = (char*) malloc(RD_BUF_SIZE);
-    while(1) {
+    bool leave = false;
+
+    static char dtmp[RD_BUF_SIZE];  // not on the heap: the supervisor deletes a stuck task, it frees nothing
+    CommandWatch = SupervisorWatch("command", COMMAND_HEARTBEAT_MS, RestartCommandTask, false);
+    while(!leave) {
         //Waiting for UART event.
         printf("\n---CONTROL TRAFFIC LIGHT VIA TERMINAL---\n");
         printf("1. Set TimeLight:     !SETTIME! \n");
         printf("2. Manual Adjust:     !ADJ! \n");
         printf("3. Slow Mode:         !SLOW! \n");
-        printf("4. Exit uart:         !x! \n");
+        printf("4. Actuated on/off:   !ACTUATED! \n");
+        printf("5. Adaptive on/off:   !ADAPTIVE! \n");
+        printf("6. Schedule on/off:   !SCHEDULE! \n");
+        printf("7. Set clock:         !CLOCK=<unix time>! \n");
+        printf("8. Exit uart:         !x! \n");
         printf("Enter your command: \n");
-        if(xQueueReceive(uart0_queue, (void * )&event, (TickType_t)portMAX_DELAY)) {
+        if(UartWait(&event)) {
             bzero(dtmp, RD_BUF_SIZE);
             //if(event.data)
             switch(event.type) {
@@ -308,7 +351,7 @@ static void uart_event_task(void *pvParameters)
                             printf("3.Exit: !EXIT!\n");
                         
                             printf("Command: \n");
-                            if(xQueueReceive(uart0_queue, (void *)&event, (TickType_t)portMAX_DELAY)){
+                            if(UartWait(&event)){
                                 bzero(dtmp, RD_BUF_SIZE);
                                 switch (event.type)
                                 {
@@ -320,21 +363,6 @@ static void uart_event_task(void *pvParameters)
                                     }
                                     else if(strncmp(dtmp, "!APPLY!", strlen("!APPLY!"))==0){
 
-                                        if(isLEDTaskRunning){
-                                            vTaskDelete(TaskHandler_LED);
-                                            isLEDTaskRunning = false;
-                                        }
-                                        LEDAllOff();
-                                        gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                                        gpio_set_level(LED_YELLOW_PHASE_2, 1);
-
-                                        for(int i = 3; i >= 1; i--){
-                                            write4Byte74HC595(&IC74HC595, LED7Seg[i/10], LED7Seg[i%10], LED7Seg[i/10], LED7Seg[i%10]);
-                                            vTaskDelay(pdMS_TO_TICKS(1000));
-                                        }
-                                        gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                                        gpio_set_level(LED_YELLOW_PHASE_2, 0);
-
                                         R1_uart = G2_uart + Y2_uart;
                                         R2_uart = G1_uart + Y1_uart;
 
@@ -351,8 +379,7 @@ static void uart_event_task(void *pvParameters)
                                         Y2 = Y2_uart;
                                         R2 = R2_uart;
 
-                                        isLEDTaskRunning = true;
-	                                    xTaskCreate(&LED_task, "LED task", 1024*4, NULL, 3, &TaskHandler_LED);      
+                                        ApplySavedPlan();
                                     }else if(strncmp(dtmp, "!EXIT!", strlen("!EXIT!"))==0){
                                         loop = false;
                                     }else{
@@ -378,7 +405,7 @@ static void uart_event_task(void *pvParameters)
                             printf("3.Exit: !EXIT!\n");
 
                             printf("Command: \n");
-                            if(xQueueReceive(uart0_queue, (void *)&event, (TickType_t)portMAX_DELAY)){
+                            if(UartWait(&event)){
                                 bzero(dtmp, RD_BUF_SIZE);
                                 switch (event.type)
                                 {
@@ -392,53 +419,10 @@ static void uart_event_task(void *pvParameters)
                                         printf("\nPHASE 1: %s -- PHASE 2: %s\n", str1, str2);
                                     }
                                     else if(strncmp(dtmp, "!APPLY!", strlen("!APPLY!"))==0){
-                                        if(isLEDTaskRunning){
-                                            vTaskDelete(TaskHandler_LED);
-                                            isLEDTaskRunning = false;
-                                        }
-                                        LEDAllOff();
-                                        gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                                        gpio_set_level(LED_YELLOW_PHASE_2, 1);
-                                        for(int i = 3; i >= 1; i--){
-                                            write4Byte74HC595(&IC74HC595, LED7Seg[i/10], LED7Seg[i%10], LED7Seg[i/10], LED7Seg[i%10]);
-                                            vTaskDelay(pdMS_TO_TICKS(1000));
-                                        }
-                                        gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                                        gpio_set_level(LED_YELLOW_PHASE_2, 0);
-
-                                        if(strncmp(str1, "GREEN", strlen("GREEN"))==0){
-                                            gpio_set_level(LED_GREEN_PHASE_1, 1);
-                                            gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                                            gpio_set_level(LED_RED_PHASE_1, 0);
-                                        }else if(strncmp(str1, "YELLOW", strlen("YELLOW"))==0){
-                                            gpio_set_level(LED_GREEN_PHASE_1, 0);
-                                            gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                                            gpio_set_level(LED_RED_PHASE_1, 0);
-                                        }else if(strncmp(str1, "RED", strlen("RED"))==0){
-                                            gpio_set_level(LED_GREEN_PHASE_1, 0);
-                                            gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                                            gpio_set_level(LED_RED_PHASE_1, 1);
-                                        }
-                                        if(strncmp(str2, "GREEN", strlen("GREEN"))==0){
-                                            gpio_set_level(LED_GREEN_PHASE_2, 1);
-                                            gpio_set_level(LED_YELLOW_PHASE_2, 0);
-                                            gpio_set_level(LED_RED_PHASE_2, 0);
-                                        }else if(strncmp(str2, "YELLOW", strlen("YELLOW"))==0){
-                                            gpio_set_level(LED_GREEN_PHASE_2, 0);
-                                            gpio_set_level(LED_YELLOW_PHASE_2, 1);
-                                            gpio_set_level(LED_RED_PHASE_2, 0);
-                                        }else if(strncmp(str2, "RED", strlen("RED"))==0){
-                                            gpio_set_level(LED_GREEN_PHASE_2, 0);
-                                            gpio_set_level(LED_YELLOW_PHASE_2, 0);
-                                            gpio_set_level(LED_RED_PHASE_2, 1);
-                                        }
-                                    //    write4Byte74HC595(&IC74HC595, LED7Seg[88/10], LED7Seg[88%10], LED7Seg[88/10], LED7Seg[88%10]);                    
-     
+                                        if(!ApplyHoldPlan(LampsFromColor(str1, 1) | LampsFromColor(str2, 2))) printf("\nNot applied\n");
                                     }else if(strncmp(dtmp, "!EXIT!", strlen("!EXIT!"))==0){
                                         loop1 = false;
-                                        LEDAllOff();
-                                        isLEDTaskRunning = true;
-	                                    xTaskCreate(&LED_task, "LED task", 1024*4, NULL, 3, &TaskHandler_LED); 
+                                        ApplySavedPlan();
                                     }else{
                                         printf("\nIncorrect command!\n");
                                     }
@@ -452,18 +436,9 @@ static void uart_event_task(void *pvParameters)
                         
 
                     }else if(strncmp(dtmp, "!SLOW!", strlen("!SLOW!"))==0){
+                        loop2 = StartSlowMode();
                         while (loop2){
-                            if(isLEDTaskRunning){
-                                vTaskDelete(TaskHandler_LED);
-                                isLEDTaskRunning = false;
-                            }
-                            gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                            gpio_set_level(LED_YELLOW_PHASE_2, 1);
-                            gpio_set_level(LED_RED_PHASE_1, 0);
-                            gpio_set_level(LED_RED_PHASE_2, 0);
-                            gpio_set_level(LED_GREEN_PHASE_1, 0);
-                            gpio_set_level(LED_GREEN_PHASE_2, 0);                    
-                            if(xQueueReceive(uart0_queue, (void *)&event, (TickType_t)portMAX_DELAY)){
+                            if(UartWait(&event)){
                                 bzero(dtmp, RD_BUF_SIZE);
                                 switch (event.type)
                                 {
@@ -473,19 +448,31 @@ static void uart_event_task(void *pvParameters)
                                     if(strncmp(dtmp, "!EXIT!", strlen("!EXIT!"))==0){
                                         
                                         loop2 = false;
-
-                                        LEDAllOff();
-                                        isLEDTaskRunning = true;
-	                                    xTaskCreate(&LED_task, "LED task", 1024*4, NULL, 3, &TaskHandler_LED);                                            
+                                        StopSlowMode();
                                     }
                                 default: break;
                                 }
                             }                 
                             vTaskDelay(10/portTICK_PERIOD_MS);
                         }
+                    }else if(strncmp(dtmp, "!ACTUATED!", strlen("!ACTUATED!"))==0){
+                        isActuated = !isActuated;
+                        printf("\nActuated mode %s\n", isActuated ? "on" : "off");
+                        ApplySavedPlan();
+                    }else if(strncmp(dtmp, "!ADAPTIVE!", strlen("!ADAPTIVE!"))==0){
+                        if(!isAdaptive) AdaptiveStart();
+                        isAdaptive = !isAdaptive;
+                        printf("\nAdaptive mode %s\n", isAdaptive ? "on" : "off");
+                        if(!isAdaptive) ApplySavedPlan();
+                    }else if(strncmp(dtmp, "!SCHEDULE!", strlen("!SCHEDULE!"))==0){
+                        ScheduleEnable(!ScheduleEnabled());
+                        printf("\nSchedule %s\n", ScheduleEnabled() ? "on" : "off");
+                        ScheduleReport();
+                    }else if(strncmp(dtmp, "!CLOCK=", strlen("!CLOCK="))==0){
+                        if(ScheduleSetClock(strtoll(dtmp + strlen("!CLOCK="), NULL, 10)) == ESP_OK) ScheduleReport();
+                        else printf("\nInvalid time\n");
                     }else if(strncmp(dtmp, "!X!", strlen("!X!"))==0){
-                        uart_exit = true;
-                        // vTaskDelete(TaskHandler_uart);
+                        leave = true;
                     }
                     break;
                 default:
@@ -493,8 +480,10 @@ static void uart_event_task(void *pvParameters)
             }
         }
     }
-    free(dtmp);
-    dtmp = NULL;
+    // gone on purpose: not a task the supervisor must restart
+    SupervisorLeave(CommandWatch);
+    TaskHandler_uart = NULL;
+    PostEvent(EVENT_UART_EXIT);
     vTaskDelete(NULL);
 }
 
@@ -517,6 +506,13 @@ static void Init_Hardware(void)
     gpio_pulldown_dis(BUTTON_UP);
     gpio_pulldown_dis(BUTTON_DOWN);
     gpio_pulldown_dis(BUTTON_ENTER);
+    ESP_ERROR_CHECK(WheelServiceInit());
+    InitButtons();
+    if(BENCHMARK) WheelSelfTest();
+    if(BENCHMARK) WheelBench(4096, esp_timer_get_time);
+    ESP_ERROR_CHECK(DetectorInit(Detectors, sizeof(Detectors)/sizeof(Detectors[0])));
+    if(BENCHMARK) DetSelfTest();
+    if(BENCHMARK) DetBench(1 << 16, esp_timer_get_time);
 
     //Install UART driver, and get the queue.
     uart_driver_install(EX_UART_NUM, BUF_SIZE * 2, BUF_SIZE * 2, 20, &uart0_queue, 0);
@@ -538,6 +534,33 @@ static void Init_Hardware(void)
 	};
 	esp_vfs_spiffs_register(&conf);
 
+    //74HC595 chain on VSPI, bit-banged if the SPI host is not available
+    if(BENCHMARK) Check74HC595BankPack();
+    if(BENCHMARK) Bench74HC595Chain(DATA_PIN_595, LATCH_PIN_595, CLOCK_PIN_595, VSPI_HOST, 1000);
+    if(Init74HC595SPI(&IC74HC595, DATA_PIN_595, LATCH_PIN_595, CLOCK_PIN_595, CHAIN_LEN_595, VSPI_HOST) != ESP_OK){
+        ESP_ERROR_CHECK(Init74HC595(&IC74HC595, DATA_PIN_595, LATCH_PIN_595, CLOCK_PIN_595, CHAIN_LEN_595));
+    }
+    ESP_ERROR_CHECK(SegBrightInit(OE_PIN_595));
+    if(BENCHMARK){
+        SegBrightCheckLatch(&IC74HC595, 1000);
+        SegBrightReport(CHAIN_LEN_595 * 7);
+    }
+    ESP_ERROR_CHECK(SegDisplayInit(&IC74HC595));
+    if(BENCHMARK) SegDisplayStress(4, 2000);
+    if(BENCHMARK) TimingDriftTest(24, 1000);
+    if(BENCHMARK) PlanSelfTest();
+    if(BENCHMARK) CtrlSelfTest();
+    if(BENCHMARK) CtrlCountdownSelfTest();
+    if(BENCHMARK) CtrlBench(CONTROLLER_MAX_INTERSECTIONS, esp_timer_get_time);
+    if(BENCHMARK) OptSelfTest();
+    if(BENCHMARK) OptBench(10000, esp_timer_get_time);
+    if(BENCHMARK) OptSimulate(24);
+    if(BENCHMARK) LampSelfTest(LampPins, PLAN_LAMPS);
+    if(BENCHMARK) MonSelfTest();
+    if(BENCHMARK) SchedSelfTest();
+    if(BENCHMARK) SchedBench(100000, esp_timer_get_time);
+    if(BENCHMARK) SupSelfTest();
+
 
 }
 
@@ -550,37 +573,39 @@ static void screen_task(void *pvParameters)
     int button_state = NOTPRESS;
     bool exit_loop = false;
 	static FontxFile fx16[2];
-    static IC74HC595_t IC74HC595;
-    Init74HC595(&IC74HC595, DATA_PIN_595, LATCH_PIN_595, CLOCK_PIN_595);
-	InitFontx(fx16,"/spiffs/ILGH16XB.FNT",""); // 8x16Dot Gothic
+	InitFontx(fx16,"/spiffs/ILGH16XB.FNT","/spiffs/VNGH16XB.FNT"); // 8x16Dot Gothic, Vietnamese letters from the second font
 	static FontxFile fx24[2];
 	InitFontx(fx24,"/spiffs/ILGH24XB.FNT",""); // 12x24Dot Gothic
+    if(BENCHMARK) BenchFontx(fx16, (const uint8_t*)"Ngã tư Lê Lợi - Trần Phú 12", 100);
 
 	static ST7735_t dev;
 	spi_master_init(&dev, GPIO_MOSI, GPIO_SCLK, GPIO_CS, GPIO_DC, GPIO_RESET);
 	lcdInit(&dev, SCREEN_WIDTH, SCREEN_HEIGHT, OFFSET_X, OFFSET_Y);
-    IntroDisplay(&dev, fx24, SCREEN_WIDTH, SCREEN_HEIGHT);
+    if(BENCHMARK){
+        static FontxFile fx32[2];
+        InitFontx(fx32,"/spiffs/ILGH32XB.FNT",""); // 16x32Dot Gothic
+        lcdBenchFont(&dev, fx16, fx32);
+        CloseFontx(&fx32[0]);
+    }
+    IntroDisplay(&dev, fx24, fx16, SCREEN_WIDTH, SCREEN_HEIGHT);
     
     OptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_1);
 	while (1) {
-        vTaskDelay(pdMS_TO_TICKS(10)); //prevent watchdog timer trigger   
-        if(DetectButton()==BUTTON_DOWN){
+        button_state = WaitEvent();
+        if(button_state == BUTTON_DOWN){
             option_counting_1 = (option_counting_1 < 4) ? option_counting_1 + 1 : 4;
             OptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_1);
-        }else if(DetectButton()==BUTTON_UP){
+        }else if(button_state == BUTTON_UP){
             option_counting_1 = (option_counting_1 > 1) ? option_counting_1 - 1 : 1;
             OptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_1);
-        }else if(DetectButton()==BUTTON_ENTER){
+        }else if(button_state == BUTTON_ENTER){
             switch (option_counting_1){
             case 1:
                 lcdFillScreen(&dev, BLACK);
                 exit_loop = false;
                 while(!exit_loop){
-                    vTaskDelay(pdMS_TO_TICKS(10)); //prevent watchdog timer trigger   
                     SetTimeLightDisplay(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT); 
-                    while((button_state = DetectButton()) == -1){
-                        vTaskDelay(pdMS_TO_TICKS(10)); //prevent watchdog timer trigger   
-                    }
+                    button_state = WaitEvent();
                     if(button_state == BUTTON_ENTER){
                         switch (time_light_chosen){
                             case G1_CHOSEN: time_light_chosen = Y1_CHOSEN; break;
@@ -597,24 +622,11 @@ static void screen_task(void *pvParameters)
                                 G2_save = G2;
                                 Y2_save = Y2;
                                 R2_save = R2;
-                                if(isLEDTaskRunning){
-                                    vTaskDelete(TaskHandler_LED);
-                                    isLEDTaskRunning = false;
-                                }
-                                LEDAllOff();
-                                gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                                gpio_set_level(LED_YELLOW_PHASE_2, 1);
-
+                                ApplySavedPlan();
                                 for(int i = 3; i >= 1; i--){
                                     SavedDisplay(&dev, fx24, SCREEN_WIDTH, SCREEN_HEIGHT, i);
-                                    write4Byte74HC595(&IC74HC595, LED7Seg[i/10], LED7Seg[i%10], LED7Seg[i/10], LED7Seg[i%10]);
-                                    vTaskDelay(pdMS_TO_TICKS(1000));
+                                    ScreenSleep(1000);
                                 }
-                                gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                                gpio_set_level(LED_YELLOW_PHASE_2, 0);
-
-                                isLEDTaskRunning = true;
-	                            xTaskCreate(&LED_task, "LED task", 1024*4, NULL, 3, &TaskHandler_LED);      
                                 lcdFillScreen(&dev, BLACK);
                                 exit_loop = true;
                                 break;
@@ -643,29 +655,27 @@ static void screen_task(void *pvParameters)
                 lcdFillScreen(&dev, BLACK);
                 PHASE1Display(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT);
                 while (1){
-                    vTaskDelay(pdMS_TO_TICKS(10)); //prevent watchdog timer trigger   
-
-                    if(DetectButton() == BUTTON_DOWN){
+                    button_state = WaitEvent();
+                    if(button_state == BUTTON_DOWN){
                         option_counting_2 = (option_counting_2 < 4) ? option_counting_2 + 1 : 4;
                         ManualAdjOptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_2);
-                    }else if(DetectButton() == BUTTON_UP){
+                    }else if(button_state == BUTTON_UP){
                         option_counting_2 = (option_counting_2 > 1) ? option_counting_2 - 1 : 1;
                         ManualAdjOptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_2);
-                    }else if(DetectButton() == BUTTON_ENTER){
+                    }else if(button_state == BUTTON_ENTER){
                         switch (option_counting_2){
                         case 1:
                             lcdFillScreen(&dev, BLACK);
                             SubRED1Display(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT);
                             while (1){
-                                vTaskDelay(pdMS_TO_TICKS(10)); //prevent watchdog timer trigger   
-
-                                if(DetectButton() == BUTTON_DOWN){
+                                button_state = WaitEvent();
+                                if(button_state == BUTTON_DOWN){
                                     option_counting_3 = (option_counting_3 < 4) ? option_counting_3 + 1 : 4;
                                     SubManualAdjOptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_3);
-                                }else if(DetectButton() == BUTTON_UP){
+                                }else if(button_state == BUTTON_UP){
                                     option_counting_3 = (option_counting_3 > 1) ? option_counting_3 - 1 : 1;
                                     SubManualAdjOptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_3);
-                                }else if(DetectButton() == BUTTON_ENTER){
+                                }else if(button_state == BUTTON_ENTER){
                                     switch(option_counting_3){
                                         case 1:
                                             isRED1on = !isRED1on;
@@ -710,15 +720,14 @@ static void screen_task(void *pvParameters)
                             lcdFillScreen(&dev, BLACK);
                             SubRED2Display(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT);
                             while (1){
-                                vTaskDelay(pdMS_TO_TICKS(10)); //prevent watchdog timer trigger   
-
-                                if(DetectButton() == BUTTON_DOWN){
+                                button_state = WaitEvent();
+                                if(button_state == BUTTON_DOWN){
                                     option_counting_3 = (option_counting_3 < 4) ? option_counting_3 + 1 : 4;
                                     Sub2ManualAdjOptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_3);
-                                }else if(DetectButton() == BUTTON_UP){
+                                }else if(button_state == BUTTON_UP){
                                     option_counting_3 = (option_counting_3 > 1) ? option_counting_3 - 1 : 1;
                                     Sub2ManualAdjOptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_3);
-                                }else if(DetectButton() == BUTTON_ENTER){
+                                }else if(button_state == BUTTON_ENTER){
                                     switch(option_counting_3){
                                         case 1:
                                             isRED2on = !isRED2on;
@@ -761,70 +770,26 @@ static void screen_task(void *pvParameters)
                             break;
                         case 3:
                             //save and apply manual adjust
-                            if(isLEDTaskRunning){
-                                vTaskDelete(TaskHandler_LED);
-                                isLEDTaskRunning = false;
-                            }
-                            LEDAllOff();
-                            gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                            gpio_set_level(LED_YELLOW_PHASE_2, 1);
-                            for(int i = 3; i >= 1; i--){
-                                    SavedDisplay(&dev, fx24, SCREEN_WIDTH, SCREEN_HEIGHT, i);
-                                    write4Byte74HC595(&IC74HC595, LED7Seg[i/10], LED7Seg[i%10], LED7Seg[i/10], LED7Seg[i%10]);
-                                    vTaskDelay(pdMS_TO_TICKS(1000));
-                            }
-                            gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                            gpio_set_level(LED_YELLOW_PHASE_2, 0);
-                            write4Byte74HC595(&IC74HC595, LED7Seg[88/10], LED7Seg[88%10], LED7Seg[88/10], LED7Seg[88%10]);
-                            if(isRED1on){
-                                gpio_set_level(LED_RED_PHASE_1, 1);
-                                gpio_set_level(LED_GREEN_PHASE_1, 0);
-                                gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                            }else if(isGREEN1on){
-                                gpio_set_level(LED_RED_PHASE_1, 0);
-                                gpio_set_level(LED_GREEN_PHASE_1, 1);
-                                gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                            }else if(isYELLOW1on){
-                                gpio_set_level(LED_RED_PHASE_1, 0);
-                                gpio_set_level(LED_GREEN_PHASE_1, 0);
-                                gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                            }
-
-                            if(isRED2on){
-                                gpio_set_level(LED_RED_PHASE_2, 1);
-                                gpio_set_level(LED_GREEN_PHASE_2, 0);
-                                gpio_set_level(LED_YELLOW_PHASE_2, 0);
-                            }else if(isGREEN2on){
-                                gpio_set_level(LED_RED_PHASE_2, 0);
-                                gpio_set_level(LED_GREEN_PHASE_2, 1);
-                                gpio_set_level(LED_YELLOW_PHASE_2, 0);
-                            }else if(isYELLOW2on){
-                                gpio_set_level(LED_RED_PHASE_2, 0);
-                                gpio_set_level(LED_GREEN_PHASE_2, 0);
-                                gpio_set_level(LED_YELLOW_PHASE_2, 1);
+                            if(ApplyHoldPlan((isRED1on ? PLAN_RED1 : 0) | (isGREEN1on ? PLAN_GREEN1 : 0) | (isYELLOW1on ? PLAN_YELLOW1 : 0) |
+                                             (isRED2on ? PLAN_RED2 : 0) | (isGREEN2on ? PLAN_GREEN2 : 0) | (isYELLOW2on ? PLAN_YELLOW2 : 0))){
+                                for(int i = 3; i >= 1; i--){
+                                        SavedDisplay(&dev, fx24, SCREEN_WIDTH, SCREEN_HEIGHT, i);
+                                        ScreenSleep(1000);
+                                }
+                            }else{
+                                ConflictDisplay(&dev, fx24, SCREEN_WIDTH, SCREEN_HEIGHT);
+                                ScreenSleep(2000);
                             }
                             lcdFillScreen(&dev, BLACK);
                             ManualAdjOptionSelect(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT, option_counting_2);
                             
                             break;
                         case 4:
-                            if(isLEDTaskRunning){
-                                vTaskDelete(TaskHandler_LED);
-                                isLEDTaskRunning = false;
-                            }
-                            LEDAllOff();
-                            gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                            gpio_set_level(LED_YELLOW_PHASE_2, 1);
+                            ApplySavedPlan();
                             for(int i = 3; i >= 1; i--){
                                     SavedDisplay(&dev, fx24, SCREEN_WIDTH, SCREEN_HEIGHT, i);
-                                    write4Byte74HC595(&IC74HC595, LED7Seg[i/10], LED7Seg[i%10], LED7Seg[i/10], LED7Seg[i%10]);
-                                    vTaskDelay(pdMS_TO_TICKS(1000));
+                                    ScreenSleep(1000);
                             }
-                            gpio_set_level(LED_YELLOW_PHASE_1, 0);
-                            gpio_set_level(LED_YELLOW_PHASE_2, 0);
-                            
-                            isLEDTaskRunning = true;
-	                        xTaskCreate(&LED_task, "LED task", 1024*4, NULL, 3, &TaskHandler_LED);      
 
                             // lcdFillScreen(&dev, BLACK);
                             break;
@@ -843,24 +808,9 @@ static void screen_task(void *pvParameters)
             case 3:
                 lcdFillScreen(&dev, BLACK);
                 SlowModeDisplay(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT);
-                while (1){
-                    gpio_set_level(LED_YELLOW_PHASE_1, 1);
-                    gpio_set_level(LED_YELLOW_PHASE_2, 1);
-                    gpio_set_level(LED_RED_PHASE_1, 0);
-                    gpio_set_level(LED_RED_PHASE_2, 0);
-                    gpio_set_level(LED_GREEN_PHASE_1, 0);
-                    gpio_set_level(LED_GREEN_PHASE_2, 0);                    
-                    write4Byte74HC595(&IC74HC595, LED7Seg[88/10], LED7Seg[88%10], LED7Seg[88/10], LED7Seg[88%10]);                    
-                    if(DetectButton() == BUTTON_ENTER) {
-                        if(isLEDTaskRunning){
-                            vTaskDelete(TaskHandler_LED);
-                            isLEDTaskRunning = false;
-                        }
-                        LEDAllOff();
-                        isLEDTaskRunning = true;
-	                    xTaskCreate(&LED_task, "LED task", 1024*4, NULL, 3, &TaskHandler_LED);          
-                        break;                
-                    }
+                if(StartSlowMode()){
+                    while(WaitEvent() != BUTTON_ENTER);
+                    StopSlowMode();
                 }
 
                 //handler
@@ -869,12 +819,11 @@ static void screen_task(void *pvParameters)
             case 4: //terminal
                 lcdFillScreen(&dev, BLACK);
                 TerminalModeDisplay(&dev, fx16, SCREEN_WIDTH, SCREEN_HEIGHT);
-                xTaskCreate(&uart_event_task, "UART Task", 4096, NULL, 2, &TaskHandler_uart);
-                
-                while(1){
-                    vTaskDelay(10/portTICK_PERIOD_MS);
-                    if(uart_exit) break;
-                }   
+                if(xTaskCreate(&uart_event_task, "UART Task", 4096, NULL, 2, &TaskHandler_uart) == pdPASS){
+                    while(WaitEvent() != EVENT_UART_EXIT);
+                }else{
+                    printf("No memory for the UART task\n");
+                }
                 lcdFillScreen(&dev, BLACK);
                 break;
             default:
@@ -886,7 +835,7 @@ static void screen_task(void *pvParameters)
     }
 }
 
-static void IntroDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height)
+static void IntroDisplay(ST7735_t * const dev, const FontxFile * const fx, const FontxFile * const fxName, const int width, const int height)
 {
     const uint16_t colors[] = {WHITE, WHITE, WHITE};
     const char *strings[] = {"Traffic", "Light", "Control"};
@@ -899,12 +848,13 @@ static void IntroDisplay(ST7735_t * const dev, const FontxFile * const fx, const
     for (int i = 0; i < 3; i++) {
         lcdDrawString(dev, fx, x[i], y[i], (uint8_t*)strings[i], colors[i]);
     }
-    vTaskDelay(1000/portTICK_PERIOD_MS);    
+    lcdDrawUTF8String(dev, fxName, 25, 132, (uint8_t*)INTERSECTION_NAME, YELLOW);
+    ScreenSleep(1000);
     lcdFillScreen(dev, BLACK);
     const char *str[] = {"Start in: 3", "Start in: 2", "Start in: 1"};
     for(int i = 0; i < 3 ; i++){
         lcdDrawString(dev, fx, 70, 150, (uint8_t*)str[i], colors[i]);
-        vTaskDelay(500/portTICK_PERIOD_MS);    
+        ScreenSleep(500);
         lcdFillScreen(dev, BLACK);
     }
 }
@@ -933,6 +883,13 @@ static void SavedDisplay(ST7735_t * const dev, const FontxFile * const fx, const
     
 }
 
+static void ConflictDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height)
+{
+    lcdSetFontDirection(dev, DIRECTION270);
+    lcdFillScreen(dev, BLACK);
+    lcdDrawString(dev, fx, 75, 130, (uint8_t*)"CONFLICT", RED);
+}
+
 static void Option1Display(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height) 
 {
     lcdSetFontDirection(dev, DIRECTION270);
@@ -1669,28 +1626,332 @@ static void SetTimeLightDisplay(ST7735_t * const dev, const FontxFile * const fx
         break;
     }
 }
-static int DetectButton()
+typedef struct {
+    gpio_num_t pin;
+    WheelTimer_t timer;         // debounce, then repeat while held
+    volatile bool edge;
+    bool pressed;
+}Button_t;
+
+static Button_t Buttons[] = {{.pin = BUTTON_ENTER}, {.pin = BUTTON_DOWN}, {.pin = BUTTON_UP}};
+static WheelTimer_t ScreenTimer;
+
+static void ButtonISR(void *arg)
 {
-    gpio_num_t buttons[] = {BUTTON_ENTER, BUTTON_DOWN, BUTTON_UP};
-    int button_count = sizeof(buttons)/sizeof(gpio_num_t);
-    for(int i = 0; i < button_count; i ++){
-        if(gpio_get_level(buttons[i])==0){
-            vTaskDelay(DEBOUNCE/portTICK_PERIOD_MS);
-            if(gpio_get_level(buttons[i])==0){
-                return buttons[i];
-            }
+    Button_t *button = arg;
+
+    button->edge = true;
+    WheelStartFromISR(&button->timer, DEBOUNCE);
+}
+
+/*
+ * Runs on the wheel DEBOUNCE ms after the last edge, or REPEAT ms after the last press event
+ */
+static void ButtonTimer(void *arg)
+{
+    Button_t *button = arg;
+    bool down = gpio_get_level(button->pin) == 0;
+
+    if(button->edge){
+        button->edge = false;
+        if(!down){
+            button->pressed = false;
+            return;
+        }
+        if(button->pressed) return;     // bounce while held, keep repeating
+        button->pressed = true;
+        PostEvent(button->pin);
+        WheelStart(&button->timer, REPEAT_DELAY);
+    }else if(button->pressed && down){
+        PostEvent(button->pin);
+        WheelStart(&button->timer, REPEAT);
+    }
+}
+
+static void ScreenTimeout(void *arg)
+{
+    PostEvent(EVENT_TIMEOUT);
+}
+
+/*
+ * Runs on the wheel at each minute of the local time: the digits follow the
+ * day/night brightness curve, at full brightness until the clock is set
+ */
+static void BrightMinute(void *arg)
+{
+    time_t now = time(NULL);
+    struct tm local;
+
+    localtime_r(&now, &local);
+    WheelStart(&BrightTimer, (60 - local.tm_sec) * 1000);
+    if(ScheduleClockSet()) SegBrightApplyMinute(local.tm_hour * 60 + local.tm_min, BRIGHT_FADE_MS);
+}
+
+/*
+ * Buttons are interrupts debounced on the timer wheel, the screen task sleeps until an event
+ */
+static void InitButtons(void)
+{
+    screen_queue = xQueueCreate(16, sizeof(int));
+    WheelTimerInit(&ScreenTimer, ScreenTimeout, NULL);
+    gpio_install_isr_service(0);
+    for(int i = 0; i < sizeof(Buttons)/sizeof(Buttons[0]); i++){
+        WheelTimerInit(&Buttons[i].timer, ButtonTimer, &Buttons[i]);
+        gpio_set_intr_type(Buttons[i].pin, GPIO_INTR_ANYEDGE);
+        gpio_isr_handler_add(Buttons[i].pin, ButtonISR, &Buttons[i]);
+    }
+}
+
+static void PostEvent(int event)
+{
+    xQueueSend(screen_queue, &event, 0);
+}
+
+/*
+ * Next screen event: a BUTTON_* pin, EVENT_TIMEOUT or EVENT_UART_EXIT
+ */
+static int WaitEvent(void)
+{
+    int event = NOTPRESS;
+
+    xQueueReceive(screen_queue, &event, portMAX_DELAY);
+    return event;
+}
+
+/*
+ * Sleep on the timer wheel, presses meanwhile are dropped
+ */
+static void ScreenSleep(uint32_t ms)
+{
+    WheelStart(&ScreenTimer, ms);
+    while(WaitEvent() != EVENT_TIMEOUT);
+}
+
+static int ActuatedMin(int green)
+{
+    return green < ACTUATED_MIN_GREEN ? green : ACTUATED_MIN_GREEN;
+}
+
+static int ActuatedMax(int green)
+{
+    return green * ACTUATED_MAX_FACTOR > 99 ? 99 : green * ACTUATED_MAX_FACTOR;
+}
+
+/*
+ * Plan of the saved timings: fixed, or in actuated mode greens from
+ * ACTUATED_MIN_GREEN up to ACTUATED_MAX_FACTOR times the saved ones,
+ * extended by the detector calls
+ */
+static bool SavedPlan(Plan_t *plan)
+{
+    if(!isActuated) return PlanTwoPhase(plan, G1_save, Y1_save, G2_save, Y2_save);
+    return PlanTwoPhaseActuated(plan, ActuatedMin(G1_save), ActuatedMax(G1_save), Y1_save,
+        ActuatedMin(G2_save), ActuatedMax(G2_save), Y2_save, ACTUATED_PASSAGE);
+}
+
+/*
+ * Run the saved timings. A timing-only change is a transition of the running
+ * plan, or committed hitless at the end of the running step when a green
+ * turns actuated or fixed; anything else (leaving manual or slow mode) after
+ * the all-yellow clearance.
+ */
+static void ApplySavedPlan(void)
+{
+    Plan_t plan;
+
+    if(!SavedPlan(&plan)){
+        printf("Invalid timings, plan not applied\n");
+        return;
+    }
+    xSemaphoreTake(ModeLock, portMAX_DELAY);
+    isHolding = false;
+    if(ControllerApply(Intersection, &plan, CTRL_TRANSITION) != ESP_OK && ControllerApply(Intersection, &plan, CTRL_AT_STEP_END) != ESP_OK){
+        ControllerApply(Intersection, &plan, CTRL_NOW);
+    }
+    xSemaphoreGive(ModeLock);
+}
+
+/*
+ * Hold fixed lamps with 88 on the countdowns after the all-yellow clearance,
+ * false if the lamps conflict or the controller refused the plan. A conflict
+ * would trip the monitor into flashing red until a reboot.
+ */
+static bool ApplyHoldPlan(uint8_t lamps)
+{
+    Plan_t plan;
+    bool staged;
+
+    if(PlanConflict(lamps)){
+        printf("Conflicting lamps 0x%02x: both phases would move\n", lamps);
+        return false;
+    }
+    PlanHold(&plan, lamps);
+    xSemaphoreTake(ModeLock, portMAX_DELAY);
+    isHolding = true;
+    staged = ControllerApply(Intersection, &plan, CTRL_NOW) == ESP_OK;
+    xSemaphoreGive(ModeLock);
+    return staged;
+}
+
+/*
+ * Start the optimizer over from the saved timings, at the next cycle end
+ */
+static void AdaptiveStart(void)
+{
+    OptimizerReset = true;
+}
+
+/*
+ * Cycle end of the board's intersection, on the timing core: the detector
+ * counts of the cycle go to the optimizer, and in adaptive mode its new
+ * greens are staged for the end of the next cycle. Sampled in every mode,
+ * so the first adaptive cycle counts from its start. The mode is checked
+ * and the plan staged under ModeLock, never waited for: while the UI holds
+ * it, the plan the UI stages wins and the optimizer starts over.
+ */
+static void AdaptiveCycle(uint32_t cycle_s)
+{
+    DetStats_t stats[DET_APPROACHES];
+    uint16_t arrivals[OPT_PHASES];
+    Plan_t plan;
+
+    DetectorSample(stats);
+    if(xSemaphoreTake(ModeLock, 0) != pdTRUE){
+        OptimizerReset = true;
+        return;
+    }
+    if(!isAdaptive || isActuated || isHolding){
+        xSemaphoreGive(ModeLock);
+        return;
+    }
+    if(OptimizerReset){
+        OptConfig_t config;
+
+        OptimizerReset = false;
+        OptDefaults(&config, Y1_save, Y2_save);
+        OptInit(&Optimizer, &config, G1_save, G2_save);
+    }
+    for(int a = 0; a < OPT_PHASES; a++) arrivals[a] = stats[a].count;
+    OptAddCycle(&Optimizer, arrivals, cycle_s);
+    if(OptEvaluate(&Optimizer) && OptPlan(&Optimizer, &plan)){
+        ControllerApply(Intersection, &plan, CTRL_AT_CYCLE_END);
+    }
+    xSemaphoreGive(ModeLock);
+}
+
+/*
+ * The week of the board: morning and evening peaks on workdays, a shorter
+ * cycle at night
+ */
+static bool BuildSchedule(Sched_t *sched)
+{
+    int night, day, morning, evening, late;
+
+    SchedInit(sched);
+    night = SchedTiming(sched, 8, 4, 6, 4);
+    day = SchedTiming(sched, 10, 5, 8, 4);
+    morning = SchedTiming(sched, 20, 5, 10, 4);
+    evening = SchedTiming(sched, 10, 5, 20, 4);
+    late = SchedTiming(sched, 12, 5, 10, 4);
+    return SchedAdd(sched, SCHED_ALL_DAYS, 0, 0, night) &&
+        SchedAdd(sched, SCHED_WORKDAYS, 6, 0, morning) &&
+        SchedAdd(sched, SCHED_WORKDAYS, 9, 0, day) &&
+        SchedAdd(sched, SCHED_WORKDAYS, 16, 0, evening) &&
+        SchedAdd(sched, SCHED_WORKDAYS, 19, 0, late) &&
+        SchedAdd(sched, SCHED_WEEKEND, 8, 0, day) &&
+        SchedAdd(sched, SCHED_ALL_DAYS, 22, 0, night) &&
+        SchedCompile(sched);
+}
+
+/*
+ * A schedule change, from the wheel task: it becomes the saved timing, run
+ * at once unless the lamps are held by hand or flashing
+ */
+static void ScheduleApply(const SchedTiming_t *timing)
+{
+    G1_save = G1 = timing->G1;
+    Y1_save = Y1 = timing->Y1;
+    G2_save = G2 = timing->G2;
+    Y2_save = Y2 = timing->Y2;
+    R1_save = R1 = G2 + Y2;
+    R2_save = R2 = G1 + Y1;
+    // the optimizer starts over from the timings of the new time of day
+    if(isAdaptive) AdaptiveStart();
+    if(!isHolding) ApplySavedPlan();
+}
+
+/*
+ * Flashing operation: the controller holds every lamp dark after its
+ * clearance, then LEDC blinks SLOW_FLASH_LAMPS with no task involved.
+ * False, and the saved plan running again, if it cannot start.
+ */
+static bool StartSlowMode(void)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    if(isInSlowMode) return true;
+    if(!ApplyHoldPlan(0)){
+        printf("Slow mode refused by the controller\n");
+        ApplySavedPlan();
+        return false;
+    }
+    // never left dark: back to the saved plan if the lamps do not go out in time
+    while(ControllerLamps(Intersection) != 0){
+        if(xTaskGetTickCount() - start >= pdMS_TO_TICKS(SLOW_DARK_WAIT_MS)){
+            printf("Lamps still lit, slow mode not started\n");
+            ApplySavedPlan();
+            return false;
         }
+        vTaskDelay(1);
+    }
+    if(LampFlashStart(LampPins, SLOW_FLASH_LAMPS) != ESP_OK){
+        printf("Flashing not available, slow mode not started\n");
+        ApplySavedPlan();
+        return false;
+    }
+    isInSlowMode = true;
+    return true;
+}
+
+/*
+ * Back to cycling in phase with the flash: the flashing lamps stay lit
+ * from the start of a flash into the clearance of the saved plan
+ */
+static void StopSlowMode(void)
+{
+    LampFlashStop();
+    isInSlowMode = false;
+    ApplySavedPlan();
+}
+
+/*
+ * Core load of the slow mode, 5 s each: the yellows held by the controller
+ * as before, then flashing on LEDC
+ */
+static void SlowModeBench(void)
+{
+    uint32_t held[portNUM_PROCESSORS], flashing[portNUM_PROCESSORS];
+
+    ApplyHoldPlan(PLAN_YELLOW1 | PLAN_YELLOW2);
+    TimingCpuLoad(5000, held);
+    StartSlowMode();
+    TimingCpuLoad(5000, flashing);
+    StopSlowMode();
+    for(int core = 0; core < portNUM_PROCESSORS; core++){
+        printf("[SlowModeBench] core %d: held yellows %"PRIu32".%"PRIu32"%%, flashing on LEDC %"PRIu32".%"PRIu32"%%\n",
+            core, held[core] / 10, held[core] % 10, flashing[core] / 10, flashing[core] % 10);
     }
-    return NOTPRESS; //not press
 }
-static void  LEDAllOff()
+
+/*
+ * Lamp bit of a color name for phase 1 or 2, 0 if unknown
+ */
+static uint8_t LampsFromColor(const char *color, int phase)
 {
-    gpio_set_level(LED_RED_PHASE_1, 0);
-    gpio_set_level(LED_RED_PHASE_2, 0);
-    gpio_set_level(LED_GREEN_PHASE_1, 0);
-    gpio_set_level(LED_GREEN_PHASE_2, 0);
-    gpio_set_level(LED_YELLOW_PHASE_1, 0);
-    gpio_set_level(LED_YELLOW_PHASE_2, 0);
+    if(strncmp(color, "GREEN", strlen("GREEN"))==0) return phase == 1 ? PLAN_GREEN1 : PLAN_GREEN2;
+    if(strncmp(color, "YELLOW", strlen("YELLOW"))==0) return phase == 1 ? PLAN_YELLOW1 : PLAN_YELLOW2;
+    if(strncmp(color, "RED", strlen("RED"))==0) return phase == 1 ? PLAN_RED1 : PLAN_RED2;
+    return 0;
 }
 
 static void SlowModeDisplay(ST7735_t * const dev, const FontxFile * const fx, const int width, const int height)
@@ -1802,3 +2063,38 @@ int scanAdjStr(char* str, int len, char* str1, char* str2)
     return 0;
 }
 
+/*
+ * Next UART event of the command task, beating the supervisor while it waits
+ */
+static bool UartWait(uart_event_t *event)
+{
+    while(!xQueueReceive(uart0_queue, (void *)event, pdMS_TO_TICKS(COMMAND_HEARTBEAT_MS / 4))){
+        SupervisorBeat(CommandWatch);
+    }
+    SupervisorBeat(CommandWatch);
+    return true;
+}
+
+/*
+ * Supervisor restart of a UART task that stopped beating
+ */
+static esp_err_t RestartCommandTask(void)
+{
+    TaskHandle_t stopped = TaskHandler_uart;
+
+    TaskHandler_uart = NULL;
+    if(stopped) vTaskDelete(stopped);
+    if(xTaskCreate(&uart_event_task, "UART Task", 4096, NULL, 2, &TaskHandler_uart) != pdPASS) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+/*
+ * Supervisor fallback, the timing core stopped: both approaches flashing
+ * yellow from the LEDC until the reboot, unless the conflict monitor's
+ * flashing red holds the lamps already
+ */
+static void FallbackLamps(void)
+{
+    if(MonitorTripped()) return;
+    if(LampFallback(LampPins, PLAN_LAMPS, PLAN_YELLOW1 | PLAN_YELLOW2) != ESP_OK) printf("Fallback flashing not available, lamps dark\n");
+}
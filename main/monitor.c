@@ -0,0 +1,362 @@
+/*
+ * monitor.c
+ *
+ *  Conflict monitor: samples the lamp output register independently of the
+ *  controller and forces flashing red on a conflict.
+ *
+ *  A general purpose timer interrupts the second core every MON_PERIOD_US.
+ *  The handler reads the GPIO output registers back, decodes the lamps and
+ *  looks the state up in a compatibility table built from PlanConflict. It
+ *  trusts nothing of the controller: not its plan, not its lamp state, only
+ *  what the pins are driven to. On an incompatible state it latches the
+ *  trip, freezes LampWrite and from then on writes the flashing red itself
+ *  on every sample, so a writer still running elsewhere is overridden
+ *  within one period. The detection latency is bounded by one period plus
+ *  the interrupt entry; MonitorFaultTest measures it on the board.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "monitor.h"
+#include "selftest.h"
+#include "plan.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gptimer.h"
+#include "soc/gpio_struct.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_private/esp_clk.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#endif
+
+/**
+ * Build the compatibility table and the flashing red outputs
+ *
+ * @param   mon                       monitor core
+ * @param   pins                      GPIO of lamp bit 0, 1, ... in PLAN_* order
+ * @param   count                     number of lamps, up to LAMP_MAX
+ */
+void MonInit(Mon_t *mon, const int *pins, int count)
+{
+    static Lamp_t lamp;
+
+    memset(mon, 0, sizeof(Mon_t));
+    if(count > LAMP_MAX) count = LAMP_MAX;
+    mon->count = count;
+    for(int b = 0; b < count; b++) mon->pin[b] = 1ULL << pins[b];
+    for(int state = 0; state < LAMP_STATES; state++) mon->compatible[state] = !PlanConflict(state);
+    LampCompile(&lamp, pins, count);
+    mon->flash[0] = lamp.masks[0];
+    mon->flash[1] = lamp.masks[PLAN_RED1 | PLAN_RED2];
+}
+
+/**
+ * Lamps driven by an output register value, GPIO 0-63
+ */
+uint8_t MonLamps(const Mon_t *mon, uint64_t out)
+{
+    uint8_t lamps = 0;
+
+    for(int b = 0; b < mon->count; b++){
+        if(out & mon->pin[b]) lamps |= 1 << b;
+    }
+    return lamps;
+}
+
+/**
+ * Check one sample of the output register
+ *
+ * @return  true if tripped, by this sample or an earlier one: write MonFlash
+ */
+bool MonSample(Mon_t *mon, uint64_t out)
+{
+    uint8_t lamps;
+
+    mon->samples++;
+    if(mon->tripped) return true;
+    lamps = MonLamps(mon, out);
+    if(mon->compatible[lamps]) return false;
+    mon->tripped = true;
+    mon->trip_lamps = lamps;
+    mon->trip_sample = mon->samples;
+    mon->trips++;
+    return true;
+}
+
+/**
+ * Outputs to force after a trip: reds lit from the trip, then dark, every MON_FLASH_SAMPLES
+ */
+const LampMasks_t *MonFlash(const Mon_t *mon)
+{
+    return &mon->flash[((mon->samples - mon->trip_sample) / MON_FLASH_SAMPLES + 1) & 1];
+}
+
+/**
+ * Clear the trip, only for tests: a real trip stays until the board restarts
+ */
+void MonReset(Mon_t *mon)
+{
+    mon->tripped = false;
+}
+
+/*
+ * Output register after a write of masks m: clear, then set
+ */
+static uint64_t Write(uint64_t out, const LampMasks_t *m)
+{
+    out &= ~((uint64_t)m->w1tc_hi << 32 | m->w1tc);
+    return out | (uint64_t)m->w1ts_hi << 32 | m->w1ts;
+}
+
+/**
+ * Check the table against the lamps of the plans and inject conflicts in
+ * virtual time. Every lamp state the two phase plans show, and the state
+ * between the clear and the set store of every change, must pass. A plan
+ * then runs on a model of the output register sampled every MON_PERIOD_US
+ * from a random phase; at a random microsecond both greens are forced on.
+ * The trip must come within one period, after which the outputs may only
+ * show the flashing red, and nothing may trip before the fault.
+ *
+ * @return  true if all passed
+ */
+bool MonSelfTest(void)
+{
+    static const int pins[PLAN_LAMPS] = {0, 2, 4, 27, 26, 33};    // one lamp on the high register
+    static Lamp_t lamp;
+    static Mon_t mon;
+    uint32_t seed = 0x3c7, hist[MON_LATENCY_BINS + 1] = {0}, latency_max = 0, errors = 0, faults = 0;
+    Plan_t plans[3];
+
+    MonInit(&mon, pins, PLAN_LAMPS);
+    LampCompile(&lamp, pins, PLAN_LAMPS);
+    PlanTwoPhase(&plans[0], 10, 5, 8, 4);
+    PlanTwoPhaseActuated(&plans[1], 5, 20, 3, 5, 20, 3, 25);
+    PlanTwoPhase(&plans[2], 1, 1, 1, 1);
+    for(int p = 0; p < 3; p++){
+        for(int s = 0; s < plans[p].steps; s++){
+            uint8_t from = plans[p].step[s].lamps, to = plans[p].step[(s + 1) % plans[p].steps].lamps;
+            if(!mon.compatible[from] || !mon.compatible[from & to]) errors++;
+        }
+    }
+    if(mon.compatible[PLAN_GREEN1 | PLAN_GREEN2 | PLAN_RED1] || mon.compatible[PLAN_GREEN1 | PLAN_YELLOW2]) errors++;
+
+    for(int trial = 0; trial < 1000; trial++){
+        const Plan_t *plan = &plans[trial % 3];
+        uint32_t sample_us = SelfTestRandom(&seed) % MON_PERIOD_US, fault_us = 1000000 + (SelfTestRandom(&seed) << 8 | SelfTestRandom(&seed) % 256) % 60000000;
+        uint32_t step = 0, next_us = 0, trip_us = 0, lit = 0;
+        uint64_t out = SelfTestRandom(&seed) | (uint64_t)SelfTestRandom(&seed) << 40;    // unrelated outputs at random
+        bool injected = false;
+
+        MonInit(&mon, pins, PLAN_LAMPS);
+        for(uint32_t now = sample_us; now < fault_us + 5 * MON_FLASH_SAMPLES * MON_PERIOD_US; now += MON_PERIOD_US){
+            // the controller's writes up to this sample, frozen after the trip like LampWrite
+            for(; next_us <= now; step = (step + 1) % plan->steps){
+                if(!mon.tripped) out = Write(out, &lamp.masks[plan->step[step].lamps]);
+                next_us += 1000000 * plan->step[step].duration;
+            }
+            // a stuck driver: both greens stay on from fault_us
+            if(fault_us <= now && !mon.tripped){
+                out |= mon.pin[2] | mon.pin[5];
+                injected = true;
+            }
+            if(!MonSample(&mon, out)) continue;
+            if(!injected) errors++;
+            if(trip_us == 0){
+                uint32_t latency = now - fault_us;
+
+                trip_us = now;
+                if(latency > MON_PERIOD_US) errors++;
+                if(latency > latency_max) latency_max = latency;
+                hist[latency * MON_LATENCY_BINS / MON_PERIOD_US]++;
+                faults++;
+            }
+            out = Write(out, MonFlash(&mon));
+            if(MonLamps(&mon, out) & ~(PLAN_RED1 | PLAN_RED2)) errors++;
+            if(MonLamps(&mon, out)) lit++;
+        }
+        // reds lit half of the time since the trip
+        if(trip_us == 0 || lit < 2 * MON_FLASH_SAMPLES || lit > 3 * MON_FLASH_SAMPLES) errors++;
+    }
+
+    printf("[MonSelfTest] %s, %"PRIu32" faults injected, detection latency max %"PRIu32"us, by %dus:",
+        errors ? "FAIL" : "ok", faults, latency_max, MON_PERIOD_US / MON_LATENCY_BINS);
+    for(int b = 0; b < MON_LATENCY_BINS; b++) printf(" %"PRIu32, hist[b]);
+    printf(", %"PRIu32" errors\n", errors);
+    return errors == 0;
+}
+
+#ifdef ESP_PLATFORM
+
+#define TAG "MONITOR"
+#define MON_CORE                (portNUM_PROCESSORS - 1)
+#define MON_ISR_SLACK_US        100     // interrupt entry on top of the sample period
+
+static Mon_t monitor;
+static portMUX_TYPE mon_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t monitor_task;
+static volatile int64_t trip_us;
+static uint64_t isr_cycles;
+static uint32_t isr_max_cycles;
+static int64_t start_us;
+
+/*
+ * Sample of the output registers on the monitor core. Once tripped the
+ * flashing red is written on every sample, whoever wrote the lamps since.
+ */
+static bool IRAM_ATTR MonitorAlarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg)
+{
+    esp_cpu_cycle_count_t start = esp_cpu_get_cycle_count();
+    uint64_t out = (uint64_t)GPIO.out1.val << 32 | GPIO.out;
+    BaseType_t woken = pdFALSE;
+    uint32_t cycles;
+
+    portENTER_CRITICAL_ISR(&mon_lock);
+    if(MonSample(&monitor, out)){
+        const LampMasks_t *m = MonFlash(&monitor);
+
+        if(monitor.trip_sample == monitor.samples){
+            LampFreeze(true);
+            trip_us = esp_timer_get_time();
+            vTaskNotifyGiveFromISR(monitor_task, &woken);
+        }
+        GPIO.out_w1tc = m->w1tc;
+        GPIO.out1_w1tc.val = m->w1tc_hi;
+        GPIO.out_w1ts = m->w1ts;
+        GPIO.out1_w1ts.val = m->w1ts_hi;
+    }
+    portEXIT_CRITICAL_ISR(&mon_lock);
+    cycles = esp_cpu_get_cycle_count() - start;
+    isr_cycles += cycles;
+    if(cycles > isr_max_cycles) isr_max_cycles = cycles;
+    return woken == pdTRUE;
+}
+
+/*
+ * Owns the sample timer, so its interrupt is allocated on this core, and
+ * logs the trips
+ */
+static void MonitorTask(void *pvParameters)
+{
+    TaskHandle_t caller = pvParameters;
+    gptimer_handle_t timer = NULL;
+    gptimer_config_t config = {.clk_src = GPTIMER_CLK_SRC_DEFAULT, .direction = GPTIMER_COUNT_UP, .resolution_hz = 1000000};
+    gptimer_event_callbacks_t callbacks = {.on_alarm = MonitorAlarm};
+    gptimer_alarm_config_t alarm = {.alarm_count = MON_PERIOD_US, .flags.auto_reload_on_alarm = true};
+    esp_err_t ret;
+
+    ret = gptimer_new_timer(&config, &timer);
+    if(ret == ESP_OK) ret = gptimer_register_event_callbacks(timer, &callbacks, NULL);
+    if(ret == ESP_OK) ret = gptimer_set_alarm_action(timer, &alarm);
+    if(ret == ESP_OK) ret = gptimer_enable(timer);
+    if(ret == ESP_OK){
+        start_us = esp_timer_get_time();
+        ret = gptimer_start(timer);
+    }
+    xTaskNotify(caller, ret, eSetValueWithOverwrite);
+    if(ret != ESP_OK) vTaskDelete(NULL);
+
+    while(1){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ESP_LOGE(TAG, "conflict: lamps 0x%02x on the outputs at sample %"PRIu32", flashing red", monitor.trip_lamps, monitor.trip_sample);
+    }
+}
+
+/**
+ * Start the monitor on the last core at the highest priority. The lamp pins
+ * must already be outputs; the monitor only reads them until a trip.
+ *
+ * @param   pins                      GPIO of lamp bit 0, 1, ... in PLAN_* order
+ * @param   count                     number of lamps
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the task cannot be created
+ *          - the gptimer error       if no timer is free
+ */
+esp_err_t MonitorInit(const int *pins, int count)
+{
+    uint32_t ret;
+
+    MonInit(&monitor, pins, count);
+    if(xTaskCreatePinnedToCore(&MonitorTask, "monitor", 1024*3, xTaskGetCurrentTaskHandle(), configMAX_PRIORITIES - 1,
+        &monitor_task, MON_CORE) != pdPASS){
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskNotifyWait(0, UINT32_MAX, &ret, portMAX_DELAY);
+    return ret;
+}
+
+bool MonitorTripped(void)
+{
+    return monitor.tripped;
+}
+
+void MonitorReport(void)
+{
+    int64_t elapsed = esp_timer_get_time() - start_us;
+    uint32_t mhz = esp_clk_cpu_freq() / 1000000;
+    uint32_t load = elapsed > 0 ? isr_cycles * 10000 / ((uint64_t)elapsed * mhz) : 0;     // hundredths of a percent
+
+    ESP_LOG_LEVEL(load < 100 ? ESP_LOG_INFO : ESP_LOG_WARN, TAG,
+        "core %d: %"PRIu32" samples, %"PRIu32" trips, cpu %"PRIu32".%02"PRIu32"%%, sample max %"PRIu32"us",
+        MON_CORE, monitor.samples, monitor.trips, load / 100, load % 100, isr_max_cycles / mhz);
+}
+
+/**
+ * Force both greens on the real outputs at random times and measure the
+ * time to the trip, then put the lamps back. The lamps flash for a
+ * moment: bench use only, with the controller running.
+ *
+ * @param   faults                    number of injections
+ *
+ * @return  true if every fault tripped within MON_PERIOD_US plus the interrupt entry
+ */
+bool MonitorFaultTest(int faults)
+{
+    uint64_t inject = monitor.pin[2] | monitor.pin[5], lamps = 0;
+    uint32_t hist[MON_LATENCY_BINS + 1] = {0}, seed = 77, missed = 0;
+    int64_t latency, latency_max = 0, total = 0;
+
+    for(int b = 0; b < monitor.count; b++) lamps |= monitor.pin[b];
+    for(int n = 0; n < faults; n++){
+        uint64_t saved = ((uint64_t)GPIO.out1.val << 32 | GPIO.out) & lamps;
+        int64_t inject_us;
+
+        esp_rom_delay_us(SelfTestRandom(&seed) % MON_PERIOD_US);
+        inject_us = esp_timer_get_time();
+        GPIO.out_w1ts = (uint32_t)inject;
+        GPIO.out1_w1ts.val = inject >> 32;
+        while(!monitor.tripped && esp_timer_get_time() - inject_us < 10 * MON_PERIOD_US);
+
+        portENTER_CRITICAL(&mon_lock);
+        if(monitor.tripped){
+            latency = trip_us - inject_us;
+            total += latency;
+            if(latency > latency_max) latency_max = latency;
+            hist[latency >= MON_PERIOD_US ? MON_LATENCY_BINS : latency * MON_LATENCY_BINS / MON_PERIOD_US]++;
+        }else{
+            missed++;
+        }
+        MonReset(&monitor);
+        GPIO.out_w1tc = (uint32_t)lamps;
+        GPIO.out1_w1tc.val = lamps >> 32;
+        GPIO.out_w1ts = (uint32_t)saved;
+        GPIO.out1_w1ts.val = saved >> 32;
+        LampFreeze(false);
+        portEXIT_CRITICAL(&mon_lock);
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    printf("[MonitorFaultTest] %d faults, %"PRIu32" missed, detection latency mean %"PRId64"us max %"PRId64"us, by %dus:",
+        faults, missed, faults > missed ? total / (faults - missed) : 0, latency_max, MON_PERIOD_US / MON_LATENCY_BINS);
+    for(int b = 0; b <= MON_LATENCY_BINS; b++) printf(" %"PRIu32, hist[b]);
+    printf("\n");
+    MonitorReport();
+    return missed == 0 && latency_max <= MON_PERIOD_US + MON_ISR_SLACK_US;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * monitor.h
+ *
+ *  Conflict monitor: samples the lamp output register independently of the
+ *  controller and forces flashing red on a conflict.
+ */
+
+#ifndef MAIN_MONITOR_H_
+#define MAIN_MONITOR_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "lamp.h"
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#endif
+
+#define MON_PERIOD_US           1000    // sample period of the output register
+#define MON_FLASH_SAMPLES       500     // half period of the flashing red, in samples
+#define MON_LATENCY_BINS        10      // fault injection histogram, MON_PERIOD_US / 10 wide bins
+
+typedef struct {
+    uint64_t pin[LAMP_MAX];             // output register bit of each lamp
+    uint8_t count;
+    bool compatible[LAMP_STATES];       // lamp states allowed on the outputs
+    LampMasks_t flash[2];               // forced after a trip: all dark, then reds lit
+    bool tripped;                       // latched until MonReset
+    uint8_t trip_lamps;                 // lamps seen on the trip
+    uint32_t samples;
+    uint32_t trip_sample;
+    uint32_t trips;
+}Mon_t;
+
+void MonInit(Mon_t *mon, const int *pins, int count);
+uint8_t MonLamps(const Mon_t *mon, uint64_t out);
+bool MonSample(Mon_t *mon, uint64_t out);
+const LampMasks_t *MonFlash(const Mon_t *mon);
+void MonReset(Mon_t *mon);
+bool MonSelfTest(void);
+#ifdef ESP_PLATFORM
+esp_err_t MonitorInit(const int *pins, int count);
+bool MonitorTripped(void);
+void MonitorReport(void);
+bool MonitorFaultTest(int faults);
+#endif
+
+#endif /* MAIN_MONITOR_H_ */
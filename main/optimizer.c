@@ -0,0 +1,361 @@
+/*
+ * optimizer.c
+ *
+ *  Webster cycle length and green split optimizer in fixed point.
+ *
+ *  Arrivals counted over each cycle are smoothed into a flow per phase.
+ *  An evaluation turns the flows into flow ratios y = q/s, takes Webster's
+ *  optimum cycle C = (1.5 L + 5) / (1 - Y) within bounds, and splits the
+ *  effective green C - L in proportion to y. It is a fixed number of
+ *  integer operations, so it can run in the controller at a cycle end; the
+ *  caller stages the plan with CTRL_AT_CYCLE_END.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "optimizer.h"
+#include "selftest.h"
+#include "controller.h"
+
+static uint32_t Clamp(int32_t value, int32_t min, int32_t max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
+/**
+ * Defaults of the board: 1800 veh/h per phase, 2 s start-up loss plus the yellow
+ */
+void OptDefaults(OptConfig_t *config, int Y1, int Y2)
+{
+    memset(config, 0, sizeof(OptConfig_t));
+    config->saturation[0] = config->saturation[1] = 1800;
+    config->yellow_s[0] = Y1;
+    config->yellow_s[1] = Y2;
+    config->lost_s[0] = Y1 + 2;
+    config->lost_s[1] = Y2 + 2;
+    config->green_min_s = 5;
+    config->green_max_s = 90;
+    config->cycle_min_s = 20;
+    config->cycle_max_s = 150;
+    config->hysteresis_s = 3;
+}
+
+/**
+ * Start from the running greens, no flow measured yet
+ */
+void OptInit(Opt_t *opt, const OptConfig_t *config, int G1, int G2)
+{
+    memset(opt, 0, sizeof(Opt_t));
+    opt->config = *config;
+    opt->green_s[0] = G1;
+    opt->green_s[1] = G2;
+    opt->cycle_s = G1 + config->yellow_s[0] + G2 + config->yellow_s[1];
+}
+
+/**
+ * Feed the arrivals counted on each phase during a cycle of cycle_s seconds
+ */
+void OptAddCycle(Opt_t *opt, const uint16_t arrivals[OPT_PHASES], uint32_t cycle_s)
+{
+    if(cycle_s == 0) return;
+    for(int i = 0; i < OPT_PHASES; i++){
+        int32_t sample = (uint32_t)arrivals[i] * 3600 * 16 / cycle_s;
+        int32_t flow = opt->flow_q4[i];
+
+        opt->flow_q4[i] = opt->primed ? flow + ((sample - flow) >> OPT_SMOOTH_SHIFT) : sample;
+    }
+    opt->primed = true;
+}
+
+/**
+ * Compute the cycle and the greens from the smoothed flows
+ *
+ * @return  true if a green moved by the hysteresis or more: the new greens
+ *          are published in opt->green_s and opt->cycle_s
+ */
+bool OptEvaluate(Opt_t *opt)
+{
+    const OptConfig_t *cfg = &opt->config;
+    uint32_t y[OPT_PHASES], Y = 0, lost = 0, cycle, effective, given = 0;
+    uint16_t green[OPT_PHASES];
+    bool changed = false;
+
+    opt->evaluations++;
+    if(!opt->primed) return false;
+    for(int i = 0; i < OPT_PHASES; i++){
+        uint64_t ratio = ((uint64_t)opt->flow_q4[i] << 12) / cfg->saturation[i];     // Q16
+        y[i] = ratio > 65535 ? 65535 : ratio;
+        Y += y[i];
+        lost += cfg->lost_s[i];
+    }
+
+    if(Y >= OPT_Y_MAX){
+        cycle = cfg->cycle_max_s;
+    }else{
+        cycle = (((3 * lost + 10) << 15) + (65536 - Y) / 2) / (65536 - Y);
+    }
+    cycle = Clamp(cycle, cfg->cycle_min_s, cfg->cycle_max_s);
+    effective = cycle > lost ? cycle - lost : 0;
+
+    for(int i = 0; i < OPT_PHASES; i++){
+        uint32_t g;
+
+        if(i == OPT_PHASES - 1) g = effective - given;
+        else if(Y == 0) g = effective / OPT_PHASES;
+        else g = (uint32_t)((uint64_t)effective * y[i] / Y);
+        given += g;
+        // displayed green = effective green + lost time - yellow
+        green[i] = Clamp((int32_t)g + cfg->lost_s[i] - cfg->yellow_s[i], cfg->green_min_s, cfg->green_max_s);
+        if(green[i] >= opt->green_s[i] + cfg->hysteresis_s || green[i] + cfg->hysteresis_s <= opt->green_s[i]) changed = true;
+    }
+    if(!changed) return false;
+
+    opt->cycle_s = 0;
+    for(int i = 0; i < OPT_PHASES; i++){
+        opt->green_s[i] = green[i];
+        opt->cycle_s += green[i] + cfg->yellow_s[i];
+    }
+    opt->published++;
+    return true;
+}
+
+/**
+ * Two-phase plan of the published greens
+ */
+bool OptPlan(const Opt_t *opt, Plan_t *plan)
+{
+    return PlanTwoPhase(plan, opt->green_s[0], opt->config.yellow_s[0], opt->green_s[1], opt->config.yellow_s[1]);
+}
+
+/*
+ * Webster in double precision for the self-test: the unrounded cycle and
+ * the displayed greens before their clamps, flows in veh/h
+ */
+static double OptReference(const OptConfig_t *cfg, const uint16_t flow[OPT_PHASES], double green[OPT_PHASES], double *Y)
+{
+    double y[OPT_PHASES], lost = 0, cycle;
+
+    *Y = 0;
+    for(int i = 0; i < OPT_PHASES; i++){
+        y[i] = (double)flow[i] / cfg->saturation[i];
+        *Y += y[i];
+        lost += cfg->lost_s[i];
+    }
+    cycle = *Y >= OPT_Y_MAX / 65536.0 ? cfg->cycle_max_s : (1.5 * lost + 5) / (1 - *Y);
+    if(cycle < cfg->cycle_min_s) cycle = cfg->cycle_min_s;
+    if(cycle > cfg->cycle_max_s) cycle = cfg->cycle_max_s;
+    for(int i = 0; i < OPT_PHASES; i++){
+        double g = *Y > 0 ? (cycle - lost) * y[i] / *Y : (cycle - lost) / OPT_PHASES;
+        green[i] = g + cfg->lost_s[i] - cfg->yellow_s[i];
+    }
+    return cycle;
+}
+
+/**
+ * Check OptEvaluate against Webster in double precision on random flows and
+ * yellows: the cycle within 1 s and each green within 2 s (the rounding of
+ * the cycle plus that of the split), the greens always within their clamps
+ * and filling the cycle with the yellows, the maximum cycle from Y >=
+ * OPT_Y_MAX on, and no publication for a move under the hysteresis.
+ *
+ * @return  true if all checks passed
+ */
+bool OptSelfTest(void)
+{
+    static Opt_t opt;
+    OptConfig_t config;
+    uint32_t seed = 0x0b7, clamped = 0, saturated = 0;
+    double cycle_err = 0, green_err = 0;
+    int errors = 0;
+
+    for(int trial = 0; trial < 5000; trial++){
+        // over a 3600 s cycle the arrivals are the flow in veh/h, exact in Q4
+        uint16_t flow[OPT_PHASES] = {SelfTestRandom(&seed) % 1100, SelfTestRandom(&seed) % 1100};
+        double ref_green[OPT_PHASES], ref_cycle, Y;
+        bool unclamped = true;
+        uint32_t filled = 0;
+
+        OptDefaults(&config, 3 + SelfTestRandom(&seed) % 4, 3 + SelfTestRandom(&seed) % 4);
+        if(trial % 4 == 0) config.green_max_s = 30;     // the green clamp hit more often
+        ref_cycle = OptReference(&config, flow, ref_green, &Y);
+        // greens of 0 differ from any clamped green by more than the hysteresis
+        OptInit(&opt, &config, 0, 0);
+        OptAddCycle(&opt, flow, 3600);
+        if(!OptEvaluate(&opt)) errors++;
+
+        for(int i = 0; i < OPT_PHASES; i++){
+            if(opt.green_s[i] < config.green_min_s || opt.green_s[i] > config.green_max_s) errors++;
+            if(ref_green[i] < config.green_min_s + 2 || ref_green[i] > config.green_max_s - 2) unclamped = false;
+            filled += opt.green_s[i] + config.yellow_s[i];
+        }
+        if(filled != opt.cycle_s) errors++;
+        if(!unclamped){
+            clamped++;
+            continue;
+        }
+        // near the limit the Q16 sum may fall on the other side of it
+        if(Y > OPT_Y_MAX / 65536.0 - 0.001 && Y < OPT_Y_MAX / 65536.0 + 0.001) continue;
+        if(Y >= OPT_Y_MAX / 65536.0){
+            saturated++;
+            if(opt.cycle_s != config.cycle_max_s) errors++;
+        }
+        if(opt.cycle_s - ref_cycle > cycle_err) cycle_err = opt.cycle_s - ref_cycle;
+        if(ref_cycle - opt.cycle_s > cycle_err) cycle_err = ref_cycle - opt.cycle_s;
+        for(int i = 0; i < OPT_PHASES; i++){
+            if(opt.green_s[i] - ref_green[i] > green_err) green_err = opt.green_s[i] - ref_green[i];
+            if(ref_green[i] - opt.green_s[i] > green_err) green_err = ref_green[i] - opt.green_s[i];
+        }
+
+        // the same flows again, the published greens moved up or down just under and then at the hysteresis
+        for(int i = 0; i < OPT_PHASES; i++) opt.green_s[i] += trial & 2 ? 1 - config.hysteresis_s : config.hysteresis_s - 1;
+        if(OptEvaluate(&opt)) errors++;
+        opt.green_s[trial % OPT_PHASES] += trial & 2 ? -1 : 1;
+        if(!OptEvaluate(&opt)) errors++;
+    }
+    if(cycle_err > 1 || green_err > 2) errors++;
+    if(clamped == 0 || saturated == 0) errors++;    // every path taken
+    printf("[OptSelfTest] %s, cycle within %d.%02d s, greens within %d.%02d s, %"PRIu32" clamped, %"PRIu32" saturated, %d errors\n",
+        errors ? "FAIL" : "ok", (int)cycle_err, (int)(cycle_err * 100) % 100, (int)green_err, (int)(green_err * 100) % 100,
+        clamped, saturated, errors);
+    return errors == 0;
+}
+
+/**
+ * Time OptAddCycle plus OptEvaluate on random flows, overall and for the
+ * slowest batch of 100. An evaluation has no data dependent loop, the
+ * spread is the clock and the scheduler.
+ *
+ * @param   evaluations               number of evaluations
+ * @param   now_us                    monotonic microsecond clock of the platform
+ */
+void OptBench(int evaluations, int64_t (*now_us)(void))
+{
+    static Opt_t opt;
+    OptConfig_t config;
+    uint32_t seed = 39, published = 0;
+    int64_t start, worst = 0, total, batch;
+
+    OptDefaults(&config, 5, 4);
+    OptInit(&opt, &config, 10, 8);
+    start = now_us();
+    for(int n = 0; n < evaluations; n++){
+        uint16_t arrivals[OPT_PHASES] = {SelfTestRandom(&seed) % 40, SelfTestRandom(&seed) % 40};
+        OptAddCycle(&opt, arrivals, opt.cycle_s);
+        published += OptEvaluate(&opt);
+    }
+    total = now_us() - start;
+    for(int n = 0; n < evaluations; n += 100){
+        batch = now_us();
+        for(int k = 0; k < 100; k++){
+            uint16_t arrivals[OPT_PHASES] = {SelfTestRandom(&seed) % 40, SelfTestRandom(&seed) % 40};
+            OptAddCycle(&opt, arrivals, opt.cycle_s);
+            OptEvaluate(&opt);
+        }
+        batch = now_us() - batch;
+        if(batch > worst) worst = batch;
+    }
+    printf("[OptBench] %d evaluations: %"PRId64"ns mean, %"PRId64"ns slowest batch mean, %"PRIu32" published, %u bytes state\n",
+        evaluations, total * 1000 / evaluations, worst * 10, published, (unsigned)sizeof(Opt_t));
+}
+
+// demand of a weekday in veh/h, phase 1 and phase 2, by hour
+static const uint16_t SimDemand[24][OPT_PHASES] = {
+    {60, 40},   {40, 30},   {30, 20},   {30, 20},   {50, 40},   {150, 100},
+    {500, 250}, {900, 350}, {850, 400}, {600, 450}, {500, 480}, {550, 500},
+    {600, 550}, {550, 500}, {500, 480}, {520, 550}, {450, 700}, {400, 900},
+    {380, 850}, {350, 600}, {300, 400}, {200, 250}, {120, 100}, {80, 60},
+};
+
+/*
+ * Run a plan for some hours of the weekday demand, adapting it every cycle
+ * or not, and return the vehicle-seconds spent waiting
+ */
+static uint64_t OptSimRun(bool adaptive, int G1, int G2, int hours, uint32_t *vehicles, uint32_t *changes)
+{
+    static const uint8_t green_lamp[OPT_PHASES] = {PLAN_GREEN1, PLAN_GREEN2};
+    static Ctrl_t ctrl;
+    static Opt_t opt;
+    OptConfig_t config;
+    Plan_t plan;
+    uint32_t seed = 2024, queue[OPT_PHASES] = {0}, credit[OPT_PHASES] = {0}, green_for[OPT_PHASES] = {0};
+    uint32_t cycles = 0, cycle_len = 0;
+    uint16_t counted[OPT_PHASES] = {0};
+    uint64_t wait = 0;
+
+    OptDefaults(&config, 5, 4);
+    OptInit(&opt, &config, G1, G2);
+    PlanTwoPhase(&plan, G1, 5, G2, 4);
+    CtrlInit(&ctrl, &plan);
+    *vehicles = 0;
+    *changes = 0;
+
+    for(uint32_t sec = 0; sec < (uint32_t)hours * 3600; sec++){
+        const uint16_t *q = SimDemand[(sec / 3600) % 24];
+        uint8_t lamps = CtrlLamps(&ctrl);
+
+        for(int i = 0; i < OPT_PHASES; i++){
+            if(SelfTestRandom32(&seed) % 3600 < q[i]){
+                queue[i]++;
+                counted[i]++;
+                (*vehicles)++;
+            }
+            // discharge at the saturation flow after a 2 s start-up
+            green_for[i] = (lamps & green_lamp[i]) ? green_for[i] + 1 : 0;
+            if(green_for[i] > 2){
+                credit[i] += (uint32_t)config.saturation[i] * 65536 / 3600;
+                while(credit[i] >= 65536 && queue[i]){
+                    queue[i]--;
+                    credit[i] -= 65536;
+                }
+                if(queue[i] == 0) credit[i] = 0;
+            }
+            wait += queue[i];
+        }
+
+        CtrlTick(&ctrl);
+        cycle_len++;
+        if(ctrl.run.cycles != cycles){
+            cycles = ctrl.run.cycles;
+            if(adaptive){
+                OptAddCycle(&opt, counted, cycle_len);
+                if(OptEvaluate(&opt) && OptPlan(&opt, &plan) && CtrlStage(&ctrl, &plan, CTRL_AT_CYCLE_END)) (*changes)++;
+            }
+            memset(counted, 0, sizeof(counted));
+            cycle_len = 0;
+        }
+    }
+    return wait;
+}
+
+/**
+ * Average delay per vehicle over a weekday demand profile: the default plan
+ * (10/5/8/4), a fixed Webster plan for the mean demand of the day, and the
+ * default plan adapted every cycle
+ */
+void OptSimulate(int hours)
+{
+    static Opt_t tuned;
+    OptConfig_t config;
+    uint16_t mean[OPT_PHASES] = {0};
+    uint32_t vehicles, changes;
+    uint64_t wait;
+
+    OptDefaults(&config, 5, 4);
+    OptInit(&tuned, &config, 10, 8);
+    for(int h = 0; h < 24; h++){
+        for(int i = 0; i < OPT_PHASES; i++) mean[i] += SimDemand[h][i] / 24;
+    }
+    OptAddCycle(&tuned, mean, 3600);
+    OptEvaluate(&tuned);
+
+    wait = OptSimRun(false, 10, 8, hours, &vehicles, &changes);
+    printf("[OptSimulate] %d h, %"PRIu32" vehicles: fixed 10/5/8/4 %"PRIu64".%"PRIu64" s/veh\n",
+        hours, vehicles, wait * 10 / vehicles / 10, wait * 10 / vehicles % 10);
+    wait = OptSimRun(false, tuned.green_s[0], tuned.green_s[1], hours, &vehicles, &changes);
+    printf("[OptSimulate] %d h, %"PRIu32" vehicles: fixed Webster %d/5/%d/4 %"PRIu64".%"PRIu64" s/veh\n",
+        hours, vehicles, tuned.green_s[0], tuned.green_s[1], wait * 10 / vehicles / 10, wait * 10 / vehicles % 10);
+    wait = OptSimRun(true, 10, 8, hours, &vehicles, &changes);
+    printf("[OptSimulate] %d h, %"PRIu32" vehicles: adaptive %"PRIu64".%"PRIu64" s/veh, %"PRIu32" plan changes\n",
+        hours, vehicles, wait * 10 / vehicles / 10, wait * 10 / vehicles % 10, changes);
+}
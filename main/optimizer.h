@@ -0,0 +1,45 @@
+/*
+ * optimizer.h
+ *
+ *  Webster cycle length and green split optimizer in fixed point.
+ */
+
+#ifndef MAIN_OPTIMIZER_H_
+#define MAIN_OPTIMIZER_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "plan.h"
+
+#define OPT_PHASES              PLAN_HEADS
+#define OPT_SMOOTH_SHIFT        3       // flow follows each cycle's sample by 1/8
+#define OPT_Y_MAX               58982   // 0.9 in Q16: at or above, the cycle goes to its maximum
+
+typedef struct {
+    uint16_t saturation[OPT_PHASES];    // veh/h of green
+    uint8_t lost_s[OPT_PHASES];         // start-up and clearance lost time
+    uint8_t yellow_s[OPT_PHASES];
+    uint16_t green_min_s, green_max_s;
+    uint16_t cycle_min_s, cycle_max_s;
+    uint8_t hysteresis_s;               // publish only if a green moves by this much
+}OptConfig_t;
+
+typedef struct {
+    OptConfig_t config;
+    uint32_t flow_q4[OPT_PHASES];       // smoothed arrivals in veh/h, Q4
+    bool primed;
+    uint16_t green_s[OPT_PHASES];       // last published greens
+    uint16_t cycle_s;
+    uint32_t evaluations;
+    uint32_t published;
+}Opt_t;
+
+void OptDefaults(OptConfig_t *config, int Y1, int Y2);
+void OptInit(Opt_t *opt, const OptConfig_t *config, int G1, int G2);
+void OptAddCycle(Opt_t *opt, const uint16_t arrivals[OPT_PHASES], uint32_t cycle_s);
+bool OptEvaluate(Opt_t *opt);
+bool OptPlan(const Opt_t *opt, Plan_t *plan);
+bool OptSelfTest(void);
+void OptBench(int evaluations, int64_t (*now_us)(void));
+void OptSimulate(int hours);
+
+#endif /* MAIN_OPTIMIZER_H_ */
@@ -0,0 +1,274 @@
+/*
+ * plan.c
+ *
+ *  Phase plans: a table of steps run by a small interpreter.
+ *
+ *  A step holds its duration, the lamps lit and, for every countdown head,
+ *  the step whose end the head counts down to. PlanCompile resolves the
+ *  countdown at the start of every step once, so the interpreter does a
+ *  constant amount of work per second and per transition whatever the
+ *  plan looks like. No ESP-IDF dependency.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "plan.h"
+
+/**
+ * Check a plan and precompute its countdowns and cycle length
+ *
+ * @param   plan                      steps and step count filled in
+ * 
+ * @return  false if the plan is empty, has a zero length step, a bad countdown
+ *          binding or an actuated step without a passage time
+ */
+bool PlanCompile(Plan_t *plan)
+{
+    if(plan->steps == 0 || plan->steps > PLAN_MAX_STEPS) return false;
+
+    plan->cycle = 0;
+    for(int i = 0; i < plan->steps; i++){
+        const PlanStep_t *step = &plan->step[i];
+
+        if(step->duration == 0) return false;
+        if(step->max && (step->max < step->duration || step->passage == 0 || step->call >= PLAN_HEADS)) return false;
+        plan->cycle += step->duration;
+    }
+    for(int i = 0; i < plan->steps; i++){
+        for(int h = 0; h < PLAN_HEADS; h++){
+            int to = plan->step[i].count_to[h];
+            uint32_t remain = 0;
+
+            if(to != PLAN_NO_COUNT && to != PLAN_SHOW_88){
+                if(to >= plan->steps) return false;
+                // sum the steps from this one to the bound one, wrapping over the cycle end
+                for(int k = i; ; k = (k + 1) % plan->steps){
+                    remain += plan->step[k].duration;
+                    if(k == to) break;
+                }
+                if(remain > UINT16_MAX) return false;
+            }
+            plan->remain[i][h] = remain;
+        }
+    }
+    return true;
+}
+
+/**
+ * Build the two phase plan: phase 2 green then yellow while phase 1 is red,
+ * then phase 1 green then yellow while phase 2 is red. Red lasts the green
+ * and yellow of the other phase, each head counts down its current color.
+ */
+bool PlanTwoPhase(Plan_t *plan, int G1, int Y1, int G2, int Y2)
+{
+    static const PlanStep_t steps[] = {
+        {.duration = 0, .lamps = PLAN_RED1 | PLAN_GREEN2,  .count_to = {1, 0}},
+        {.duration = 0, .lamps = PLAN_RED1 | PLAN_YELLOW2, .count_to = {1, 1}},
+        {.duration = 0, .lamps = PLAN_RED2 | PLAN_GREEN1,  .count_to = {2, 3}},
+        {.duration = 0, .lamps = PLAN_RED2 | PLAN_YELLOW1, .count_to = {3, 3}},
+    };
+
+    memset(plan, 0, sizeof(Plan_t));
+    plan->steps = sizeof(steps) / sizeof(steps[0]);
+    memcpy(plan->step, steps, sizeof(steps));
+    plan->step[0].duration = G2;
+    plan->step[1].duration = Y2;
+    plan->step[2].duration = G1;
+    plan->step[3].duration = Y1;
+    return PlanCompile(plan);
+}
+
+/**
+ * The two phase plan with actuated greens: each green runs its minimum, is
+ * extended by the calls of its own approach up to its maximum, and cycle and
+ * countdowns are those of the minimums
+ *
+ * @param   passage                   tenths of a second a call extends a green by
+ */
+bool PlanTwoPhaseActuated(Plan_t *plan, int G1, int G1max, int Y1, int G2, int G2max, int Y2, int passage)
+{
+    if(!PlanTwoPhase(plan, G1, Y1, G2, Y2)) return false;
+    plan->step[0].max = G2max;
+    plan->step[0].passage = passage;
+    plan->step[0].call = 1;
+    plan->step[2].max = G1max;
+    plan->step[2].passage = passage;
+    plan->step[2].call = 0;
+    return PlanCompile(plan);
+}
+
+/**
+ * Build a plan holding fixed lamps with 88 on both heads, for the manual and slow modes
+ */
+bool PlanHold(Plan_t *plan, uint8_t lamps)
+{
+    memset(plan, 0, sizeof(Plan_t));
+    plan->steps = 1;
+    plan->step[0] = (PlanStep_t){.duration = 1, .lamps = lamps, .count_to = {PLAN_SHOW_88, PLAN_SHOW_88}};
+    return PlanCompile(plan);
+}
+
+/**
+ * Start a compiled plan at its first step
+ */
+void PlanStart(PlanRunner_t *run, const Plan_t *plan)
+{
+    run->plan = plan;
+    run->step = 0;
+    run->elapsed = 0;
+    run->extend = 0;
+    run->cycles = 0;
+}
+
+/**
+ * Advance one second. An actuated step only ends here at its maximum, its
+ * gap-out is decided by the controller.
+ *
+ * @return  true if a new step started
+ */
+bool PlanTick(PlanRunner_t *run)
+{
+    const PlanStep_t *step = &run->plan->step[run->step];
+
+    if(++run->elapsed < (step->max ? step->max : step->duration)) return false;
+    PlanNext(run);
+    return true;
+}
+
+/**
+ * End the running step now and start the next one
+ */
+void PlanNext(PlanRunner_t *run)
+{
+    run->elapsed = 0;
+    run->extend = 0;
+    if(++run->step >= run->plan->steps){
+        run->step = 0;
+        run->cycles++;
+    }
+}
+
+uint8_t PlanLamps(const PlanRunner_t *run)
+{
+    return run->plan->step[run->step].lamps;
+}
+
+/**
+ * Value shown on a countdown head, -1 when the head is blank
+ */
+int PlanCount(const PlanRunner_t *run, int head)
+{
+    uint8_t to = run->plan->step[run->step].count_to[head];
+
+    if(to == PLAN_NO_COUNT) return -1;
+    if(to == PLAN_SHOW_88) return 88;
+    return run->plan->remain[run->step][head] + run->extend - run->elapsed;
+}
+
+/**
+ * True if the lamps let both phases move: a green on one phase while the
+ * other phase shows green or yellow. Both yellow is the caution state.
+ */
+bool PlanConflict(uint8_t lamps)
+{
+    bool green1 = lamps & PLAN_GREEN1, green2 = lamps & PLAN_GREEN2;
+    bool moving1 = lamps & (PLAN_GREEN1 | PLAN_YELLOW1), moving2 = lamps & (PLAN_GREEN2 | PLAN_YELLOW2);
+
+    return (green1 && moving2) || (green2 && moving1);
+}
+
+/**
+ * True if two plans have the same steps with the same lamps, they may only differ in timing
+ */
+bool PlanSameLamps(const Plan_t *a, const Plan_t *b)
+{
+    if(a->steps != b->steps) return false;
+    for(int i = 0; i < a->steps; i++){
+        if(a->step[i].lamps != b->step[i].lamps) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    uint8_t lamps;
+    int count[PLAN_HEADS];
+}PlanFrame_t;
+
+/*
+ * One cycle of the former hand-written LED_task loops, one frame per second:
+ * the lamps lit and the values shown during that second.
+ */
+static int PlanReference(int G1, int Y1, int G2, int Y2, PlanFrame_t *out, int max)
+{
+    int n = 0, idx;
+    uint8_t lamps = 0;
+
+    idx = G2 + Y2;
+    lamps |= PLAN_RED1 | PLAN_GREEN2;
+    while(idx >= 1){
+        for(int i = G2; i >= 1 && n < max; i--){
+            out[n++] = (PlanFrame_t){lamps, {idx, i}};
+            idx--;
+        }
+        lamps = (lamps & ~PLAN_GREEN2) | PLAN_YELLOW2;
+        for(int i = Y2; i >= 1 && n < max; i--){
+            out[n++] = (PlanFrame_t){lamps, {idx, i}};
+            idx--;
+        }
+        lamps &= ~PLAN_YELLOW2;
+    }
+    lamps &= ~PLAN_RED1;
+    idx = G1 + Y1;
+    lamps |= PLAN_RED2 | PLAN_GREEN1;
+    while(idx >= 1){
+        for(int i = G1; i >= 1 && n < max; i--){
+            out[n++] = (PlanFrame_t){lamps, {i, idx}};
+            idx--;
+        }
+        lamps = (lamps & ~PLAN_GREEN1) | PLAN_YELLOW1;
+        for(int i = Y1; i >= 1 && n < max; i--){
+            out[n++] = (PlanFrame_t){lamps, {i, idx}};
+            idx--;
+        }
+        lamps &= ~PLAN_YELLOW1;
+    }
+    return n;
+}
+
+/**
+ * Run the two phase plan against the former hand-written loop for a range
+ * of settings over two cycles and compare lamps and countdowns every second
+ *
+ * @return  true if every second matches
+ */
+bool PlanSelfTest(void)
+{
+    static const int settings[][4] = {
+        {10, 5, 8, 4}, {1, 1, 1, 1}, {30, 3, 45, 4}, {99, 9, 2, 9}, {5, 4, 60, 3},
+    };
+    PlanFrame_t ref[256];
+    Plan_t plan;
+    PlanRunner_t run;
+    int errors = 0;
+
+    for(int s = 0; s < sizeof(settings) / sizeof(settings[0]); s++){
+        const int *t = settings[s];
+        int n = PlanReference(t[0], t[1], t[2], t[3], ref, sizeof(ref) / sizeof(ref[0]));
+
+        if(!PlanTwoPhase(&plan, t[0], t[1], t[2], t[3]) || plan.cycle != n){
+            errors++;
+            continue;
+        }
+        PlanStart(&run, &plan);
+        for(int sec = 0; sec < 2 * n; sec++){
+            const PlanFrame_t *f = &ref[sec % n];
+            if(PlanLamps(&run) != f->lamps || PlanCount(&run, 0) != f->count[0] || PlanCount(&run, 1) != f->count[1]){
+                errors++;
+            }
+            PlanTick(&run);
+        }
+        if(run.cycles != 2 || run.step != 0 || run.elapsed != 0) errors++;
+    }
+    printf("[PlanSelfTest] %s, %d mismatches\n", errors ? "FAIL" : "ok", errors);
+    return errors == 0;
+}
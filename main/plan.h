@@ -0,0 +1,63 @@
+/*
+ * plan.h
+ *
+ *  Phase plans: a table of steps run by a small interpreter.
+ */
+
+#ifndef MAIN_PLAN_H_
+#define MAIN_PLAN_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PLAN_MAX_STEPS          16
+#define PLAN_HEADS              2       // countdown heads, 0: phase 1, 1: phase 2
+#define PLAN_NO_COUNT           0xFF    // head blank during the step
+#define PLAN_SHOW_88            0xFE    // head shows 88 during the step (manual and slow modes)
+
+// lamp bits of PlanStep_t.lamps
+#define PLAN_RED1               (1 << 0)
+#define PLAN_YELLOW1            (1 << 1)
+#define PLAN_GREEN1             (1 << 2)
+#define PLAN_RED2               (1 << 3)
+#define PLAN_YELLOW2            (1 << 4)
+#define PLAN_GREEN2             (1 << 5)
+#define PLAN_LAMPS              6
+
+typedef struct {
+    uint16_t duration;                  // seconds, the minimum of an actuated step
+    uint8_t lamps;                      // PLAN_* bits lit during the step
+    uint8_t count_to[PLAN_HEADS];       // each head counts down to the end of this step, or PLAN_NO_COUNT
+    uint16_t max;                       // actuated step: seconds it may be extended to, 0 for a fixed step
+    uint8_t passage;                    // actuated step: tenths of a second a call extends it by
+    uint8_t call;                       // actuated step: approach whose calls extend it
+}PlanStep_t;
+
+typedef struct {
+    uint8_t steps;
+    PlanStep_t step[PLAN_MAX_STEPS];
+    uint16_t remain[PLAN_MAX_STEPS][PLAN_HEADS];    // filled by PlanCompile: countdown at the start of a step
+    uint32_t cycle;                                 // filled by PlanCompile: cycle length in seconds
+}Plan_t;
+
+typedef struct {
+    const Plan_t *plan;
+    uint8_t step;
+    uint16_t elapsed;                   // seconds since the step started
+    uint16_t extend;                    // projected seconds of an actuated step beyond its minimum
+    uint32_t cycles;
+}PlanRunner_t;
+
+bool PlanCompile(Plan_t *plan);
+bool PlanTwoPhase(Plan_t *plan, int G1, int Y1, int G2, int Y2);
+bool PlanTwoPhaseActuated(Plan_t *plan, int G1, int G1max, int Y1, int G2, int G2max, int Y2, int passage);
+bool PlanHold(Plan_t *plan, uint8_t lamps);
+void PlanStart(PlanRunner_t *run, const Plan_t *plan);
+bool PlanTick(PlanRunner_t *run);
+void PlanNext(PlanRunner_t *run);
+uint8_t PlanLamps(const PlanRunner_t *run);
+int PlanCount(const PlanRunner_t *run, int head);
+bool PlanConflict(uint8_t lamps);
+bool PlanSameLamps(const Plan_t *a, const Plan_t *b);
+bool PlanSelfTest(void);
+
+#endif /* MAIN_PLAN_H_ */
@@ -0,0 +1,508 @@
+/*
+ * schedule.c
+ *
+ *  Time-of-day and day-of-week plan schedule: a sorted table of plan
+ *  changes over the week with a binary search lookup.
+ *
+ *  Entries are added per set of days and time of day, then compiled once:
+ *  sorted by minute of the week, a later entry wins over an earlier one at
+ *  the same minute, and entries that keep the timing already running are
+ *  dropped. The minutes sit in their own array, so a lookup is a binary
+ *  search over 2 bytes per entry and also gives the next change, which is
+ *  when the timing engine wakes up next; nothing runs in between.
+ *
+ *  A lookup always answers for the local time it is given, so a change
+ *  that falls into a gap of the clock (summer time starting) is taken at
+ *  the jump. The clock going back by up to SCHED_REPEAT_MIN (summer time
+ *  ending) holds the running timing until the time seen last comes again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "schedule.h"
+#include "selftest.h"
+#ifdef ESP_PLATFORM
+#include <sys/time.h>
+#include "esp_log.h"
+#include "wheel.h"
+#endif
+
+void SchedInit(Sched_t *sched)
+{
+    memset(sched, 0, sizeof(Sched_t));
+}
+
+/**
+ * Find or add a timing
+ *
+ * @return  its index, -1 if a time is out of 1-99 s or the timing table is full
+ */
+int SchedTiming(Sched_t *sched, int G1, int Y1, int G2, int Y2)
+{
+    SchedTiming_t timing = {G1, Y1, G2, Y2};
+
+    if(G1 < 1 || G1 > 99 || Y1 < 1 || Y1 > 99 || G2 < 1 || G2 > 99 || Y2 < 1 || Y2 > 99) return -1;
+    for(int i = 0; i < sched->timing_count; i++){
+        if(!memcmp(&sched->timings[i], &timing, sizeof(timing))) return i;
+    }
+    if(sched->timing_count >= SCHED_MAX_TIMINGS) return -1;
+    sched->timings[sched->timing_count] = timing;
+    return sched->timing_count++;
+}
+
+uint16_t SchedMinuteOfWeek(int wday, int hour, int minute)
+{
+    return wday * SCHED_DAY_MIN + hour * 60 + minute;
+}
+
+/**
+ * Run a timing from a time of day on some days of the week, until the next
+ * entry. Call SchedCompile after the last one.
+ *
+ * @param   sched                     schedule
+ * @param   days                      SCHED_* day bits, bit 0 Sunday
+ * @param   hour                      local time of day the timing starts at
+ * @param   minute
+ * @param   timing                    index returned by SchedTiming
+ *
+ * @return  false if an argument is out of range or the table is full
+ */
+bool SchedAdd(Sched_t *sched, uint8_t days, int hour, int minute, int timing)
+{
+    if(days == 0 || days > SCHED_ALL_DAYS || hour < 0 || hour > 23 || minute < 0 || minute > 59) return false;
+    if(timing < 0 || timing >= sched->timing_count) return false;
+    if(sched->count + __builtin_popcount(days) > SCHED_MAX_ENTRIES) return false;
+    for(int d = 0; d < 7; d++){
+        if(!(days & (1 << d))) continue;
+        sched->start[sched->count] = SchedMinuteOfWeek(d, hour, minute);
+        sched->timing[sched->count] = timing;
+        sched->count++;
+    }
+    sched->compiled = false;
+    return true;
+}
+
+/**
+ * Sort the entries by minute of the week, keep the last one added at a
+ * minute and drop the ones that change nothing
+ *
+ * @return  false if the schedule has no entry
+ */
+bool SchedCompile(Sched_t *sched)
+{
+    int n = 0;
+
+    if(sched->count == 0) return false;
+    // insertion sort: stable, so the entries added last stay last at a minute
+    for(int i = 1; i < sched->count; i++){
+        uint16_t start = sched->start[i];
+        uint8_t timing = sched->timing[i];
+        int j = i;
+
+        for(; j > 0 && sched->start[j - 1] > start; j--){
+            sched->start[j] = sched->start[j - 1];
+            sched->timing[j] = sched->timing[j - 1];
+        }
+        sched->start[j] = start;
+        sched->timing[j] = timing;
+    }
+    for(int i = 0; i < sched->count; i++){
+        if(i + 1 < sched->count && sched->start[i + 1] == sched->start[i]) continue;
+        if(n > 0 && sched->timing[n - 1] == sched->timing[i]) continue;
+        sched->start[n] = sched->start[i];
+        sched->timing[n] = sched->timing[i];
+        n++;
+    }
+    // the last entry of the week runs on into the first one
+    while(n > 1 && sched->timing[0] == sched->timing[n - 1]){
+        memmove(&sched->start[0], &sched->start[1], (n - 1) * sizeof(sched->start[0]));
+        memmove(&sched->timing[0], &sched->timing[1], (n - 1) * sizeof(sched->timing[0]));
+        n--;
+    }
+    sched->count = n;
+    sched->compiled = true;
+    return true;
+}
+
+/**
+ * Entry running at a minute of the week: the last one starting at or before
+ * it, or the last of the week before the first one
+ *
+ * @param   sched                     compiled schedule
+ * @param   minute                    minute of the week, local time
+ * @param   next                      set to the minute of the week of the next entry
+ *
+ * @return  index of the entry, -1 if the schedule is not compiled
+ */
+int SchedLookup(const Sched_t *sched, uint16_t minute, uint16_t *next)
+{
+    int lo = 0, hi = sched->count, index;
+
+    if(!sched->compiled) return -1;
+    // first entry starting after minute
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+
+        if(sched->start[mid] <= minute) lo = mid + 1;
+        else hi = mid;
+    }
+    index = lo > 0 ? lo - 1 : sched->count - 1;
+    *next = sched->start[(index + 1) % sched->count];
+    return index;
+}
+
+/*
+ * Minutes from one minute of the week to the next time another one comes,
+ * a whole week if they are the same
+ */
+static uint32_t SchedMinutes(uint16_t from, uint16_t to)
+{
+    uint32_t minutes = (to + SCHED_WEEK_MIN - from) % SCHED_WEEK_MIN;
+
+    return minutes ? minutes : SCHED_WEEK_MIN;
+}
+
+void SchedStart(SchedRunner_t *run)
+{
+    memset(run, 0, sizeof(SchedRunner_t));
+    run->index = -1;
+}
+
+/**
+ * Take the local time: find the entry running and the wait until the next one
+ *
+ * @param   sched                     compiled schedule
+ * @param   run                       state kept between the calls
+ * @param   minute                    minute of the week, local time
+ * @param   wait                      set to the minutes of local time until the next call is due
+ *
+ * @return  true if another entry runs now: apply SchedRunning
+ */
+bool SchedUpdate(const Sched_t *sched, SchedRunner_t *run, uint16_t minute, uint32_t *wait)
+{
+    uint32_t back = (run->seen + SCHED_WEEK_MIN - minute) % SCHED_WEEK_MIN;
+    uint16_t next;
+    int index;
+
+    // the clock went back a little: the time since then was already run
+    if(run->index >= 0 && back > 0 && back <= SCHED_REPEAT_MIN){
+        SchedLookup(sched, run->seen, &next);
+        *wait = back + SchedMinutes(run->seen, next);
+        return false;
+    }
+    index = SchedLookup(sched, minute, &next);
+    if(index < 0) return false;
+    run->seen = minute;
+    *wait = SchedMinutes(minute, next);
+    if(index == run->index) return false;
+    run->index = index;
+    run->changes++;
+    return true;
+}
+
+/**
+ * Timing of the entry applied last, NULL before the first one
+ */
+const SchedTiming_t *SchedRunning(const Sched_t *sched, const SchedRunner_t *run)
+{
+    return run->index < 0 ? NULL : &sched->timings[sched->timing[run->index]];
+}
+
+/*
+ * A random schedule, with some entries on the same minutes to check that the last one added wins
+ */
+static void SelfTestFill(Sched_t *sched, uint32_t *seed, int adds, int8_t *added)
+{
+    SchedInit(sched);
+    for(int t = 0; t < 6; t++) SchedTiming(sched, 5 + t, 3, 10 + t, 3);
+    memset(added, -1, SCHED_WEEK_MIN);
+    for(int i = 0; i < adds; i++){
+        uint8_t days = 1 + SelfTestRandom(seed) % SCHED_ALL_DAYS;
+        int hour = SelfTestRandom(seed) % 24, minute = (SelfTestRandom(seed) % 4) * 15;
+        int timing = SelfTestRandom(seed) % 6;
+
+        if(!SchedAdd(sched, days, hour, minute, timing)) break;
+        for(int d = 0; d < 7; d++){
+            if(days & (1 << d)) added[SchedMinuteOfWeek(d, hour, minute)] = timing;
+        }
+    }
+}
+
+/*
+ * Local time of a minute of real time over two weeks: summer time starts at
+ * 02:00 of the first Sunday (02:00 becomes 03:00) and ends at 02:00 of the
+ * second one (02:00 becomes 01:00 again)
+ */
+static int32_t SelfTestLocal(int32_t real)
+{
+    if(real < 120) return real;
+    if(real < SCHED_WEEK_MIN + 60) return real + 60;
+    return real;
+}
+
+/*
+ * Run two weeks of real minutes through the summer time changes, waking
+ * only when the local time reaches the change SchedUpdate asked for, plus
+ * a spurious wake now and then. Every minute the timing running must be
+ * the one of the latest local time seen.
+ */
+static int SelfTestClock(const Sched_t *sched, uint32_t *seed, uint32_t *wakes)
+{
+    SchedRunner_t run;
+    int32_t due = 0, high = 0;
+    uint32_t woke = 0;
+    int errors = 0;
+
+    SchedStart(&run);
+    for(int32_t real = 0; real < 2 * SCHED_WEEK_MIN + SCHED_DAY_MIN; real++){
+        int32_t local = SelfTestLocal(real);
+        const SchedTiming_t *running;
+        uint16_t next;
+        uint32_t wait;
+        bool woken = local >= due;
+
+        if(local > high) high = local;
+        if(woken || SelfTestRandom(seed) % 97 == 0){
+            woke += woken;
+            SchedUpdate(sched, &run, local % SCHED_WEEK_MIN, &wait);
+            if(woken || local + wait < due) due = local + wait;
+        }
+        running = SchedRunning(sched, &run);
+        if(running == NULL || running != &sched->timings[sched->timing[SchedLookup(sched, high % SCHED_WEEK_MIN, &next)]]) errors++;
+    }
+    // one wake per change, and the two clock changes
+    if(woke > run.changes + 2) errors++;
+    *wakes += woke;
+    return errors;
+}
+
+/**
+ * Check the compiled lookup and next change against a minute by minute
+ * reference for random schedules, then run the summer time changes
+ *
+ * @return  true if every minute matched
+ */
+bool SchedSelfTest(void)
+{
+    static const int sizes[] = {1, 2, 10, 60, 200};
+    static Sched_t sched;
+    int8_t *added = malloc(SCHED_WEEK_MIN), *ref = malloc(SCHED_WEEK_MIN);
+    uint32_t seed = 0x5c4ed, wakes = 0;
+    int errors = 0, entries = 0;
+
+    if(added == NULL || ref == NULL){
+        free(added);
+        free(ref);
+        return false;
+    }
+    for(int trial = 0; trial < 40; trial++){
+        int last = -1, changed = 0;
+
+        SelfTestFill(&sched, &seed, sizes[trial % 5], added);
+        if(!SchedCompile(&sched)){
+            errors++;
+            continue;
+        }
+        entries += sched.count;
+        // reference: the timing added last at or before each minute, wrapping over the week
+        for(int m = 0; m < 2 * SCHED_WEEK_MIN; m++){
+            if(added[m % SCHED_WEEK_MIN] >= 0) last = added[m % SCHED_WEEK_MIN];
+            ref[m % SCHED_WEEK_MIN] = last;
+        }
+        for(int m = 0; m < SCHED_WEEK_MIN; m++) changed += ref[m] != ref[(m + SCHED_WEEK_MIN - 1) % SCHED_WEEK_MIN];
+        if(sched.count != (changed ? changed : 1)) errors++;
+        for(int i = 1; i < sched.count; i++){
+            if(sched.start[i] <= sched.start[i - 1]) errors++;
+        }
+        for(int m = 0; m < SCHED_WEEK_MIN; m++){
+            uint16_t next;
+            int index = SchedLookup(&sched, m, &next);
+
+            if(index < 0 || sched.timing[index] != ref[m]) errors++;
+            // nothing changes before next, and something does at next unless one timing runs all week
+            for(int k = (m + 1) % SCHED_WEEK_MIN; changed && k != next; k = (k + 1) % SCHED_WEEK_MIN){
+                if(ref[k] != ref[m]){
+                    errors++;
+                    break;
+                }
+            }
+            if(changed && ref[next] == ref[(next + SCHED_WEEK_MIN - 1) % SCHED_WEEK_MIN]) errors++;
+        }
+        if(trial % 5 == 4) errors += SelfTestClock(&sched, &seed, &wakes);
+    }
+    free(added);
+    free(ref);
+    printf("[SchedSelfTest] %s, %d entries, %"PRIu32" wakes over the summer time changes, %d errors\n",
+        errors ? "FAIL" : "ok", entries, wakes, errors);
+    return errors == 0;
+}
+
+/**
+ * Time lookups at random minutes on a full schedule, against a linear scan
+ *
+ * @param   lookups                   number of lookups of each kind
+ * @param   now_us                    monotonic microsecond clock of the platform
+ */
+void SchedBench(int lookups, int64_t (*now_us)(void))
+{
+    static Sched_t sched;
+    int8_t *added = malloc(SCHED_WEEK_MIN);
+    uint32_t seed = 0xbe7c;
+    volatile uint32_t sink = 0;
+    int64_t start, search_us, scan_us;
+
+    if(added == NULL) return;
+    SelfTestFill(&sched, &seed, SCHED_MAX_ENTRIES, added);
+    free(added);
+    SchedCompile(&sched);
+
+    start = now_us();
+    for(int i = 0; i < lookups; i++){
+        uint16_t next;
+
+        sink += SchedLookup(&sched, SelfTestRandom(&seed) % SCHED_WEEK_MIN, &next) + next;
+    }
+    search_us = now_us() - start;
+    start = now_us();
+    for(int i = 0; i < lookups; i++){
+        uint16_t minute = SelfTestRandom(&seed) % SCHED_WEEK_MIN;
+        int index = sched.count - 1;
+
+        for(int k = 0; k < sched.count && sched.start[k] <= minute; k++) index = k;
+        sink += index + sched.start[(index + 1) % sched.count];
+    }
+    scan_us = now_us() - start;
+    printf("[SchedBench] %d entries: lookup %"PRId64"ns, linear scan %"PRId64"ns, %u bytes table\n",
+        sched.count, search_us * 1000 / lookups, scan_us * 1000 / lookups, (unsigned)sizeof(Sched_t));
+}
+
+#ifdef ESP_PLATFORM
+
+#define TAG "SCHEDULE"
+#define SCHEDULE_VALID_TIME     1704067200  // 2024-01-01: an older clock was never set
+
+static const Sched_t *schedule;
+static SchedRunner_t runner;
+static WheelTimer_t timer;
+static void (*apply_timing)(const SchedTiming_t *timing);
+static bool enabled = true;
+static time_t wake_at;
+
+/*
+ * A change is due, or the clock was set: apply the timing running now and
+ * sleep until the next change. mktime turns the local time of the change
+ * into a wait in real time, a summer time change between the two included.
+ */
+static void ScheduleWake(void *arg)
+{
+    time_t now = time(NULL);
+    struct tm local;
+    uint32_t wait;
+    int64_t seconds;
+
+    if(!ScheduleClockSet()){
+        ESP_LOGW(TAG, "clock not set, schedule waits for it");
+        return;
+    }
+    localtime_r(&now, &local);
+    if(SchedUpdate(schedule, &runner, SchedMinuteOfWeek(local.tm_wday, local.tm_hour, local.tm_min), &wait) && enabled){
+        const SchedTiming_t *t = SchedRunning(schedule, &runner);
+
+        ESP_LOGI(TAG, "%02d:%02d day %d: G1=%d Y1=%d G2=%d Y2=%d", local.tm_hour, local.tm_min, local.tm_wday, t->G1, t->Y1, t->G2, t->Y2);
+        apply_timing(t);
+    }
+    local.tm_min += wait;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    wake_at = mktime(&local);
+    seconds = wake_at - now;
+    if(seconds <= 0) seconds = 60;
+    WheelStart(&timer, seconds * 1000);
+}
+
+/**
+ * Run a schedule from the wheel service, which must be running. The clock
+ * is the system time: the RTC keeps it across resets and deep sleep, so
+ * once set it runs from the boot on. Until then the schedule waits.
+ *
+ * @param   sched                     compiled schedule, kept
+ * @param   apply                     called from the wheel task with each new timing, must not block
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_ARG     if the schedule is not compiled
+ */
+esp_err_t ScheduleInit(const Sched_t *sched, void (*apply)(const SchedTiming_t *timing))
+{
+    if(!sched->compiled || sched->count == 0) return ESP_ERR_INVALID_ARG;
+    schedule = sched;
+    apply_timing = apply;
+    SchedStart(&runner);
+    WheelTimerInit(&timer, ScheduleWake, NULL);
+    WheelStart(&timer, 0);
+    return ESP_OK;
+}
+
+/**
+ * Set the clock, from the UART or a time source, and look at the schedule again
+ *
+ * @param   now                       seconds since 1970-01-01 UTC
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_ARG     if the time is before SCHEDULE_VALID_TIME
+ */
+esp_err_t ScheduleSetClock(time_t now)
+{
+    struct timeval tv = {.tv_sec = now};
+
+    if(now < SCHEDULE_VALID_TIME) return ESP_ERR_INVALID_ARG;
+    settimeofday(&tv, NULL);
+    if(schedule){
+        // from a new time the clock going back is no repeat
+        SchedStart(&runner);
+        WheelStart(&timer, 0);
+    }
+    return ESP_OK;
+}
+
+/**
+ * Whether the clock was ever set, local times before that mean nothing
+ */
+bool ScheduleClockSet(void)
+{
+    return time(NULL) >= SCHEDULE_VALID_TIME;
+}
+
+/**
+ * Follow the schedule or leave the timings to the UI; enabling applies the timing running now
+ */
+void ScheduleEnable(bool enable)
+{
+    enabled = enable;
+    if(enable && schedule){
+        SchedStart(&runner);
+        WheelStart(&timer, 0);
+    }
+}
+
+bool ScheduleEnabled(void)
+{
+    return enabled;
+}
+
+void ScheduleReport(void)
+{
+    time_t now = time(NULL);
+    struct tm local;
+    char text[32];
+
+    localtime_r(&now, &local);
+    strftime(text, sizeof(text), "%a %Y-%m-%d %H:%M:%S", &local);
+    ESP_LOGI(TAG, "%s, %s, %d entries, %"PRIu32" changes, next in %"PRId64"s", text, enabled ? "on" : "off",
+        schedule ? schedule->count : 0, runner.changes, (int64_t)(wake_at - now));
+}
+
+#endif
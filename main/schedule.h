@@ -0,0 +1,65 @@
+/*
+ * schedule.h
+ *
+ *  Time-of-day and day-of-week plan schedule: a sorted table of plan
+ *  changes over the week with a binary search lookup.
+ */
+
+#ifndef MAIN_SCHEDULE_H_
+#define MAIN_SCHEDULE_H_
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef ESP_PLATFORM
+#include <time.h>
+#include "esp_err.h"
+#endif
+
+#define SCHED_MAX_ENTRIES       512
+#define SCHED_MAX_TIMINGS       32
+#define SCHED_DAY_MIN           1440
+#define SCHED_WEEK_MIN          (7 * SCHED_DAY_MIN)
+#define SCHED_ALL_DAYS          0x7F    // day bits as tm_wday: bit 0 Sunday ... bit 6 Saturday
+#define SCHED_WORKDAYS          0x3E
+#define SCHED_WEEKEND           0x41
+#define SCHED_REPEAT_MIN        60      // the local clock going back this much or less repeats time, the plan holds
+
+typedef struct {
+    uint8_t G1, Y1, G2, Y2;             // seconds
+}SchedTiming_t;
+
+typedef struct {
+    uint16_t start[SCHED_MAX_ENTRIES];  // minute of the week, local time from Sunday 00:00, sorted by SchedCompile
+    uint8_t timing[SCHED_MAX_ENTRIES];  // index into timings, kept apart so the search reads start only
+    uint16_t count;
+    SchedTiming_t timings[SCHED_MAX_TIMINGS];
+    uint8_t timing_count;
+    bool compiled;
+}Sched_t;
+
+typedef struct {
+    int16_t index;                      // entry applied, -1 before the first one
+    uint16_t seen;                      // latest minute of the week seen, the clock going back holds until past it
+    uint32_t changes;
+}SchedRunner_t;
+
+void SchedInit(Sched_t *sched);
+int SchedTiming(Sched_t *sched, int G1, int Y1, int G2, int Y2);
+bool SchedAdd(Sched_t *sched, uint8_t days, int hour, int minute, int timing);
+bool SchedCompile(Sched_t *sched);
+uint16_t SchedMinuteOfWeek(int wday, int hour, int minute);
+int SchedLookup(const Sched_t *sched, uint16_t minute, uint16_t *next);
+void SchedStart(SchedRunner_t *run);
+bool SchedUpdate(const Sched_t *sched, SchedRunner_t *run, uint16_t minute, uint32_t *wait);
+const SchedTiming_t *SchedRunning(const Sched_t *sched, const SchedRunner_t *run);
+bool SchedSelfTest(void);
+void SchedBench(int lookups, int64_t (*now_us)(void));
+#ifdef ESP_PLATFORM
+esp_err_t ScheduleInit(const Sched_t *sched, void (*apply)(const SchedTiming_t *timing));
+esp_err_t ScheduleSetClock(time_t now);
+bool ScheduleClockSet(void);
+void ScheduleEnable(bool enable);
+bool ScheduleEnabled(void);
+void ScheduleReport(void);
+#endif
+
+#endif /* MAIN_SCHEDULE_H_ */
@@ -0,0 +1,231 @@
+/*
+ * segbright.c
+ *
+ *  Seven-segment brightness by PWM on the 74HC595 !OE line.
+ *
+ *  !OE only gates the chip outputs, it does not touch the shift or storage
+ *  registers, so the digits can be dimmed by the LEDC peripheral without any
+ *  extra shifting. Day/night changes are handed to the LEDC fade unit and
+ *  cost no CPU while they run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "driver/ledc.h"
+#include "esp_log.h"
+#include "segbright.h"
+
+#define TAG "SEGBRIGHT"
+
+#define SEGBRIGHT_MODE          LEDC_HIGH_SPEED_MODE
+#define SEGBRIGHT_TIMER         LEDC_TIMER_0
+#define SEGBRIGHT_CHANNEL       LEDC_CHANNEL_0
+#define SEGBRIGHT_RESOLUTION    LEDC_TIMER_10_BIT
+#define SEGBRIGHT_DUTY_MAX      ((1 << SEGBRIGHT_RESOLUTION) - 1)
+#define MINUTES_PER_DAY         1440
+
+// night level, ramp up at dawn (05:30-06:30), full day, ramp down at dusk (18:00-19:00)
+static const SegBrightPoint_t default_curve[] = {
+    {0, 40}, {330, 40}, {390, SEGBRIGHT_MAX}, {1080, SEGBRIGHT_MAX}, {1140, 40},
+};
+
+static const SegBrightPoint_t *curve = default_curve;
+static size_t curve_len = sizeof(default_curve) / sizeof(default_curve[0]);
+static int16_t oe_pin = -1;
+static uint8_t level_now;
+
+/**
+ * Drive !OE from an LEDC channel, inverted because !OE is active low.
+ * Starts at full brightness like the hard-wired !OE = GND.
+ *
+ * @param   oePin                     GPIO connected to !OE of every chip of the chain
+ * 
+ * @return
+ *          - ESP_OK                  if success
+ *          - error from the LEDC driver otherwise
+ */
+esp_err_t SegBrightInit(int16_t oePin)
+{
+    esp_err_t ret;
+    ledc_timer_config_t timer = {
+        .speed_mode = SEGBRIGHT_MODE,
+        .duty_resolution = SEGBRIGHT_RESOLUTION,
+        .timer_num = SEGBRIGHT_TIMER,
+        .freq_hz = SEGBRIGHT_FREQ_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    ledc_channel_config_t channel = {
+        .gpio_num = oePin,
+        .speed_mode = SEGBRIGHT_MODE,
+        .channel = SEGBRIGHT_CHANNEL,
+        .intr_type = LEDC_INTR_DISABLE,
+        .timer_sel = SEGBRIGHT_TIMER,
+        .duty = SEGBRIGHT_DUTY_MAX,
+        .hpoint = 0,
+        .flags.output_invert = 1,
+    };
+
+    ret = ledc_timer_config(&timer);
+    if(ret != ESP_OK) return ret;
+    ret = ledc_channel_config(&channel);
+    if(ret != ESP_OK) return ret;
+    ret = ledc_fade_func_install(0);
+    if(ret != ESP_OK) return ret;
+    oe_pin = oePin;
+    level_now = SEGBRIGHT_MAX;
+    return ESP_OK;
+}
+
+/**
+ * PWM duty of a brightness level, squared so that equal steps look equal
+ */
+uint32_t SegBrightDuty(uint8_t level)
+{
+    uint32_t duty = ((uint32_t)level * level * SEGBRIGHT_DUTY_MAX + SEGBRIGHT_MAX * SEGBRIGHT_MAX / 2) / (SEGBRIGHT_MAX * SEGBRIGHT_MAX);
+    return (level && duty == 0) ? 1 : duty;
+}
+
+/**
+ * Set the brightness, the fade runs in hardware and the call returns at once
+ *
+ * @param   level                     0 (off) to SEGBRIGHT_MAX
+ * @param   fade_ms                   fade duration, 0 to change at the next PWM period
+ */
+void SegBrightSet(uint8_t level, uint32_t fade_ms)
+{
+    if(oe_pin < 0) return;
+    if(fade_ms == 0){
+        ledc_set_duty(SEGBRIGHT_MODE, SEGBRIGHT_CHANNEL, SegBrightDuty(level));
+        ledc_update_duty(SEGBRIGHT_MODE, SEGBRIGHT_CHANNEL);
+    }else{
+        ledc_set_fade_time_and_start(SEGBRIGHT_MODE, SEGBRIGHT_CHANNEL, SegBrightDuty(level), fade_ms, LEDC_FADE_NO_WAIT);
+    }
+    level_now = level;
+}
+
+/**
+ * Target brightness of the last SegBrightSet, a fade may still be running
+ */
+uint8_t SegBrightGet(void)
+{
+    return level_now;
+}
+
+/**
+ * Replace the day/night curve, points sorted by minute, the table is not copied
+ */
+void SegBrightSetCurve(const SegBrightPoint_t *points, size_t count)
+{
+    if(points == NULL || count == 0){
+        curve = default_curve;
+        curve_len = sizeof(default_curve) / sizeof(default_curve[0]);
+    }else{
+        curve = points;
+        curve_len = count;
+    }
+}
+
+/**
+ * Brightness of the curve at a minute of the day, linear between points
+ * and wrapping from the last point of the day to the first one
+ */
+uint8_t SegBrightForMinute(uint16_t minute)
+{
+    const SegBrightPoint_t *a, *b;
+    int32_t span, pos;
+    size_t i;
+
+    minute %= MINUTES_PER_DAY;
+    for(i = 0; i < curve_len && curve[i].minute <= minute; i++);
+    a = &curve[(i + curve_len - 1) % curve_len];
+    b = &curve[i % curve_len];
+
+    span = ((int32_t)b->minute - a->minute + MINUTES_PER_DAY) % MINUTES_PER_DAY;
+    pos = ((int32_t)minute - a->minute + MINUTES_PER_DAY) % MINUTES_PER_DAY;
+    if(span == 0) return a->level;
+    return a->level + ((int32_t)b->level - a->level) * pos / span;
+}
+
+/**
+ * Fade to the curve level of a minute of the day
+ */
+void SegBrightApplyMinute(uint16_t minute, uint32_t fade_ms)
+{
+    uint8_t level = SegBrightForMinute(minute);
+    if(level != level_now) SegBrightSet(level, fade_ms);
+}
+
+/**
+ * Average chain current at a brightness level
+ *
+ * @param   level                     brightness level
+ * @param   segments                  number of lit segments
+ * 
+ * @return  current in uA
+ */
+uint32_t SegBrightCurrent_uA(uint8_t level, int segments)
+{
+    return (uint64_t)segments * SEGBRIGHT_SEGMENT_MA * 1000 * SegBrightDuty(level) / SEGBRIGHT_DUTY_MAX;
+}
+
+/**
+ * Print the duty and the current model for every 16th brightness level
+ *
+ * @param   segments                  number of lit segments, 4 digits showing 88 88 light 28
+ */
+void SegBrightReport(int segments)
+{
+    for(int level = 0; level <= SEGBRIGHT_MAX; level += (level == 240) ? 15 : 16){
+        printf("[SegBright] level=%3d duty=%4"PRIu32"/%d current=%"PRIu32"uA\n",
+            level, SegBrightDuty(level), SEGBRIGHT_DUTY_MAX, SegBrightCurrent_uA(level, segments));
+    }
+}
+
+static int64_t CommitTime(IC74HC595_t *chain, int loops)
+{
+    int64_t total = chain->total_us;
+    uint32_t updates = chain->updates;
+
+    for(int i = 0; i < loops; i++){
+        setNumber74HC595(chain, 0, chain->len, i);
+        commit74HC595(chain);
+    }
+    return (chain->total_us - total) / (chain->updates - updates);
+}
+
+/**
+ * Check that the PWM on !OE leaves the chain alone: the !OE pin is not one
+ * of the chain pins and latching takes the same time with the PWM steady,
+ * fading or off. Call before the chain is handed to the display service.
+ *
+ * @param   chain                     initialized 74HC595 chain
+ * @param   loops                     commits per measurement
+ * 
+ * @return  true if the PWM does not interfere
+ */
+bool SegBrightCheckLatch(IC74HC595_t *chain, int loops)
+{
+    int64_t steady, fading, off;
+    bool ok;
+
+    if(loops <= 0 || oe_pin < 0) return false;
+    if(oe_pin == chain->dataPin || oe_pin == chain->latchPin || oe_pin == chain->clkPin){
+        ESP_LOGE(TAG, "!OE on GPIO%d is also a chain pin", oe_pin);
+        return false;
+    }
+
+    SegBrightSet(SEGBRIGHT_MAX / 2, 0);
+    steady = CommitTime(chain, loops);
+    SegBrightSet(SEGBRIGHT_MAX, 500);
+    fading = CommitTime(chain, loops);
+    SegBrightSet(0, 0);
+    off = CommitTime(chain, loops);
+    SegBrightSet(SEGBRIGHT_MAX, 0);
+
+    // the LEDC runs on its own, any difference is measurement noise
+    ok = llabs(fading - steady) <= steady / 10 + 2 && llabs(off - steady) <= steady / 10 + 2;
+    ESP_LOGI(TAG, "latch check: steady=%"PRId64"us fading=%"PRId64"us off=%"PRId64"us %s",
+        steady, fading, off, ok ? "OK" : "FAIL");
+    return ok;
+}
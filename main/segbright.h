@@ -0,0 +1,35 @@
+/*
+ * segbright.h
+ *
+ *  Seven-segment brightness by PWM on the 74HC595 !OE line.
+ */
+
+#ifndef MAIN_SEGBRIGHT_H_
+#define MAIN_SEGBRIGHT_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "74HC595.h"
+
+#define SEGBRIGHT_MAX           255     // full brightness level
+#define SEGBRIGHT_FREQ_HZ       5000    // PWM frequency on !OE, far above flicker
+#define SEGBRIGHT_SEGMENT_MA    10      // current of one lit segment at full duty, set by the board resistors
+
+typedef struct {
+    uint16_t minute;        // minute of the day, 0-1439
+    uint8_t level;          // brightness at that minute
+}SegBrightPoint_t;
+
+esp_err_t SegBrightInit(int16_t oePin);
+void SegBrightSet(uint8_t level, uint32_t fade_ms);
+uint8_t SegBrightGet(void);
+void SegBrightSetCurve(const SegBrightPoint_t *points, size_t count);
+uint8_t SegBrightForMinute(uint16_t minute);
+void SegBrightApplyMinute(uint16_t minute, uint32_t fade_ms);
+uint32_t SegBrightDuty(uint8_t level);
+uint32_t SegBrightCurrent_uA(uint8_t level, int segments);
+void SegBrightReport(int segments);
+bool SegBrightCheckLatch(IC74HC595_t *chain, int loops);
+
+#endif /* MAIN_SEGBRIGHT_H_ */
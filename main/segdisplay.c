@@ -0,0 +1,287 @@
+/*
+ * segdisplay.c
+ *
+ *  Single owner of the 74HC595 seven-segment chain.
+ *
+ *  Producers never touch the chain: they store the digits they want into a
+ *  mailbox word (one atomic store, no lock) and wake the service task. The
+ *  service compares the mailbox with a shadow of what is latched and shifts
+ *  the chain only when the content changed. It wakes at least every
+ *  second for the supervisor's heartbeat.
+ *
+ *  The timing core shifts the chain itself when the digits must change
+ *  with the lamps: SegDisplayLatchWith holds the new digits in the shift
+ *  registers, writes the lamps and pulses the latch right after. The chain
+ *  lock keeps the service out meanwhile.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "segdisplay.h"
+#include "supervisor.h"
+
+#define TAG "SEGDISPLAY"
+
+static IC74HC595_t *chain;
+static TaskHandle_t service_task;
+static SemaphoreHandle_t chain_lock;
+static _Atomic uint32_t mailbox[SEGDISPLAY_MAX_WORDS];
+static uint32_t shadow[SEGDISPLAY_MAX_WORDS];
+static size_t words;
+static atomic_uint posted;
+static uint32_t shifted;
+static uint32_t latched_with;
+static int64_t latch_skew_max_us;
+static int supervisor_id = -1;
+
+static volatile bool stress_running;
+static uint32_t stress_torn;
+
+/*
+ * Copy the mailbox words that changed into the frame buffer, with the chain lock held
+ */
+static bool SegDisplayLoad(void)
+{
+    bool changed = false;
+
+    for(size_t w = 0; w < words; w++){
+        uint32_t value = atomic_load(&mailbox[w]);
+        if(value == shadow[w]) continue;
+        shadow[w] = value;
+        for(size_t b = 0; b < 4; b++){
+            setByte74HC595(chain, w * 4 + b, value >> (8 * (3 - b)));
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+static void SegDisplayTask(void *pvParameters)
+{
+    while(1){
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+        SupervisorBeat(supervisor_id);
+
+        xSemaphoreTake(chain_lock, portMAX_DELAY);
+        if(!SegDisplayLoad()){
+            xSemaphoreGive(chain_lock);
+            continue;
+        }
+        commit74HC595(chain);
+        shifted++;
+        xSemaphoreGive(chain_lock);
+
+        if(stress_running){
+            // every producer posts a word of four equal bytes
+            for(size_t b = 1; b < 4 && b < chain->len; b++){
+                if(chain->buf[b] != chain->buf[0]) stress_torn++;
+            }
+        }
+    }
+}
+
+/**
+ * Start the display service, it becomes the only writer of the chain
+ *
+ * @param   chain                     initialized 74HC595 chain
+ * 
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the task cannot be created
+ */
+esp_err_t SegDisplayInit(IC74HC595_t *ic)
+{
+    size_t count = (ic->len + 3) / 4;
+
+    chain_lock = xSemaphoreCreateMutex();
+    if(chain_lock == NULL) return ESP_ERR_NO_MEM;
+    chain = ic;
+    if(count > SEGDISPLAY_MAX_WORDS) count = SEGDISPLAY_MAX_WORDS;
+    for(size_t w = 0; w < count; w++){
+        atomic_store(&mailbox[w], 0);
+        shadow[w] = 0;
+    }
+    memset(ic->buf, 0, ic->len);
+    commit74HC595(ic);
+    words = count;
+
+    if(xTaskCreate(&SegDisplayTask, "7seg", 1024*2, NULL, 4, &service_task) != pdPASS){
+        return ESP_ERR_NO_MEM;
+    }
+    supervisor_id = SupervisorWatch("display", SEGDISPLAY_HEARTBEAT_MS, SegDisplayRestart, false);
+    return ESP_OK;
+}
+
+/**
+ * Replace a service task that stopped, for the supervisor: the new one
+ * shifts the whole chain out again
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the task cannot be created
+ */
+esp_err_t SegDisplayRestart(void)
+{
+    TaskHandle_t stopped = service_task;
+
+    service_task = NULL;
+    vTaskDelete(stopped);
+    // the stopped task may have died holding the chain lock
+    SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+    if(lock == NULL) return ESP_ERR_NO_MEM;
+    chain_lock = lock;
+    for(size_t w = 0; w < words; w++) shadow[w] = ~atomic_load(&mailbox[w]);
+    if(xTaskCreate(&SegDisplayTask, "7seg", 1024*2, NULL, 4, &service_task) != pdPASS){
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskNotifyGive(service_task);
+    return ESP_OK;
+}
+
+/**
+ * Post the wanted content of 4 chips, safe from any task
+ *
+ * @param   word                      chips word*4 .. word*4+3
+ * @param   segments                  chip word*4 in the most significant byte
+ */
+void SegDisplayPost(size_t word, uint32_t segments)
+{
+    if(word >= words) return;
+    atomic_store(&mailbox[word], segments);
+    atomic_fetch_add(&posted, 1);
+    if(service_task) xTaskNotifyGive(service_task);
+}
+
+/**
+ * Shift a word out from the calling task and latch it together with another
+ * output: write runs after the shift and the latch pulse follows it back to
+ * back, so both change together. The other words go out with their latest
+ * posts. Before SegDisplayInit, or if the chain stays busy, write runs alone
+ * and the word is left to the service.
+ *
+ * @param   word                      chips word*4 .. word*4+3
+ * @param   segments                  chip word*4 in the most significant byte
+ * @param   write                     output changed with the word, NULL for none
+ * @param   arg                       argument of write
+ *
+ * @return  microseconds from the start of write to the latch pulse, -1 if not latched with it
+ */
+int64_t SegDisplayLatchWith(size_t word, uint32_t segments, void (*write)(void *arg), void *arg)
+{
+    SemaphoreHandle_t lock = chain_lock;    // SegDisplayRestart may replace it meanwhile: give the one taken
+    int64_t start;
+
+    if(word >= words){
+        if(write) write(arg);
+        return -1;
+    }
+    atomic_store(&mailbox[word], segments);
+    atomic_fetch_add(&posted, 1);
+    if(xSemaphoreTake(lock, pdMS_TO_TICKS(SEGDISPLAY_LOCK_MS)) != pdTRUE){
+        if(write) write(arg);
+        if(service_task) xTaskNotifyGive(service_task);
+        return -1;
+    }
+    SegDisplayLoad();
+    shift74HC595(chain);
+    start = esp_timer_get_time();
+    if(write) write(arg);
+    latch74HC595(chain);
+    start = esp_timer_get_time() - start;
+    shifted++;
+    latched_with++;
+    if(start > latch_skew_max_us) latch_skew_max_us = start;
+    xSemaphoreGive(lock);
+    return start;
+}
+
+/**
+ * Post some bits of a word, safe from any task. The other bits keep what
+ * other producers posted, so several owners can share the chips of a word.
+ *
+ * @param   word                      chips word*4 .. word*4+3
+ * @param   mask                      bits to change
+ * @param   bits                      new value of those bits
+ */
+void SegDisplayPostBits(size_t word, uint32_t mask, uint32_t bits)
+{
+    uint32_t old;
+
+    if(word >= words) return;
+    old = atomic_load(&mailbox[word]);
+    while(!atomic_compare_exchange_weak(&mailbox[word], &old, (old & ~mask) | (bits & mask)));
+    atomic_fetch_add(&posted, 1);
+    if(service_task) xTaskNotifyGive(service_task);
+}
+
+/**
+ * Post 4 chips in write4Byte74HC595 order
+ */
+void SegDisplayPost4(size_t word, uint8_t data4, uint8_t data3, uint8_t data2, uint8_t data1)
+{
+    SegDisplayPost(word, ((uint32_t)data4 << 24) | ((uint32_t)data3 << 16) | ((uint32_t)data2 << 8) | data1);
+}
+
+void SegDisplayGetStats(SegDisplayStats_t *stats)
+{
+    stats->posted = atomic_load(&posted);
+    stats->shifted = shifted;
+    stats->skipped = (stats->posted > stats->shifted) ? stats->posted - stats->shifted : 0;
+}
+
+void SegDisplayReport(void)
+{
+    SegDisplayStats_t stats;
+
+    if(chain == NULL) return;
+    SegDisplayGetStats(&stats);
+    ESP_LOGI(TAG, "posted=%"PRIu32" shifted=%"PRIu32" skipped=%"PRIu32" last update=%"PRId64"us",
+        stats.posted, stats.shifted, stats.skipped, chain->update_us);
+    ESP_LOGI(TAG, "latched with the lamps=%"PRIu32" max skew=%"PRId64"us", latched_with, latch_skew_max_us);
+}
+
+static void StressProducer(void *pvParameters)
+{
+    uint32_t pattern = 0x01010101 * (uint32_t)(uintptr_t)pvParameters;
+    uint32_t n = 0;
+
+    while(stress_running){
+        SegDisplayPost(0, pattern);
+        if((++n & 0x3F) == 0) vTaskDelay(1);
+    }
+    vTaskDelete(NULL);
+}
+
+/**
+ * Stress the mailbox with concurrent producers and check that the chain
+ * only ever latched complete words. Takes over the display while running.
+ *
+ * @param   producers                 number of producer tasks (1-8)
+ * @param   duration_ms               test duration
+ */
+void SegDisplayStress(int producers, int duration_ms)
+{
+    SegDisplayStats_t before, after;
+
+    SegDisplayGetStats(&before);
+    stress_torn = 0;
+    stress_running = true;
+    for(int p = 1; p <= producers && p <= 8; p++){
+        xTaskCreatePinnedToCore(&StressProducer, "7seg stress", 1024*2, (void *)(uintptr_t)p, 3, NULL, p % 2);
+    }
+    vTaskDelay(pdMS_TO_TICKS(duration_ms));
+    stress_running = false;
+    vTaskDelay(pdMS_TO_TICKS(100));
+    SegDisplayGetStats(&after);
+
+    ESP_LOGI(TAG, "stress %d producers: posted=%"PRIu32" shifted=%"PRIu32" torn=%"PRIu32" %s",
+        producers, after.posted - before.posted, after.shifted - before.shifted, stress_torn,
+        stress_torn ? "FAIL" : "OK");
+}
@@ -0,0 +1,34 @@
+/*
+ * segdisplay.h
+ *
+ *  Single owner of the 74HC595 seven-segment chain.
+ */
+
+#ifndef MAIN_SEGDISPLAY_H_
+#define MAIN_SEGDISPLAY_H_
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "74HC595.h"
+
+#define SEGDISPLAY_MAX_WORDS    4       // mailbox words, 4 chips each
+#define SEGDISPLAY_HEARTBEAT_MS 3000    // supervisor timeout, the service wakes at least every second
+#define SEGDISPLAY_LOCK_MS      5       // longest SegDisplayLatchWith wait for a shift of the service
+
+typedef struct {
+    uint32_t posted;        // values posted by producers
+    uint32_t shifted;       // chain updates actually shifted out
+    uint32_t skipped;       // posts that needed no shift (unchanged or coalesced)
+}SegDisplayStats_t;
+
+esp_err_t SegDisplayInit(IC74HC595_t *chain);
+esp_err_t SegDisplayRestart(void);
+void SegDisplayPost(size_t word, uint32_t segments);
+int64_t SegDisplayLatchWith(size_t word, uint32_t segments, void (*write)(void *arg), void *arg);
+void SegDisplayPostBits(size_t word, uint32_t mask, uint32_t bits);
+void SegDisplayPost4(size_t word, uint8_t data4, uint8_t data3, uint8_t data2, uint8_t data1);
+void SegDisplayGetStats(SegDisplayStats_t *stats);
+void SegDisplayReport(void);
+void SegDisplayStress(int producers, int duration_ms);
+
+#endif /* MAIN_SEGDISPLAY_H_ */
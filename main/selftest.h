@@ -0,0 +1,31 @@
+/*
+ * selftest.h
+ *
+ *  Pseudo-random numbers of the self-tests and benchmarks, the same
+ *  sequence from a seed on the board and on the host.
+ */
+
+#ifndef MAIN_SELFTEST_H_
+#define MAIN_SELFTEST_H_
+#include <stdint.h>
+
+/*
+ * Next 16 bits of the C library example LCG, the high half of its state
+ */
+static inline uint32_t SelfTestRandom(uint32_t *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 16;
+}
+
+/*
+ * 32 bits from two steps, for ranges beyond 16 bits
+ */
+static inline uint32_t SelfTestRandom32(uint32_t *seed)
+{
+    uint32_t high = SelfTestRandom(seed);
+
+    return high << 16 | SelfTestRandom(seed);
+}
+
+#endif /* MAIN_SELFTEST_H_ */
@@ -4,6 +4,7 @@
 #include <math.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
 #include <driver/spi_master.h>
 #include <driver/gpio.h>
 #include "esp_log.h"
@@ -241,6 +242,7 @@ void lcdInit(ST7735_t * dev, int width, int height, int offsetx, int offsety)
 	dev->_font_direction = DIRECTION0;
 	dev->_font_fill = false;
 	dev->_font_underline = false;
+	dev->_font_scale = 1;
 
 	spi_master_write_command(dev, 0x01);	//Software Reset 
 	delayMS(150);
@@ -419,9 +421,12 @@ void lcdDrawFillRect(ST7735_t * dev, uint16_t x1, uint16_t y1, uint16_t x2, uint
 	spi_master_write_addr(dev, _y1, _y2);
 	spi_master_write_command(dev, 0x2C);	//	Memory Write
 
-	for(int i=_x1;i<=_x2;i++){
-		uint16_t size = _y2-_y1+1;
+	// one transaction per 512 pixels (the size of the color buffer)
+	uint32_t total = (uint32_t)(_x2-_x1+1) * (_y2-_y1+1);
+	while (total > 0) {
+		uint16_t size = (total > 512) ? 512 : total;
 		spi_master_write_color(dev, color, size);
+		total -= size;
 	}
 }
 
@@ -639,12 +644,140 @@ uint16_t rgb565_conv(uint16_t r,uint16_t g,uint16_t b) {
 	return (((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
 }
 
-// Draw ASCII character
+// Screen coordinates of glyph pixel (u across, v down) for a glyph of
+// height ph drawn at (x,y), following the direction rules of lcdDrawChar.
+static void lcdGlyphToScreen(ST7735_t * dev, int x, int y, int ph, int u, int v, int *sx, int *sy) {
+	if (dev->_font_direction == 0) {
+		*sx = x + u;
+		*sy = y - (ph-1) + v;
+	} else if (dev->_font_direction == 2) {
+		*sx = x - u;
+		*sy = y + ph + 1 - v;
+	} else if (dev->_font_direction == 1) {
+		*sx = x + ph - v;
+		*sy = y + u;
+	} else {
+		*sx = x - (ph-1) + v;
+		*sy = y - u;
+	}
+}
+
+// Inverse of lcdGlyphToScreen.
+static void lcdScreenToGlyph(ST7735_t * dev, int x, int y, int ph, int sx, int sy, int *u, int *v) {
+	if (dev->_font_direction == 0) {
+		*u = sx - x;
+		*v = sy - (y - (ph-1));
+	} else if (dev->_font_direction == 2) {
+		*u = x - sx;
+		*v = y + ph + 1 - sy;
+	} else if (dev->_font_direction == 1) {
+		*u = sy - y;
+		*v = x + ph - sx;
+	} else {
+		*u = y - sy;
+		*v = sx - (x - (ph-1));
+	}
+}
+
+// Screen rectangle covering glyph pixels u0..u1 x v0..v1, clipped to the panel.
+// Returns false if nothing is visible.
+static bool lcdGlyphRect(ST7735_t * dev, int x, int y, int ph, int u0, int v0, int u1, int v1,
+	uint16_t *x1, uint16_t *y1, uint16_t *x2, uint16_t *y2) {
+	int ax, ay, bx, by;
+	lcdGlyphToScreen(dev, x, y, ph, u0, v0, &ax, &ay);
+	lcdGlyphToScreen(dev, x, y, ph, u1, v1, &bx, &by);
+	int minx = (ax < bx) ? ax : bx;
+	int maxx = (ax < bx) ? bx : ax;
+	int miny = (ay < by) ? ay : by;
+	int maxy = (ay < by) ? by : ay;
+	if (maxx < 0 || maxy < 0 || minx >= dev->_width || miny >= dev->_height) return false;
+	*x1 = (minx < 0) ? 0 : minx;
+	*y1 = (miny < 0) ? 0 : miny;
+	*x2 = (maxx >= dev->_width) ? dev->_width-1 : maxx;
+	*y2 = (maxy >= dev->_height) ? dev->_height-1 : maxy;
+	return true;
+}
+
+/**
+ * @brief Draw a glyph enlarged by dev->_font_scale.
+ * Every glyph bit becomes a scale x scale block. With font fill on, each
+ * scaled glyph row is written as one window in one transaction; otherwise
+ * runs of set bits are emitted as filled rectangles.
+ * 
+ * @return the position of the next character, as lcdDrawChar.
+ */
+static int lcdDrawScaledChar(ST7735_t * dev, uint8_t *fonts, uint8_t pw, uint8_t ph, uint16_t x, uint16_t y, uint16_t color) {
+	static uint16_t band[512];
+	int s = dev->_font_scale;
+	int PW = pw * s;
+	int PH = ph * s;
+	int stride = (pw + 7) / 8;
+	uint16_t x1, y1, x2, y2;
+
+	for(int v=0;v<ph;v++) {
+		uint8_t *row = &fonts[v * stride];
+		bool underline = dev->_font_underline && v >= ph-2;
+
+		if (dev->_font_fill && PW * s <= 512) {
+			if (!lcdGlyphRect(dev, x, y, PH, 0, v*s, PW-1, v*s+s-1, &x1, &y1, &x2, &y2)) continue;
+			int n = 0;
+			for(int sy=y1;sy<=y2;sy++) {
+				for(int sx=x1;sx<=x2;sx++) {
+					int u, vv;
+					lcdScreenToGlyph(dev, x, y, PH, sx, sy, &u, &vv);
+					u /= s;
+					if (underline) {
+						band[n++] = dev->_font_underline_color;
+					} else if (row[u/8] & (0x80 >> (u%8))) {
+						band[n++] = color;
+					} else {
+						band[n++] = dev->_font_fill_color;
+					}
+				}
+			}
+			spi_master_write_command(dev, 0x2A);	// set column(x) address
+			spi_master_write_addr(dev, x1 + dev->_offsetx, x2 + dev->_offsetx);
+			spi_master_write_command(dev, 0x2B);	// set Page(y) address
+			spi_master_write_addr(dev, y1 + dev->_offsety, y2 + dev->_offsety);
+			spi_master_write_command(dev, 0x2C);	//	Memory Write
+			spi_master_write_colors(dev, band, n);
+			continue;
+		}
+
+		if (underline) {
+			if (lcdGlyphRect(dev, x, y, PH, 0, v*s, PW-1, v*s+s-1, &x1, &y1, &x2, &y2))
+				lcdDrawFillRect(dev, x1, y1, x2, y2, dev->_font_underline_color);
+			continue;
+		}
+		int u = 0;
+		while (u < pw) {
+			if (!(row[u/8] & (0x80 >> (u%8)))) {
+				u++;
+				continue;
+			}
+			int run = u;
+			while (run+1 < pw && (row[(run+1)/8] & (0x80 >> ((run+1)%8)))) run++;
+			if (lcdGlyphRect(dev, x, y, PH, u*s, v*s, run*s+s-1, v*s+s-1, &x1, &y1, &x2, &y2))
+				lcdDrawFillRect(dev, x1, y1, x2, y2, color);
+			u = run + 1;
+		}
+	}
+
+	int next = 0;
+	if (dev->_font_direction == 0) next = x + PW;
+	if (dev->_font_direction == 2) next = x - PW;
+	if (dev->_font_direction == 1) next = y + PW;
+	if (dev->_font_direction == 3) next = y - PW;
+	if (next < 0) next = 0;
+	return next;
+}
+
+// Draw character
 // x:X coordinate
 // y:Y coordinate
-// ascii: ascii code
+// code: ascii or Unicode code point
 // color:color
-int lcdDrawChar(ST7735_t * dev, FontxFile *fxs, uint16_t x, uint16_t y, uint8_t ascii, uint16_t color) {
+int lcdDrawChar(ST7735_t * dev, FontxFile *fxs, uint16_t x, uint16_t y, uint16_t code, uint16_t color) {
 	uint16_t xx,yy,bit,ofs;
 	unsigned char fonts[128]; // font pattern
 	unsigned char pw, ph;
@@ -653,10 +786,11 @@ int lcdDrawChar(ST7735_t * dev, FontxFile *fxs, uint16_t x, uint16_t y, uint8_t
 	bool rc;
 
 	// if(_DEBUG_)printf("_font_direction=%d x=%d y=%d\n",dev->_font_direction,x,y);
-	rc = GetFontx(fxs, ascii, fonts, &pw, &ph);
+	rc = GetFontx(fxs, code, fonts, &pw, &ph);
 	// if(_DEBUG_)printf("GetFontx rc=%d pw=%d ph=%d\n",rc,pw,ph);
 	if(_DEBUG_)ShowFont(fonts, pw, ph);
 	if (!rc) return 0;
+	if (dev->_font_scale > 1) return lcdDrawScaledChar(dev, fonts, pw, ph, x, y, color);
 
 	uint16_t xd1 = 0;
 	uint16_t yd1 = 0;
@@ -796,132 +930,35 @@ int lcdDrawString(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint8_t
 }
 
 
-#if 0
-int lcdDrawSJISChar(ST7735_t * dev, FontxFile *fxs, uint16_t x,uint16_t y,uint16_t sjis,uint16_t color) {
-	uint16_t xx,yy,bit,ofs;
-	unsigned char fonts[128]; // font pattern
-	unsigned char pw, ph;
-	int h,w;
-	uint16_t mask;
-	bool rc;
-
-	if(_DEBUG_)printf("_font_direction=%d\n",dev->_font_direction);
-
-	rc = GetFontx(fxs, sjis, fonts, &pw, &ph); // SJIS -> Font pattern
-	if(_DEBUG_)printf("GetFontx rc=%d pw=%d ph=%d\n",rc,pw,ph);
-	if (!rc) return 0;
-
-	uint16_t xd1, yd1;
-	uint16_t xd2, yd2;
-	uint16_t xss, yss;
-	uint16_t xsd, ysd;
-	int next;
-	if (dev->_font_direction == 0) {
-		xd1 = +1;
-		yd1 = -1;
-		xd2 =  0;
-		yd2 =  0;
-		xss =  x;
-		yss =  y + ph - 1;
-		xsd =  1;
-		ysd =  0;
-		next = x + pw;
-	} else if (dev->_font_direction == 2) {
-		xd1 = -1;
-		yd1 = +1;
-		xd2 =  0;
-		yd2 =  0;
-		xss =  x;
-		yss =  y - ph + 1;
-		xsd =  1;
-		ysd =  0;
-		next = x - pw;
-	} else if (dev->_font_direction == 1) {
-		xd1 =  0;
-		yd1 =  0;
-		xd2 = -1;
-		yd2 = -1;
-		xss =  x + ph;
-		yss =  y;
-		xsd =  0;
-		ysd =  1;
-		next = y - pw;
-	} else if (dev->_font_direction == 3) {
-		xd1 =  0;
-		yd1 =  0;
-		xd2 = +1;
-		yd2 = +1;
-		xss =  x - ph - 1;
-		yss =  y;
-		xsd =  0;
-		ysd =  1;
-		next = y + pw;
-	}
-
-	int bits;
-	if(_DEBUG_)printf("xss=%d yss=%d\n",xss,yss);
-	ofs = 0;
-	yy = yss;
-	xx = xss;
-	for(h=0;h<ph;h++) {
-		if(xsd) xx = xss;
-		if(ysd) yy = yss;
-		//	  for(w=0;w<(pw/8);w++) {
-		bits = pw;
-		for(w=0;w<((pw+4)/8);w++) {
-			mask = 0x80;
-			for(bit=0;bit<8;bit++) {
-				bits--;
-				if (bits < 0) continue;
-				//if(_DEBUG_)printf("xx=%d yy=%d mask=%02x fonts[%d]=%02x\n",xx,yy,mask,ofs,fonts[ofs]);
-				if (fonts[ofs] & mask) {
-					lcdDrawPixel(dev, xx, yy, color);
-				} else {
-					if (dev->_font_fill) lcdDrawPixel(dev, xx, yy, dev->_font_fill_color);
-				}
-				if (h == (ph-2) && dev->_font_underline)
-					lcdDrawPixel(xx, yy, dev->_font_underline_color);
-				if (h == (ph-1) && dev->_font_underline)
-					lcdDrawPixel(xx, yy, dev->_font_underline_color);
-				xx = xx + xd1;
-				yy = yy + yd2;
-				mask = mask >> 1;
-			}
-			ofs++;
-		}
-		yy = yy + yd1;
-		xx = xx + xd2;
-	}
-
-	if (next < 0) next = 0;
-	return next;
-}
-
-int lcdDrawUTF8Char(ST7735_t * dev, FontxFile *fx, uint16_t x,uint16_t y,uint8_t *utf8,uint16_t color) {
-	uint16_t sjis[1];
-
-	sjis[0] = UTF2SJIS(utf8);
-	if(_DEBUG_)printf("sjis=%04x\n",sjis[0]);
-	return lcdDrawSJISChar(dev, fx, x, y, sjis[0], color);
+// Draw UTF-8 character
+// x:X coordinate
+// y:Y coordinate
+// utf8: first byte of a UTF-8 sequence
+// color:color
+int lcdDrawUTF8Char(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint8_t *utf8, uint16_t color) {
+	const uint8_t *p = utf8;
+	uint16_t code = UTF2Unicode(&p);
+	if(_DEBUG_)printf("code=%04x\n",code);
+	return lcdDrawChar(dev, fx, x, y, code, color);
 }
 
-int lcdDrawUTF8String(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, unsigned char *utfs, uint16_t color) {
+int lcdDrawUTF8String(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint8_t *utfs, uint16_t color) {
 
 	int i;
 	int spos;
-	uint16_t sjis[64];
-	spos = String2SJIS(utfs, strlen((char *)utfs), sjis, 64);
+	uint16_t codes[64];
+	spos = String2Unicode(utfs, strlen((char *)utfs), codes, 64);
 	if(_DEBUG_)printf("spos=%d\n",spos);
 	for(i=0;i<spos;i++) {
-		if(_DEBUG_)printf("sjis[%d]=%x y=%d\n",i,sjis[i],y);
+		if(_DEBUG_)printf("codes[%d]=%x y=%d\n",i,codes[i],y);
 		if (dev->_font_direction == 0)
-			x = lcdDrawSJISChar(dev, fx, x, y, sjis[i], color);
+			x = lcdDrawChar(dev, fx, x, y, codes[i], color);
 		if (dev->_font_direction == 1)
-			y = lcdDrawSJISChar(dev, fx, x, y, sjis[i], color);
+			y = lcdDrawChar(dev, fx, x, y, codes[i], color);
 		if (dev->_font_direction == 2)
-			x = lcdDrawSJISChar(dev, fx, x, y, sjis[i], color);
+			x = lcdDrawChar(dev, fx, x, y, codes[i], color);
 		if (dev->_font_direction == 3)
-			y = lcdDrawSJISChar(dev, fx, x, y, sjis[i], color);
+			y = lcdDrawChar(dev, fx, x, y, codes[i], color);
 	}
 	if (dev->_font_direction == 0) return x;
 	if (dev->_font_direction == 2) return x;
@@ -929,12 +966,16 @@ int lcdDrawUTF8String(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uns
 	if (dev->_font_direction == 3) return y;
 	return 0;
 }
-#endif
 
 void lcdSetFontDirection(ST7735_t * dev, uint16_t dir) {
 	dev->_font_direction = dir;
 }
 
+// Integer glyph magnification for lcdDrawChar/lcdDrawString (1 = native size)
+void lcdSetFontScale(ST7735_t * dev, uint16_t scale) {
+	dev->_font_scale = (scale < 1) ? 1 : scale;
+}
+
 void lcdSetFontFill(ST7735_t * dev, uint16_t color) {
 	dev->_font_fill = true;
 	dev->_font_fill_color = color;
@@ -955,3 +996,41 @@ void lcdUnsetFontUnderLine(ST7735_t * dev) {
 	dev->_font_underline = false;
 }
 
+/**
+ * @brief Print the time to draw a row of digits with the native 32px font
+ * and with the 16px font at scale 2, with and without font fill.
+ * 
+ * @param dev pointer to the ST7735_t struct
+ * @param fx16 8x16 font
+ * @param fx32 16x32 font
+ */
+void lcdBenchFont(ST7735_t * dev, FontxFile *fx16, FontxFile *fx32) {
+	uint8_t digits[] = "0123456789";
+	uint16_t direction = dev->_font_direction;
+	uint16_t scale = dev->_font_scale;
+	bool fill = dev->_font_fill;
+	uint16_t fill_color = dev->_font_fill_color;
+
+	lcdSetFontDirection(dev, DIRECTION270);
+	for(int f=0;f<2;f++) {
+		if (f) lcdSetFontFill(dev, BLACK); else lcdUnsetFontFill(dev);
+
+		lcdSetFontScale(dev, 1);
+		lcdDrawString(dev, fx32, 40, 159, digits, WHITE);	// open the font file outside the timing
+		int64_t t0 = esp_timer_get_time();
+		lcdDrawString(dev, fx32, 40, 159, digits, WHITE);
+		int64_t t1 = esp_timer_get_time();
+
+		lcdSetFontScale(dev, 2);
+		lcdDrawString(dev, fx16, 90, 159, digits, WHITE);
+		int64_t t2 = esp_timer_get_time();
+		lcdDrawString(dev, fx16, 90, 159, digits, WHITE);
+		int64_t t3 = esp_timer_get_time();
+
+		printf("[lcdBenchFont]fill=%d native32=%"PRId64"us scaled16x2=%"PRId64"us\n", f, t1 - t0, t3 - t2);
+	}
+	dev->_font_direction = direction;
+	dev->_font_scale = scale;
+	dev->_font_fill = fill;
+	dev->_font_fill_color = fill_color;
+}
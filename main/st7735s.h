@@ -28,6 +28,7 @@ typedef struct {
 	uint16_t _font_fill_color;
 	uint16_t _font_underline;
 	uint16_t _font_underline_color;
+	uint16_t _font_scale;
 	int16_t _dc;
 	spi_device_handle_t _SPIHandle;
 } ST7735_t;
@@ -55,12 +56,16 @@ void lcdDrawRoundRect(ST7735_t * dev, uint16_t x1, uint16_t y1, uint16_t x2, uin
 void lcdDrawArrow(ST7735_t * dev, uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1, uint16_t w, uint16_t color);
 void lcdDrawFillArrow(ST7735_t * dev, uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1, uint16_t w, uint16_t color);
 uint16_t rgb565_conv(uint16_t r, uint16_t g, uint16_t b);
-int lcdDrawChar(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint8_t ascii, uint16_t color);
+int lcdDrawChar(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint16_t code, uint16_t color);
 int lcdDrawString(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint8_t * ascii, uint16_t color);
+int lcdDrawUTF8Char(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint8_t *utf8, uint16_t color);
+int lcdDrawUTF8String(ST7735_t * dev, FontxFile *fx, uint16_t x, uint16_t y, uint8_t *utfs, uint16_t color);
 void lcdSetFontDirection(ST7735_t * dev, uint16_t);
+void lcdSetFontScale(ST7735_t * dev, uint16_t scale);
 void lcdSetFontFill(ST7735_t * dev, uint16_t color);
 void lcdUnsetFontFill(ST7735_t * dev);
 void lcdSetFontUnderLine(ST7735_t * dev, uint16_t color);
 void lcdUnsetFontUnderLine(ST7735_t * dev);
+void lcdBenchFont(ST7735_t * dev, FontxFile *fx16, FontxFile *fx32);
 #endif /* MAIN_ST7735_H_ */
 
@@ -0,0 +1,390 @@
+/*
+ * supervisor.c
+ *
+ *  Task supervisor: heartbeats of the timing, display and command tasks,
+ *  escalating from a task restart to the flashing yellow fallback to a
+ *  controlled reboot.
+ *
+ *  Each watched task beats at least once per timeout. A task that misses
+ *  its timeout is deleted and created again, up to SUP_RESTARTS times until
+ *  it has run SUP_HEALTHY_MS since its last restart. When the restarts are
+ *  used up or the task cannot be created (no heap left for its stack), a
+ *  task the lamps depend on takes them to flashing yellow from the LEDC,
+ *  with no task involved, and the board reboots SUP_FALLBACK_MS later; any
+ *  other task reboots it at once, the lamps resuming their checkpoint. The
+ *  fallback has no way back but the reboot: the lamps were taken from the
+ *  controller.
+ *
+ *  The heartbeats also feed one task watchdog user per task, so the task
+ *  watchdog names a task that stopped in its own log; the supervisor task
+ *  itself is subscribed to the task watchdog.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "supervisor.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_task_wdt.h"
+#include "esp_timer.h"
+#endif
+
+void SupInit(Sup_t *sup)
+{
+    memset(sup, 0, sizeof(Sup_t));
+}
+
+/**
+ * Watch a task from now, or again under a name watched before: a task
+ * created anew keeps its restarts
+ *
+ * @param   sup                       supervisor core
+ * @param   name                      task name, kept
+ * @param   timeout_ms                longest time between two heartbeats
+ * @param   restartable               the task can be deleted and created again
+ * @param   lamps                     the lamps stop with the task
+ * @param   now_ms                    millisecond clock
+ *
+ * @return  task number, -1 if SUP_MAX_TASKS are watched
+ */
+int SupWatch(Sup_t *sup, const char *name, uint32_t timeout_ms, bool restartable, bool lamps, uint32_t now_ms)
+{
+    SupTask_t *t;
+    int id;
+
+    for(id = 0; id < sup->count && strcmp(sup->task[id].name, name) != 0; id++);
+    if(id == SUP_MAX_TASKS) return -1;
+    t = &sup->task[id];
+    if(id == sup->count){
+        memset(t, 0, sizeof(SupTask_t));
+        t->name = name;
+        sup->count++;
+    }
+    t->timeout_ms = timeout_ms;
+    t->restartable = restartable;
+    t->lamps = lamps;
+    t->beat_ms = now_ms;
+    t->watched = true;
+    return id;
+}
+
+void SupBeat(Sup_t *sup, int id, uint32_t now_ms)
+{
+    SupTask_t *t = &sup->task[id];
+
+    t->beat_ms = now_ms;
+    if(t->restarts && now_ms - t->restart_ms >= SUP_HEALTHY_MS) t->restarts = 0;
+}
+
+/**
+ * The task stops on purpose, as the command task when the terminal is left
+ */
+void SupLeave(Sup_t *sup, int id)
+{
+    sup->task[id].watched = false;
+}
+
+/*
+ * A task is given up: the fallback if the lamps depend on it and it has
+ * not started yet, the reboot otherwise
+ */
+static SupAction_t SupEscalate(Sup_t *sup, SupTask_t *t, uint32_t now_ms)
+{
+    t->watched = false;
+    if(t->lamps && sup->level < SUP_FALLBACK){
+        sup->level = SUP_FALLBACK;
+        sup->fallback_ms = now_ms;
+        return SUP_FALLBACK;
+    }
+    sup->level = SUP_REBOOT;
+    return SUP_REBOOT;
+}
+
+/**
+ * Check the heartbeats, every SUP_PERIOD_MS. Takes at most one step of the
+ * escalation per call.
+ *
+ * @param   sup                       supervisor core
+ * @param   now_ms                    millisecond clock
+ * @param   id                        set to the task the action is for, -1 for the reboot ending the fallback
+ *
+ * @return  action the caller owes
+ */
+SupAction_t SupCheck(Sup_t *sup, uint32_t now_ms, int *id)
+{
+    *id = -1;
+    if(sup->level == SUP_REBOOT) return SUP_REBOOT;
+    if(sup->level == SUP_FALLBACK && now_ms - sup->fallback_ms >= SUP_FALLBACK_MS){
+        sup->level = SUP_REBOOT;
+        return SUP_REBOOT;
+    }
+    for(int i = 0; i < sup->count; i++){
+        SupTask_t *t = &sup->task[i];
+
+        if(!t->watched || now_ms - t->beat_ms <= t->timeout_ms) continue;
+        *id = i;
+        if(t->restartable && t->restarts < SUP_RESTARTS){
+            t->restarts++;
+            t->restart_ms = t->beat_ms = now_ms;
+            sup->restarts++;
+            return SUP_RESTART;
+        }
+        return SupEscalate(sup, t, now_ms);
+    }
+    return SUP_OK;
+}
+
+/**
+ * A SUP_RESTART could not create the task again: the escalation goes on at once
+ */
+SupAction_t SupRestartFailed(Sup_t *sup, int id, uint32_t now_ms)
+{
+    return SupEscalate(sup, &sup->task[id], now_ms);
+}
+
+const char *SupActionName(SupAction_t action)
+{
+    static const char *names[] = {"ok", "restart", "fallback", "reboot"};
+
+    return action <= SUP_REBOOT ? names[action] : "?";
+}
+
+typedef struct {
+    const char *name;
+    int8_t task;            // task failing, -1 for none
+    uint32_t fail_ms;       // its last heartbeat is before this
+    uint32_t runs_ms;       // after a restart it beats this long and fails again, UINT32_MAX for good
+    bool create_fails;      // a restart cannot create it
+    bool leaves;            // it leaves the supervisor when it stops
+    const char *expect;     // actions: r restart, f fallback, b reboot
+}SupFault_t;
+
+/**
+ * Fault injection matrix in virtual time: the timing core (1 s heartbeat,
+ * 2 s timeout, lamps depend on it), the display service and the command
+ * task (3 s timeouts) beat from different phases while one of them hangs,
+ * flaps, cannot be created again or leaves. Every row must take exactly the
+ * expected actions, each one within SUP_PERIOD_MS of the timeout after the
+ * last heartbeat (or restart), and the reboot SUP_FALLBACK_MS after the
+ * fallback. Prints the time from the fault to each step.
+ *
+ * @return  true if every row escalated as expected
+ */
+bool SupSelfTest(void)
+{
+    static const char *names[] = {"timing", "display", "command"};
+    static const uint32_t period[] = {1000, 1000, 500}, timeout[] = {2000, 3000, 3000}, phase[] = {0, 300, 700};
+    static const bool lamps[] = {true, false, false};
+    static const SupFault_t faults[] = {
+        {"no fault",                     -1, 0,     0,          false, false, ""},
+        {"timing hangs, restart helps",  0,  5050,  UINT32_MAX, false, false, "r"},
+        {"timing hangs for good",        0,  5050,  0,          false, false, "rrfb"},
+        {"timing restart out of memory", 0,  5050,  0,          true,  false, "rfb"},
+        {"timing hangs every 30 s",      0,  5050,  30000,      false, false, "rrfb"},
+        {"timing hangs every 90 s",      0,  5050,  90000,      false, false, "rrrrrrr"},
+        {"display hangs for good",       1,  8000,  0,          false, false, "rrb"},
+        {"command exits silently",       2,  12345, UINT32_MAX, false, false, "r"},
+        {"command leaves on !X!",        2,  12345, 0,          false, true,  ""},
+    };
+    static Sup_t sup;
+    int errors = 0;
+
+    for(int f = 0; f < sizeof(faults) / sizeof(faults[0]); f++){
+        const SupFault_t *fault = &faults[f];
+        uint32_t next[3], beat[3], fail = fault->fail_ms, at[4] = {0};
+        char actions[16] = "";
+        int n = 0;
+
+        SupInit(&sup);
+        for(int t = 0; t < 3; t++){
+            SupWatch(&sup, names[t], timeout[t], true, lamps[t], 0);
+            next[t] = phase[t];
+            beat[t] = 0;
+        }
+        for(uint32_t now = 10; now <= 600000 && sup.level != SUP_REBOOT; now += 10){
+            SupAction_t action;
+            int id;
+
+            for(int t = 0; t < 3; t++){
+                if(next[t] > now) continue;
+                if(t == fault->task && now >= fail){
+                    if(fault->leaves && sup.task[t].watched) SupLeave(&sup, t);
+                    next[t] = UINT32_MAX;
+                    continue;
+                }
+                SupBeat(&sup, t, now);
+                beat[t] = now;
+                next[t] += period[t];
+            }
+            if(now % SUP_PERIOD_MS) continue;
+            action = SupCheck(&sup, now, &id);
+            if(action == SUP_OK) continue;
+            if(action == SUP_REBOOT && id < 0){
+                if(now - sup.fallback_ms < SUP_FALLBACK_MS || now - sup.fallback_ms >= SUP_FALLBACK_MS + SUP_PERIOD_MS) errors++;
+            }else if(id != fault->task || now - beat[id] <= timeout[id] || now - beat[id] > timeout[id] + SUP_PERIOD_MS){
+                errors++;
+            }
+            if(n < sizeof(actions) - 2) actions[n++] = "-rfb"[action];
+            if(at[action] == 0) at[action] = now;
+            if(action == SUP_RESTART){
+                if(fault->create_fails){
+                    action = SupRestartFailed(&sup, id, now);
+                    if(n < sizeof(actions) - 2) actions[n++] = "-rfb"[action];
+                    if(at[action] == 0) at[action] = now;
+                }else{
+                    // the new task beats from its first loop, until it fails again
+                    beat[id] = now;
+                    next[id] = now + 10;
+                    fail = fault->runs_ms == UINT32_MAX ? UINT32_MAX : now + fault->runs_ms;
+                }
+            }
+        }
+        actions[n] = '\0';
+        if(strcmp(actions, fault->expect) != 0) errors++;
+        printf("[SupSelfTest] %-30s %-8s", fault->name, n ? actions : "-");
+        for(int a = SUP_RESTART; a <= SUP_REBOOT; a++){
+            if(at[a]) printf(" %s %"PRIu32".%us", SupActionName(a), (at[a] - fault->fail_ms) / 1000, (unsigned)(at[a] - fault->fail_ms) % 1000 / 100);
+            else printf(" %s -", SupActionName(a));
+        }
+        printf("%s\n", strcmp(actions, fault->expect) ? " FAIL" : "");
+    }
+    printf("[SupSelfTest] %s, %d errors\n", errors ? "FAIL" : "ok", errors);
+    return errors == 0;
+}
+
+#ifdef ESP_PLATFORM
+
+#define TAG "SUPERVISOR"
+
+static Sup_t sup;
+static esp_err_t (*restart_task[SUP_MAX_TASKS])(void);
+static esp_task_wdt_user_handle_t wdt_user[SUP_MAX_TASKS];
+static portMUX_TYPE sup_lock = portMUX_INITIALIZER_UNLOCKED;
+static void (*fallback_lamps)(void);
+
+static uint32_t SupervisorNow(void)
+{
+    return esp_timer_get_time() / 1000;
+}
+
+/**
+ * Watch the calling module's task, safe before SupervisorInit
+ *
+ * @param   name                      task name, kept
+ * @param   timeout_ms                longest time between two SupervisorBeat
+ * @param   restart                   deletes and creates the task again, NULL if it cannot be
+ * @param   lamps                     the lamps stop with the task
+ *
+ * @return  task number for SupervisorBeat, -1 if SUP_MAX_TASKS are watched
+ */
+int SupervisorWatch(const char *name, uint32_t timeout_ms, esp_err_t (*restart)(void), bool lamps)
+{
+    int id;
+
+    portENTER_CRITICAL(&sup_lock);
+    id = SupWatch(&sup, name, timeout_ms, restart != NULL, lamps, SupervisorNow());
+    if(id >= 0) restart_task[id] = restart;
+    portEXIT_CRITICAL(&sup_lock);
+    if(id >= 0 && wdt_user[id] == NULL) esp_task_wdt_add_user(name, &wdt_user[id]);
+    return id;
+}
+
+void SupervisorBeat(int id)
+{
+    if(id < 0) return;
+    portENTER_CRITICAL(&sup_lock);
+    SupBeat(&sup, id, SupervisorNow());
+    portEXIT_CRITICAL(&sup_lock);
+    if(wdt_user[id]) esp_task_wdt_reset_user(wdt_user[id]);
+}
+
+void SupervisorLeave(int id)
+{
+    if(id < 0) return;
+    portENTER_CRITICAL(&sup_lock);
+    SupLeave(&sup, id);
+    portEXIT_CRITICAL(&sup_lock);
+    if(wdt_user[id]) esp_task_wdt_delete_user(wdt_user[id]);
+    wdt_user[id] = NULL;
+}
+
+/*
+ * Checks the heartbeats every SUP_PERIOD_MS and takes the actions, above
+ * the timing core so a task spinning there cannot hold it off
+ */
+static void SupervisorTask(void *pvParameters)
+{
+    TickType_t wake = xTaskGetTickCount();
+
+    esp_task_wdt_add(NULL);
+    while(1){
+        SupAction_t action;
+        uint32_t now;
+        int id;
+
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(SUP_PERIOD_MS));
+        esp_task_wdt_reset();
+        now = SupervisorNow();
+        portENTER_CRITICAL(&sup_lock);
+        action = SupCheck(&sup, now, &id);
+        portEXIT_CRITICAL(&sup_lock);
+
+        if(action == SUP_RESTART){
+            ESP_LOGW(TAG, "%s: no heartbeat for %"PRIu32"ms, restart %d of %d", sup.task[id].name,
+                sup.task[id].timeout_ms, sup.task[id].restarts, SUP_RESTARTS);
+            if(restart_task[id]() != ESP_OK){
+                ESP_LOGE(TAG, "%s: restart failed", sup.task[id].name);
+                portENTER_CRITICAL(&sup_lock);
+                action = SupRestartFailed(&sup, id, now);
+                portEXIT_CRITICAL(&sup_lock);
+            }
+        }else if(action != SUP_OK && id >= 0){
+            ESP_LOGE(TAG, "%s: no heartbeat for %"PRIu32"ms after %d restarts", sup.task[id].name,
+                now - sup.task[id].beat_ms, sup.task[id].restarts);
+        }
+        if(action == SUP_FALLBACK){
+            ESP_LOGE(TAG, "%s stopped: flashing yellow, reboot in %ds", sup.task[id].name, SUP_FALLBACK_MS / 1000);
+            if(fallback_lamps) fallback_lamps();
+        }
+        if(action == SUP_REBOOT){
+            ESP_LOGE(TAG, "controlled reboot%s", id < 0 ? " at the end of the fallback" : "");
+            vTaskDelay(pdMS_TO_TICKS(100));     // the log out first
+            esp_restart();
+        }
+    }
+}
+
+/**
+ * Start checking the heartbeats of the tasks watched so far and from now on
+ *
+ * @param   fallback                  takes the lamps to flashing yellow without the timing core
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the task cannot be created
+ */
+esp_err_t SupervisorInit(void (*fallback)(void))
+{
+    fallback_lamps = fallback;
+    if(xTaskCreate(&SupervisorTask, "supervisor", 1024*3, NULL, SUPERVISOR_PRIORITY, NULL) != pdPASS){
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void SupervisorReport(void)
+{
+    uint32_t now = SupervisorNow();
+
+    ESP_LOGI(TAG, "%s, %"PRIu32" restarts", SupActionName(sup.level), sup.restarts);
+    for(int i = 0; i < sup.count; i++){
+        ESP_LOGI(TAG, "%s: %s, last heartbeat %"PRIu32"ms ago, %d restarts", sup.task[i].name,
+            sup.task[i].watched ? "watched" : "not watched", now - sup.task[i].beat_ms, sup.task[i].restarts);
+    }
+}
+
+#endif
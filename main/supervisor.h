@@ -0,0 +1,66 @@
+/*
+ * supervisor.h
+ *
+ *  Task supervisor: heartbeats of the timing, display and command tasks,
+ *  escalating from a task restart to the flashing yellow fallback to a
+ *  controlled reboot.
+ */
+
+#ifndef MAIN_SUPERVISOR_H_
+#define MAIN_SUPERVISOR_H_
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#endif
+
+#define SUP_MAX_TASKS           8
+#define SUP_PERIOD_MS           100     // heartbeat check period
+#define SUP_RESTARTS            2       // restarts of a task before the escalation goes on
+#define SUP_HEALTHY_MS          60000   // a task beating this long after its last restart may be restarted again
+#define SUP_FALLBACK_MS         30000   // flashing yellow before the reboot
+#define SUPERVISOR_PRIORITY     11      // above the timing core, which it restarts
+
+typedef enum {
+    SUP_OK = 0,
+    SUP_RESTART,            // delete and create the task again
+    SUP_FALLBACK,           // the lamps stopped with the task: flashing yellow until the reboot
+    SUP_REBOOT,             // controlled reboot
+}SupAction_t;
+
+typedef struct {
+    const char *name;
+    uint32_t timeout_ms;    // longest time between two heartbeats
+    uint32_t beat_ms;       // last heartbeat, or the last restart
+    uint32_t restart_ms;
+    uint8_t restarts;       // since it last beat SUP_HEALTHY_MS after a restart
+    bool watched;           // false once the task left or was given up
+    bool restartable;
+    bool lamps;             // the lamps stop with the task: the fallback comes before the reboot
+}SupTask_t;
+
+typedef struct {
+    SupTask_t task[SUP_MAX_TASKS];
+    uint8_t count;
+    SupAction_t level;      // furthest step of the escalation, SUP_OK to SUP_REBOOT
+    uint32_t fallback_ms;
+    uint32_t restarts;
+}Sup_t;
+
+void SupInit(Sup_t *sup);
+int SupWatch(Sup_t *sup, const char *name, uint32_t timeout_ms, bool restartable, bool lamps, uint32_t now_ms);
+void SupBeat(Sup_t *sup, int id, uint32_t now_ms);
+void SupLeave(Sup_t *sup, int id);
+SupAction_t SupCheck(Sup_t *sup, uint32_t now_ms, int *id);
+SupAction_t SupRestartFailed(Sup_t *sup, int id, uint32_t now_ms);
+const char *SupActionName(SupAction_t action);
+bool SupSelfTest(void);
+#ifdef ESP_PLATFORM
+int SupervisorWatch(const char *name, uint32_t timeout_ms, esp_err_t (*restart)(void), bool lamps);
+void SupervisorBeat(int id);
+void SupervisorLeave(int id);
+esp_err_t SupervisorInit(void (*fallback)(void));
+void SupervisorReport(void);
+#endif
+
+#endif /* MAIN_SUPERVISOR_H_ */
@@ -0,0 +1,247 @@
+/*
+ * timing.c
+ *
+ *  Deadline based timing engine on the monotonic microsecond clock.
+ *
+ *  Every event is scheduled at a fixed offset from an epoch instead of
+ *  "one second after the previous event", so the time spent shifting,
+ *  switching lamps or waiting for the scheduler delays one event but is
+ *  never carried into the next one: lateness is jitter, not drift.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "timing.h"
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#include "esp_freertos_hooks.h"
+#include "esp_private/esp_clk.h"
+#endif
+
+/**
+ * Restart the time line and clear the statistics
+ *
+ * @param   timing                    Pointer to Timing_t structure
+ * @param   epoch_us                  monotonic time of offset 0
+ */
+void TimingReset(Timing_t *timing, int64_t epoch_us)
+{
+    timing->epoch_us = epoch_us;
+    timing->events = 0;
+    timing->late_min_us = INT64_MAX;
+    timing->late_max_us = 0;
+    timing->late_sum_us = 0;
+    timing->drift_us = 0;
+    timing->drift_max_us = 0;
+    memset(timing->hist, 0, sizeof(timing->hist));
+}
+
+/**
+ * Absolute deadline of an offset from the epoch
+ */
+int64_t TimingDeadline(const Timing_t *timing, int64_t offset_us)
+{
+    return timing->epoch_us + offset_us;
+}
+
+/**
+ * Account one event fired at actual_us for a deadline
+ */
+void TimingRecord(Timing_t *timing, int64_t deadline_us, int64_t actual_us)
+{
+    int64_t late = actual_us - deadline_us;
+    int bin = 0;
+
+    timing->events++;
+    if(late < timing->late_min_us) timing->late_min_us = late;
+    if(late > timing->late_max_us) timing->late_max_us = late;
+    timing->late_sum_us += late;
+    timing->drift_us = late;
+    if((late < 0 ? -late : late) > timing->drift_max_us) timing->drift_max_us = late < 0 ? -late : late;
+
+    for(int64_t limit = 10; late >= limit && bin < TIMING_HIST_BINS - 1; limit *= 2) bin++;
+    timing->hist[bin]++;
+}
+
+void TimingReport(const Timing_t *timing, const char *name)
+{
+    if(timing->events == 0) return;
+    printf("[Timing]%s events=%"PRIu32" late min=%"PRId64"us avg=%"PRId64"us max=%"PRId64"us drift=%"PRId64"us max drift=%"PRId64"us\n",
+        name, timing->events, timing->late_min_us, timing->late_sum_us / timing->events, timing->late_max_us,
+        timing->drift_us, timing->drift_max_us);
+    printf("[Timing]%s hist <10/<20/<40/<80/<160/<320/<640/more us:", name);
+    for(int i = 0; i < TIMING_HIST_BINS; i++) printf(" %"PRIu32, timing->hist[i]);
+    printf("\n");
+}
+
+#ifdef ESP_PLATFORM
+
+static void TimingExpired(void *arg)
+{
+    Timing_t *timing = arg;
+    if(timing->task) xTaskNotify(timing->task, TIMING_EVENT_DEADLINE, eSetBits);
+}
+
+/**
+ * Bind the time line to the calling task and start it now, the one-shot
+ * timer is created on the first call and reused afterwards.
+ * Only the bound task may wait on it, zero the structure before the first call.
+ *
+ * @param   timing                    Pointer to Timing_t structure
+ * 
+ * @return
+ *          - ESP_OK                  if success
+ *          - error from esp_timer otherwise
+ */
+esp_err_t TimingInit(Timing_t *timing)
+{
+    esp_timer_create_args_t args = {
+        .callback = TimingExpired,
+        .arg = timing,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "timing",
+    };
+
+    if(timing->timer == NULL){
+        esp_err_t ret = esp_timer_create(&args, &timing->timer);
+        if(ret != ESP_OK) return ret;
+    }
+    esp_timer_stop(timing->timer);
+    timing->task = xTaskGetCurrentTaskHandle();
+    TimingReset(timing, esp_timer_get_time());
+    return ESP_OK;
+}
+
+/**
+ * Cancel a pending deadline and unbind the task, call before deleting the bound task
+ */
+void TimingStop(Timing_t *timing)
+{
+    if(timing->timer) esp_timer_stop(timing->timer);
+    timing->task = NULL;
+}
+
+void TimingDeinit(Timing_t *timing)
+{
+    TimingStop(timing);
+    esp_timer_delete(timing->timer);
+    timing->timer = NULL;
+}
+
+/**
+ * Block the calling task until epoch + offset_us and record the lateness,
+ * or until another task notifies it with bits other than TIMING_EVENT_DEADLINE.
+ * Returns at once when the deadline already passed.
+ *
+ * @param   timing                    Pointer to Timing_t structure
+ * @param   offset_us                 offset of the event from the epoch
+ * @param   events                    notification bits received when woken early, may be NULL
+ * 
+ * @return  true at the deadline, false when woken early by an event
+ */
+bool TimingWaitUntilEvent(Timing_t *timing, int64_t offset_us, uint32_t *events)
+{
+    int64_t deadline = TimingDeadline(timing, offset_us);
+    uint32_t bits;
+    int64_t now;
+
+    // a deadline bit left from an earlier wait is stale, the clock decides
+    while((now = esp_timer_get_time()) < deadline){
+        esp_timer_stop(timing->timer);
+        esp_timer_start_once(timing->timer, deadline - now);
+        xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+        bits &= ~TIMING_EVENT_DEADLINE;
+        if(bits){
+            if(events) *events = bits;
+            return false;
+        }
+    }
+    TimingRecord(timing, deadline, now);
+    return true;
+}
+
+/**
+ * Block the calling task until epoch + offset_us and record the lateness,
+ * other notifications are dropped
+ *
+ * @return  lateness in us
+ */
+int64_t TimingWaitUntil(Timing_t *timing, int64_t offset_us)
+{
+    while(!TimingWaitUntilEvent(timing, offset_us, NULL));
+    return timing->drift_us;
+}
+
+/**
+ * Run a day of one second events accelerated by speedup (1000: 86.4 s for
+ * 24 h) and check that the error of the last event is no larger than the
+ * worst jitter, i.e. that nothing accumulated over the run.
+ *
+ * @param   hours                     simulated duration
+ * @param   speedup                   simulated seconds per real second
+ * 
+ * @return  true if no drift accumulated
+ */
+bool TimingDriftTest(int hours, int speedup)
+{
+    Timing_t timing = {0};
+    int64_t period = TIMING_SECOND_US / speedup;
+    int64_t events = (int64_t)hours * 3600;
+    bool ok;
+
+    if(period <= 0 || events <= 0 || TimingInit(&timing) != ESP_OK) return false;
+    for(int64_t n = 1; n <= events; n++){
+        TimingWaitUntil(&timing, n * period);
+    }
+    // one microsecond lost per event would already add up to 86 ms over a day
+    ok = timing.drift_us >= 0 && timing.drift_us < period;
+    TimingReport(&timing, "drift test");
+    printf("[TimingDriftTest] %dh x%d: elapsed %"PRId64"us ideal %"PRId64"us %s\n", hours, speedup,
+        esp_timer_get_time() - timing.epoch_us, events * period, ok ? "OK" : "FAIL");
+    TimingDeinit(&timing);
+    return ok;
+}
+
+static uint32_t idle_last[portNUM_PROCESSORS];
+static volatile uint64_t idle_cycles[portNUM_PROCESSORS];
+
+/*
+ * Runs in the idle loop of its core, again and again while nothing else
+ * is ready: the gaps between two calls add up to the idle time. It returns
+ * false so the core spins instead of waiting for an interrupt.
+ */
+static bool TimingIdleHook(void)
+{
+    int core = xPortGetCoreID();
+    uint32_t now = esp_cpu_get_cycle_count(), gap = now - idle_last[core];
+
+    if(gap < TIMING_IDLE_GAP_CYCLES) idle_cycles[core] += gap;
+    idle_last[core] = now;
+    return false;
+}
+
+/**
+ * Measure the load of every core over a window. The caller blocks for the
+ * window; the cores spin in their idle loop meanwhile, so it is a bench tool.
+ *
+ * @param   ms                        window
+ * @param   permille                  set to the busy time of each core in 1/1000
+ */
+void TimingCpuLoad(uint32_t ms, uint32_t permille[portNUM_PROCESSORS])
+{
+    uint64_t window = (uint64_t)ms * (esp_clk_cpu_freq() / 1000);
+
+    for(int core = 0; core < portNUM_PROCESSORS; core++){
+        idle_cycles[core] = 0;
+        idle_last[core] = 0;
+        esp_register_freertos_idle_hook_for_cpu(TimingIdleHook, core);
+    }
+    vTaskDelay(pdMS_TO_TICKS(ms));
+    for(int core = 0; core < portNUM_PROCESSORS; core++){
+        esp_deregister_freertos_idle_hook_for_cpu(TimingIdleHook, core);
+        permille[core] = idle_cycles[core] >= window ? 0 : 1000 - idle_cycles[core] * 1000 / window;
+    }
+}
+
+#endif
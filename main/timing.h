@@ -0,0 +1,52 @@
+/*
+ * timing.h
+ *
+ *  Deadline based timing engine on the monotonic microsecond clock.
+ */
+
+#ifndef MAIN_TIMING_H_
+#define MAIN_TIMING_H_
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+#define TIMING_SECOND_US        1000000LL
+#define TIMING_EVENT_DEADLINE   (1 << 0)    // notification bit of the deadline timer, others are free for the caller
+#define TIMING_HIST_BINS        8       // lateness histogram: <10us, <20us, <40us ... >=640us
+#define TIMING_IDLE_GAP_CYCLES  2000    // idle hook calls closer than this are idle time, farther apart a task ran
+
+typedef struct {
+    int64_t epoch_us;           // monotonic time of offset 0
+    uint32_t events;
+    int64_t late_min_us;        // lateness of an event against its deadline
+    int64_t late_max_us;
+    int64_t late_sum_us;
+    int64_t drift_us;           // error of the last event against the ideal time line
+    int64_t drift_max_us;       // largest drift seen, stays bounded because deadlines never accumulate
+    uint32_t hist[TIMING_HIST_BINS];
+#ifdef ESP_PLATFORM
+    esp_timer_handle_t timer;
+    TaskHandle_t task;
+#endif
+}Timing_t;
+
+void TimingReset(Timing_t *timing, int64_t epoch_us);
+int64_t TimingDeadline(const Timing_t *timing, int64_t offset_us);
+void TimingRecord(Timing_t *timing, int64_t deadline_us, int64_t actual_us);
+void TimingReport(const Timing_t *timing, const char *name);
+#ifdef ESP_PLATFORM
+esp_err_t TimingInit(Timing_t *timing);
+void TimingStop(Timing_t *timing);
+void TimingDeinit(Timing_t *timing);
+int64_t TimingWaitUntil(Timing_t *timing, int64_t offset_us);
+bool TimingWaitUntilEvent(Timing_t *timing, int64_t offset_us, uint32_t *events);
+bool TimingDriftTest(int hours, int speedup);
+void TimingCpuLoad(uint32_t ms, uint32_t permille[portNUM_PROCESSORS]);
+#endif
+
+#endif /* MAIN_TIMING_H_ */
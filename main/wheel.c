@@ -0,0 +1,439 @@
+/*
+ * wheel.c
+ *
+ *  Hierarchical timer wheel with millisecond resolution.
+ *
+ *  Level 0 has a slot per millisecond of the next 64 ms, level 1 a slot per
+ *  64 ms of the next 4 s, and so on. Insert and cancel are a list link and
+ *  a bitmap bit, whatever the number of pending timers. When the time
+ *  crosses a 64 ms boundary the matching higher slot is cascaded down, and
+ *  the occupancy bitmaps tell the earliest time anything can happen, so a
+ *  single one-shot hardware timer drives the whole wheel and the CPU idles
+ *  between events instead of polling.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "wheel.h"
+#include "selftest.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#endif
+
+#define WHEEL_MASK              (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(level)       (1UL << (WHEEL_BITS * (level)))
+
+static uint64_t RotateRight(uint64_t bits, unsigned n)
+{
+    return n ? (bits >> n) | (bits << (64 - n)) : bits;
+}
+
+static void Link(Wheel_t *wheel, WheelTimer_t *timer)
+{
+    uint32_t delta = timer->expires - wheel->now;
+    uint32_t at = timer->expires;
+    WheelTimer_t **head;
+    int level = 0;
+
+    if((int32_t)delta < 0){
+        at = wheel->now;        // already due, fires at the next expire
+        delta = 0;
+    }
+    while(level < WHEEL_LEVELS - 1 && delta >= WHEEL_SPAN(level + 1)) level++;
+    if(delta >= WHEEL_SPAN(WHEEL_LEVELS)){
+        // beyond the wheel: park on the last slot cascaded before the expiry, relinked from there
+        at = wheel->now + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+    }
+    timer->level = level;
+    timer->slot = (at >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    head = &wheel->slot[level][timer->slot];
+    timer->next = *head;
+    if(*head) (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= 1ULL << timer->slot;
+    wheel->pending++;
+}
+
+static void Unlink(Wheel_t *wheel, WheelTimer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if(timer->next) timer->next->pprev = timer->pprev;
+    if(wheel->slot[timer->level][timer->slot] == NULL) wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+    timer->pprev = NULL;
+    wheel->pending--;
+}
+
+/*
+ * The time just reached a 64 ms boundary: move the due higher slots one level down
+ */
+static void Cascade(Wheel_t *wheel)
+{
+    for(int level = 1; level < WHEEL_LEVELS; level++){
+        int slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        WheelTimer_t *list = wheel->slot[level][slot];
+
+        wheel->slot[level][slot] = NULL;
+        wheel->occupied[level] &= ~(1ULL << slot);
+        while(list){
+            WheelTimer_t *timer = list;
+            list = timer->next;
+            wheel->pending--;
+            Link(wheel, timer);
+        }
+        if(slot != 0) break;
+    }
+}
+
+/**
+ * Start an empty wheel
+ *
+ * @param   wheel                     Pointer to Wheel_t structure
+ * @param   now                       current time in ms
+ */
+void WheelInit(Wheel_t *wheel, uint32_t now)
+{
+    memset(wheel, 0, sizeof(Wheel_t));
+    wheel->now = now;
+}
+
+void WheelTimerInit(WheelTimer_t *timer, WheelCallback_t callback, void *arg)
+{
+    memset(timer, 0, sizeof(WheelTimer_t));
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+/**
+ * Arm a timer for an absolute time, a pending timer is moved. O(1).
+ *
+ * @param   expires                   time in ms, a past time fires at the next expire
+ */
+void WheelAdd(Wheel_t *wheel, WheelTimer_t *timer, uint32_t expires)
+{
+    if(timer->pprev) Unlink(wheel, timer);
+    timer->expires = expires;
+    Link(wheel, timer);
+}
+
+/**
+ * Disarm a timer, nothing if it is not pending. O(1).
+ */
+void WheelCancel(Wheel_t *wheel, WheelTimer_t *timer)
+{
+    if(timer->pprev) Unlink(wheel, timer);
+}
+
+bool WheelPending(const WheelTimer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/**
+ * Advance the wheel up to now and take one due timer off it. Call until it
+ * returns NULL and run each callback in between, so a callback may add or
+ * cancel timers, itself included.
+ *
+ * @param   now                       current time in ms
+ *
+ * @return  a disarmed due timer, NULL when none is left up to now
+ */
+WheelTimer_t *WheelExpire(Wheel_t *wheel, uint32_t now)
+{
+    while(1){
+        unsigned slot = wheel->now & WHEEL_MASK;
+        WheelTimer_t *timer = wheel->slot[0][slot];
+        uint64_t ahead;
+        uint32_t step;
+
+        if(timer){
+            Unlink(wheel, timer);
+            return timer;
+        }
+        if((int32_t)(now - wheel->now) <= 0) return NULL;
+
+        // jump to the next busy level 0 slot or the next boundary, whichever is first
+        ahead = (wheel->occupied[0] >> slot) >> 1;
+        step = ahead ? __builtin_ctzll(ahead) + 1 : WHEEL_SLOTS - slot;
+        if((int32_t)(now - wheel->now) < (int32_t)step){
+            wheel->now = now;
+            return NULL;
+        }
+        wheel->now += step;
+        if((wheel->now & WHEEL_MASK) == 0) Cascade(wheel);
+    }
+}
+
+/**
+ * Earliest time the wheel has work: a timer expiry or a cascade that may
+ * bring one. Never later than the first expiry, so a single one-shot timer
+ * armed for it is enough.
+ *
+ * @param   at                        set to that time in ms
+ *
+ * @return  false if no timer is pending
+ */
+bool WheelNext(const Wheel_t *wheel, uint32_t *at)
+{
+    uint32_t best = 0, distance = UINT32_MAX;
+
+    if(wheel->pending == 0) return false;
+    for(int level = 0; level < WHEEL_LEVELS; level++){
+        uint32_t next;
+
+        if(wheel->occupied[level] == 0) continue;
+        if(level == 0){
+            next = wheel->now + __builtin_ctzll(RotateRight(wheel->occupied[0], wheel->now & WHEEL_MASK));
+        }else{
+            // the cascade of this level happening after now
+            uint32_t index = (wheel->now >> (WHEEL_BITS * level)) + 1;
+            index += __builtin_ctzll(RotateRight(wheel->occupied[level], index & WHEEL_MASK));
+            next = index << (WHEEL_BITS * level);
+        }
+        if(next - wheel->now < distance){
+            distance = next - wheel->now;
+            best = next;
+        }
+    }
+    *at = best;
+    return true;
+}
+
+typedef struct {
+    WheelTimer_t timer;
+    uint32_t armed_at;      // model of the expiry
+    bool armed;
+    uint32_t fired;
+}WheelProbe_t;
+
+static void WheelProbeFired(void *arg)
+{
+    ((WheelProbe_t *)arg)->fired++;
+}
+
+/**
+ * Drive random timers, cancels and re-arms across short and long jumps of
+ * time, including past the 4.6 hour span and the 32-bit wrap, and check
+ * every timer fires once, at the first expire that reaches it, and that
+ * WheelNext never overshoots
+ *
+ * @return  true if no timer was lost, early, late or doubled
+ */
+bool WheelSelfTest(void)
+{
+    enum { PROBES = 256, ROUNDS = 4000 };
+    static Wheel_t wheel;
+    static WheelProbe_t probe[PROBES];
+    uint32_t seed = 38, now = 0xFFFF0000u, fired = 0;
+    int errors = 0;
+
+    WheelInit(&wheel, now);
+    for(int i = 0; i < PROBES; i++){
+        WheelTimerInit(&probe[i].timer, WheelProbeFired, &probe[i]);
+        probe[i].armed = false;
+        probe[i].fired = 0;
+    }
+    for(int round = 0; round < ROUNDS; round++){
+        uint32_t to, next, r = SelfTestRandom(&seed) % 100;
+        WheelTimer_t *timer;
+
+        // re-arm or cancel a few probes
+        for(int k = 0; k < 8; k++){
+            WheelProbe_t *p = &probe[SelfTestRandom(&seed) % PROBES];
+            uint32_t kind = SelfTestRandom(&seed) % 10;
+            uint32_t delay = SelfTestRandom32(&seed) % (kind < 3 ? 64 : kind < 6 ? 4096 : kind < 8 ? 300000 : 40000000);
+
+            if(kind == 9 && (SelfTestRandom(&seed) & 1)){
+                WheelCancel(&wheel, &p->timer);
+                p->armed = false;
+            }else{
+                WheelAdd(&wheel, &p->timer, now + delay);
+                p->armed = true;
+                p->armed_at = now + delay;
+            }
+        }
+        if(WheelNext(&wheel, &next)){
+            for(int i = 0; i < PROBES; i++){
+                if(probe[i].armed && (int32_t)(probe[i].armed_at - next) < 0){
+                    errors++;   // the wake up would come after an expiry
+                    break;
+                }
+            }
+        }
+
+        to = now + (r < 60 ? r : r < 95 ? SelfTestRandom32(&seed) % 100000 : SelfTestRandom32(&seed) % 30000000);
+        while((timer = WheelExpire(&wheel, to)) != NULL){
+            WheelProbe_t *p = timer->arg;
+
+            if(!p->armed || (int32_t)(p->armed_at - to) > 0) errors++;   // early or not armed
+            timer->callback(timer->arg);
+            p->armed = false;
+            fired++;
+        }
+        for(int i = 0; i < PROBES; i++){
+            if(probe[i].armed && (int32_t)(probe[i].armed_at - to) <= 0){
+                errors++;   // due but not returned: late or lost
+                probe[i].armed = false;
+            }
+            if(probe[i].armed != WheelPending(&probe[i].timer)) errors++;
+        }
+        now = to;
+    }
+    printf("[WheelSelfTest] %s, %"PRIu32" timers fired, %d errors\n", errors ? "FAILED" : "ok", fired, errors);
+    return errors == 0;
+}
+
+/**
+ * Time insert, cancel and expiry with many pending timers spread over an hour
+ *
+ * @param   timers                    number of pending timers
+ * @param   now_us                    monotonic microsecond clock of the platform
+ */
+void WheelBench(int timers, int64_t (*now_us)(void))
+{
+    static Wheel_t wheel;
+    WheelTimer_t *timer = malloc(timers * sizeof(WheelTimer_t));
+    uint32_t seed = 1, fired = 0;
+    int64_t start, add_us, cancel_us, expire_us;
+
+    if(timer == NULL) return;
+    WheelInit(&wheel, 0);
+    for(int i = 0; i < timers; i++) WheelTimerInit(&timer[i], NULL, NULL);
+
+    start = now_us();
+    for(int i = 0; i < timers; i++) WheelAdd(&wheel, &timer[i], 1 + SelfTestRandom32(&seed) % 3600000);
+    add_us = now_us() - start;
+
+    start = now_us();
+    for(int i = 0; i < timers; i += 2) WheelCancel(&wheel, &timer[i]);
+    cancel_us = now_us() - start;
+    for(int i = 0; i < timers; i += 2) WheelAdd(&wheel, &timer[i], 1 + SelfTestRandom32(&seed) % 3600000);
+
+    // walk the hour the way the service does: expire, then sleep until WheelNext
+    start = now_us();
+    for(uint32_t at; WheelNext(&wheel, &at); ){
+        while(WheelExpire(&wheel, at) != NULL) fired++;
+    }
+    expire_us = now_us() - start;
+
+    printf("[WheelBench] %d timers: insert %"PRId64"ns, cancel %"PRId64"ns, expire %"PRId64"ns per timer, %"PRIu32" fired, %u bytes per timer + %u bytes wheel\n",
+        timers, add_us * 1000 / timers, cancel_us * 2000 / timers, expire_us * 1000 / timers, fired,
+        (unsigned)sizeof(WheelTimer_t), (unsigned)sizeof(Wheel_t));
+    free(timer);
+}
+
+#ifdef ESP_PLATFORM
+
+#define TAG "WHEEL"
+
+static Wheel_t wheel;
+static portMUX_TYPE wheel_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t wheel_task;
+static esp_timer_handle_t wake;
+
+uint32_t WheelNow(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static void WheelWake(void *arg)
+{
+    xTaskNotifyGive(wheel_task);
+}
+
+/*
+ * Runs the callbacks of the due timers, then sleeps until the next one
+ */
+static void WheelTask(void *pvParameters)
+{
+    while(1){
+        WheelTimer_t *timer;
+        uint32_t at;
+        bool pending;
+
+        portENTER_CRITICAL(&wheel_lock);
+        timer = WheelExpire(&wheel, WheelNow());
+        portEXIT_CRITICAL(&wheel_lock);
+        if(timer){
+            timer->callback(timer->arg);
+            continue;
+        }
+
+        portENTER_CRITICAL(&wheel_lock);
+        pending = WheelNext(&wheel, &at);
+        portEXIT_CRITICAL(&wheel_lock);
+        esp_timer_stop(wake);
+        if(pending){
+            int64_t now = esp_timer_get_time();
+            int32_t ms = (int32_t)(at - (uint32_t)(now / 1000));
+            esp_timer_start_once(wake, ms <= 0 ? 0 : (int64_t)ms * 1000 - now % 1000);
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+/**
+ * Start the wheel task and its one-shot wake timer. Callbacks run in that
+ * task, one after the other: they must not block.
+ *
+ * @return
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NO_MEM          if the task or the timer cannot be created
+ */
+esp_err_t WheelServiceInit(void)
+{
+    esp_err_t ret;
+
+    WheelInit(&wheel, WheelNow());
+    ret = esp_timer_create(&(esp_timer_create_args_t){
+        .callback = WheelWake,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wheel",
+    }, &wake);
+    if(ret != ESP_OK) return ret;
+    if(xTaskCreate(&WheelTask, "wheel", 1024*3, NULL, 6, &wheel_task) != pdPASS){
+        esp_timer_delete(wake);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Arm or re-arm a timer delay_ms from now, safe from any task
+ */
+void WheelStart(WheelTimer_t *timer, uint32_t delay_ms)
+{
+    portENTER_CRITICAL(&wheel_lock);
+    WheelAdd(&wheel, timer, WheelNow() + delay_ms);
+    portEXIT_CRITICAL(&wheel_lock);
+    xTaskNotifyGive(wheel_task);
+}
+
+/**
+ * WheelStart for a GPIO interrupt handler
+ */
+void WheelStartFromISR(WheelTimer_t *timer, uint32_t delay_ms)
+{
+    BaseType_t woken = pdFALSE;
+
+    portENTER_CRITICAL_ISR(&wheel_lock);
+    WheelAdd(&wheel, timer, WheelNow() + delay_ms);
+    portEXIT_CRITICAL_ISR(&wheel_lock);
+    vTaskNotifyGiveFromISR(wheel_task, &woken);
+    if(woken) portYIELD_FROM_ISR();
+}
+
+void WheelStop(WheelTimer_t *timer)
+{
+    portENTER_CRITICAL(&wheel_lock);
+    WheelCancel(&wheel, timer);
+    portEXIT_CRITICAL(&wheel_lock);
+}
+
+#endif
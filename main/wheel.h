@@ -0,0 +1,54 @@
+/*
+ * wheel.h
+ *
+ *  Hierarchical timer wheel with millisecond resolution.
+ */
+
+#ifndef MAIN_WHEEL_H_
+#define MAIN_WHEEL_H_
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+#endif
+
+#define WHEEL_BITS              6
+#define WHEEL_SLOTS             (1 << WHEEL_BITS)
+#define WHEEL_LEVELS            4       // 64^4 ms = 4.6 hours, later timers wait on the last level
+
+typedef void (*WheelCallback_t)(void *arg);
+
+typedef struct WheelTimer {
+    struct WheelTimer *next;
+    struct WheelTimer **pprev;          // NULL when not pending
+    uint32_t expires;                   // ms
+    uint8_t level, slot;
+    WheelCallback_t callback;
+    void *arg;
+}WheelTimer_t;
+
+typedef struct {
+    WheelTimer_t *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS];    // bit per non-empty slot
+    uint32_t now;                       // ms, timers before now have expired
+    uint32_t pending;
+}Wheel_t;
+
+void WheelInit(Wheel_t *wheel, uint32_t now);
+void WheelTimerInit(WheelTimer_t *timer, WheelCallback_t callback, void *arg);
+void WheelAdd(Wheel_t *wheel, WheelTimer_t *timer, uint32_t expires);
+void WheelCancel(Wheel_t *wheel, WheelTimer_t *timer);
+bool WheelPending(const WheelTimer_t *timer);
+WheelTimer_t *WheelExpire(Wheel_t *wheel, uint32_t now);
+bool WheelNext(const Wheel_t *wheel, uint32_t *at);
+bool WheelSelfTest(void);
+void WheelBench(int timers, int64_t (*now_us)(void));
+#ifdef ESP_PLATFORM
+esp_err_t WheelServiceInit(void);
+uint32_t WheelNow(void);
+void WheelStart(WheelTimer_t *timer, uint32_t delay_ms);
+void WheelStartFromISR(WheelTimer_t *timer, uint32_t delay_ms);
+void WheelStop(WheelTimer_t *timer);
+#endif
+
+#endif /* MAIN_WHEEL_H_ */
@@ -0,0 +1,113 @@
+/*
+ * selftest.c
+ *
+ *  Host runner of the firmware self-tests and benchmarks that the board
+ *  runs under BENCHMARK: the same pure cores, linked for Linux. Runs the
+ *  test named on the command line, or all of them, and exits with 1 if
+ *  any failed, so ctest can gate a change on a CI machine.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "plan.h"
+#include "controller.h"
+#include "lamp.h"
+#include "74HC595.h"
+#include "wheel.h"
+#include "optimizer.h"
+#include "detector.h"
+#include "monitor.h"
+#include "schedule.h"
+#include "supervisor.h"
+
+static int64_t NowUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// lamp GPIOs of the board: R1 Y1 G1 R2 Y2 G2
+static const int LampPins[PLAN_LAMPS] = {0, 2, 4, 27, 26, 25};
+
+static bool CtrlBenchTest(void)
+{
+    CtrlBench(CONTROLLER_MAX_INTERSECTIONS, NowUs);
+    return true;
+}
+
+static bool LampTest(void)
+{
+    return LampSelfTest(LampPins, PLAN_LAMPS);
+}
+
+static bool WheelTest(void)
+{
+    bool ok = WheelSelfTest();
+
+    WheelBench(4096, NowUs);
+    return ok;
+}
+
+static bool DetTest(void)
+{
+    bool ok = DetSelfTest();
+
+    DetBench(1 << 16, NowUs);
+    return ok;
+}
+
+static bool OptTest(void)
+{
+    bool ok = OptSelfTest();
+
+    OptBench(10000, NowUs);
+    OptSimulate(24);
+    return ok;
+}
+
+static bool SchedTest(void)
+{
+    bool ok = SchedSelfTest();
+
+    SchedBench(100000, NowUs);
+    return ok;
+}
+
+static const struct {
+    const char *name;
+    bool (*run)(void);
+}tests[] = {
+    {"plan",        PlanSelfTest},
+    {"controller",  CtrlSelfTest},
+    {"countdown",   CtrlCountdownSelfTest},
+    {"intersections", CtrlBenchTest},
+    {"lamp",        LampTest},
+    {"bank",        Check74HC595BankPack},
+    {"wheel",       WheelTest},
+    {"detector",    DetTest},
+    {"optimizer",   OptTest},
+    {"monitor",     MonSelfTest},
+    {"schedule",    SchedTest},
+    {"supervisor",  SupSelfTest},
+};
+
+int main(int argc, char **argv)
+{
+    int ran = 0, failed = 0;
+
+    for(size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++){
+        if(argc > 1 && strcmp(argv[1], tests[t].name) != 0) continue;
+        failed += !tests[t].run();
+        ran++;
+    }
+    if(ran == 0){
+        fprintf(stderr, "unknown test %s\n", argv[1]);
+        return 2;
+    }
+    printf("[selftest] %s, %d of %d failed\n", failed ? "FAIL" : "ok", failed, ran);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,712 @@
+/*
+ * sim.c
+ *
+ *  Host discrete-event simulator of the traffic light controller.
+ *
+ *  Links the firmware's pure cores (plan interpreter, controller core,
+ *  lamp masks, countdown segments, timer wheel, optimizer, detectors) and runs them
+ *  against a virtual millisecond clock. Events are timers on the same
+ *  wheel the firmware uses: the controller second, Poisson arrivals and
+ *  departures at the saturation headway. Every arrival crosses a detector
+ *  loop whose edges go through the firmware's detector ring, and the
+ *  adaptive mode feeds the optimizer from those counts. The actuated mode
+ *  adds the 100 ms decision tick, with calls from those loops and from the
+ *  car waiting at the stop line, and compares with the fixed plan. The
+ *  preempt mode sends emergency vehicle requests at random and measures
+ *  how long the requested green takes against its bound. A plan change
+ *  runs twice, as a transition and as the former all-yellow reset, and the
+ *  green lost and the queue peaks after it are compared. Lamp writes go to a model of the
+ *  GPIO output register and the countdown to a bit level model of the
+ *  74HC595 chain; both are read back and checked every second, and the
+ *  firmware's conflict monitor samples the same register model.
+ *
+ *  Prints queue and delay metrics per hour, optionally a timeline of every
+ *  lamp change, and exits with 1 if any timing or safety check failed, so
+ *  a plan or firmware change can be checked on a Linux CI machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include "plan.h"
+#include "controller.h"
+#include "lamp.h"
+#include "74HC595.h"
+#include "wheel.h"
+#include "optimizer.h"
+#include "detector.h"
+#include "monitor.h"
+
+#define SIM_PHASES              PLAN_HEADS
+#define SIM_QUEUE_MAX           4096
+#define SIM_STARTUP_MS          2000    // first vehicle leaves 2 s after green
+#define SIM_HEADWAY_MS          2000    // then one every 2 s: 1800 veh/h
+#define SIM_SECOND_MS           1000
+#define SIM_CHAIN_LEN           4
+#define SIM_OCCUPANCY_MS        300     // a car over the loop at the stop line
+#define SIM_PREEMPT_BOUND_MS    ((CTRL_PREEMPT_YELLOW_S + CTRL_ALL_RED_S) * SIM_SECOND_MS)
+#define SIM_PREEMPT_HOLD_MS     60000   // a request stands for its clearance plus up to a minute
+#define SIM_APPLY_CYCLES        3       // a plan change is measured over 3 cycles of the longer plan
+
+// same pins as main.c, so the GPIO masks are the ones the board uses
+static const int LampPins[PLAN_LAMPS] = {0, 2, 4, 27, 26, 25};
+static const uint8_t PhaseLamps[SIM_PHASES][3] = {
+    {PLAN_RED1, PLAN_YELLOW1, PLAN_GREEN1}, {PLAN_RED2, PLAN_YELLOW2, PLAN_GREEN2},
+};
+
+// weekday demand in veh/h, phase 1 and phase 2, by hour
+static const uint16_t Weekday[24][SIM_PHASES] = {
+    {60, 40},   {40, 30},   {30, 20},   {30, 20},   {50, 40},   {150, 100},
+    {500, 250}, {900, 350}, {850, 400}, {600, 450}, {500, 480}, {550, 500},
+    {600, 550}, {550, 500}, {500, 480}, {520, 550}, {450, 700}, {400, 900},
+    {380, 850}, {350, 600}, {300, 400}, {200, 250}, {120, 100}, {80, 60},
+};
+
+typedef struct {
+    uint32_t queue[SIM_QUEUE_MAX];      // arrival times, FIFO
+    uint32_t head, tail;
+    WheelTimer_t arrive, depart, leave;
+    bool green;
+    uint32_t green_ms;                  // green onset
+    uint32_t last_departure_ms;
+    uint32_t detected;
+    // metrics of the running hour and of the run
+    uint32_t arrived, served, max_queue, dropped;
+    uint64_t delay_ms;
+    uint32_t max_delay_ms;
+    uint32_t total_arrived, total_served;
+    uint64_t total_delay_ms;
+}SimPhase_t;
+
+typedef struct {
+    uint32_t hours;
+    uint32_t seed;
+    int plan[4];                        // G1, Y1, G2, Y2
+    int demand[SIM_PHASES];             // constant veh/h, -1 for the weekday profile
+    bool adaptive;
+    bool actuated;
+    int actuation[5];                   // G1 min, G1 max, G2 min, G2 max, passage in tenths
+    uint32_t apply_s;                   // 0: no plan change during the run
+    int apply[4];
+    bool reset;                         // the plan change restarts after the clearance, the baseline
+    uint32_t preempts;                  // emergency vehicle requests per hour, 0 for none
+    const char *timeline;
+}SimOptions_t;
+
+typedef struct {
+    uint32_t start_ms, end_ms;          // from the plan change over SIM_APPLY_CYCLES, 0 before it
+    uint8_t green;                      // green lit at the change, 0 once it ended
+    uint32_t promised_ms;               // ... and the time it had left in the running plan
+    uint32_t lost_ms;                   // green cut short plus the clearance
+    uint32_t max_queue[SIM_PHASES];
+}SimApply_t;
+
+static struct {
+    SimOptions_t opt;
+    Wheel_t wheel;
+    WheelTimer_t tick, apply, decide, preempt;
+    bool quiet;                         // fixed-time baseline of an actuated run
+    uint32_t now_ms;
+    uint64_t random;
+
+    Ctrl_t ctrl;
+    Lamp_t lamp;
+    Opt_t optimizer;
+    DetRing_t ring;
+    Det_t det;
+    Mon_t monitor;
+    uint64_t gpio;                      // output register model, GPIO 0-63
+    uint32_t shift, latched;            // 74HC595 chain model: shift and storage registers
+    uint8_t lamps;                      // read back from the GPIO model
+    uint8_t step, active;
+    bool preempted;                     // the step runs from the preempt plan, no duration to check
+    uint32_t step_ms, cycle_ms, cycles, lamp_changes, plan_changes;
+    SimPhase_t phase[SIM_PHASES];
+    FILE *timeline;
+    int preempt_phase;                  // approach requesting, -1 for none
+    bool preempt_waiting;               // its green is not lit yet
+    uint32_t preempt_ms, preempt_max_ms;
+    uint32_t preempt_hist[SIM_PREEMPT_BOUND_MS / SIM_SECOND_MS + 2];   // request to green by second, the last bin over the bound
+    SimApply_t window;
+
+    uint32_t conflicts, bad_heads, bad_steps, bad_digits, bad_preempts;
+}sim;
+
+static double Uniform(void)
+{
+    sim.random ^= sim.random << 13;
+    sim.random ^= sim.random >> 7;
+    sim.random ^= sim.random << 17;
+    return ((sim.random >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static int Demand(int phase)
+{
+    if(sim.opt.demand[phase] >= 0) return sim.opt.demand[phase];
+    return Weekday[(sim.now_ms / 3600000) % 24][phase];
+}
+
+static void At(WheelTimer_t *timer, uint32_t ms)
+{
+    WheelAdd(&sim.wheel, timer, ms);
+}
+
+/*
+ * The chain as the chips see it: every byte MSB first, clocked into a
+ * 32-bit shift register, then the latch copies it to the outputs
+ */
+static void ShiftChain(const uint8_t segments[SIM_CHAIN_LEN])
+{
+    for(int i = 0; i < SIM_CHAIN_LEN; i++){
+        for(int bit = 7; bit >= 0; bit--) sim.shift = (sim.shift << 1) | ((segments[i] >> bit) & 1);
+    }
+    sim.latched = sim.shift;
+}
+
+/*
+ * Value a head shows on the latched chain: -1 blank, 88, or 0-99
+ */
+static int ReadHead(int head)
+{
+    // the first byte shifted ends in the last chip: head 1 on the top bytes, head 0 below
+    int shift = head == 0 ? 8 : 24;
+    int tens = Segments74HC595(sim.latched >> shift), units = Segments74HC595(sim.latched >> (shift - 8));
+
+    if((uint8_t)(sim.latched >> shift) == 0 && (uint8_t)(sim.latched >> (shift - 8)) == 0) return -1;
+    if(tens < 0 || units < 0) return -2;
+    return tens * 10 + units;
+}
+
+static void PhaseSwitch(int i, bool green)
+{
+    SimPhase_t *p = &sim.phase[i];
+
+    if(green == p->green) return;
+    p->green = green;
+    if(green){
+        p->green_ms = sim.now_ms;
+        if(p->head != p->tail) At(&p->depart, sim.now_ms + SIM_STARTUP_MS);
+    }else{
+        WheelCancel(&sim.wheel, &p->depart);
+    }
+}
+
+static void WriteTimeline(void)
+{
+    char colors[SIM_PHASES + 1] = {0};
+
+    if(!sim.timeline) return;
+    for(int i = 0; i < SIM_PHASES; i++){
+        colors[i] = (sim.lamps & PhaseLamps[i][2]) ? 'G' : (sim.lamps & PhaseLamps[i][1]) ? 'Y' : (sim.lamps & PhaseLamps[i][0]) ? 'R' : '-';
+    }
+    fprintf(sim.timeline, "%"PRIu32".%03"PRIu32",%c,%c,0x%010"PRIx64",%d,%d,%"PRIu32",%"PRIu32"\n",
+        sim.now_ms / 1000, sim.now_ms % 1000, colors[0], colors[1], sim.gpio, ReadHead(0), ReadHead(1),
+        sim.phase[0].head - sim.phase[0].tail, sim.phase[1].head - sim.phase[1].tail);
+}
+
+/*
+ * The green running at the plan change ended: count what it lost against
+ * the time the running plan had left for it
+ */
+static void ApplyGreenEnd(uint8_t lamps)
+{
+    SimApply_t *w = &sim.window;
+    uint32_t lasted = sim.now_ms - w->start_ms;
+
+    if(w->green == 0 || (lamps & w->green)) return;
+    if(lasted < w->promised_ms) w->lost_ms += w->promised_ms - lasted;
+    w->green = 0;
+}
+
+/*
+ * What ControllerOutput does on the board, against the models, with the
+ * lamps and digits read back and checked
+ */
+static void Output(void)
+{
+    const LampMasks_t *m = &sim.lamp.masks[CtrlLamps(&sim.ctrl)];
+    uint8_t segments[SIM_CHAIN_LEN], lamps = 0;
+
+    // clear first, then set, like LampWrite
+    sim.gpio &= ~((uint64_t)m->w1tc_hi << 32 | m->w1tc);
+    sim.gpio |= (uint64_t)m->w1ts_hi << 32 | m->w1ts;
+    CtrlDisplay(&sim.ctrl, segments);
+    ShiftChain(segments);
+
+    for(int b = 0; b < PLAN_LAMPS; b++){
+        if(sim.gpio & (1ULL << LampPins[b])) lamps |= 1 << b;
+    }
+    if(PlanConflict(lamps)) sim.conflicts++;
+    if(MonSample(&sim.monitor, sim.gpio)) sim.conflicts++;
+    for(int i = 0; i < SIM_PHASES; i++){
+        int lit = 0;
+        for(int c = 0; c < 3; c++) lit += (lamps & PhaseLamps[i][c]) ? 1 : 0;
+        if(lit != 1) sim.bad_heads++;
+        // green straight to red is the one transition a driver must never see
+        if((sim.lamps & PhaseLamps[i][2]) && (lamps & PhaseLamps[i][0])) sim.bad_heads++;
+        if(ReadHead(i) != CtrlCount(&sim.ctrl, i)) sim.bad_digits++;
+    }
+    if(sim.preempt_waiting && (lamps & PhaseLamps[sim.preempt_phase][2])){
+        uint32_t latency = sim.now_ms - sim.preempt_ms;
+        int bin = latency > SIM_PREEMPT_BOUND_MS ? SIM_PREEMPT_BOUND_MS / SIM_SECOND_MS + 1 : latency / SIM_SECOND_MS;
+
+        sim.preempt_waiting = false;
+        sim.preempt_hist[bin]++;
+        if(latency > sim.preempt_max_ms) sim.preempt_max_ms = latency;
+        if(latency > SIM_PREEMPT_BOUND_MS) sim.bad_preempts++;
+    }
+    if(lamps != sim.lamps){
+        ApplyGreenEnd(lamps);
+        sim.lamps = lamps;
+        sim.lamp_changes++;
+        for(int i = 0; i < SIM_PHASES; i++) PhaseSwitch(i, (lamps & PhaseLamps[i][2]) != 0);
+        WriteTimeline();
+    }
+}
+
+/*
+ * A step starts: decision ticks for an actuated one, as ControllerTask does
+ */
+static void StepStart(void)
+{
+    sim.step = sim.ctrl.run.step;
+    sim.active = sim.ctrl.active;
+    sim.preempted = sim.ctrl.preempting;
+    sim.step_ms = sim.now_ms;
+    if(CtrlActuated(&sim.ctrl)) At(&sim.decide, sim.now_ms + CTRL_DECISION_MS);
+    else WheelCancel(&sim.wheel, &sim.decide);
+}
+
+/*
+ * A step ended or a plan was committed: a step of the running plan must
+ * last exactly its duration, an actuated one from its minimum to its maximum
+ */
+static void StepEnd(bool committed, bool in_clearance, const Plan_t *plan)
+{
+    const PlanStep_t *step = &plan->step[sim.step];
+    uint32_t lasted = sim.now_ms - sim.step_ms;
+
+    if(!committed && !in_clearance && !sim.preempted){
+        if(step->max && (lasted < step->duration * SIM_SECOND_MS || lasted > step->max * SIM_SECOND_MS)) sim.bad_steps++;
+        if(!step->max && lasted != step->duration * SIM_SECOND_MS) sim.bad_steps++;
+    }
+    StepStart();
+}
+
+static void CycleEnd(void)
+{
+    uint16_t counted[SIM_PHASES];
+    DetStats_t stats[DET_APPROACHES];
+    Plan_t plan;
+
+    DetConsume(&sim.det, &sim.ring);
+    DetSample(&sim.det, sim.now_ms * 1000, stats);
+    for(int i = 0; i < SIM_PHASES; i++){
+        counted[i] = stats[i].count;
+        sim.phase[i].detected += stats[i].count;
+    }
+    if(sim.opt.adaptive){
+        OptAddCycle(&sim.optimizer, counted, (sim.now_ms - sim.cycle_ms) / SIM_SECOND_MS);
+        if(OptEvaluate(&sim.optimizer) && OptPlan(&sim.optimizer, &plan) && CtrlStage(&sim.ctrl, &plan, CTRL_AT_CYCLE_END)){
+            sim.plan_changes++;
+        }
+    }
+    sim.cycle_ms = sim.now_ms;
+    sim.cycles++;
+}
+
+/*
+ * The controller second, as ControllerTask runs it
+ */
+static void Tick(void *arg)
+{
+    bool committed, in_clearance = sim.ctrl.in_clearance;
+    uint32_t cycles = sim.ctrl.run.cycles;
+    const Plan_t *plan = &sim.ctrl.plan[sim.active];
+
+    DetConsume(&sim.det, &sim.ring);
+    committed = CtrlTick(&sim.ctrl);
+    At(&sim.tick, sim.now_ms + SIM_SECOND_MS);
+    if(sim.ctrl.run.step != sim.step || sim.ctrl.active != sim.active || sim.ctrl.preempting != sim.preempted ||
+        sim.ctrl.in_clearance != in_clearance || committed){
+        StepEnd(committed, in_clearance, plan);
+    }
+    Output();
+    if(!sim.ctrl.in_clearance && sim.ctrl.run.cycles != cycles) CycleEnd();
+}
+
+/*
+ * The decision tick of an actuated step, as ControllerTask runs it. The car
+ * first in the queue stands on the stop line loop and calls too.
+ */
+static void Decide(void *arg)
+{
+    uint32_t cycles = sim.ctrl.run.cycles, commits = sim.ctrl.commits;
+    const Plan_t *plan = &sim.ctrl.plan[sim.active];
+    uint8_t calls;
+
+    DetConsume(&sim.det, &sim.ring);
+    calls = DetCalls(&sim.det);
+    for(int i = 0; i < SIM_PHASES; i++){
+        if(sim.phase[i].head != sim.phase[i].tail) calls |= 1 << i;
+    }
+    if(!CtrlDecide(&sim.ctrl, calls, CTRL_DECISION_MS)){
+        At(&sim.decide, sim.now_ms + CTRL_DECISION_MS);
+        return;
+    }
+    // gap-out or max-out: whole seconds count from here
+    At(&sim.tick, sim.now_ms + SIM_SECOND_MS);
+    StepEnd(sim.ctrl.commits != commits, false, plan);
+    Output();
+    if(!sim.ctrl.in_clearance && sim.ctrl.run.cycles != cycles) CycleEnd();
+}
+
+/*
+ * A plan change from the UI or UART: a transition if only the timing
+ * changes, after the clearance otherwise, like ApplySavedPlan. The reset
+ * baseline always takes the clearance.
+ */
+static void Apply(void *arg)
+{
+    const PlanRunner_t *run = &sim.ctrl.run;
+    uint32_t cycle = sim.ctrl.plan[sim.ctrl.active].cycle;
+    Plan_t plan;
+
+    if(!PlanTwoPhase(&plan, sim.opt.apply[0], sim.opt.apply[1], sim.opt.apply[2], sim.opt.apply[3])) return;
+    if(plan.cycle > cycle) cycle = plan.cycle;
+    sim.window = (SimApply_t){.start_ms = sim.now_ms, .end_ms = sim.now_ms + SIM_APPLY_CYCLES * cycle * SIM_SECOND_MS,
+        .green = sim.lamps & (PLAN_GREEN1 | PLAN_GREEN2)};
+    // the step ends on the tick that brings elapsed to its duration
+    if(sim.window.green){
+        sim.window.promised_ms = sim.tick.expires - sim.now_ms + (run->plan->step[run->step].duration + run->extend - run->elapsed - 1) * SIM_SECOND_MS;
+    }
+    for(int i = 0; i < SIM_PHASES; i++) sim.window.max_queue[i] = sim.phase[i].head - sim.phase[i].tail;
+    if(!sim.opt.reset && CtrlStage(&sim.ctrl, &plan, CTRL_TRANSITION)) return;
+    if(!sim.opt.reset && CtrlStage(&sim.ctrl, &plan, CTRL_AT_STEP_END)) return;
+    CtrlStage(&sim.ctrl, &plan, CTRL_NOW);
+    if(CtrlCommitNow(&sim.ctrl)){
+        sim.window.lost_ms += CTRL_CLEARANCE_S * SIM_SECOND_MS;
+        // the clearance starts now, whole seconds count from here
+        At(&sim.tick, sim.now_ms + SIM_SECOND_MS);
+        StepStart();
+        Output();
+    }
+}
+
+/*
+ * An emergency vehicle requests the green of a random approach and holds
+ * it for a while, then the next one comes at the request rate. The
+ * conflicting green must go at once and the requested one come within
+ * SIM_PREEMPT_BOUND_MS.
+ */
+static void Preempt(void *arg)
+{
+    bool started;
+
+    if(sim.preempt_phase < 0){
+        sim.preempt_phase = Uniform() * SIM_PHASES;
+        sim.preempt_ms = sim.now_ms;
+        sim.preempt_waiting = true;
+        started = CtrlPreempt(&sim.ctrl, sim.preempt_phase);
+        At(&sim.preempt, sim.now_ms + SIM_PREEMPT_BOUND_MS + (uint32_t)(Uniform() * SIM_PREEMPT_HOLD_MS));
+    }else{
+        // released before its green was lit: that one no longer counts
+        if(sim.preempt_waiting) sim.bad_preempts++;
+        sim.preempt_waiting = false;
+        sim.preempt_phase = -1;
+        started = CtrlPreempt(&sim.ctrl, -1);
+        At(&sim.preempt, sim.now_ms + (uint32_t)(-log(Uniform()) * 3600000.0 / sim.opt.preempts) + 1);
+    }
+    if(!started) return;
+    // the clearance starts now, whole seconds count from here
+    At(&sim.tick, sim.now_ms + SIM_SECOND_MS);
+    StepStart();
+    Output();
+    if(sim.preempt_phase >= 0 && (sim.lamps & PhaseLamps[sim.preempt_phase ^ 1][2])) sim.bad_preempts++;
+}
+
+/*
+ * Edge of the loop of a phase, as DetectorISR pushes it
+ */
+static void Loop(int phase, bool present)
+{
+    DetEvent_t event = {.time_us = sim.now_ms * 1000, .channel = phase, .present = present};
+
+    DetPush(&sim.ring, &event);
+}
+
+static void Leave(void *arg)
+{
+    Loop((SimPhase_t *)arg - sim.phase, false);
+}
+
+static void Arrive(void *arg)
+{
+    SimPhase_t *p = arg;
+    int i = p - sim.phase, rate = Demand(i);
+
+    if(p->head - p->tail < SIM_QUEUE_MAX){
+        p->queue[p->head++ % SIM_QUEUE_MAX] = sim.now_ms;
+        p->arrived++;
+        if(p->head - p->tail > p->max_queue) p->max_queue = p->head - p->tail;
+        if(sim.now_ms < sim.window.end_ms && p->head - p->tail > sim.window.max_queue[i]) sim.window.max_queue[i] = p->head - p->tail;
+    }else{
+        p->dropped++;
+    }
+    // a car right behind the one still on the loop is not seen, as on a real loop
+    if(!WheelPending(&p->leave)){
+        Loop(i, true);
+        At(&p->leave, sim.now_ms + SIM_OCCUPANCY_MS);
+    }
+    if(p->green && !WheelPending(&p->depart)){
+        uint32_t at = sim.now_ms;
+        if(at < p->green_ms + SIM_STARTUP_MS) at = p->green_ms + SIM_STARTUP_MS;
+        if(p->served && at < p->last_departure_ms + SIM_HEADWAY_MS) at = p->last_departure_ms + SIM_HEADWAY_MS;
+        At(&p->depart, at);
+    }
+    // Poisson arrivals, looked at again in a minute when there is no demand
+    At(&p->arrive, sim.now_ms + (rate > 0 ? (uint32_t)(-log(Uniform()) * 3600000.0 / rate) + 1 : 60000));
+}
+
+static void Depart(void *arg)
+{
+    SimPhase_t *p = arg;
+    uint32_t delay;
+
+    if(!p->green || p->head == p->tail) return;
+    delay = sim.now_ms - p->queue[p->tail++ % SIM_QUEUE_MAX];
+    p->served++;
+    p->delay_ms += delay;
+    if(delay > p->max_delay_ms) p->max_delay_ms = delay;
+    p->last_departure_ms = sim.now_ms;
+    if(p->head != p->tail) At(&p->depart, sim.now_ms + SIM_HEADWAY_MS);
+}
+
+static void HourReport(uint32_t hour)
+{
+    if(!sim.quiet) printf("%5"PRIu32" %6"PRIu32, hour, sim.cycles);
+    for(int i = 0; i < SIM_PHASES; i++){
+        SimPhase_t *p = &sim.phase[i];
+
+        if(!sim.quiet){
+            printf(" | %6"PRIu32" %6"PRIu32" %8.1f %6"PRIu32" %7.1f", p->arrived, p->served,
+                p->served ? p->delay_ms / 1000.0 / p->served : 0.0, p->max_queue, p->max_delay_ms / 1000.0);
+        }
+        p->total_arrived += p->arrived;
+        p->total_served += p->served;
+        p->total_delay_ms += p->delay_ms;
+        p->arrived = p->served = p->max_queue = p->max_delay_ms = 0;
+        p->delay_ms = 0;
+    }
+    sim.cycles = 0;
+    if(!sim.quiet) printf("\n");
+}
+
+static bool ParseInts(const char *text, int *values, int count)
+{
+    for(int i = 0; i < count; i++){
+        char *end;
+        values[i] = strtol(text, &end, 10);
+        if(end == text || (i < count - 1 && *end != ',') || (i == count - 1 && *end != 0)) return false;
+        text = end + 1;
+    }
+    return true;
+}
+
+static void Usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --hours N              simulated hours (24)\n"
+        "  --seed N               arrival seed (1)\n"
+        "  --plan G1,Y1,G2,Y2     plan in seconds (10,5,8,4)\n"
+        "  --demand Q1,Q2         constant veh/h per phase instead of the weekday profile\n"
+        "  --adaptive             retime the plan every cycle with the Webster optimizer\n"
+        "  --actuated G1MIN,G1MAX,G2MIN,G2MAX,PASSAGE\n"
+        "                         actuated greens, passage in tenths of a second, compared\n"
+        "                         with the fixed plan\n"
+        "  --apply T:G1,Y1,G2,Y2  change the plan at second T, as the UI does, compared with\n"
+        "                         the all-yellow reset\n"
+        "  --preempt N            N emergency vehicle requests per hour on random approaches\n"
+        "  --timeline FILE        write every lamp change as CSV\n", name);
+}
+
+static bool ParseOptions(int argc, char **argv, SimOptions_t *opt)
+{
+    *opt = (SimOptions_t){.hours = 24, .seed = 1, .plan = {10, 5, 8, 4}, .demand = {-1, -1}};
+    for(int a = 1; a < argc; a++){
+        const char *arg = argv[a], *value = a + 1 < argc ? argv[a + 1] : NULL;
+        char *end;
+
+        if(!strcmp(arg, "--adaptive")){
+            opt->adaptive = true;
+            continue;
+        }
+        if(value == NULL) return false;
+        a++;
+        if(!strcmp(arg, "--hours")) opt->hours = strtoul(value, NULL, 10);
+        else if(!strcmp(arg, "--seed")) opt->seed = strtoul(value, NULL, 10);
+        else if(!strcmp(arg, "--plan")){ if(!ParseInts(value, opt->plan, 4)) return false; }
+        else if(!strcmp(arg, "--demand")){ if(!ParseInts(value, opt->demand, SIM_PHASES)) return false; }
+        else if(!strcmp(arg, "--timeline")) opt->timeline = value;
+        else if(!strcmp(arg, "--preempt")) opt->preempts = strtoul(value, NULL, 10);
+        else if(!strcmp(arg, "--actuated")){
+            if(!ParseInts(value, opt->actuation, 5)) return false;
+            opt->actuated = true;
+        }
+        else if(!strcmp(arg, "--apply")){
+            opt->apply_s = strtoul(value, &end, 10);
+            if(*end != ':' || !ParseInts(end + 1, opt->apply, 4)) return false;
+        }
+        else return false;
+    }
+    return opt->hours > 0 && opt->hours < 24 * 40;
+}
+
+/*
+ * The plan of the options: fixed, or with actuated greens
+ */
+static bool SimPlan(Plan_t *plan)
+{
+    const int *p = sim.opt.plan, *a = sim.opt.actuation;
+
+    if(!sim.opt.actuated) return PlanTwoPhase(plan, p[0], p[1], p[2], p[3]);
+    return PlanTwoPhaseActuated(plan, a[0], a[1], p[1], a[2], a[3], p[3], a[4]);
+}
+
+/*
+ * Run the options from a clean state
+ *
+ * @return  mean delay of a vehicle in seconds, negative if a check failed
+ */
+static double Run(bool quiet)
+{
+    SimOptions_t opt = sim.opt;
+    Plan_t plan;
+    OptConfig_t config;
+    uint32_t end_ms, hour = 0, at, served = 0;
+    uint64_t delay_ms = 0;
+    WheelTimer_t *timer;
+    bool ok;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.opt = opt;
+    sim.quiet = quiet;
+    if(!SimPlan(&plan)){
+        fprintf(stderr, "invalid plan\n");
+        return -1;
+    }
+    if(sim.opt.timeline && !quiet){
+        sim.timeline = fopen(sim.opt.timeline, "w");
+        if(!sim.timeline){
+            perror(sim.opt.timeline);
+            return -1;
+        }
+        fprintf(sim.timeline, "time_s,phase1,phase2,gpio,count1,count2,queue1,queue2\n");
+    }
+
+    sim.random = 0x9E3779B97F4A7C15ULL * (sim.opt.seed + 1);
+    WheelInit(&sim.wheel, 0);
+    LampCompile(&sim.lamp, LampPins, PLAN_LAMPS);
+    MonInit(&sim.monitor, LampPins, PLAN_LAMPS);
+    CtrlInit(&sim.ctrl, &plan);
+    OptDefaults(&config, sim.opt.plan[1], sim.opt.plan[3]);
+    OptInit(&sim.optimizer, &config, sim.opt.plan[0], sim.opt.plan[2]);
+    DetInit(&sim.det, (const uint8_t[SIM_PHASES]){0, 1}, SIM_PHASES, 0);
+    WheelTimerInit(&sim.tick, Tick, NULL);
+    WheelTimerInit(&sim.apply, Apply, NULL);
+    WheelTimerInit(&sim.decide, Decide, NULL);
+    WheelTimerInit(&sim.preempt, Preempt, NULL);
+    sim.preempt_phase = -1;
+    Output();
+    StepStart();
+
+    At(&sim.tick, SIM_SECOND_MS);
+    if(sim.opt.apply_s) At(&sim.apply, sim.opt.apply_s * SIM_SECOND_MS);
+    if(sim.opt.preempts) At(&sim.preempt, (uint32_t)(-log(Uniform()) * 3600000.0 / sim.opt.preempts) + 1);
+    for(int i = 0; i < SIM_PHASES; i++){
+        WheelTimerInit(&sim.phase[i].arrive, Arrive, &sim.phase[i]);
+        WheelTimerInit(&sim.phase[i].depart, Depart, &sim.phase[i]);
+        WheelTimerInit(&sim.phase[i].leave, Leave, &sim.phase[i]);
+        At(&sim.phase[i].arrive, (uint32_t)(Uniform() * 10000));
+    }
+
+    if(!quiet) printf(" hour cycles | arr1   srv1   delay1 maxq1  maxwt1 | arr2   srv2   delay2 maxq2  maxwt2\n");
+    end_ms = sim.opt.hours * 3600000;
+    while(WheelNext(&sim.wheel, &at) && at <= end_ms){
+        while(hour < at / 3600000){
+            sim.now_ms = ++hour * 3600000;
+            HourReport(hour - 1);
+        }
+        while((timer = WheelExpire(&sim.wheel, at)) != NULL){
+            sim.now_ms = timer->expires;
+            timer->callback(timer->arg);
+        }
+    }
+    while(hour < sim.opt.hours) HourReport(hour++);
+
+    for(int i = 0; i < SIM_PHASES; i++){
+        SimPhase_t *p = &sim.phase[i];
+
+        served += p->total_served;
+        delay_ms += p->total_delay_ms;
+        if(quiet) continue;
+        printf("phase %d: %"PRIu32" arrived, %"PRIu32" detected, %"PRIu32" served, %.2f s mean delay, %"PRIu32" dropped\n", i + 1,
+            p->total_arrived, p->detected, p->total_served, p->total_served ? p->total_delay_ms / 1000.0 / p->total_served : 0.0, p->dropped);
+    }
+    if(!quiet){
+        printf("%"PRIu32" lamp changes, %"PRIu32" plan changes, %"PRIu32" gap-outs, %"PRIu32" max-outs, checks: %"PRIu32" conflicts (%"PRIu32" monitor trips), %"PRIu32" bad heads, %"PRIu32" bad step times, %"PRIu32" bad digits, %"PRIu32" lost detector edges\n",
+            sim.lamp_changes, sim.plan_changes, sim.ctrl.gap_outs, sim.ctrl.max_outs, sim.conflicts, sim.monitor.trips, sim.bad_heads, sim.bad_steps, sim.bad_digits,
+            sim.det.errors + sim.ring.overflows);
+    }
+    if(!quiet && sim.opt.preempts){
+        printf("%"PRIu32" preemptions, request to green:", sim.ctrl.preempts);
+        for(int s = 0; s <= SIM_PREEMPT_BOUND_MS / SIM_SECOND_MS; s++) printf(" <%ds %"PRIu32",", s + 1, sim.preempt_hist[s]);
+        printf(" later %"PRIu32", max %"PRIu32" ms, bound %d ms, %"PRIu32" bad preemptions\n",
+            sim.preempt_hist[SIM_PREEMPT_BOUND_MS / SIM_SECOND_MS + 1], sim.preempt_max_ms, SIM_PREEMPT_BOUND_MS, sim.bad_preempts);
+    }
+    if(sim.timeline) fclose(sim.timeline);
+    ok = sim.conflicts == 0 && sim.bad_heads == 0 && sim.bad_steps == 0 && sim.bad_digits == 0 && sim.det.errors == 0 && sim.ring.overflows == 0 && sim.bad_preempts == 0;
+    if(!ok) return -1;
+    return served ? delay_ms / 1000.0 / served : 0.0;
+}
+
+int main(int argc, char **argv)
+{
+    double fixed = 0, delay;
+    SimApply_t reset = {0};
+
+    if(!ParseOptions(argc, argv, &sim.opt)){
+        Usage(argv[0]);
+        return 2;
+    }
+    // the baselines on the same arrivals first: the fixed plan, the plan change with the clearance
+    if(sim.opt.actuated){
+        sim.opt.actuated = false;
+        fixed = Run(true);
+        sim.opt.actuated = true;
+    }
+    if(sim.opt.apply_s){
+        sim.opt.reset = true;
+        if(Run(true) < 0) return 1;
+        reset = sim.window;
+        sim.opt.reset = false;
+    }
+    delay = Run(false);
+    if(fixed < 0 || delay < 0) return 1;
+
+    if(sim.opt.apply_s && sim.window.end_ms){
+        printf("plan change at %"PRIu32" s, next %"PRIu32" s: reset %.1f s green lost, queue peaks %"PRIu32"/%"PRIu32"; "
+            "transition %.1f s green lost, queue peaks %"PRIu32"/%"PRIu32"\n",
+            sim.opt.apply_s, (sim.window.end_ms - sim.window.start_ms) / SIM_SECOND_MS,
+            reset.lost_ms / 1000.0, reset.max_queue[0], reset.max_queue[1],
+            sim.window.lost_ms / 1000.0, sim.window.max_queue[0], sim.window.max_queue[1]);
+    }
+    if(sim.opt.actuated){
+        printf("mean delay: fixed %d/%d/%d/%d %.2f s/veh, actuated %.2f s/veh (%+.1f%%)\n",
+            sim.opt.plan[0], sim.opt.plan[1], sim.opt.plan[2], sim.opt.plan[3], fixed, delay, fixed > 0 ? (delay - fixed) * 100 / fixed : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""
+fontx_vietnamese.py
+
+Build a double-byte FONTX2 font indexed by Unicode with the Vietnamese
+letters, composed from the letters of an 8x16 ANK FONTX font and bitmap
+diacritics. GetFontx serves code points >= 0x80 from it as fxs[1].
+
+    tools/fontx_vietnamese.py font/ILGH16XB.FNT font/VNGH16XB.FNT
+"""
+
+import sys
+import unicodedata
+
+W, H = 8, 16
+TOP, BASE = 2, 11           # cap height rows of the ANK font
+NAME = b"VNGH16XB"
+
+GRAVE, ACUTE, TILDE, HOOK, DOT = "̀", "́", "̃", "̉", "̣"
+CIRCUMFLEX, BREVE, HORN = "̂", "̆", "̛"
+
+# marks above: two rows each, MSB left
+ABOVE = {
+    GRAVE:      ["..##....", "...##..."],
+    ACUTE:      ["....##..", "...##..."],
+    TILDE:      ["..##..#.", ".#..##.."],
+    HOOK:       ["..###...", "....#..."],
+    CIRCUMFLEX: ["...##...", "..#..#.."],
+    BREVE:      ["..#..#..", "...##..."],
+}
+
+
+def rows(pattern):
+    return [int(r.replace(".", "0").replace("#", "1"), 2) for r in pattern]
+
+
+def ank(font, ch):
+    offset = 17 + ord(ch) * H
+    return list(font[offset:offset + H])
+
+
+def squash(glyph):
+    """Capital letter two rows shorter, to fit a mark above: drop two
+    rows repeating the row above them, nearest the middle first."""
+    body = glyph[TOP:BASE + 1]
+    middle = len(body) / 2
+    repeats = sorted((i for i in range(1, len(body)) if body[i] == body[i - 1]), key=lambda i: abs(i - middle))
+    drop = sorted(repeats[:2], reverse=True)
+    while len(drop) < 2:
+        drop.append(len(body) // 2 - len(drop))
+    for i in sorted(drop, reverse=True):
+        del body[i]
+    return [0] * (TOP + 2) + body + glyph[BASE + 1:]
+
+
+def compose(font, code):
+    ch = chr(code)
+    if ch in "Đđ":
+        glyph = ank(font, "D" if ch == "Đ" else "d")
+        if ch == "Đ":
+            glyph[(TOP + BASE) // 2] |= rows(["###....."])[0]
+        else:
+            glyph[TOP + 1] |= rows(["....####"])[0]
+        return glyph
+    decomposed = unicodedata.normalize("NFD", ch)
+    base, marks = decomposed[0], decomposed[1:]
+    glyph = ank(font, base)
+    capital = base.isupper()
+    above = [m for m in marks if m in ABOVE]
+    if base == "i" and above:
+        glyph[TOP] = 0                  # dotless under the mark
+    top = TOP + 2                       # the mark next to the letter on rows 2 and 3
+    if capital and above:
+        glyph = squash(glyph)
+    # the mark next to the letter first, a tone mark stacks over a circumflex or breve
+    above.sort(key=lambda m: m not in (CIRCUMFLEX, BREVE))
+    row = top
+    for m in above:
+        row -= 2
+        for i, bits in enumerate(rows(ABOVE[m])):
+            glyph[row + i] |= bits
+    if HORN in marks:
+        height = TOP + 2 if capital else TOP + 3
+        glyph[height - 1] |= rows([".......#"])[0]
+        glyph[height] |= rows(["......##"])[0]
+    if DOT in marks:
+        glyph[BASE + 2 if base not in "y" else H - 1] |= rows(["...##..."])[0]
+    return glyph
+
+
+def vietnamese():
+    marks = set(ABOVE) | {DOT, HORN}
+    codes = [0x110, 0x111]
+    for code in range(0x80, 0x1F00):
+        decomposed = unicodedata.normalize("NFD", chr(code))
+        if len(decomposed) > 1 and decomposed[0] in "AEIOUYaeiouy" and all(m in marks for m in decomposed[1:]):
+            codes.append(code)
+    return sorted(codes)
+
+
+def blocks(codes):
+    runs = []
+    for code in codes:
+        if runs and runs[-1][1] == code - 1:
+            runs[-1][1] = code
+        else:
+            runs.append([code, code])
+    return runs
+
+
+def main():
+    font = open(sys.argv[1], "rb").read()
+    if font[:6] != b"FONTX2" or font[14] != W or font[15] != H or font[16] != 0:
+        sys.exit("%s: not an 8x16 ANK FONTX2 font" % sys.argv[1])
+    codes = vietnamese()
+    runs = blocks(codes)
+    out = bytearray(b"FONTX2" + NAME + bytes([W, H, 1, len(runs)]))
+    for start, end in runs:
+        out += bytes([start & 0xFF, start >> 8, end & 0xFF, end >> 8])
+    for code in codes:
+        out += bytes(compose(font, code))
+    open(sys.argv[2], "wb").write(out)
+    print("%s: %d glyphs in %d blocks" % (sys.argv[2], len(codes), len(runs)))
+
+
+if __name__ == "__main__":
+    main()